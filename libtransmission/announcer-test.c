@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h> /* memcpy, memset */
+
+#include "transmission.h"
+#include "announcer.h"
+#include "bencode.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/* append "20:<hash>d8:completei<n>ee" to walk */
+static char*
+putFile( char * walk, const uint8_t * hash, int complete )
+{
+    memcpy( walk, "20:", 3 ); walk += 3;
+    memcpy( walk, hash, SHA_DIGEST_LENGTH ); walk += SHA_DIGEST_LENGTH;
+    return walk + sprintf( walk, "d8:completei%dee", complete );
+}
+
+/* a multi-hash scrape reply that only covers some of the info_hashes */
+static int
+testPartialScrape( void )
+{
+    int i;
+    int64_t complete;
+    char buf[512];
+    char * walk = buf;
+    tr_benc top;
+    tr_benc * files;
+    tr_benc * file;
+    uint8_t hashes[3][SHA_DIGEST_LENGTH];
+
+    /* binary hashes, with a NUL in the middle of each one */
+    for( i=0; i<3; ++i ) {
+        memset( hashes[i], 'a' + i, SHA_DIGEST_LENGTH );
+        hashes[i][10] = '\0';
+    }
+
+    /* the tracker answered for the first and third torrents */
+    walk += sprintf( walk, "d5:filesd" );
+    walk = putFile( walk, hashes[0], 10 );
+    walk = putFile( walk, hashes[2], 30 );
+    walk += sprintf( walk, "ee" );
+    check( !tr_bencLoad( buf, walk - buf, &top, NULL ) )
+    check( tr_bencDictFindDict( &top, "files", &files ) )
+
+    file = tr_announcerFindScrapeFile( files, hashes[0] );
+    check( file != NULL )
+    check( tr_bencDictFindInt( file, "complete", &complete ) )
+    check( complete == 10 )
+
+    check( tr_announcerFindScrapeFile( files, hashes[1] ) == NULL )
+
+    file = tr_announcerFindScrapeFile( files, hashes[2] );
+    check( file != NULL )
+    check( tr_bencDictFindInt( file, "complete", &complete ) )
+    check( complete == 30 )
+
+    /* a reply without a "files" dict has nothing in it */
+    check( tr_announcerFindScrapeFile( NULL, hashes[0] ) == NULL )
+
+    tr_bencFree( &top );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    if(( i = testPartialScrape( )))
+        return i;
+
+    return 0;
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <string.h> /* memset */
+#include <unistd.h> /* close */
+
+#include "transmission.h"
+#include "announcer-udp.h"
+#include "net.h"
+#include "session.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/***
+****  A fake tracker on the loopback interface. The client's requests
+****  go out through a real socket, and the fake tracker's replies are
+****  handed to tr_tauHandleMessage() the way tr-udp.c would.
+***/
+
+enum
+{
+    MAX_PACKET = 2048,
+    SCRAPE_COUNT = 100
+};
+
+struct fake_tracker
+{
+    int fd;
+    char url[64];
+};
+
+static tr_session session;
+static struct sockaddr_in clientAddr;
+static struct fake_tracker tracker;
+static struct fake_tracker deadTracker; /* never answers */
+
+static int
+bindLoopback( struct sockaddr_in * setme )
+{
+    socklen_t len = sizeof( struct sockaddr_in );
+    const int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+
+    memset( setme, 0, sizeof( struct sockaddr_in ) );
+    setme->sin_family = AF_INET;
+    setme->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    bind( fd, (struct sockaddr*)setme, len );
+    getsockname( fd, (struct sockaddr*)setme, &len );
+    return fd;
+}
+
+static void
+fakeTrackerInit( struct fake_tracker * t )
+{
+    struct sockaddr_in addr;
+    t->fd = bindLoopback( &addr );
+    tr_snprintf( t->url, sizeof( t->url ), "udp://127.0.0.1:%d/announce", ntohs( addr.sin_port ) );
+}
+
+/* read the client's next request, or return -1 if it hasn't sent one */
+static int
+trackerRecv( const struct fake_tracker * t, uint8_t * buf )
+{
+    return recv( t->fd, buf, MAX_PACKET, MSG_DONTWAIT );
+}
+
+static void
+trackerReply( const struct fake_tracker * t, const uint8_t * buf, size_t len )
+{
+    uint8_t in[MAX_PACKET];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof( from );
+    int n;
+
+    sendto( t->fd, buf, len, 0, (struct sockaddr*)&clientAddr, sizeof( clientAddr ) );
+
+    while(( n = recvfrom( session.udp_socket, in, sizeof( in ), MSG_DONTWAIT,
+                          (struct sockaddr*)&from, &fromlen )) >= 0 ) {
+        tr_tauHandleMessage( &session, in, n, (struct sockaddr*)&from, fromlen );
+        fromlen = sizeof( from );
+    }
+}
+
+static uint8_t*
+put32( uint8_t * walk, uint32_t val )
+{
+    val = htonl( val );
+    memcpy( walk, &val, 4 );
+    return walk + 4;
+}
+
+static uint32_t
+get32( const uint8_t * walk )
+{
+    uint32_t val;
+    memcpy( &val, walk, 4 );
+    return ntohl( val );
+}
+
+/* the tracker hands out this connection id */
+static const uint8_t connectionId[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static int
+isConnectRequest( const uint8_t * buf, int len )
+{
+    static const uint8_t protocolId[8] = { 0, 0, 0x04, 0x17, 0x27, 0x10, 0x19, 0x80 };
+
+    return ( len == 16 ) && !memcmp( buf, protocolId, 8 ) && ( get32( buf + 8 ) == 0 );
+}
+
+/* read a connect request and answer it */
+static tr_bool
+answerConnect( void )
+{
+    uint8_t buf[MAX_PACKET];
+    uint8_t * walk = buf;
+    const int len = trackerRecv( &tracker, buf );
+
+    if( !isConnectRequest( buf, len ) )
+        return FALSE;
+
+    walk = put32( walk, 0 );
+    memmove( walk, buf + 12, 4 ); walk += 4;
+    memcpy( walk, connectionId, 8 ); walk += 8;
+    trackerReply( &tracker, buf, walk - buf );
+    return TRUE;
+}
+
+/***
+****  The client side
+***/
+
+static int announceCount;
+static tr_tau_announce_response lastAnnounce;
+static char lastErrmsg[128];
+
+static void
+onAnnounce( tr_session * s UNUSED, const tr_tau_announce_response * r, void * vdata UNUSED )
+{
+    ++announceCount;
+    lastAnnounce = *r;
+    lastAnnounce.peers = NULL;
+    tr_strlcpy( lastErrmsg, r->errmsg ? r->errmsg : "", sizeof( lastErrmsg ) );
+}
+
+static int scrapeCount;
+static tr_tau_scrape_response scrapes[SCRAPE_COUNT];
+static int scrapeIds[SCRAPE_COUNT];
+
+static void
+onScrape( tr_session * s UNUSED, const tr_tau_scrape_response * r, void * vid )
+{
+    const int * id = vid;
+    ++scrapeCount;
+    scrapes[*id] = *r;
+}
+
+static void
+initAnnounce( tr_tau_announce_request * req )
+{
+    memset( req, 0, sizeof( tr_tau_announce_request ) );
+    memset( req->info_hash, 'h', SHA_DIGEST_LENGTH );
+    memcpy( req->peer_id, "-TR2000-abcdefghijkl", 20 );
+    req->up = 1;
+    req->down = 2;
+    req->left = 3;
+    req->event = TR_TAU_EVENT_STARTED;
+    req->key = 0x12345678;
+    req->numwant = 80;
+    req->port = 51413;
+}
+
+/***
+****
+***/
+
+/* connect, then announce, and get peers back */
+static int
+testAnnounce( void )
+{
+    int len;
+    uint8_t buf[MAX_PACKET];
+    uint8_t * walk;
+    tr_tau_announce_request req;
+
+    tr_timeUpdate( 1000 );
+    initAnnounce( &req );
+    announceCount = 0;
+    tr_tauAnnounce( &session, tracker.url, &req, onAnnounce, NULL );
+
+    /* nothing goes out until upkeep */
+    check( trackerRecv( &tracker, buf ) == -1 )
+    tr_tauUpkeep( &session );
+    check( answerConnect( ) )
+
+    /* now that it has a connection id, the client sends the announce */
+    len = trackerRecv( &tracker, buf );
+    check( len == 98 )
+    check( !memcmp( buf, connectionId, 8 ) )
+    check( get32( buf + 8 ) == 1 )
+    check( !memcmp( buf + 16, req.info_hash, 20 ) )
+    check( !memcmp( buf + 36, req.peer_id, 20 ) )
+    check( get32( buf + 60 ) == 2 ) /* downloaded */
+    check( get32( buf + 68 ) == 3 ) /* left */
+    check( get32( buf + 76 ) == 1 ) /* uploaded */
+    check( get32( buf + 80 ) == TR_TAU_EVENT_STARTED )
+    check( get32( buf + 84 ) == 0 ) /* ip */
+    check( get32( buf + 88 ) == 0x12345678 )
+    check( get32( buf + 92 ) == 80 )
+    check( buf[96] == ( 51413 >> 8 ) && buf[97] == ( 51413 & 0xff ) )
+
+    memmove( buf + 4, buf + 12, 4 ); /* the transaction id */
+    walk = put32( buf, 1 ) + 4;
+    walk = put32( walk, 1800 );
+    walk = put32( walk, 5 );
+    walk = put32( walk, 7 );
+    memset( walk, 0, 12 ); walk += 12; /* two peers */
+
+    /* a reply with the right transaction id from somewhere else is ignored */
+    trackerReply( &deadTracker, buf, walk - buf );
+    check( announceCount == 0 )
+
+    trackerReply( &tracker, buf, walk - buf );
+    check( announceCount == 1 )
+    check( lastAnnounce.didConnect )
+    check( !lastAnnounce.didTimeout )
+    check( lastAnnounce.errmsg == NULL )
+    check( lastAnnounce.interval == 1800 )
+    check( lastAnnounce.leechers == 5 )
+    check( lastAnnounce.seeders == 7 )
+    check( lastAnnounce.peersLen == 12 )
+    check( !lastAnnounce.peersAreIPv6 )
+    return 0;
+}
+
+/* the connection id is reused for a minute, and errors get passed along */
+static int
+testConnectionReuse( void )
+{
+    int len;
+    uint8_t buf[MAX_PACKET];
+    uint8_t * walk;
+    tr_tau_announce_request req;
+    const char * errmsg = "unregistered torrent";
+
+    tr_timeUpdate( 1030 );
+    initAnnounce( &req );
+    announceCount = 0;
+    tr_tauAnnounce( &session, tracker.url, &req, onAnnounce, NULL );
+    tr_tauUpkeep( &session );
+
+    len = trackerRecv( &tracker, buf );
+    check( len == 98 )
+    check( !memcmp( buf, connectionId, 8 ) )
+
+    memmove( buf + 4, buf + 12, 4 );
+    walk = put32( buf, 3 ) + 4;
+    memcpy( walk, errmsg, strlen( errmsg ) ); walk += strlen( errmsg );
+    trackerReply( &tracker, buf, walk - buf );
+
+    check( announceCount == 1 )
+    check( lastAnnounce.didConnect )
+    check( !strcmp( lastErrmsg, errmsg ) )
+
+    /* a minute after connecting, it has to connect again */
+    tr_timeUpdate( 1060 );
+    tr_tauAnnounce( &session, tracker.url, &req, onAnnounce, NULL );
+    tr_tauUpkeep( &session );
+    check( answerConnect( ) )
+    check( trackerRecv( &tracker, buf ) == 98 )
+    memmove( buf + 4, buf + 12, 4 );
+    walk = put32( buf, 1 ) + 4;
+    memset( walk, 0, 12 ); walk += 12;
+    trackerReply( &tracker, buf, walk - buf );
+    check( announceCount == 2 )
+    check( lastErrmsg[0] == '\0' )
+    return 0;
+}
+
+/* unanswered requests are resent after 15, 30, and 60 seconds,
+ * reconnecting if need be, and then they fail */
+static int
+testRetransmit( void )
+{
+    int len;
+    uint8_t buf[MAX_PACKET];
+    uint32_t transactionId;
+    tr_tau_announce_request req;
+    time_t now = 2000;
+
+    tr_timeUpdate( now );
+    initAnnounce( &req );
+    announceCount = 0;
+    tr_tauAnnounce( &session, tracker.url, &req, onAnnounce, NULL );
+    tr_tauUpkeep( &session );
+    check( answerConnect( ) )
+    len = trackerRecv( &tracker, buf );
+    check( len == 98 )
+    transactionId = get32( buf + 12 );
+
+    tr_timeUpdate( now + 14 );
+    tr_tauUpkeep( &session );
+    check( trackerRecv( &tracker, buf ) == -1 )
+
+    tr_timeUpdate( now += 15 );
+    tr_tauUpkeep( &session );
+    check( trackerRecv( &tracker, buf ) == 98 )
+    check( get32( buf + 12 ) == transactionId )
+
+    tr_timeUpdate( now += 30 );
+    tr_tauUpkeep( &session );
+    check( trackerRecv( &tracker, buf ) == 98 )
+
+    /* the connection id has expired by now */
+    tr_timeUpdate( now += 60 );
+    tr_tauUpkeep( &session );
+    check( answerConnect( ) )
+    check( trackerRecv( &tracker, buf ) == 98 )
+    check( announceCount == 0 )
+
+    tr_timeUpdate( now += 119 );
+    tr_tauUpkeep( &session );
+    check( announceCount == 0 )
+
+    tr_timeUpdate( now += 1 );
+    tr_tauUpkeep( &session );
+    check( announceCount == 1 )
+    check( lastAnnounce.didConnect )
+    check( lastAnnounce.didTimeout )
+
+    /* a late answer is ignored */
+    put32( put32( buf, 1 ), transactionId );
+    trackerReply( &tracker, buf, 20 );
+    check( announceCount == 1 )
+    return 0;
+}
+
+/* a tracker that never answers the connect request */
+static int
+testConnectTimeout( void )
+{
+    int i;
+    uint8_t buf[MAX_PACKET];
+    tr_tau_announce_request req;
+    time_t now = 3000;
+    const int waits[] = { 15, 30, 60, 120 };
+
+    tr_timeUpdate( now );
+    initAnnounce( &req );
+    announceCount = 0;
+    tr_tauAnnounce( &session, deadTracker.url, &req, onAnnounce, NULL );
+    tr_tauUpkeep( &session );
+    check( isConnectRequest( buf, trackerRecv( &deadTracker, buf ) ) )
+
+    for( i=0; i<4; ++i )
+    {
+        tr_timeUpdate( now += waits[i] );
+        tr_tauUpkeep( &session );
+        if( i < 3 )
+            check( isConnectRequest( buf, trackerRecv( &deadTracker, buf ) ) )
+    }
+
+    check( trackerRecv( &deadTracker, buf ) == -1 )
+    check( announceCount == 1 )
+    check( !lastAnnounce.didConnect )
+    check( lastAnnounce.didTimeout )
+    return 0;
+}
+
+/* scrapes for the same tracker share packets, 74 info_hashes apiece */
+static int
+testScrape( void )
+{
+    int i;
+    int len;
+    uint8_t buf[MAX_PACKET];
+    uint8_t reply[MAX_PACKET];
+    uint8_t * walk;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+
+    tr_timeUpdate( 4000 );
+    scrapeCount = 0;
+    memset( hash, 0, sizeof( hash ) );
+    for( i=0; i<SCRAPE_COUNT; ++i ) {
+        scrapeIds[i] = i;
+        hash[0] = i;
+        tr_tauScrape( &session, tracker.url, hash, onScrape, &scrapeIds[i] );
+    }
+    tr_tauUpkeep( &session );
+    check( answerConnect( ) )
+
+    /* the first packet holds 74 hashes... */
+    len = trackerRecv( &tracker, buf );
+    check( len == 16 + 74 * SHA_DIGEST_LENGTH )
+    check( get32( buf + 8 ) == 2 )
+    for( i=0; i<74; ++i )
+        check( buf[16 + i * SHA_DIGEST_LENGTH] == i )
+
+    walk = put32( reply, 2 );
+    memcpy( walk, buf + 12, 4 ); walk += 4;
+    for( i=0; i<74; ++i ) {
+        walk = put32( walk, i );
+        walk = put32( walk, i * 2 );
+        walk = put32( walk, i * 3 );
+    }
+
+    /* ...and the second holds the rest */
+    len = trackerRecv( &tracker, buf );
+    check( len == 16 + 26 * SHA_DIGEST_LENGTH )
+    check( buf[16] == 74 )
+    check( trackerRecv( &tracker, buf ) == -1 )
+
+    trackerReply( &tracker, reply, walk - reply );
+    check( scrapeCount == 74 )
+    for( i=0; i<74; ++i ) {
+        check( scrapes[i].didConnect )
+        check( scrapes[i].errmsg == NULL )
+        check( scrapes[i].seeders == i )
+        check( scrapes[i].downloads == i * 2 )
+        check( scrapes[i].leechers == i * 3 )
+    }
+
+    /* a short answer leaves the missing torrents with an error */
+    walk = put32( reply, 2 );
+    memcpy( walk, buf + 12, 4 ); walk += 4;
+    for( i=0; i<25; ++i ) {
+        walk = put32( walk, 1 );
+        walk = put32( walk, 1 );
+        walk = put32( walk, 1 );
+    }
+    trackerReply( &tracker, reply, walk - reply );
+    check( scrapeCount == SCRAPE_COUNT )
+    check( scrapes[98].errmsg == NULL )
+    check( scrapes[98].seeders == 1 )
+    check( scrapes[99].errmsg != NULL )
+    return 0;
+}
+
+/* closing calls back everyone who's still waiting on an answer */
+static int
+testClose( void )
+{
+    uint8_t buf[MAX_PACKET];
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    tr_tau_announce_request req;
+
+    tr_timeUpdate( 5000 );
+    initAnnounce( &req );
+    announceCount = 0;
+    scrapeCount = 0;
+    memset( hash, 0, sizeof( hash ) );
+    memset( scrapes, 0, sizeof( scrapes ) );
+    tr_tauAnnounce( &session, deadTracker.url, &req, onAnnounce, NULL );
+    tr_tauScrape( &session, deadTracker.url, hash, onScrape, &scrapeIds[0] );
+    tr_tauUpkeep( &session );
+    check( isConnectRequest( buf, trackerRecv( &deadTracker, buf ) ) )
+
+    tr_tauClose( &session, TR_TAU_CLOSE_NOW );
+    check( session.announcer_udp == NULL )
+    check( announceCount == 1 )
+    check( !lastAnnounce.didConnect )
+    check( !lastAnnounce.didTimeout )
+    check( scrapeCount == 1 )
+    check( !scrapes[0].didConnect )
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    memset( &session, 0, sizeof( session ) );
+    session.magicNumber = SESSION_MAGIC_NUMBER;
+    session.udp_socket = bindLoopback( &clientAddr );
+    session.udp6_socket = -1;
+    fakeTrackerInit( &tracker );
+    fakeTrackerInit( &deadTracker );
+
+    if(( i = testAnnounce( )))
+        return i;
+
+    if(( i = testConnectionReuse( )))
+        return i;
+
+    if(( i = testRetransmit( )))
+        return i;
+
+    if(( i = testConnectTimeout( )))
+        return i;
+
+    if(( i = testScrape( )))
+        return i;
+
+    if(( i = testClose( )))
+        return i;
+
+    close( tracker.fd );
+    close( deadTracker.fd );
+    close( session.udp_socket );
+    return 0;
+}
@@ -0,0 +1,1012 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memcpy(), memset(), strcmp() */
+
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "announcer-udp.h"
+#include "crypto.h" /* tr_cryptoRandBuf() */
+#include "net.h"
+#include "ptrarray.h"
+#include "session.h"
+#include "tr-udp.h"
+#include "utils.h"
+
+#define dbgmsg( tracker, ... ) \
+    do { \
+        if( tr_deepLoggingIsActive( ) ) \
+            tr_deepLog( __FILE__, __LINE__, (tracker)->key, __VA_ARGS__ ); \
+    } while( 0 )
+
+/* the magic number that opens every connect request */
+#define TAU_PROTOCOL_ID 0x41727101980ull
+
+enum
+{
+    TAU_ACTION_CONNECT = 0,
+    TAU_ACTION_ANNOUNCE = 1,
+    TAU_ACTION_SCRAPE = 2,
+    TAU_ACTION_ERROR = 3,
+
+    /* connection id, action, transaction id */
+    TAU_HEADER_LEN = 16,
+
+    TAU_ANNOUNCE_REQUEST_LEN = TAU_HEADER_LEN + 82,
+    TAU_ANNOUNCE_RESPONSE_MIN = 20,
+    TAU_CONNECT_RESPONSE_LEN = 16,
+    TAU_SCRAPE_ROW_LEN = 12,
+
+    /* how many info_hashes fit in one scrape packet */
+    TAU_MAX_SCRAPE_HASHES = 74,
+
+    /* a tracker's connection id is good for this long after we get it */
+    TAU_CONNECTION_TTL_SECS = 60,
+
+    /* an unanswered request is resent after 15 * 2^n seconds... */
+    TAU_RETRANSMIT_SECS = 15,
+
+    /* ...until it's been tried this many times. Past that, the announcer's
+     * own retry schedule takes over, so we don't hold a tier for hours. */
+    TAU_MAX_ATTEMPTS = 4,
+
+    /* how long to trust a tracker's address before looking it up again */
+    TAU_DNS_TTL_SECS = 60 * 60,
+
+    /* at shutdown, how long to wait for our "stopped" announces to go out */
+    TAU_CLOSE_SECS = 5
+};
+
+/***
+****
+***/
+
+/* one torrent in a scrape */
+struct tau_scrape
+{
+    uint8_t info_hash[SHA_DIGEST_LENGTH];
+    tr_tau_scrape_func * callback;
+    void * user_data;
+};
+
+/* a datagram that's waiting for its answer */
+struct tau_request
+{
+    int action;
+    uint32_t transaction_id;
+    time_t sent_at;       /* 0 until it's first sent */
+    int attempts;
+
+    /* TAU_ACTION_ANNOUNCE */
+    tr_tau_announce_request announce;
+    tr_tau_announce_func * announce_func;
+    void * announce_data;
+
+    /* TAU_ACTION_SCRAPE */
+    tr_ptrArray scrapes; /* struct tau_scrape */
+};
+
+struct tau_tracker
+{
+    char * key;           /* "host:port" */
+    char * host;
+    int port;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;    /* 0 until the host is resolved */
+    time_t addr_expires_at;
+    tr_bool isResolving;
+
+    uint64_t connection_id;
+    time_t connection_expires_at;
+
+    uint32_t connect_transaction_id;
+    time_t connect_sent_at; /* 0 unless a connect request is out */
+    int connect_attempts;
+
+    tr_ptrArray requests; /* struct tau_request, oldest first */
+    tr_ptrArray scrapes;  /* struct tau_scrape, not yet in a request */
+
+    struct tr_announcer_udp * tau;
+};
+
+typedef struct tr_announcer_udp
+{
+    tr_session * session;
+    struct evdns_base * dns;
+    tr_ptrArray trackers; /* struct tau_tracker, sorted by key */
+
+    struct event * closeTimer; /* non-NULL while we're closing */
+    time_t closeDeadline;
+}
+tr_announcer_udp;
+
+/***
+****  Packing and unpacking
+***/
+
+static uint8_t*
+putUint32( uint8_t * walk, uint32_t val )
+{
+    val = htonl( val );
+    memcpy( walk, &val, 4 );
+    return walk + 4;
+}
+
+static uint8_t*
+putUint64( uint8_t * walk, uint64_t val )
+{
+    walk = putUint32( walk, (uint32_t)( val >> 32 ) );
+    return putUint32( walk, (uint32_t)( val & 0xffffffffu ) );
+}
+
+static uint32_t
+getUint32( const uint8_t * walk )
+{
+    uint32_t val;
+    memcpy( &val, walk, 4 );
+    return ntohl( val );
+}
+
+static uint64_t
+getUint64( const uint8_t * walk )
+{
+    return ( (uint64_t)getUint32( walk ) << 32 ) | getUint32( walk + 4 );
+}
+
+static uint32_t
+newTransactionId( void )
+{
+    uint32_t id;
+    tr_cryptoRandBuf( &id, sizeof( id ) );
+    return id;
+}
+
+/***
+****  Requests
+***/
+
+static struct tau_request*
+requestNew( int action )
+{
+    struct tau_request * req = tr_new0( struct tau_request, 1 );
+    req->action = action;
+    req->transaction_id = newTransactionId( );
+    req->scrapes = TR_PTR_ARRAY_INIT;
+    return req;
+}
+
+static void
+requestFree( void * vreq )
+{
+    struct tau_request * req = vreq;
+    tr_ptrArrayDestruct( &req->scrapes, tr_free );
+    tr_free( req );
+}
+
+/* tell everyone waiting on this request how it turned out */
+static void
+requestFinish( tr_session                      * session,
+               struct tau_request              * req,
+               const tr_tau_announce_response  * announce,
+               const tr_tau_scrape_response    * scrape )
+{
+    if( req->action == TAU_ACTION_ANNOUNCE )
+    {
+        if( req->announce_func != NULL )
+            req->announce_func( session, announce, req->announce_data );
+    }
+    else
+    {
+        int i;
+        const int n = tr_ptrArraySize( &req->scrapes );
+
+        for( i=0; i<n; ++i )
+        {
+            struct tau_scrape * s = tr_ptrArrayNth( &req->scrapes, i );
+            s->callback( session, scrape, s->user_data );
+        }
+    }
+}
+
+static void
+requestFail( tr_session          * session,
+             struct tau_request  * req,
+             tr_bool               didConnect,
+             tr_bool               didTimeout,
+             const char          * errmsg )
+{
+    tr_tau_announce_response announce;
+    tr_tau_scrape_response scrape;
+
+    memset( &announce, 0, sizeof( announce ) );
+    announce.didConnect = didConnect;
+    announce.didTimeout = didTimeout;
+    announce.errmsg = errmsg;
+
+    memset( &scrape, 0, sizeof( scrape ) );
+    scrape.didConnect = didConnect;
+    scrape.didTimeout = didTimeout;
+    scrape.errmsg = errmsg;
+
+    requestFinish( session, req, &announce, &scrape );
+}
+
+/* fill buf with the request's datagram and return its length */
+static size_t
+requestBuild( const struct tau_request  * req,
+              uint64_t                    connection_id,
+              uint8_t                   * buf )
+{
+    uint8_t * walk = buf;
+
+    walk = putUint64( walk, connection_id );
+    walk = putUint32( walk, req->action );
+    walk = putUint32( walk, req->transaction_id );
+
+    if( req->action == TAU_ACTION_ANNOUNCE )
+    {
+        const tr_tau_announce_request * a = &req->announce;
+        memcpy( walk, a->info_hash, SHA_DIGEST_LENGTH ); walk += SHA_DIGEST_LENGTH;
+        memcpy( walk, a->peer_id, sizeof( a->peer_id ) ); walk += sizeof( a->peer_id );
+        walk = putUint64( walk, a->down );
+        walk = putUint64( walk, a->left );
+        walk = putUint64( walk, a->up );
+        walk = putUint32( walk, a->event );
+        walk = putUint32( walk, 0 ); /* let the tracker use our IP address */
+        walk = putUint32( walk, a->key );
+        walk = putUint32( walk, (uint32_t)a->numwant );
+        *walk++ = ( a->port >> 8 ) & 0xff;
+        *walk++ = a->port & 0xff;
+        assert( walk - buf == TAU_ANNOUNCE_REQUEST_LEN );
+    }
+    else
+    {
+        int i;
+        const int n = tr_ptrArraySize( &req->scrapes );
+
+        for( i=0; i<n; ++i )
+        {
+            const struct tau_scrape * s = tr_ptrArrayNth( (tr_ptrArray*)&req->scrapes, i );
+            memcpy( walk, s->info_hash, SHA_DIGEST_LENGTH );
+            walk += SHA_DIGEST_LENGTH;
+        }
+    }
+
+    return walk - buf;
+}
+
+/***
+****  Trackers
+***/
+
+static int
+compareTrackerToKey( const void * va, const void * vb )
+{
+    const struct tau_tracker * a = va;
+    return strcmp( a->key, vb );
+}
+
+static int
+compareTrackers( const void * va, const void * vb )
+{
+    const struct tau_tracker * b = vb;
+    return compareTrackerToKey( va, b->key );
+}
+
+static void
+trackerFree( void * vtracker )
+{
+    struct tau_tracker * tracker = vtracker;
+
+    tr_ptrArrayDestruct( &tracker->scrapes, tr_free );
+    tr_ptrArrayDestruct( &tracker->requests, requestFree );
+    tr_free( tracker->host );
+    tr_free( tracker->key );
+    tr_free( tracker );
+}
+
+static tr_announcer_udp*
+getTau( tr_session * session )
+{
+    if( session->announcer_udp == NULL )
+    {
+        tr_announcer_udp * tau = tr_new0( tr_announcer_udp, 1 );
+        tau->session = session;
+        tau->trackers = TR_PTR_ARRAY_INIT;
+        session->announcer_udp = tau;
+    }
+
+    return session->announcer_udp;
+}
+
+static struct tau_tracker*
+getTracker( tr_announcer_udp * tau, const char * url )
+{
+    int port = 0;
+    char * host = NULL;
+    char * key;
+    struct tau_tracker * tracker = NULL;
+
+    if( tr_urlParse( url, -1, NULL, &host, &port, NULL ) || ( port <= 0 ) )
+    {
+        tr_free( host );
+        return NULL;
+    }
+
+    key = tr_strdup_printf( "%s:%d", host, port );
+    tracker = tr_ptrArrayFindSorted( &tau->trackers, key, compareTrackerToKey );
+
+    if( tracker == NULL )
+    {
+        tracker = tr_new0( struct tau_tracker, 1 );
+        tracker->key = key;
+        tracker->host = host;
+        tracker->port = port;
+        tracker->requests = TR_PTR_ARRAY_INIT;
+        tracker->scrapes = TR_PTR_ARRAY_INIT;
+        tracker->tau = tau;
+        tr_ptrArrayInsertSorted( &tau->trackers, tracker, compareTrackers );
+    }
+    else
+    {
+        tr_free( key );
+        tr_free( host );
+    }
+
+    return tracker;
+}
+
+static int
+getSocket( const tr_session * session, int family )
+{
+    if( family == AF_INET )
+        return session->udp_socket;
+    if( family == AF_INET6 )
+        return session->udp6_socket;
+    return -1;
+}
+
+static tr_bool
+trackerIsConnected( const struct tau_tracker * tracker, time_t now )
+{
+    return tracker->connection_expires_at > now;
+}
+
+static void
+trackerSend( struct tau_tracker * tracker, const uint8_t * buf, size_t buflen )
+{
+    tr_udpSendTo( tracker->tau->session, buf, buflen,
+                  (const struct sockaddr*)&tracker->addr, tracker->addrlen );
+}
+
+/* fail every request bound for this tracker */
+static void
+trackerFail( struct tau_tracker  * tracker,
+             tr_bool               didConnect,
+             tr_bool               didTimeout,
+             const char          * errmsg )
+{
+    int i, n;
+    struct tau_request ** requests;
+    tr_ptrArray pending = tracker->requests;
+    tr_ptrArray scrapes = tracker->scrapes;
+    struct tau_request * req = requestNew( TAU_ACTION_SCRAPE );
+
+    dbgmsg( tracker, "failing all requests: %s", errmsg ? errmsg : "no answer" );
+
+    /* the callbacks might queue new requests, so start a fresh list */
+    tracker->requests = TR_PTR_ARRAY_INIT;
+    tracker->scrapes = TR_PTR_ARRAY_INIT;
+
+    requests = (struct tau_request**) tr_ptrArrayPeek( &pending, &n );
+    for( i=0; i<n; ++i )
+        requestFail( tracker->tau->session, requests[i], didConnect, didTimeout, errmsg );
+    tr_ptrArrayDestruct( &pending, requestFree );
+
+    req->scrapes = scrapes;
+    requestFail( tracker->tau->session, req, didConnect, didTimeout, errmsg );
+    requestFree( req );
+}
+
+static void
+trackerSendConnect( struct tau_tracker * tracker, time_t now )
+{
+    uint8_t buf[TAU_HEADER_LEN];
+    uint8_t * walk = buf;
+
+    tracker->connect_transaction_id = newTransactionId( );
+    tracker->connect_sent_at = now;
+    ++tracker->connect_attempts;
+
+    walk = putUint64( walk, TAU_PROTOCOL_ID );
+    walk = putUint32( walk, TAU_ACTION_CONNECT );
+    walk = putUint32( walk, tracker->connect_transaction_id );
+
+    dbgmsg( tracker, "sending connect request, attempt %d", tracker->connect_attempts );
+    trackerSend( tracker, buf, walk - buf );
+}
+
+static void
+trackerSendRequest( struct tau_tracker * tracker, struct tau_request * req, time_t now )
+{
+    uint8_t buf[TAU_HEADER_LEN + SHA_DIGEST_LENGTH * TAU_MAX_SCRAPE_HASHES];
+    const size_t len = requestBuild( req, tracker->connection_id, buf );
+
+    req->sent_at = now;
+    ++req->attempts;
+
+    dbgmsg( tracker, "sending request %u (action %d), attempt %d",
+            req->transaction_id, req->action, req->attempts );
+    trackerSend( tracker, buf, len );
+}
+
+/* pack the waiting scrapes into as few requests as possible */
+static void
+trackerPackScrapes( struct tau_tracker * tracker )
+{
+    int i;
+    const int n = tr_ptrArraySize( &tracker->scrapes );
+
+    for( i=0; i<n; i+=TAU_MAX_SCRAPE_HASHES )
+    {
+        int j;
+        const int end = MIN( n, i + TAU_MAX_SCRAPE_HASHES );
+        struct tau_request * req = requestNew( TAU_ACTION_SCRAPE );
+
+        for( j=i; j<end; ++j )
+            tr_ptrArrayAppend( &req->scrapes, tr_ptrArrayNth( &tracker->scrapes, j ) );
+        tr_ptrArrayAppend( &tracker->requests, req );
+    }
+
+    tr_ptrArrayClear( &tracker->scrapes );
+}
+
+static tr_bool
+isDue( time_t sent_at, int attempts, time_t now )
+{
+    return ( sent_at == 0 )
+        || ( now >= sent_at + ( TAU_RETRANSMIT_SECS << ( attempts - 1 ) ) );
+}
+
+static tr_bool
+trackerHasWork( struct tau_tracker * tracker, time_t now )
+{
+    int i;
+
+    if( tr_ptrArraySize( &tracker->scrapes ) )
+        return TRUE;
+
+    for( i=0; i<tr_ptrArraySize( &tracker->requests ); ++i ) {
+        const struct tau_request * req = tr_ptrArrayNth( &tracker->requests, i );
+        if( isDue( req->sent_at, req->attempts, now ) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void trackerResolve( struct tau_tracker * tracker );
+
+/* send everything that's waiting on this tracker,
+ * connecting first if our connection id is stale */
+static void
+trackerFlush( struct tau_tracker * tracker, time_t now )
+{
+    int i;
+    tr_session * session = tracker->tau->session;
+
+    /* give up on requests that have used all their tries */
+    for( i=0; i<tr_ptrArraySize( &tracker->requests ); )
+    {
+        struct tau_request * req = tr_ptrArrayNth( &tracker->requests, i );
+
+        if( ( req->attempts < TAU_MAX_ATTEMPTS ) || !isDue( req->sent_at, req->attempts, now ) )
+            ++i;
+        else {
+            dbgmsg( tracker, "giving up on request %u", req->transaction_id );
+            tr_ptrArrayErase( &tracker->requests, i, i + 1 );
+            requestFail( session, req, TRUE, TRUE, NULL );
+            requestFree( req );
+        }
+    }
+
+    /* don't reconnect just to wait on requests that are already out */
+    if( !trackerHasWork( tracker, now ) && !tracker->connect_sent_at )
+        return;
+
+    if( tracker->isResolving )
+        return;
+
+    if( !tracker->addrlen || ( tracker->addr_expires_at <= now ) )
+    {
+        trackerResolve( tracker );
+        return;
+    }
+
+    if( getSocket( session, tracker->addr.ss_family ) < 0 )
+    {
+        trackerFail( tracker, FALSE, FALSE, NULL );
+        return;
+    }
+
+    if( !trackerIsConnected( tracker, now ) )
+    {
+        if( !isDue( tracker->connect_sent_at, tracker->connect_attempts, now ) )
+            return;
+
+        if( tracker->connect_attempts < TAU_MAX_ATTEMPTS )
+            trackerSendConnect( tracker, now );
+        else {
+            tracker->connect_sent_at = 0;
+            tracker->connect_attempts = 0;
+            trackerFail( tracker, FALSE, TRUE, NULL );
+        }
+        return;
+    }
+
+    trackerPackScrapes( tracker );
+
+    for( i=0; i<tr_ptrArraySize( &tracker->requests ); ++i )
+    {
+        struct tau_request * req = tr_ptrArrayNth( &tracker->requests, i );
+
+        if( isDue( req->sent_at, req->attempts, now ) )
+            trackerSendRequest( tracker, req, now );
+    }
+}
+
+static void
+onResolved( int err, struct evutil_addrinfo * res, void * vtracker )
+{
+    struct evutil_addrinfo * ai;
+    struct tau_tracker * tracker = vtracker;
+    const tr_session * session = tracker->tau->session;
+    const time_t now = tr_time( );
+
+    tracker->isResolving = FALSE;
+    tracker->addrlen = 0;
+
+    /* use the first address that we have a socket for */
+    for( ai=err?NULL:res; ai!=NULL; ai=ai->ai_next )
+    {
+        if( ( getSocket( session, ai->ai_family ) >= 0 )
+            && ( ai->ai_addrlen <= sizeof( tracker->addr ) ) )
+        {
+            memcpy( &tracker->addr, ai->ai_addr, ai->ai_addrlen );
+            tracker->addrlen = ai->ai_addrlen;
+            tracker->addr_expires_at = now + TAU_DNS_TTL_SECS;
+            break;
+        }
+    }
+
+    if( res != NULL )
+        evutil_freeaddrinfo( res );
+
+    if( tracker->addrlen )
+    {
+        dbgmsg( tracker, "resolved" );
+        trackerFlush( tracker, now );
+    }
+    else
+    {
+        dbgmsg( tracker, "couldn't resolve: %s", evutil_gai_strerror( err ) );
+        trackerFail( tracker, FALSE, FALSE, NULL );
+    }
+}
+
+static void
+trackerResolve( struct tau_tracker * tracker )
+{
+    int err;
+    char port[16];
+    struct evutil_addrinfo hints;
+    struct evutil_addrinfo * res = NULL;
+    tr_announcer_udp * tau = tracker->tau;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    tr_snprintf( port, sizeof( port ), "%d", tracker->port );
+
+    tracker->isResolving = TRUE;
+
+    /* numeric addresses don't need a round trip to the nameserver */
+    hints.ai_flags = EVUTIL_AI_NUMERICHOST;
+    err = evutil_getaddrinfo( tracker->host, port, &hints, &res );
+    if( !err )
+    {
+        onResolved( 0, res, tracker );
+        return;
+    }
+
+    if( tau->dns == NULL )
+        tau->dns = evdns_base_new( tau->session->event_base, TRUE );
+    if( tau->dns == NULL )
+    {
+        onResolved( EVUTIL_EAI_FAIL, NULL, tracker );
+        return;
+    }
+
+    hints.ai_flags = 0;
+    dbgmsg( tracker, "looking up host" );
+    evdns_getaddrinfo( tau->dns, tracker->host, port, &hints, onResolved, tracker );
+}
+
+/***
+****  Replies
+***/
+
+static void
+onConnectReply( struct tau_tracker  * tracker,
+                int                   action,
+                const uint8_t       * msg,
+                size_t                msglen )
+{
+    const time_t now = tr_time( );
+
+    tracker->connect_sent_at = 0;
+    tracker->connect_attempts = 0;
+
+    if( ( action == TAU_ACTION_CONNECT ) && ( msglen >= TAU_CONNECT_RESPONSE_LEN ) )
+    {
+        tracker->connection_id = getUint64( msg + 8 );
+        tracker->connection_expires_at = now + TAU_CONNECTION_TTL_SECS;
+        dbgmsg( tracker, "got a connection id" );
+        trackerFlush( tracker, now );
+    }
+    else
+    {
+        char * errmsg = NULL;
+        if( action == TAU_ACTION_ERROR )
+            errmsg = tr_strndup( msg + 8, msglen - 8 );
+        trackerFail( tracker, TRUE, FALSE, errmsg ? errmsg : _( "Unrecognized response" ) );
+        tr_free( errmsg );
+    }
+}
+
+static void
+onRequestReply( struct tau_tracker  * tracker,
+                struct tau_request  * req,
+                int                   action,
+                const uint8_t       * msg,
+                size_t                msglen )
+{
+    tr_session * session = tracker->tau->session;
+
+    if( ( req->action == TAU_ACTION_ANNOUNCE )
+        && ( action == TAU_ACTION_ANNOUNCE )
+        && ( msglen >= TAU_ANNOUNCE_RESPONSE_MIN ) )
+    {
+        tr_tau_announce_response response;
+
+        memset( &response, 0, sizeof( response ) );
+        response.didConnect = TRUE;
+        response.interval = getUint32( msg + 8 );
+        response.leechers = getUint32( msg + 12 );
+        response.seeders = getUint32( msg + 16 );
+        response.peers = msg + TAU_ANNOUNCE_RESPONSE_MIN;
+        response.peersLen = msglen - TAU_ANNOUNCE_RESPONSE_MIN;
+        response.peersAreIPv6 = tracker->addr.ss_family == AF_INET6;
+        requestFinish( session, req, &response, NULL );
+    }
+    else if( ( req->action == TAU_ACTION_SCRAPE ) && ( action == TAU_ACTION_SCRAPE ) )
+    {
+        int i;
+        const int n = tr_ptrArraySize( &req->scrapes );
+        const int rows = ( msglen - 8 ) / TAU_SCRAPE_ROW_LEN;
+
+        for( i=0; i<n; ++i )
+        {
+            struct tau_scrape * s = tr_ptrArrayNth( &req->scrapes, i );
+            tr_tau_scrape_response response;
+
+            memset( &response, 0, sizeof( response ) );
+            response.didConnect = TRUE;
+
+            if( i < rows )
+            {
+                const uint8_t * row = msg + 8 + i * TAU_SCRAPE_ROW_LEN;
+                response.seeders = getUint32( row );
+                response.downloads = getUint32( row + 4 );
+                response.leechers = getUint32( row + 8 );
+            }
+            else
+            {
+                response.errmsg = _( "Unrecognized response" );
+            }
+
+            s->callback( session, &response, s->user_data );
+        }
+    }
+    else
+    {
+        char * errmsg = NULL;
+        if( action == TAU_ACTION_ERROR )
+            errmsg = tr_strndup( msg + 8, msglen - 8 );
+        requestFail( session, req, TRUE, FALSE, errmsg ? errmsg : _( "Unrecognized response" ) );
+        tr_free( errmsg );
+    }
+}
+
+/* is this datagram from the address we sent the tracker's requests to? */
+static tr_bool
+isFromTracker( const struct tau_tracker  * tracker,
+               const struct sockaddr     * from,
+               socklen_t                   fromlen )
+{
+    if( !tracker->addrlen || ( from->sa_family != tracker->addr.ss_family ) )
+        return FALSE;
+
+    if( from->sa_family == AF_INET )
+    {
+        const struct sockaddr_in * a = (const struct sockaddr_in*) from;
+        const struct sockaddr_in * b = (const struct sockaddr_in*) &tracker->addr;
+
+        return ( fromlen >= sizeof( struct sockaddr_in ) )
+            && ( a->sin_port == b->sin_port )
+            && ( a->sin_addr.s_addr == b->sin_addr.s_addr );
+    }
+
+    if( from->sa_family == AF_INET6 )
+    {
+        const struct sockaddr_in6 * a = (const struct sockaddr_in6*) from;
+        const struct sockaddr_in6 * b = (const struct sockaddr_in6*) &tracker->addr;
+
+        return ( fromlen >= sizeof( struct sockaddr_in6 ) )
+            && ( a->sin6_port == b->sin6_port )
+            && !memcmp( &a->sin6_addr, &b->sin6_addr, sizeof( struct in6_addr ) );
+    }
+
+    return FALSE;
+}
+
+tr_bool
+tr_tauHandleMessage( tr_session             * session,
+                     const uint8_t          * msg,
+                     size_t                   msglen,
+                     const struct sockaddr  * from,
+                     socklen_t                fromlen )
+{
+    int i, j;
+    int action;
+    uint32_t transaction_id;
+    tr_announcer_udp * tau = session->announcer_udp;
+
+    if( ( tau == NULL ) || ( msglen < 8 ) )
+        return FALSE;
+
+    action = getUint32( msg );
+    transaction_id = getUint32( msg + 4 );
+
+    for( i=0; i<tr_ptrArraySize( &tau->trackers ); ++i )
+    {
+        struct tau_tracker * tracker = tr_ptrArrayNth( &tau->trackers, i );
+
+        /* transaction ids are easy to guess, so a reply
+         * has to come from the tracker we asked */
+        if( !isFromTracker( tracker, from, fromlen ) )
+            continue;
+
+        if( tracker->connect_sent_at && ( tracker->connect_transaction_id == transaction_id ) )
+        {
+            dbgmsg( tracker, "got a reply to our connect request" );
+            onConnectReply( tracker, action, msg, msglen );
+            return TRUE;
+        }
+
+        for( j=0; j<tr_ptrArraySize( &tracker->requests ); ++j )
+        {
+            struct tau_request * req = tr_ptrArrayNth( &tracker->requests, j );
+
+            if( req->sent_at && ( req->transaction_id == transaction_id ) )
+            {
+                dbgmsg( tracker, "got a reply to request %u", transaction_id );
+                tr_ptrArrayErase( &tracker->requests, j, j + 1 );
+                onRequestReply( tracker, req, action, msg, msglen );
+                requestFree( req );
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+/***
+****
+***/
+
+void
+tr_tauAnnounce( tr_session                     * session,
+                const char                     * url,
+                const tr_tau_announce_request  * request,
+                tr_tau_announce_func             callback,
+                void                           * user_data )
+{
+    struct tau_tracker * tracker = getTracker( getTau( session ), url );
+    struct tau_request * req = requestNew( TAU_ACTION_ANNOUNCE );
+
+    req->announce = *request;
+    req->announce_func = callback;
+    req->announce_data = user_data;
+
+    if( tracker != NULL )
+        tr_ptrArrayAppend( &tracker->requests, req );
+    else {
+        requestFail( session, req, FALSE, FALSE, NULL );
+        requestFree( req );
+    }
+}
+
+void
+tr_tauScrape( tr_session          * session,
+              const char          * url,
+              const uint8_t       * info_hash,
+              tr_tau_scrape_func    callback,
+              void                * user_data )
+{
+    struct tau_tracker * tracker = getTracker( getTau( session ), url );
+    struct tau_scrape * s = tr_new0( struct tau_scrape, 1 );
+
+    memcpy( s->info_hash, info_hash, SHA_DIGEST_LENGTH );
+    s->callback = callback;
+    s->user_data = user_data;
+
+    if( tracker != NULL )
+        tr_ptrArrayAppend( &tracker->scrapes, s );
+    else {
+        struct tau_request * req = requestNew( TAU_ACTION_SCRAPE );
+        tr_ptrArrayAppend( &req->scrapes, s );
+        requestFail( session, req, FALSE, FALSE, NULL );
+        requestFree( req );
+    }
+}
+
+void
+tr_tauUpkeep( tr_session * session )
+{
+    int i;
+    const time_t now = tr_time( );
+    tr_announcer_udp * tau = session->announcer_udp;
+
+    if( tau != NULL )
+        for( i=0; i<tr_ptrArraySize( &tau->trackers ); ++i )
+            trackerFlush( tr_ptrArrayNth( &tau->trackers, i ), now );
+}
+
+static tr_bool
+tauHasRequests( const tr_announcer_udp * tau )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( (tr_ptrArray*)&tau->trackers ); ++i )
+    {
+        const struct tau_tracker * tracker = tr_ptrArrayNth( (tr_ptrArray*)&tau->trackers, i );
+
+        if( !tr_ptrArrayEmpty( &tracker->requests ) || !tr_ptrArrayEmpty( &tracker->scrapes ) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* fail every request that has a callback waiting on it, leaving
+ * only the "stopped" announces that nobody's waiting on */
+static void
+tauFailWaitingRequests( tr_announcer_udp * tau )
+{
+    int i, j, n;
+
+    for( i=0; i<tr_ptrArraySize( &tau->trackers ); ++i )
+    {
+        struct tau_tracker * tracker = tr_ptrArrayNth( &tau->trackers, i );
+        tr_ptrArray pending = tracker->requests;
+        struct tau_request ** requests;
+        struct tau_request * scrape = requestNew( TAU_ACTION_SCRAPE );
+
+        scrape->scrapes = tracker->scrapes;
+        tracker->scrapes = TR_PTR_ARRAY_INIT;
+        tracker->requests = TR_PTR_ARRAY_INIT;
+
+        requests = (struct tau_request**) tr_ptrArrayPeek( &pending, &n );
+        for( j=0; j<n; ++j )
+        {
+            struct tau_request * req = requests[j];
+
+            if( ( req->action == TAU_ACTION_ANNOUNCE ) && ( req->announce_func == NULL ) )
+                tr_ptrArrayAppend( &tracker->requests, req );
+            else {
+                requestFail( tau->session, req, FALSE, FALSE, NULL );
+                requestFree( req );
+            }
+        }
+        tr_ptrArrayDestruct( &pending, NULL );
+
+        requestFail( tau->session, scrape, FALSE, FALSE, NULL );
+        requestFree( scrape );
+    }
+}
+
+static void
+tauFree( tr_announcer_udp * tau )
+{
+    int i;
+
+    /* cancel the lookups still in flight. onResolved() gets called
+     * with an error and fails the requests waiting on the lookup */
+    if( tau->dns != NULL )
+    {
+        evdns_base_free( tau->dns, TRUE );
+        tau->dns = NULL;
+    }
+
+    for( i=0; i<tr_ptrArraySize( &tau->trackers ); ++i )
+        trackerFail( tr_ptrArrayNth( &tau->trackers, i ), FALSE, FALSE, NULL );
+
+    if( tau->closeTimer != NULL )
+        event_free( tau->closeTimer );
+
+    tau->session->announcer_udp = NULL;
+    tr_ptrArrayDestruct( &tau->trackers, trackerFree );
+    tr_free( tau );
+}
+
+static void
+onCloseTimer( int foo UNUSED, short bar UNUSED, void * vtau )
+{
+    tr_announcer_udp * tau = vtau;
+
+    /* the session's clock timer is gone by now, so keep it going
+     * ourselves or the stops would never be resent */
+    tr_timeUpdate( time( NULL ) );
+    tr_tauUpkeep( tau->session );
+
+    if( !tauHasRequests( tau ) || ( tr_time( ) >= tau->closeDeadline ) )
+        tauFree( tau );
+    else
+        tr_timerAdd( tau->closeTimer, 1, 0 );
+}
+
+void
+tr_tauClose( tr_session * session, tr_tau_close_mode close_mode )
+{
+    tr_announcer_udp * tau = session->announcer_udp;
+
+    if( tau == NULL )
+        return;
+
+    if( ( close_mode == TR_TAU_CLOSE_NOW ) || ( session->event_base == NULL ) )
+    {
+        tauFree( tau );
+        return;
+    }
+
+    if( tau->closeTimer != NULL )
+        return;
+
+    tauFailWaitingRequests( tau );
+    tr_tauUpkeep( session );
+
+    if( !tauHasRequests( tau ) )
+        tauFree( tau );
+    else {
+        tau->closeDeadline = tr_time( ) + TAU_CLOSE_SECS;
+        tau->closeTimer = evtimer_new( session->event_base, onCloseTimer, tau );
+        tr_timerAdd( tau->closeTimer, 1, 0 );
+    }
+}
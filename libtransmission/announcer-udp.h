@@ -0,0 +1,149 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef _TR_ANNOUNCER_UDP_H_
+#define _TR_ANNOUNCER_UDP_H_
+
+#include "transmission.h"
+#include "net.h" /* struct sockaddr, socklen_t */
+
+/**
+ * ***  UDP tracker protocol (BEP 15), or "tau" for short.
+ * ***
+ * ***  Requests share the session's DHT/uTP socket, so tr-udp.c hands
+ * ***  us every datagram that looks like a tracker's reply. Connection
+ * ***  IDs are kept per tracker host, and scrapes bound for the same
+ * ***  tracker go out together, up to 74 info_hashes to a packet.
+ * **/
+
+typedef enum
+{
+    TR_TAU_EVENT_NONE = 0,
+    TR_TAU_EVENT_COMPLETED = 1,
+    TR_TAU_EVENT_STARTED = 2,
+    TR_TAU_EVENT_STOPPED = 3
+}
+tr_tau_event;
+
+typedef struct
+{
+    uint8_t info_hash[SHA_DIGEST_LENGTH];
+    uint8_t peer_id[20];
+
+    uint64_t up;
+    uint64_t down;
+    uint64_t left;
+
+    tr_tau_event event;
+
+    /* identifies us to the tracker if our IP address changes */
+    uint32_t key;
+
+    int numwant;
+
+    /* in host byte order */
+    tr_port port;
+}
+tr_tau_announce_request;
+
+typedef struct
+{
+    /* false if we never got a connection ID from the tracker */
+    tr_bool didConnect;
+
+    /* true if the tracker stopped answering */
+    tr_bool didTimeout;
+
+    /* the tracker's error message, or NULL */
+    const char * errmsg;
+
+    int interval;
+    int leechers;
+    int seeders;
+
+    /* compact peers: 6 bytes each, or 18 if peersAreIPv6 */
+    const uint8_t * peers;
+    size_t peersLen;
+    tr_bool peersAreIPv6;
+}
+tr_tau_announce_response;
+
+typedef struct
+{
+    tr_bool didConnect;
+    tr_bool didTimeout;
+    const char * errmsg;
+
+    int seeders;
+    int leechers;
+    int downloads;
+}
+tr_tau_scrape_response;
+
+typedef void tr_tau_announce_func( tr_session                      * session,
+                                   const tr_tau_announce_response  * response,
+                                   void                            * user_data );
+
+typedef void tr_tau_scrape_func( tr_session                    * session,
+                                 const tr_tau_scrape_response  * response,
+                                 void                          * user_data );
+
+/** @brief queue an announce to the tracker at udp://host:port
+    @param callback invoked when the tracker answers or times out. May be NULL. */
+void tr_tauAnnounce( tr_session                     * session,
+                     const char                     * url,
+                     const tr_tau_announce_request  * request,
+                     tr_tau_announce_func             callback,
+                     void                           * user_data );
+
+/** @brief queue a scrape for one torrent at udp://host:port */
+void tr_tauScrape( tr_session          * session,
+                   const char          * url,
+                   const uint8_t       * info_hash,
+                   tr_tau_scrape_func    callback,
+                   void                * user_data );
+
+/** @brief send the queued requests, and resend or give up on unanswered ones.
+    The announcer calls this once a second. */
+void tr_tauUpkeep( tr_session * session );
+
+/** @brief hand a datagram from the UDP socket to the tracker client.
+    @param from the datagram's source; replies from anywhere other
+                than the tracker a request was sent to are ignored
+    @return true if it was a reply to one of our requests */
+tr_bool tr_tauHandleMessage( tr_session             * session,
+                             const uint8_t          * msg,
+                             size_t                   msglen,
+                             const struct sockaddr  * from,
+                             socklen_t                fromlen );
+
+typedef enum
+{
+    TR_TAU_CLOSE_WHEN_IDLE,
+    TR_TAU_CLOSE_NOW
+}
+tr_tau_close_mode;
+
+/** @brief shut down the tracker client.
+
+    Every request with a callback is failed as if the tracker never
+    answered. With TR_TAU_CLOSE_WHEN_IDLE, the "stopped" announces are
+    given a few seconds to go out before everything's freed, so the
+    UDP socket needs to stay open until session->announcer_udp is NULL.
+    TR_TAU_CLOSE_NOW frees everything right away. */
+void tr_tauClose( tr_session * session, tr_tau_close_mode close_mode );
+
+#endif /* _TR_ANNOUNCER_UDP_H_ */
@@ -19,6 +19,7 @@
 
 #include "transmission.h"
 #include "announcer.h"
+#include "announcer-udp.h"
 #include "crypto.h"
 #include "net.h"
 #include "peer-mgr.h" /* tr_peerMgrCompactToPex() */
@@ -117,6 +118,23 @@ compareStops( const void * va, const void * vb )
 ****
 ***/
 
+/* something the announcer needs to look at once `at' comes around:
+ * a tier's next announce or scrape, or a torrent's next DHT announce */
+struct sched_item
+{
+    time_t at;
+    int pos;        /* where it is in its sched_heap, or -1 */
+    void * owner;   /* the tr_tier or tr_torrent */
+};
+
+/* a binary heap of sched_items, soonest first */
+struct sched_heap
+{
+    struct sched_item ** items;
+    int count;
+    int alloc;
+};
+
 /**
  * "global" (per-tr_session) fields
  */
@@ -127,6 +145,14 @@ typedef struct tr_announcer
     struct event * upkeepTimer;
     int slotsAvailable;
     time_t lpdHouseKeepingAt;
+
+    struct sched_heap tierSched; /* tr_tier */
+    struct sched_heap dhtSched;  /* tr_torrent */
+    tr_announcer_stats stats;
+
+    /* scrape URLs whose trackers only answer for the first info_hash
+     * in a multi-hash scrape. Sorted, so use compareStrings() */
+    tr_ptrArray singleScrapeUrls; /* char* */
 }
 tr_announcer;
 
@@ -176,6 +202,7 @@ tr_announcerInit( tr_session * session )
 
     a = tr_new0( tr_announcer, 1 );
     a->stops = TR_PTR_ARRAY_INIT;
+    a->singleScrapeUrls = TR_PTR_ARRAY_INIT;
     a->session = session;
     a->slotsAvailable = MAX_CONCURRENT_TASKS;
     a->lpdHouseKeepingAt = lpdAt;
@@ -193,16 +220,142 @@ tr_announcerClose( tr_session * session )
     tr_announcer * announcer = session->announcer;
 
     flushCloseMessages( announcer );
+    tr_tauClose( session, TR_TAU_CLOSE_WHEN_IDLE );
 
     event_free( announcer->upkeepTimer );
     announcer->upkeepTimer = NULL;
 
     tr_ptrArrayDestruct( &announcer->stops, NULL );
+    tr_ptrArrayDestruct( &announcer->singleScrapeUrls, tr_free );
+    tr_free( announcer->tierSched.items );
+    tr_free( announcer->dhtSched.items );
 
     session->announcer = NULL;
     tr_free( announcer );
 }
 
+void
+tr_announcerGetStats( const tr_announcer * announcer, tr_announcer_stats * setme )
+{
+    *setme = announcer->stats;
+    setme->scheduledItems = announcer->tierSched.count
+                          + announcer->dhtSched.count;
+}
+
+/***
+****  SCHEDULING
+****
+****  The tiers are kept in a heap keyed by when each will next need an
+****  announce or a scrape, and the torrents in one keyed by their next
+****  DHT announce, so an upkeep tick only looks at the ones that are due.
+****  Whatever changes one of those times has to reschedule the item.
+***/
+
+static void
+schedHeapSet( struct sched_heap * heap, int pos, struct sched_item * item )
+{
+    heap->items[pos] = item;
+    item->pos = pos;
+}
+
+/* move the item at `pos' up or down to where its time belongs */
+static void
+schedHeapFix( struct sched_heap * heap, int pos )
+{
+    struct sched_item * item = heap->items[pos];
+
+    while( pos > 0 )
+    {
+        const int parent = ( pos - 1 ) / 2;
+
+        if( heap->items[parent]->at <= item->at )
+            break;
+
+        schedHeapSet( heap, pos, heap->items[parent] );
+        pos = parent;
+    }
+
+    for( ;; )
+    {
+        int child = 2 * pos + 1;
+
+        if( child >= heap->count )
+            break;
+        if( ( child + 1 < heap->count ) && ( heap->items[child+1]->at < heap->items[child]->at ) )
+            ++child;
+        if( item->at <= heap->items[child]->at )
+            break;
+
+        schedHeapSet( heap, pos, heap->items[child] );
+        pos = child;
+    }
+
+    schedHeapSet( heap, pos, item );
+}
+
+static void
+schedRemove( struct sched_heap * heap, struct sched_item * item )
+{
+    if( item->pos >= 0 )
+    {
+        struct sched_item * last = heap->items[--heap->count];
+
+        if( last != item ) {
+            schedHeapSet( heap, item->pos, last );
+            schedHeapFix( heap, last->pos );
+        }
+
+        item->pos = -1;
+    }
+}
+
+/* add the item to the heap, or move it if it's already there */
+static void
+schedSet( struct sched_heap * heap, struct sched_item * item, time_t at )
+{
+    item->at = at;
+
+    if( item->pos < 0 )
+    {
+        if( heap->count == heap->alloc ) {
+            heap->alloc = heap->alloc ? heap->alloc * 2 : 64;
+            heap->items = tr_renew( struct sched_item*, heap->items, heap->alloc );
+        }
+
+        schedHeapSet( heap, heap->count++, item );
+    }
+
+    schedHeapFix( heap, item->pos );
+}
+
+/* remove and return the soonest item if it's due, or return NULL */
+static void*
+schedPopDue( struct sched_heap * heap, time_t now )
+{
+    struct sched_item * item;
+
+    if( !heap->count || ( heap->items[0]->at > now ) )
+        return NULL;
+
+    item = heap->items[0];
+    schedRemove( heap, item );
+    return item->owner;
+}
+
+/* note how long a due item waited before its request went out.
+ * Items that are put back because there's no free slot keep their
+ * old time, so they're only counted once they're finally sent */
+static void
+schedItemSent( tr_announcer * announcer, const struct sched_item * item, time_t now )
+{
+    const time_t lag = now > item->at ? now - item->at : 0;
+
+    ++announcer->stats.dueItems;
+    announcer->stats.lagSeconds += lag;
+    if( announcer->stats.maxLagSeconds < (uint64_t)lag )
+        announcer->stats.maxLagSeconds = lag;
+}
+
 /***
 ****
 ***/
@@ -225,6 +378,9 @@ typedef struct
 
     uint32_t id;
 
+    /* speaks the UDP tracker protocol (BEP 15) instead of HTTP */
+    tr_bool isUDP;
+
     /* Sent as the "key" argument in tracker requests
      * to verify us if our IP address changes.
      * This is immutable for the life of the tracker object.
@@ -256,6 +412,7 @@ trackerNew( const char  * announce,
     tracker->announce = tr_strdup( announce );
     tracker->scrape = tr_strdup( scrape );
     tracker->id = id;
+    tracker->isUDP = !strncmp( announce, "udp://", 6 );
     generateKeyParam( tracker->key_param, KEYLEN );
     tracker->seederCount = -1;
     tracker->leecherCount = -1;
@@ -325,9 +482,42 @@ typedef struct
 
     char lastAnnounceStr[128];
     char lastScrapeStr[128];
+
+    /* when announceMore() next needs to look at this tier */
+    struct sched_item sched;
 }
 tr_tier;
 
+/* put the tier in the announcer's heap at the time it'll next need an
+ * announce or a scrape. This mirrors tierNeedsToAnnounce() and
+ * tierNeedsToScrape(), so call it whenever their inputs change */
+static void
+tierReschedule( tr_tier * tier )
+{
+    time_t at = 0;
+    tr_announcer * announcer = tier->tor->session->announcer;
+
+    if( announcer == NULL )
+        return;
+
+    if( !tier->isAnnouncing && !tier->isScraping
+        && ( tier->announceAt != 0 )
+        && !tr_ptrArrayEmpty( &tier->announceEvents ) )
+        at = tier->announceAt;
+
+    if( !tier->isScraping
+        && ( tier->scrapeAt != 0 )
+        && ( tier->currentTracker != NULL )
+        && ( tier->currentTracker->scrape != NULL )
+        && ( !at || ( tier->scrapeAt < at ) ) )
+        at = tier->scrapeAt;
+
+    if( at )
+        schedSet( &announcer->tierSched, &tier->sched, at );
+    else
+        schedRemove( &announcer->tierSched, &tier->sched );
+}
+
 static tr_tier *
 tierNew( tr_torrent * tor )
 {
@@ -346,6 +536,8 @@ tierNew( tr_torrent * tor )
     t->announceMinIntervalSec = DEFAULT_ANNOUNCE_MIN_INTERVAL_SEC;
     t->scrapeAt = now + tr_cryptoWeakRandInt( 60*5 );
     t->tor = tor;
+    t->sched.pos = -1;
+    t->sched.owner = t;
 
     return t;
 }
@@ -354,6 +546,11 @@ static void
 tierFree( void * vtier )
 {
     tr_tier * tier = vtier;
+    tr_announcer * announcer = tier->tor->session->announcer;
+
+    if( announcer != NULL )
+        schedRemove( &announcer->tierSched, &tier->sched );
+
     tr_ptrArrayDestruct( &tier->trackers, trackerFree );
     tr_ptrArrayDestruct( &tier->announceEvents, NULL );
     tr_free( tier );
@@ -376,6 +573,8 @@ tierIncrementTracker( tr_tier * tier )
     tier->isScraping = FALSE;
     tier->lastAnnounceStartTime = 0;
     tier->lastScrapeStartTime = 0;
+
+    tierReschedule( tier );
 }
 
 static void
@@ -408,17 +607,34 @@ typedef struct tr_torrent_tiers
     tr_ptrArray tiers; /* tr_tier */
     tr_tracker_callback * callback;
     void * callbackData;
+
+    /* when the torrent's next DHT announce is due */
+    struct sched_item dhtSched;
 }
 tr_torrent_tiers;
 
 static tr_torrent_tiers*
-tiersNew( void )
+tiersNew( tr_torrent * tor )
 {
     tr_torrent_tiers * tiers = tr_new0( tr_torrent_tiers, 1 );
     tiers->tiers = TR_PTR_ARRAY_INIT;
+    tiers->dhtSched.pos = -1;
+    tiers->dhtSched.owner = tor;
     return tiers;
 }
 
+static void
+torrentRescheduleDHT( tr_announcer * announcer, tr_torrent * tor )
+{
+    struct sched_item * item = &tor->tiers->dhtSched;
+
+    if( tor->isRunning && !tr_torrentIsPrivate( tor ) )
+        schedSet( &announcer->dhtSched, item, MIN( tor->dhtAnnounceAt,
+                                                   tor->dhtAnnounce6At ) );
+    else
+        schedRemove( &announcer->dhtSched, item );
+}
+
 static void
 tiersFree( tr_torrent_tiers * tiers )
 {
@@ -649,6 +865,37 @@ createAnnounceURL( const tr_announcer     * announcer,
     return evbuffer_free_to_str( buf );
 }
 
+/* the UDP tracker equivalent of createAnnounceURL() */
+static void
+createUdpAnnounce( const tr_announcer       * announcer,
+                   const tr_torrent         * torrent,
+                   const tr_tier            * tier,
+                   const char               * eventName,
+                   tr_tau_announce_request  * req )
+{
+    const tr_tracker_item * tracker = tier->currentTracker;
+
+    memset( req, 0, sizeof( tr_tau_announce_request ) );
+    memcpy( req->info_hash, torrent->info.hash, SHA_DIGEST_LENGTH );
+    memcpy( req->peer_id, torrent->peer_id, sizeof( req->peer_id ) );
+    req->up = tier->byteCounts[TR_ANN_UP];
+    req->down = tier->byteCounts[TR_ANN_DOWN];
+    req->left = tr_cpLeftUntilComplete( &torrent->completion );
+    req->port = tr_sessionGetPublicPeerPort( announcer->session );
+    req->numwant = NUMWANT;
+    memcpy( &req->key, tracker->key_param, sizeof( req->key ) );
+
+    /* there's no "paused" in BEP 15, so partial seeds just say nothing */
+    if( !strcmp( eventName, "started" ) )
+        req->event = TR_TAU_EVENT_STARTED;
+    else if( !strcmp( eventName, "completed" ) )
+        req->event = TR_TAU_EVENT_COMPLETED;
+    else if( !strcmp( eventName, "stopped" ) ) {
+        req->event = TR_TAU_EVENT_STOPPED;
+        req->numwant = 0;
+    }
+}
+
 
 /***
 ****
@@ -706,7 +953,7 @@ tr_announcerAddTorrent( tr_torrent           * tor,
 
     assert( tr_isTorrent( tor ) );
 
-    tiers = tiersNew( );
+    tiers = tiersNew( tor );
     tiers->callback = callback;
     tiers->callbackData = callbackData;
 
@@ -776,6 +1023,7 @@ tierAddAnnounce( tr_tier * tier, const char * announceEvent, time_t announceAt )
 
     tr_ptrArrayAppend( &tier->announceEvents, (void*)announceEvent );
     tier->announceAt = announceAt;
+    tierReschedule( tier );
 
     dbgmsg( tier, "appended event \"%s\"; announcing in %d seconds", announceEvent, (int)difftime(announceAt,time(NULL)) );
 }
@@ -799,6 +1047,9 @@ void
 tr_announcerTorrentStarted( tr_torrent * tor )
 {
     torrentAddAnnounce( tor, STARTED, tr_time( ) );
+
+    if( tor->tiers != NULL )
+        torrentRescheduleDHT( tor->session->announcer, tor );
 }
 void
 tr_announcerManualAnnounce( tr_torrent * tor )
@@ -860,7 +1111,14 @@ tr_announcerRemoveTorrent( tr_announcer * announcer, tr_torrent * tor )
         {
             tr_tier * tier = tr_ptrArrayNth( &tor->tiers->tiers, i );
 
-            if( tier->isRunning )
+            if( tier->isRunning && tier->currentTracker->isUDP )
+            {
+                tr_tau_announce_request req;
+                createUdpAnnounce( announcer, tor, tier, "stopped", &req );
+                tr_tauAnnounce( announcer->session, tier->currentTracker->announce,
+                                &req, NULL, NULL );
+            }
+            else if( tier->isRunning )
             {
                 struct stop_message * s = tr_new0( struct stop_message, 1 );
                 s->up = tier->byteCounts[TR_ANN_UP];
@@ -870,6 +1128,7 @@ tr_announcerRemoveTorrent( tr_announcer * announcer, tr_torrent * tor )
             }
         }
 
+        schedRemove( &announcer->dhtSched, &tor->tiers->dhtSched );
         tiersFree( tor->tiers );
         tor->tiers = NULL;
     }
@@ -1034,6 +1293,85 @@ struct announce_data
     tr_bool isRunningOnSuccess;
 };
 
+/* the part of handling an announce's result that's
+ * the same for HTTP and UDP trackers */
+static void
+tierAnnounceDone( tr_tier                     * tier,
+                  const struct announce_data  * data,
+                  tr_bool                       didRespond,
+                  tr_bool                       success,
+                  tr_bool                       gotScrape )
+{
+    tr_tracker_item * tracker;
+    const time_t now = tr_time( );
+    const char * announceEvent = data->event;
+
+    tier->lastAnnounceTime = now;
+    tier->lastAnnounceSucceeded = FALSE;
+    tier->isAnnouncing = FALSE;
+    tier->manualAnnounceAllowedAt = now + tier->announceMinIntervalSec;
+
+    if(( tracker = tier->currentTracker ))
+        ++tracker->consecutiveAnnounceFailures;
+
+    if( didRespond )
+    {
+        const tr_bool isStopped = !strcmp( announceEvent, "stopped" );
+
+        if( success )
+        {
+            tier->lastAnnounceSucceeded = TRUE;
+            tier->isRunning = data->isRunningOnSuccess;
+
+            if(( tracker = tier->currentTracker ))
+            {
+                tracker->consecutiveAnnounceFailures = 0;
+            }
+
+            if( gotScrape )
+            {
+                tier->lastScrapeTime = now;
+                tier->lastScrapeSucceeded = TRUE;
+                tier->scrapeAt = now + tier->scrapeIntervalSec;
+            }
+        }
+
+        if( isStopped )
+        {
+            /* now that we've successfully stopped the torrent,
+             * we can reset the up/down/corrupt count we've kept
+             * for this tracker */
+            tier->byteCounts[ TR_ANN_UP ] = 0;
+            tier->byteCounts[ TR_ANN_DOWN ] = 0;
+            tier->byteCounts[ TR_ANN_CORRUPT ] = 0;
+        }
+
+        if( !isStopped && !tr_ptrArraySize( &tier->announceEvents ) )
+        {
+            /* the queue is empty, so enqueue a perodic update */
+            const int interval = tier->announceIntervalSec;
+            dbgmsg( tier, "Sending periodic reannounce in %d seconds", interval );
+            tierAddAnnounce( tier, "", now + interval );
+        }
+    }
+    else
+    {
+        int interval;
+
+        dbgmsg( tier, "%s", tier->lastAnnounceStr );
+        tr_torinf( tier->tor, "%s", tier->lastAnnounceStr );
+
+        tierIncrementTracker( tier );
+
+        /* schedule the next announce */
+        interval = getRetryInterval( tier->currentTracker );
+        dbgmsg( tier, "Retrying announce in %d seconds.", interval );
+        tierAddAnnounce( tier, announceEvent, now + interval );
+    }
+
+    tierReschedule( tier );
+}
+
 static void
 onAnnounceDone( tr_session   * session,
                 tr_bool        didConnect,
@@ -1046,98 +1384,114 @@ onAnnounceDone( tr_session   * session,
     tr_announcer * announcer = session->announcer;
     struct announce_data * data = vdata;
     tr_tier * tier = getTier( announcer, data->torrentId, data->tierId );
-    const time_t now = tr_time( );
-    const char * announceEvent = data->event;
 
     if( tier )
     {
-        tr_tracker_item * tracker;
+        tr_bool success = FALSE;
+        tr_bool gotScrape = FALSE;
 
-        tier->lastAnnounceTime = now;
         tier->lastAnnounceTimedOut = didTimeout;
-        tier->lastAnnounceSucceeded = FALSE;
-        tier->isAnnouncing = FALSE;
-        tier->manualAnnounceAllowedAt = now + tier->announceMinIntervalSec;
-
-        if(( tracker = tier->currentTracker ))
-            ++tracker->consecutiveAnnounceFailures;
 
         if( responseCode == HTTP_OK )
         {
-            tr_bool gotScrape;
-            const tr_bool isStopped = !strcmp( announceEvent, "stopped" );
+            success = parseAnnounceResponse( tier, response, responseLen, &gotScrape );
+        }
+        else if( !didConnect )
+        {
+            tr_strlcpy( tier->lastAnnounceStr, _( "Could not connect to tracker" ),
+                        sizeof( tier->lastAnnounceStr ) );
+        }
+        else if( !responseCode )
+        {
+            tr_strlcpy( tier->lastAnnounceStr, _( "Tracker did not respond" ),
+                        sizeof( tier->lastAnnounceStr ) );
+        }
+        else
+        {
+            /* %1$ld - http status code, such as 404
+             * %2$s - human-readable explanation of the http status code */
+            tr_snprintf( tier->lastAnnounceStr, sizeof( tier->lastAnnounceStr ),
+                         _( "Tracker gave HTTP response code %1$ld (%2$s)" ),
+                         responseCode,
+                         tr_webGetResponseStr( responseCode ) );
+            if( responseCode >= 400 )
+                if( tr_torrentIsPrivate( tier->tor ) || ( tier->tor->info.trackerCount == 1 ) )
+                    publishWarning( tier, tier->lastAnnounceStr );
+        }
 
-            if( parseAnnounceResponse( tier, response, responseLen, &gotScrape ) )
-            {
-                tier->lastAnnounceSucceeded = TRUE;
-                tier->isRunning = data->isRunningOnSuccess;
+        tierAnnounceDone( tier, data, responseCode == HTTP_OK, success, gotScrape );
+    }
 
-                if(( tracker = tier->currentTracker ))
-                {
-                    tracker->consecutiveAnnounceFailures = 0;
-                }
+    if( announcer )
+        ++announcer->slotsAvailable;
 
-                if( gotScrape )
-                {
-                    tier->lastScrapeTime = now;
-                    tier->lastScrapeSucceeded = TRUE;
-                    tier->scrapeAt = now + tier->scrapeIntervalSec;
-                }
-            }
+    tr_free( data );
+}
 
-            if( isStopped )
-            {
-                /* now that we've successfully stopped the torrent,
-                 * we can reset the up/down/corrupt count we've kept
-                 * for this tracker */
-                tier->byteCounts[ TR_ANN_UP ] = 0;
-                tier->byteCounts[ TR_ANN_DOWN ] = 0;
-                tier->byteCounts[ TR_ANN_CORRUPT ] = 0;
-            }
+static void
+onUdpAnnounceDone( tr_session                      * session,
+                   const tr_tau_announce_response  * response,
+                   void                            * vdata )
+{
+    struct announce_data * data = vdata;
+    tr_tier * tier = getTier( session->announcer, data->torrentId, data->tierId );
 
-            if( !isStopped && !tr_ptrArraySize( &tier->announceEvents ) )
-            {
-                /* the queue is empty, so enqueue a perodic update */
-                const int interval = tier->announceIntervalSec;
-                dbgmsg( tier, "Sending periodic reannounce in %d seconds", interval );
-                tierAddAnnounce( tier, "", now + interval );
-            }
+    if( tier )
+    {
+        tr_bool success = FALSE;
+        tr_tracker_item * tracker = tier->currentTracker;
+
+        tier->lastAnnounceTimedOut = response->didTimeout;
+
+        if( response->errmsg != NULL )
+        {
+            tr_strlcpy( tier->lastAnnounceStr, response->errmsg,
+                        sizeof( tier->lastAnnounceStr ) );
+            dbgmsg( tier, "tracker gave \"%s\"", response->errmsg );
+            publishMessage( tier, response->errmsg, TR_TRACKER_ERROR );
+        }
+        else if( !response->didConnect )
+        {
+            tr_strlcpy( tier->lastAnnounceStr, _( "Could not connect to tracker" ),
+                        sizeof( tier->lastAnnounceStr ) );
+        }
+        else if( response->didTimeout )
+        {
+            tr_strlcpy( tier->lastAnnounceStr, _( "Tracker did not respond" ),
+                        sizeof( tier->lastAnnounceStr ) );
         }
         else
         {
-            int interval;
-
-            if( !didConnect )
-                tr_strlcpy( tier->lastAnnounceStr, _( "Could not connect to tracker" ),
-                            sizeof( tier->lastAnnounceStr ) );
-            else if( !responseCode )
-                tr_strlcpy( tier->lastAnnounceStr, _( "Tracker did not respond" ),
-                            sizeof( tier->lastAnnounceStr ) );
-            else {
-                /* %1$ld - http status code, such as 404
-                 * %2$s - human-readable explanation of the http status code */
-                tr_snprintf( tier->lastAnnounceStr, sizeof( tier->lastAnnounceStr ),
-                             _( "Tracker gave HTTP response code %1$ld (%2$s)" ),
-                             responseCode,
-                             tr_webGetResponseStr( responseCode ) );
-                if( responseCode >= 400 )
-                    if( tr_torrentIsPrivate( tier->tor ) || ( tier->tor->info.trackerCount == 1 ) )
-                        publishWarning( tier, tier->lastAnnounceStr );
+            const int seeders = response->seeders;
+            const int leechers = response->leechers;
+
+            success = TRUE;
+            publishErrorClear( tier );
+
+            if( response->interval > 0 )
+            {
+                dbgmsg( tier, "setting interval to %d", response->interval );
+                tier->announceIntervalSec = response->interval;
             }
-            dbgmsg( tier, "%s", tier->lastAnnounceStr );
-            tr_torinf( tier->tor, "%s", tier->lastAnnounceStr );
 
-            tierIncrementTracker( tier );
+            tracker->seederCount = seeders;
+            tracker->leecherCount = leechers;
 
-            /* schedule the next announce */
-            interval = getRetryInterval( tier->currentTracker );
-            dbgmsg( tier, "Retrying announce in %d seconds.", interval );
-            tierAddAnnounce( tier, announceEvent, now + interval );
+            if( response->peersAreIPv6 )
+                tier->lastAnnouncePeerCount = publishPeersCompact6( tier, seeders, leechers,
+                                                                    response->peers,
+                                                                    response->peersLen );
+            else
+                tier->lastAnnouncePeerCount = publishPeersCompact( tier, seeders, leechers,
+                                                                   response->peers,
+                                                                   response->peersLen );
+
+            tr_strlcpy( tier->lastAnnounceStr, _( "Success" ),
+                        sizeof( tier->lastAnnounceStr ) );
         }
-    }
 
-    if( announcer )
-        ++announcer->slotsAvailable;
+        tierAnnounceDone( tier, data, success || ( response->errmsg != NULL ), success, success );
+    }
 
     tr_free( data );
 }
@@ -1225,7 +1579,6 @@ tierAnnounce( tr_announcer * announcer, tr_tier * tier )
 
     if( announceEvent != NULL )
     {
-        char * url;
         struct announce_data * data;
         const tr_torrent * tor = tier->tor;
         const time_t now = tr_time( );
@@ -1236,14 +1589,24 @@ tierAnnounce( tr_announcer * announcer, tr_tier * tier )
         data->isRunningOnSuccess = tor->isRunning;
         data->timeSent = now;
         data->event = announceEvent;
-        url = createAnnounceURL( announcer, tor, tier, data->event );
 
         tier->isAnnouncing = TRUE;
         tier->lastAnnounceStartTime = now;
-        --announcer->slotsAvailable;
-        tr_webRun( announcer->session, url, NULL, onAnnounceDone, data );
 
-        tr_free( url );
+        if( tier->currentTracker->isUDP )
+        {
+            tr_tau_announce_request req;
+            createUdpAnnounce( announcer, tor, tier, data->event, &req );
+            tr_tauAnnounce( announcer->session, tier->currentTracker->announce,
+                            &req, onUdpAnnounceDone, data );
+        }
+        else
+        {
+            char * url = createAnnounceURL( announcer, tor, tier, data->event );
+            --announcer->slotsAvailable;
+            tr_webRun( announcer->session, url, NULL, onAnnounceDone, data );
+            tr_free( url );
+        }
     }
 }
 
@@ -1251,57 +1614,59 @@ tierAnnounce( tr_announcer * announcer, tr_tier * tier )
 ****
 ***/
 
+tr_benc*
+tr_announcerFindScrapeFile( tr_benc * files, const uint8_t * info_hash )
+{
+    int i = 0;
+    const char * key;
+    tr_benc * val;
+
+    if( files != NULL )
+        while( tr_bencDictChild( files, i++, &key, &val ) )
+            if( !memcmp( info_hash, key, SHA_DIGEST_LENGTH ) )
+                return val;
+
+    return NULL;
+}
+
 static tr_bool
 parseScrapeResponse( tr_tier     * tier,
-                     const char  * response,
-                     size_t        responseLen,
+                     tr_benc     * files,
                      char        * result,
                      size_t        resultlen )
 {
     tr_bool success = FALSE;
-    tr_benc benc, *files;
-    const int bencLoaded = !tr_bencLoad( response, responseLen, &benc, NULL );
-    if( bencLoaded && tr_bencDictFindDict( &benc, "files", &files ) )
-    {
-        const char * key;
-        tr_benc * val;
-        int i = 0;
-        while( tr_bencDictChild( files, i++, &key, &val ))
-        {
-            int64_t intVal;
-            tr_benc * flags;
+    tr_benc * val = tr_announcerFindScrapeFile( files, tier->tor->info.hash );
 
-            if( memcmp( tier->tor->info.hash, key, SHA_DIGEST_LENGTH ) )
-                continue;
+    if( val != NULL )
+    {
+        int64_t intVal;
+        tr_benc * flags;
 
-            success = TRUE;
-            publishErrorClear( tier );
+        success = TRUE;
+        publishErrorClear( tier );
 
-            if( ( tr_bencDictFindInt( val, "complete", &intVal ) ) )
-                tier->currentTracker->seederCount = intVal;
+        if( ( tr_bencDictFindInt( val, "complete", &intVal ) ) )
+            tier->currentTracker->seederCount = intVal;
 
-            if( ( tr_bencDictFindInt( val, "incomplete", &intVal ) ) )
-                tier->currentTracker->leecherCount = intVal;
+        if( ( tr_bencDictFindInt( val, "incomplete", &intVal ) ) )
+            tier->currentTracker->leecherCount = intVal;
 
-            if( ( tr_bencDictFindInt( val, "downloaded", &intVal ) ) )
-                tier->currentTracker->downloadCount = intVal;
+        if( ( tr_bencDictFindInt( val, "downloaded", &intVal ) ) )
+            tier->currentTracker->downloadCount = intVal;
 
-            if( ( tr_bencDictFindInt( val, "downloaders", &intVal ) ) )
-                tier->currentTracker->downloaderCount = intVal;
+        if( ( tr_bencDictFindInt( val, "downloaders", &intVal ) ) )
+            tier->currentTracker->downloaderCount = intVal;
 
-            if( tr_bencDictFindDict( val, "flags", &flags ) )
-                if( ( tr_bencDictFindInt( flags, "min_request_interval", &intVal ) ) )
-                    tier->scrapeIntervalSec = MAX( DEFAULT_SCRAPE_INTERVAL_SEC, (int)intVal );
+        if( tr_bencDictFindDict( val, "flags", &flags ) )
+            if( ( tr_bencDictFindInt( flags, "min_request_interval", &intVal ) ) )
+                tier->scrapeIntervalSec = MAX( DEFAULT_SCRAPE_INTERVAL_SEC, (int)intVal );
 
-            tr_tordbg( tier->tor,
-                       "Scrape successful. Rescraping in %d seconds.",
-                       tier->scrapeIntervalSec );
-        }
+        tr_tordbg( tier->tor,
+                   "Scrape successful. Rescraping in %d seconds.",
+                   tier->scrapeIntervalSec );
     }
 
-    if( bencLoaded )
-        tr_bencFree( &benc );
-
     if( success )
         tr_strlcpy( result, _( "Success" ), resultlen );
     else
@@ -1310,6 +1675,100 @@ parseScrapeResponse( tr_tier     * tier,
     return success;
 }
 
+struct tier_id
+{
+    int torrentId;
+    int tierId;
+};
+
+/* the tiers whose info_hashes went out in one HTTP scrape */
+struct scrape_data
+{
+    char * url;
+    int tierCount;
+    struct tier_id * tiers;
+};
+
+static int
+compareStrings( const void * va, const void * vb )
+{
+    return strcmp( va, vb );
+}
+
+static tr_bool
+scrapeUrlIsSingle( tr_announcer * announcer, const char * url )
+{
+    return tr_ptrArrayFindSorted( &announcer->singleScrapeUrls, url, compareStrings ) != NULL;
+}
+
+/* apply one HTTP scrape's result to one of the tiers in it.
+ * `files' is the response's "files" dict, or NULL if there wasn't one */
+static void
+tierScrapeDone( tr_tier   * tier,
+                tr_bool     didConnect,
+                tr_bool     didTimeout,
+                long        responseCode,
+                tr_benc   * files )
+{
+    tr_bool success = FALSE;
+    const time_t now = tr_time( );
+
+    tier->isScraping = FALSE;
+    tier->lastScrapeTime = now;
+
+    if( 200 <= responseCode && responseCode <= 299 )
+    {
+        const int interval = tier->scrapeIntervalSec;
+        tier->scrapeAt = now + interval;
+
+        if( responseCode == HTTP_OK )
+            success = parseScrapeResponse( tier, files,
+                                           tier->lastScrapeStr, sizeof( tier->lastScrapeStr ) );
+        else
+            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                         _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
+                         responseCode, tr_webGetResponseStr( responseCode ) );
+        dbgmsg( tier, "%s", tier->lastScrapeStr );
+    }
+    else if( 300 <= responseCode && responseCode <= 399 )
+    {
+        /* this shouldn't happen; libcurl should handle this */
+        const int interval = 5;
+        tier->scrapeAt = now + interval;
+        tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                     "Got a redirect. Retrying in %d seconds", interval );
+        dbgmsg( tier, "%s", tier->lastScrapeStr );
+    }
+    else
+    {
+        const int interval = getRetryInterval( tier->currentTracker );
+
+        /* Don't retry on a 4xx.
+         * Retry at growing intervals on a 5xx */
+        if( 400 <= responseCode && responseCode <= 499 )
+            tier->scrapeAt = 0;
+        else
+            tier->scrapeAt = now + interval;
+
+        /* %1$ld - http status code, such as 404
+         * %2$s - human-readable explanation of the http status code */
+        if( !didConnect )
+            tr_strlcpy( tier->lastScrapeStr, _( "Could not connect to tracker" ),
+                        sizeof( tier->lastScrapeStr ) );
+        else if( !responseCode )
+            tr_strlcpy( tier->lastScrapeStr, _( "tracker did not respond" ),
+                        sizeof( tier->lastScrapeStr ) );
+        else
+            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                         _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
+                         responseCode, tr_webGetResponseStr( responseCode ) );
+    }
+
+    tier->lastScrapeSucceeded = success;
+    tier->lastScrapeTimedOut = didTimeout;
+    tierReschedule( tier );
+}
+
 static void
 onScrapeDone( tr_session   * session,
               tr_bool        didConnect,
@@ -1319,105 +1778,216 @@ onScrapeDone( tr_session   * session,
               size_t         responseLen,
               void         * vdata )
 {
-    tr_bool success = FALSE;
+    int i;
+    tr_benc benc;
+    tr_benc * files = NULL;
+    tr_bool isPartial = FALSE;
     tr_announcer * announcer = session->announcer;
-    struct announce_data * data = vdata;
-    tr_tier * tier = getTier( announcer, data->torrentId, data->tierId );
-    const time_t now = tr_time( );
+    struct scrape_data * data = vdata;
+    const tr_bool bencLoaded = ( responseCode == HTTP_OK )
+                            && !tr_bencLoad( response, responseLen, &benc, NULL );
 
-    if( announcer )
-        ++announcer->slotsAvailable;
+    if( bencLoaded && !tr_bencDictFindDict( &benc, "files", &files ) )
+        files = NULL;
 
-    if( announcer && tier )
+    if( announcer )
     {
-        tier->isScraping = FALSE;
-        tier->lastScrapeTime = now;
+        ++announcer->slotsAvailable;
 
-        if( 200 <= responseCode && responseCode <= 299 )
+        /* some trackers only answer for the first info_hash in a
+         * multi-hash scrape. If this reply left any out, scrape
+         * that URL one torrent at a time from now on */
+        if( ( files != NULL ) && ( data->tierCount > 1 ) )
         {
-            const int interval = tier->scrapeIntervalSec;
-            tier->scrapeAt = now + interval;
+            for( i=0; i<data->tierCount && !isPartial; ++i )
+            {
+                tr_tier * tier = getTier( announcer, data->tiers[i].torrentId,
+                                                     data->tiers[i].tierId );
+                if( tier && !tr_announcerFindScrapeFile( files, tier->tor->info.hash ) )
+                    isPartial = TRUE;
+            }
 
-            if( responseCode == HTTP_OK )
-                success = parseScrapeResponse( tier, response, responseLen,
-                                               tier->lastScrapeStr, sizeof( tier->lastScrapeStr ) );
-            else
-                tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                             _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
-                             responseCode, tr_webGetResponseStr( responseCode ) );
-            dbgmsg( tier, "%s", tier->lastScrapeStr );
+            if( isPartial && !scrapeUrlIsSingle( announcer, data->url ) )
+            {
+                tr_ndbg( data->url, "tracker skipped some info_hashes; scraping one at a time" );
+                tr_ptrArrayInsertSorted( &announcer->singleScrapeUrls,
+                                         tr_strdup( data->url ), compareStrings );
+            }
         }
-        else if( 300 <= responseCode && responseCode <= 399 )
+
+        /* parse the response once and fan it out to every tier in the batch */
+        for( i=0; i<data->tierCount; ++i )
         {
-            /* this shouldn't happen; libcurl should handle this */
-            const int interval = 5;
-            tier->scrapeAt = now + interval;
-            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                         "Got a redirect. Retrying in %d seconds", interval );
-            dbgmsg( tier, "%s", tier->lastScrapeStr );
+            tr_tier * tier = getTier( announcer, data->tiers[i].torrentId,
+                                                 data->tiers[i].tierId );
+            if( tier == NULL )
+                continue;
+
+            if( isPartial && !tr_announcerFindScrapeFile( files, tier->tor->info.hash ) )
+            {
+                /* not an error; rescrape it by itself on the next upkeep */
+                tier->isScraping = FALSE;
+                tier->scrapeAt = tr_time( );
+                tierReschedule( tier );
+            }
+            else
+                tierScrapeDone( tier, didConnect, didTimeout, responseCode, files );
         }
+    }
+
+    if( bencLoaded )
+        tr_bencFree( &benc );
+
+    tr_free( data->tiers );
+    tr_free( data->url );
+    tr_free( data );
+}
+
+static void
+onUdpScrapeDone( tr_session                    * session,
+                 const tr_tau_scrape_response  * response,
+                 void                          * vdata )
+{
+    tr_bool success = FALSE;
+    struct announce_data * data = vdata;
+    tr_tier * tier = getTier( session->announcer, data->torrentId, data->tierId );
+    const time_t now = tr_time( );
+
+    if( tier )
+    {
+        tier->isScraping = FALSE;
+        tier->lastScrapeTime = now;
+
+        if( response->errmsg != NULL )
+            tr_strlcpy( tier->lastScrapeStr, response->errmsg,
+                        sizeof( tier->lastScrapeStr ) );
+        else if( !response->didConnect )
+            tr_strlcpy( tier->lastScrapeStr, _( "Could not connect to tracker" ),
+                        sizeof( tier->lastScrapeStr ) );
+        else if( response->didTimeout )
+            tr_strlcpy( tier->lastScrapeStr, _( "tracker did not respond" ),
+                        sizeof( tier->lastScrapeStr ) );
         else
         {
-            const int interval = getRetryInterval( tier->currentTracker );
-
-            /* Don't retry on a 4xx.
-             * Retry at growing intervals on a 5xx */
-            if( 400 <= responseCode && responseCode <= 499 )
-                tier->scrapeAt = 0;
-            else
-                tier->scrapeAt = now + interval;
+            tr_tracker_item * tracker = tier->currentTracker;
 
-            /* %1$ld - http status code, such as 404
-             * %2$s - human-readable explanation of the http status code */
-            if( !didConnect )
-                tr_strlcpy( tier->lastScrapeStr, _( "Could not connect to tracker" ),
-                            sizeof( tier->lastScrapeStr ) );
-            else if( !responseCode )
-                tr_strlcpy( tier->lastScrapeStr, _( "tracker did not respond" ),
-                            sizeof( tier->lastScrapeStr ) );
-            else
-                tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                             _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
-                             responseCode, tr_webGetResponseStr( responseCode ) );
+            success = TRUE;
+            publishErrorClear( tier );
+            tracker->seederCount = response->seeders;
+            tracker->leecherCount = response->leechers;
+            tracker->downloadCount = response->downloads;
+            tr_strlcpy( tier->lastScrapeStr, _( "Success" ),
+                        sizeof( tier->lastScrapeStr ) );
         }
 
+        if( success )
+            tier->scrapeAt = now + tier->scrapeIntervalSec;
+        else
+            tier->scrapeAt = now + getRetryInterval( tier->currentTracker );
+
+        dbgmsg( tier, "%s", tier->lastScrapeStr );
         tier->lastScrapeSucceeded = success;
-        tier->lastScrapeTimedOut = didTimeout;
+        tier->lastScrapeTimedOut = response->didTimeout;
+        tierReschedule( tier );
     }
 
     tr_free( data );
 }
 
 static void
-tierScrape( tr_announcer * announcer, tr_tier * tier )
+tierScrapeUdp( tr_announcer * announcer, tr_tier * tier )
 {
-    char * url;
-    const char * scrape;
     struct announce_data * data;
 
     assert( tier );
     assert( !tier->isScraping );
     assert( tier->currentTracker != NULL );
+    assert( tier->currentTracker->isUDP );
     assert( tr_isTorrent( tier->tor ) );
 
     data = tr_new0( struct announce_data, 1 );
     data->torrentId = tr_torrentId( tier->tor );
     data->tierId = tier->key;
 
-    scrape = tier->currentTracker->scrape;
-
-    url = tr_strdup_printf( "%s%cinfo_hash=%s",
-                            scrape,
-                            strchr( scrape, '?' ) ? '&' : '?',
-                            tier->tor->info.hashEscaped );
-
     tier->isScraping = TRUE;
     tier->lastScrapeStartTime = tr_time( );
+
+    dbgmsg( tier, "scraping over UDP" );
+    tr_tauScrape( announcer->session, tier->currentTracker->scrape,
+                  tier->tor->info.hash, onUdpScrapeDone, data );
+}
+
+static tr_bool
+tiersShareScrapeURL( const tr_tier * a, const tr_tier * b )
+{
+    return !b->currentTracker->isUDP
+        && !strcmp( a->currentTracker->scrape, b->currentTracker->scrape );
+}
+
+/**
+ * Scrape tiers[0] over HTTP, along with as many of the tiers after it
+ * as share its scrape URL and still fit in the session's URL length limit.
+ * Trackers that have shown they only answer one info_hash at a time
+ * are scraped one tier at a time.
+ * The tiers must be sorted by scrape URL.
+ * @return the number of tiers that went out in the request
+ */
+static int
+tiersScrape( tr_announcer * announcer, tr_tier ** tiers, int n )
+{
+    int i;
+    char * url;
+    struct scrape_data * data;
+    const char * scrape = tiers[0]->currentTracker->scrape;
+    const size_t maxlen = announcer->session->scrapeUrlMaxLength;
+    const size_t keylen = strlen( "&info_hash=" );
+    struct evbuffer * buf = evbuffer_new( );
+    const time_t now = tr_time( );
+
+    assert( !tiers[0]->currentTracker->isUDP );
+
+    for( i=1; i<n && tiersShareScrapeURL( tiers[0], tiers[i] ); )
+        ++i;
+    n = i;
+
+    if( scrapeUrlIsSingle( announcer, scrape ) )
+        n = 1;
+
+    data = tr_new0( struct scrape_data, 1 );
+    data->url = tr_strdup( scrape );
+    data->tiers = tr_new( struct tier_id, n );
+
+    evbuffer_add( buf, scrape, strlen( scrape ) );
+    for( i=0; i<n; ++i )
+    {
+        tr_tier * tier = tiers[i];
+        const char * hash = tier->tor->info.hashEscaped;
+
+        assert( !tier->isScraping );
+        assert( tr_isTorrent( tier->tor ) );
+
+        /* the first info_hash always goes in, even if it's too long */
+        if( i && ( evbuffer_get_length( buf ) + keylen + strlen( hash ) > maxlen ) )
+            break;
+
+        evbuffer_add_printf( buf, "%cinfo_hash=%s",
+                             ( i || strchr( scrape, '?' ) ) ? '&' : '?',
+                             hash );
+
+        tier->isScraping = TRUE;
+        tier->lastScrapeStartTime = now;
+        data->tiers[i].torrentId = tr_torrentId( tier->tor );
+        data->tiers[i].tierId = tier->key;
+    }
+    data->tierCount = i;
+
+    url = evbuffer_free_to_str( buf );
     --announcer->slotsAvailable;
-    dbgmsg( tier, "scraping \"%s\"", url );
+    dbgmsg( tiers[0], "scraping %d torrents: \"%s\"", data->tierCount, url );
     tr_webRun( announcer->session, url, NULL, onScrapeDone, data );
 
     tr_free( url );
+    return data->tierCount;
 }
 
 static void
@@ -1474,53 +2044,74 @@ compareTiers( const void * va, const void * vb )
     return ret;
 }
 
+static int
+compareTiersByScrapeURL( const void * va, const void * vb )
+{
+    const tr_tier * a = *(const tr_tier**)va;
+    const tr_tier * b = *(const tr_tier**)vb;
+
+    return strcmp( a->currentTracker->scrape, b->currentTracker->scrape );
+}
+
 static void
 announceMore( tr_announcer * announcer )
 {
-    tr_torrent * tor = NULL;
+    int i;
+    int n;
+    tr_tier * tier;
+    tr_torrent * tor;
     const time_t now = tr_time( );
+    tr_ptrArray due = TR_PTR_ARRAY_INIT;
+    tr_ptrArray announceMe = TR_PTR_ARRAY_INIT;
+    tr_ptrArray scrapeMe = TR_PTR_ARRAY_INIT;
+
+    /* build a list of tiers that need to be announced */
+    while(( tier = schedPopDue( &announcer->tierSched, now ))) {
+        tr_ptrArrayAppend( &due, tier );
+        if( tierNeedsToAnnounce( tier, now ) )
+            tr_ptrArrayAppend( &announceMe, tier );
+        else if( tierNeedsToScrape( tier, now ) )
+            tr_ptrArrayAppend( &scrapeMe, tier );
+    }
 
-    if( announcer->slotsAvailable > 0 )
-    {
-        int i;
-        int n;
-        tr_ptrArray announceMe = TR_PTR_ARRAY_INIT;
-        tr_ptrArray scrapeMe = TR_PTR_ARRAY_INIT;
-
-        /* build a list of tiers that need to be announced */
-        while(( tor = tr_torrentNext( announcer->session, tor ))) {
-            if( tor->tiers ) {
-                n = tr_ptrArraySize( &tor->tiers->tiers );
-                for( i=0; i<n; ++i ) {
-                    tr_tier * tier = tr_ptrArrayNth( &tor->tiers->tiers, i );
-                    if( tierNeedsToAnnounce( tier, now ) )
-                        tr_ptrArrayAppend( &announceMe, tier );
-                    else if( tierNeedsToScrape( tier, now ) )
-                        tr_ptrArrayAppend( &scrapeMe, tier );
-                }
-            }
-        }
-
-        /* if there are more tiers than slots available, prioritize */
-        n = tr_ptrArraySize( &announceMe );
-        if( n > announcer->slotsAvailable )
-            qsort( tr_ptrArrayBase( &announceMe ), n, sizeof( tr_tier * ), compareTiers );
+    /* if there are more tiers than slots available, prioritize */
+    n = tr_ptrArraySize( &announceMe );
+    if( n > announcer->slotsAvailable )
+        qsort( tr_ptrArrayBase( &announceMe ), n, sizeof( tr_tier * ), compareTiers );
 
-        /* announce some */
-        n = MIN( tr_ptrArraySize( &announceMe ), announcer->slotsAvailable );
-        for( i=0; i<n; ++i ) {
-            tr_tier * tier = tr_ptrArrayNth( &announceMe, i );
+    /* announce some. UDP trackers don't need a web task,
+     * so only HTTP announces have to wait for a free slot */
+    n = tr_ptrArraySize( &announceMe );
+    for( i=0; i<n; ++i ) {
+        tr_tier * tier = tr_ptrArrayNth( &announceMe, i );
+        if( tier->currentTracker->isUDP || ( announcer->slotsAvailable > 0 ) ) {
             dbgmsg( tier, "announcing tier %d of %d", i, n );
+            schedItemSent( announcer, &tier->sched, now );
             tierAnnounce( announcer, tier );
         }
+    }
 
-        /* scrape some */
-        n = MIN( tr_ptrArraySize( &scrapeMe ), announcer->slotsAvailable );
-        for( i=0; i<n; ++i ) {
-            tr_tier * tier = tr_ptrArrayNth( &scrapeMe, i );
+    /* scrape some. HTTP scrapes bound for the same URL are sent
+     * together in one request; UDP scrapes are batched by announcer-udp */
+    n = tr_ptrArraySize( &scrapeMe );
+    qsort( tr_ptrArrayBase( &scrapeMe ), n, sizeof( tr_tier * ), compareTiersByScrapeURL );
+    for( i=0; i<n; ) {
+        tr_tier ** tiers = (tr_tier**) tr_ptrArrayBase( &scrapeMe );
+        tr_tier * tier = tiers[i];
+        if( tier->currentTracker->isUDP ) {
             dbgmsg( tier, "scraping tier %d of %d", (i+1), n );
-            tierScrape( announcer, tier );
+            schedItemSent( announcer, &tier->sched, now );
+            tierScrapeUdp( announcer, tier );
+            ++i;
+        } else if( announcer->slotsAvailable > 0 ) {
+            const int end = i + tiersScrape( announcer, tiers + i, n - i );
+            dbgmsg( tier, "scraping tiers %d-%d of %d", (i+1), end, n );
+            for( ; i<end; ++i )
+                schedItemSent( announcer, &tiers[i]->sched, now );
+        } else {
+            ++i;
         }
+    }
 
 #if 0
 char timebuf[64];
@@ -1528,13 +2119,23 @@ tr_getLogTimeStr( timebuf, 64 );
 fprintf( stderr, "[%s] announce.c has %d requests ready to send (announce: %d, scrape: %d)\n", timebuf, (int)(tr_ptrArraySize(&announceMe)+tr_ptrArraySize(&scrapeMe)), (int)tr_ptrArraySize(&announceMe), (int)tr_ptrArraySize(&scrapeMe) );
 #endif
 
-        /* cleanup */
-        tr_ptrArrayDestruct( &scrapeMe, NULL );
-        tr_ptrArrayDestruct( &announceMe, NULL );
-    }
+    /* put the tiers back in the heap. The ones we announced or scraped
+     * stay out until they're done; the ones without a free slot are
+     * still due and will be looked at again on the next tick */
+    n = tr_ptrArraySize( &due );
+    for( i=0; i<n; ++i )
+        tierReschedule( tr_ptrArrayNth( &due, i ) );
 
-    tor = NULL;
-    while(( tor = tr_torrentNext( announcer->session, tor ))) {
+    /* cleanup */
+    tr_ptrArrayDestruct( &scrapeMe, NULL );
+    tr_ptrArrayDestruct( &announceMe, NULL );
+    tr_ptrArrayDestruct( &due, NULL );
+
+    /* if the session's DHT is off, leave the torrents in the heap
+     * so that they're all due when it gets turned back on */
+    while( tr_sessionAllowsDHT( announcer->session )
+        && (( tor = schedPopDue( &announcer->dhtSched, now ))) ) {
+        schedItemSent( announcer, &tor->tiers->dhtSched, now );
         if( tor->dhtAnnounceAt <= now ) {
             if( tor->isRunning && tr_torrentAllowsDHT(tor) ) {
                 int rc;
@@ -1560,6 +2161,8 @@ fprintf( stderr, "[%s] announce.c has %d requests ready to send (announce: %d, s
                         now + 25 * 60 + tr_cryptoWeakRandInt( 3 * 60 );
             }
         }
+
+        torrentRescheduleDHT( announcer, tor );
     }
 
     /* Local Peer Discovery */
@@ -1585,6 +2188,9 @@ onUpkeepTimer( int foo UNUSED, short bar UNUSED, void * vannouncer )
     /* maybe send out some announcements to trackers */
     announceMore( announcer );
 
+    /* send this pass's UDP tracker requests and retry the unanswered ones */
+    tr_tauUpkeep( announcer->session );
+
     /* set up the next timer */
     tr_timerAdd( announcer->upkeepTimer, UPKEEP_INTERVAL_SECS, 0 );
 
@@ -1744,6 +2350,7 @@ tierCopyAttributes( tr_tier * t, const tr_tier * o )
     t->announceEvents = bak.announceEvents;
     t->currentTracker = bak.currentTracker;
     t->currentTrackerIndex = bak.currentTrackerIndex;
+    t->sched = bak.sched;
 
     tr_ptrArrayClear( &t->announceEvents );
     for( i=0, n=tr_ptrArraySize(&o->announceEvents); i<n; ++i )
@@ -1815,6 +2422,14 @@ tr_announcerResetTorrent( tr_announcer * announcer UNUSED, tr_torrent * tor )
         }
     }
 
+    /* the copied tiers have new announce and scrape times */
+    {
+        int i, n;
+        tr_tier ** tiers = (tr_tier**) tr_ptrArrayPeek( &tor->tiers->tiers, &n );
+        for( i=0; i<n; ++i )
+            tierReschedule( tiers[i] );
+    }
+
     /* cleanup */
     tr_ptrArrayDestruct( &oldTiers, tierFree );
 }
@@ -68,6 +68,8 @@ void tr_announcerInit( tr_session * );
 
 void tr_announcerClose( tr_session * );
 
+void tr_announcerGetStats( const struct tr_announcer * , tr_announcer_stats * setme );
+
 /**
 ***  For torrent customers
 **/
@@ -104,5 +106,10 @@ tr_tracker_stat * tr_announcerStats( const tr_torrent * torrent,
 void tr_announcerStatsFree( tr_tracker_stat * trackers,
                             int               trackerCount );
 
+/** @brief find a torrent's entry in an HTTP scrape reply's "files" dict
+    @return the entry, or NULL if `files' is NULL or the tracker left it out */
+struct tr_benc * tr_announcerFindScrapeFile( struct tr_benc  * files,
+                                            const uint8_t   * info_hash );
+
 
 #endif /* _TR_ANNOUNCER_H_ */
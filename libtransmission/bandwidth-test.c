@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <string.h> /* memset */
+
+#include "transmission.h"
+#include "bandwidth.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/***
+****  A simulated swarm: each peer has a link speed and a backlog,
+****  the clock moves in small steps, and tr_bandwidthAllocate() stands
+****  in for the refill timers, handing out turns through simFlush().
+***/
+
+enum
+{
+    STEP_MSEC = 10,
+    DURATION_MSEC = 20000,
+    STEPS = DURATION_MSEC / STEP_MSEC,
+    MAX_PEERS = 16,
+    KiB = 1024,
+    LINK_BUFFER = 64 * KiB /* what a socket holds until it gets a turn */
+};
+
+struct sim_peer
+{
+    tr_bandwidth b; /* first, so simFlush() can cast back to us */
+    size_t linkBytesPerStep;
+    size_t linkLeft;
+    size_t backlog;
+    uint64_t moved;
+};
+
+static uint64_t simNow = 0;
+
+static uint64_t
+simClock( void )
+{
+    return simNow;
+}
+
+static int flushCount = 0;
+static uint64_t flushBytes = 0;
+
+static size_t
+simFlush( tr_bandwidth * b, tr_direction dir, size_t limit )
+{
+    struct sim_peer * peer = (struct sim_peer *) b;
+    size_t n = tr_bandwidthClamp( b, dir, limit );
+
+    n = MIN( n, peer->linkLeft );
+    n = MIN( n, peer->backlog );
+
+    if( n > 0 ) {
+        peer->linkLeft -= n;
+        peer->backlog -= n;
+        peer->moved += n;
+        tr_bandwidthUsed( b, dir, n, TRUE, tr_time_msec( ) );
+        flushBytes += n;
+        ++flushCount;
+    }
+
+    return n;
+}
+
+static void
+simPeerInit( struct sim_peer * peer, tr_bandwidth * parent, size_t link_KiBps )
+{
+    memset( peer, 0, sizeof( struct sim_peer ) );
+    tr_bandwidthConstruct( &peer->b, NULL, parent );
+    peer->linkBytesPerStep = link_KiBps ? ( link_KiBps * KiB * STEP_MSEC ) / 1000 : ~(size_t)0;
+    peer->backlog = ~(size_t)0;
+}
+
+/* time passes, every peer with a backlog asks for a turn
+ * as its socket becoming readable would, then the scheduler runs */
+static void
+simStep( tr_bandwidth * root, struct sim_peer * peers, int peerCount )
+{
+    int i;
+
+    simNow += STEP_MSEC;
+
+    for( i=0; i<peerCount; ++i ) {
+        struct sim_peer * peer = &peers[i];
+        peer->linkLeft += MIN( peer->linkBytesPerStep, LINK_BUFFER - peer->linkLeft );
+        if( peer->backlog )
+            tr_bandwidthActivate( &peer->b, TR_DOWN );
+    }
+
+    tr_bandwidthAllocate( root, TR_DOWN, STEP_MSEC );
+}
+
+static void
+simRun( tr_bandwidth * root, struct sim_peer * peers, int peerCount )
+{
+    int i;
+
+    for( i=0; i<STEPS; ++i )
+        simStep( root, peers, peerCount );
+}
+
+static void
+simPeersFree( struct sim_peer * peers, int peerCount )
+{
+    int i;
+
+    for( i=0; i<peerCount; ++i )
+        tr_bandwidthDestruct( &peers[i].b );
+}
+
+static void
+setLimit( tr_bandwidth * b, size_t KiBps )
+{
+    tr_bandwidthSetLimited( b, TR_DOWN, TRUE );
+    tr_bandwidthSetDesiredSpeed_Bps( b, TR_DOWN, KiBps * KiB );
+}
+
+static uint64_t
+expectedBytes( size_t KiBps )
+{
+    return ( (uint64_t)KiBps * KiB * DURATION_MSEC ) / 1000;
+}
+
+/* is a within pct percent of b? */
+static tr_bool
+isNear( uint64_t a, uint64_t b, int pct )
+{
+    const uint64_t diff = a > b ? a - b : b - a;
+    return diff * 100 <= b * pct;
+}
+
+/***
+****
+***/
+
+/* peers sharing a capped link each get an even slice of it,
+ * in chunks of a few blocks rather than a few bytes at a time */
+static int
+testFairness( void )
+{
+    int i;
+    uint64_t total = 0;
+    const int peerCount = 8;
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, root );
+
+    setLimit( root, 200 );
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], tor, 0 );
+
+    flushCount = 0;
+    flushBytes = 0;
+    simRun( root, peers, peerCount );
+
+    for( i=0; i<peerCount; ++i )
+        total += peers[i].moved;
+    check( isNear( total, expectedBytes( 200 ), 1 ) )
+    for( i=0; i<peerCount; ++i )
+        check( isNear( peers[i].moved, total / peerCount, 10 ) )
+    check( flushBytes / flushCount >= 4096 )
+
+    simPeersFree( peers, peerCount );
+    tr_bandwidthFree( tor );
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* slow peers get all they can take and the rest is split among the others */
+static int
+testSlowPeers( void )
+{
+    int i;
+    uint64_t total = 0;
+    const int peerCount = 6;
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, root );
+
+    setLimit( root, 200 );
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], tor, i < 2 ? 10 : 0 );
+
+    simRun( root, peers, peerCount );
+
+    for( i=0; i<peerCount; ++i )
+        total += peers[i].moved;
+    check( isNear( total, expectedBytes( 200 ), 1 ) )
+    check( isNear( peers[0].moved, expectedBytes( 10 ), 1 ) )
+    check( isNear( peers[1].moved, expectedBytes( 10 ), 1 ) )
+    for( i=2; i<peerCount; ++i )
+        check( isNear( peers[i].moved, expectedBytes( 45 ), 10 ) )
+
+    simPeersFree( peers, peerCount );
+    tr_bandwidthFree( tor );
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* a high priority torrent gets four times a low priority one's share */
+static int
+testPriority( void )
+{
+    int i;
+    uint64_t high = 0;
+    uint64_t low = 0;
+    const int peerCount = 8;
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * a = tr_bandwidthNew( NULL, root );
+    tr_bandwidth * b = tr_bandwidthNew( NULL, root );
+
+    setLimit( root, 200 );
+    a->priority = TR_PRI_HIGH;
+    b->priority = TR_PRI_LOW;
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], i < 4 ? a : b, 0 );
+
+    simRun( root, peers, peerCount );
+
+    for( i=0; i<peerCount; ++i ) {
+        if( i < 4 )
+            high += peers[i].moved;
+        else
+            low += peers[i].moved;
+    }
+    check( isNear( high + low, expectedBytes( 200 ), 1 ) )
+    check( isNear( high, low * 4, 10 ) )
+
+    simPeersFree( peers, peerCount );
+    tr_bandwidthFree( b );
+    tr_bandwidthFree( a );
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* a torrent's own limit holds and its siblings get what it leaves */
+static int
+testTorrentLimit( void )
+{
+    int i;
+    uint64_t capped = 0;
+    uint64_t other = 0;
+    const int peerCount = 8;
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * a = tr_bandwidthNew( NULL, root );
+    tr_bandwidth * b = tr_bandwidthNew( NULL, root );
+
+    setLimit( root, 200 );
+    setLimit( a, 50 );
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], i < 4 ? a : b, 0 );
+
+    simRun( root, peers, peerCount );
+
+    for( i=0; i<peerCount; ++i ) {
+        if( i < 4 )
+            capped += peers[i].moved;
+        else
+            other += peers[i].moved;
+    }
+    check( capped <= expectedBytes( 50 ) + 16 * KiB ) /* plus the first bucketful */
+    check( isNear( capped, expectedBytes( 50 ), 2 ) )
+    check( isNear( other, expectedBytes( 150 ), 2 ) )
+
+    simPeersFree( peers, peerCount );
+    tr_bandwidthFree( b );
+    tr_bandwidthFree( a );
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* without limits everyone runs at link speed, and peers
+ * that run out of things to move drop out of the rings */
+static int
+testUnlimited( void )
+{
+    int i;
+    const int peerCount = 4;
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, root );
+
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], tor, 100 * ( i + 1 ) );
+
+    simRun( root, peers, peerCount );
+
+    for( i=0; i<peerCount; ++i )
+        check( peers[i].moved == expectedBytes( 100 * ( i + 1 ) ) )
+
+    /* each peer used less than its turn, so nothing's left waiting */
+    check( root->band[TR_DOWN].activeCount == 0 )
+    check( tor->band[TR_DOWN].activeCount == 0 )
+
+    /* a peer that asks for a turn gets one, and leaves once it's drained */
+    peers[0].backlog = 1000;
+    peers[0].linkLeft = LINK_BUFFER;
+    tr_bandwidthActivate( &peers[0].b, TR_DOWN );
+    check( root->band[TR_DOWN].activeCount == 1 )
+    check( tor->band[TR_DOWN].activeCount == 1 )
+    tr_bandwidthAllocate( root, TR_DOWN, STEP_MSEC );
+    check( peers[0].backlog == 0 )
+    check( root->band[TR_DOWN].activeCount == 0 )
+
+    /* a waiting peer that moves to a new parent is still waiting there */
+    peers[1].backlog = 1000;
+    tr_bandwidthActivate( &peers[1].b, TR_DOWN );
+    tr_bandwidthSetParent( &peers[1].b, root );
+    check( tor->band[TR_DOWN].activeCount == 0 )
+    check( root->band[TR_DOWN].activeCount == 2 )
+
+    simPeersFree( peers, peerCount );
+    check( root->band[TR_DOWN].activeCount == 1 )
+    tr_bandwidthFree( tor );
+    check( root->band[TR_DOWN].activeCount == 0 )
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* the bucket fills continuously, holds a tenth of a second's worth,
+ * and won't let a big read through a few bytes at a time */
+static int
+testTokens( void )
+{
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+
+    simNow = 100000;
+    setLimit( root, 200 );
+    check( tr_bandwidthClamp( root, TR_DOWN, 32 * KiB ) == 20 * KiB )
+    tr_bandwidthUsed( root, TR_DOWN, 20 * KiB, TRUE, tr_time_msec( ) );
+    check( tr_bandwidthClamp( root, TR_DOWN, 16 * KiB ) == 0 )
+
+    /* 10 msec later there's 2 KiB: enough for a small write, not a big read */
+    simNow += 10;
+    check( tr_bandwidthClamp( root, TR_DOWN, 100 ) == 100 )
+    check( tr_bandwidthClamp( root, TR_DOWN, 16 * KiB ) == 0 )
+
+    simNow += 10;
+    check( tr_bandwidthClamp( root, TR_DOWN, 16 * KiB ) == 4096 )
+
+    /* protocol messages don't use up tokens */
+    tr_bandwidthUsed( root, TR_DOWN, 4096, FALSE, tr_time_msec( ) );
+    check( tr_bandwidthClamp( root, TR_DOWN, 16 * KiB ) == 4096 )
+
+    /* an idle bucket doesn't save up more than a burst */
+    simNow += 10000;
+    check( tr_bandwidthClamp( root, TR_DOWN, 64 * KiB ) == 20 * KiB )
+
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+/* a capped torrent moves about the same amount every tenth of a second
+ * instead of all at once at the start of each pulse */
+static int
+testSmoothness( void )
+{
+    int i;
+    uint64_t prev = 0;
+    const int peerCount = 4;
+    const int stepsPerWindow = 100 / STEP_MSEC;
+    const uint64_t perWindow = expectedBytes( 100 ) / ( DURATION_MSEC / 100 );
+    struct sim_peer peers[MAX_PEERS];
+    tr_bandwidth * root = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, root );
+
+    simNow = 0;
+    setLimit( tor, 100 );
+    for( i=0; i<peerCount; ++i )
+        simPeerInit( &peers[i], tor, 0 );
+
+    flushBytes = 0;
+    for( i=0; i<STEPS; ++i )
+    {
+        simStep( root, peers, peerCount );
+
+        if( ( i + 1 ) % stepsPerWindow == 0 )
+        {
+            const uint64_t moved = flushBytes - prev;
+            if( i + 1 > stepsPerWindow ) /* the first window has a full bucket */
+                check( ( moved >= perWindow / 2 ) && ( moved <= perWindow * 2 ) )
+            prev = flushBytes;
+        }
+    }
+
+    check( isNear( flushBytes, expectedBytes( 100 ), 1 ) )
+
+    simPeersFree( peers, peerCount );
+    tr_bandwidthFree( tor );
+    tr_bandwidthFree( root );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    tr_bandwidthSetFlushFunc( simFlush );
+    tr_bandwidthSetClockFunc( simClock );
+
+    if(( i = testTokens( )))
+        return i;
+
+    if(( i = testFairness( )))
+        return i;
+
+    if(( i = testSlowPeers( )))
+        return i;
+
+    if(( i = testPriority( )))
+        return i;
+
+    if(( i = testTorrentLimit( )))
+        return i;
+
+    if(( i = testUnlimited( )))
+        return i;
+
+    if(( i = testSmoothness( )))
+        return i;
+
+    return 0;
+}
@@ -13,11 +13,13 @@
 #include <assert.h>
 #include <limits.h>
 
+#include <event2/event.h>
+
 #include "transmission.h"
 #include "bandwidth.h"
-#include "crypto.h"
 #include "peer-io.h"
 #include "ptrarray.h"
+#include "session.h"
 #include "utils.h"
 
 #define dbgmsg( ... ) \
@@ -102,6 +104,9 @@ tr_bandwidthDestruct( tr_bandwidth * b )
     tr_bandwidthSetParent( b, NULL );
     tr_ptrArrayDestruct( &b->children, NULL );
 
+    if( b->refillTimer != NULL )
+        event_free( b->refillTimer );
+
     memset( b, ~0, sizeof( tr_bandwidth ) );
     return b;
 }
@@ -110,19 +115,31 @@ tr_bandwidthDestruct( tr_bandwidth * b )
 ****
 ***/
 
+static void ringRemove( tr_bandwidth * parent, tr_bandwidth * b, tr_direction dir );
+
 void
 tr_bandwidthSetParent( tr_bandwidth  * b,
                        tr_bandwidth  * parent )
 {
+    int dir;
+    tr_bool wasActive[2];
+
     assert( tr_isBandwidth( b ) );
     assert( b != parent );
 
+    for( dir=0; dir<2; ++dir )
+        wasActive[dir] = b->band[dir].isActive || ( b->band[dir].activeCount > 0 );
+
     if( b->parent )
     {
         void * removed;
 
         assert( tr_isBandwidth( b->parent ) );
 
+        for( dir=0; dir<2; ++dir )
+            if( b->band[dir].isActive )
+                ringRemove( b->parent, b, dir );
+
         removed = tr_ptrArrayRemoveSorted( &b->parent->children, b, comparePointers );
         assert( removed == b );
         assert( tr_ptrArrayFindSorted( &b->parent->children, b, comparePointers ) == NULL );
@@ -138,100 +155,377 @@ tr_bandwidthSetParent( tr_bandwidth  * b,
         tr_ptrArrayInsertSorted( &parent->children, b, comparePointers );
         assert( tr_ptrArrayFindSorted( &parent->children, b, comparePointers ) == b );
         b->parent = parent;
+
+        /* bring along any backlog to the new parent */
+        for( dir=0; dir<2; ++dir )
+            if( wasActive[dir] )
+                tr_bandwidthActivate( b, dir );
     }
 }
 
 /***
-****
+****  Token buckets
 ***/
-#if 0
-#warning do not check the code in with this enabled
-#define DEBUG_DIRECTION TR_UP
-#endif
+
+enum
+{
+    /* the smallest turn, so that a torrent with hundreds of peers
+       still moves them a few blocks at a time. A bucket that's running
+       low also holds out for this much instead of letting bytes dribble
+       out as fast as they come in. */
+    QUANTUM_MIN = 4096,
+
+    /* a bucket saves up this many msec of its speed, but never less
+       than a few turns' worth so that a slow torrent waiting on its
+       parents doesn't spill what it's been given */
+    BURST_MSEC = 100,
+    BURST_MIN = QUANTUM_MIN * 4
+};
+
+static tr_bandwidth_clock_func clockFunc = NULL;
+
+void
+tr_bandwidthSetClockFunc( tr_bandwidth_clock_func func )
+{
+    clockFunc = func;
+}
+
+static uint64_t
+getNow( void )
+{
+    return clockFunc != NULL ? clockFunc( ) : tr_time_msec_monotonic( );
+}
+
+static size_t
+getBurst( const struct tr_band * band )
+{
+    return MAX( ( band->desiredSpeed_Bps * (uint64_t)BURST_MSEC ) / 1000u, BURST_MIN );
+}
+
+/* the bucket's tokens, topped off for the time since it was last touched */
+static size_t
+getTokens( const struct tr_band * band, uint64_t now )
+{
+    uint64_t tokens = band->tokens;
+
+    if( now > band->lastRefill )
+        tokens += ( band->desiredSpeed_Bps * ( now - band->lastRefill ) ) / 1000u;
+
+    return MIN( tokens, getBurst( band ) );
+}
 
 static void
-allocateBandwidth( tr_bandwidth  * b,
-                   tr_priority_t   parent_priority,
-                   tr_direction    dir,
-                   unsigned int    period_msec,
-                   tr_ptrArray   * peer_pool )
+takeTokens( struct tr_band * band, size_t byteCount, uint64_t now )
 {
-    tr_priority_t priority;
+    const size_t tokens = getTokens( band, now );
 
-    assert( tr_isBandwidth( b ) );
-    assert( tr_isDirection( dir ) );
+    band->tokens = tokens - MIN( tokens, byteCount );
+    band->lastRefill = now;
+}
 
-    /* set the available bandwidth */
-    if( b->band[dir].isLimited )
+static unsigned int
+clampAt( const tr_bandwidth * b, tr_direction dir, unsigned int byteCount, uint64_t now )
+{
+    for( ; b != NULL; b = b->parent )
     {
-        const unsigned int nextPulseSpeed = b->band[dir].desiredSpeed_Bps;
-        b->band[dir].bytesLeft = ( nextPulseSpeed * period_msec ) / 1000u;
-
-#ifdef DEBUG_DIRECTION
-        if( dir == DEBUG_DIRECTION )
-                fprintf( stderr, "bandwidth %p currentPieceSpeed(%5.2f of %5.2f) desiredSpeed(%5.2f), allocating %d\n",
-                         b, currentSpeed, tr_bandwidthGetRawSpeed( b, dir ), desiredSpeed,
-                         b->band[dir].bytesLeft );
-#endif
+        const struct tr_band * band = &b->band[dir];
+
+        if( band->isLimited )
+        {
+            const size_t tokens = getTokens( band, now );
+
+            if( ( tokens < byteCount ) && ( tokens < QUANTUM_MIN ) )
+                return 0;
+
+            byteCount = MIN( byteCount, tokens );
+        }
+
+        if( !band->honorParentLimits )
+            break;
+    }
+
+    return byteCount;
+}
+
+static tr_bool
+isThrottled( const tr_bandwidth * b, tr_direction dir, uint64_t now )
+{
+    return clampAt( b, dir, QUANTUM_MIN, now ) == 0;
+}
+
+/* find the bucket that will take the longest to let a worthwhile chunk
+ * through to b, and how many msec it'll take to fill up that much */
+static tr_bandwidth *
+getThrottle( tr_bandwidth * b, tr_direction dir, uint64_t now, int * setme_msec )
+{
+    int wait = 0;
+    tr_bandwidth * throttle = NULL;
+
+    for( ; b != NULL; b = b->parent )
+    {
+        const struct tr_band * band = &b->band[dir];
+
+        if( band->isLimited && band->desiredSpeed_Bps )
+        {
+            const size_t need = MAX( getBurst( band ) / 4, QUANTUM_MIN );
+            const size_t tokens = getTokens( band, now );
+
+            if( tokens < need )
+            {
+                const int msec = 1 + ( ( need - tokens ) * (uint64_t)1000u ) / band->desiredSpeed_Bps;
+
+                if( msec > wait ) {
+                    wait = msec;
+                    throttle = b;
+                }
+            }
+        }
+
+        if( !band->honorParentLimits )
+            break;
+    }
+
+    *setme_msec = wait;
+    return throttle;
+}
+
+static void onRefill( int fd UNUSED, short what UNUSED, void * vb );
+
+/* b has a backlog but no bandwidth, so wake up the bucket
+ * that's holding it back once it's refilled */
+static void
+scheduleRefill( tr_bandwidth * b, tr_direction dir, uint64_t now )
+{
+    int msec;
+    tr_bandwidth * throttle = getThrottle( b, dir, now, &msec );
+
+    if( ( throttle == NULL ) || ( throttle->session == NULL ) )
+        return;
+
+    if( throttle->refillTimer == NULL )
+        throttle->refillTimer = evtimer_new( throttle->session->event_base, onRefill, throttle );
+
+    if( !evtimer_pending( throttle->refillTimer, NULL ) )
+        tr_timerAddMsec( throttle->refillTimer, msec );
+}
+
+/***
+****  Deficit round robin
+****
+****  Each bandwidth keeps a ring of the children that have bytes waiting
+****  to move. When a child's turn comes up it gets its quantum -- an even
+****  share of what its parent expects to move this period, weighted by its
+****  priority among its siblings -- and passes it down to its own ring the
+****  same way. A child that doesn't use all of its turn has drained its
+****  socket and leaves the ring until tr_bandwidthActivate() brings it back.
+***/
+
+static tr_bandwidth_flush_func flushFunc = NULL;
+
+void
+tr_bandwidthSetFlushFunc( tr_bandwidth_flush_func func )
+{
+    flushFunc = func;
+}
+
+static int
+getWeight( tr_priority_t priority )
+{
+    switch( priority ) {
+        case TR_PRI_HIGH: return 4;
+        case TR_PRI_LOW:  return 1;
+        default:          return 2;
     }
+}
 
-    priority = MAX( parent_priority, b->priority );
+static void
+ringAdd( tr_bandwidth * parent, tr_bandwidth * b, tr_direction dir )
+{
+    struct tr_band * band = &b->band[dir];
+    struct tr_band * pband = &parent->band[dir];
+    tr_bandwidth * head = pband->active;
+
+    assert( !band->isActive );
 
-    /* add this bandwidth's peer, if any, to the peer pool */
-    if( b->peer != NULL ) {
-        b->peer->priority = priority;
-        tr_ptrArrayAppend( peer_pool, b->peer );
+    if( head == NULL )
+    {
+        band->prev = band->next = b;
+        pband->active = b;
     }
+    else /* join at the tail so that everyone else goes first */
+    {
+        tr_bandwidth * tail = head->band[dir].prev;
+        band->prev = tail;
+        band->next = head;
+        tail->band[dir].next = b;
+        head->band[dir].prev = b;
+    }
+
+    band->isActive = TRUE;
+    band->deficit = 0;
+    ++pband->activeCount;
+}
 
-#ifdef DEBUG_DIRECTION
-if( ( dir == DEBUG_DIRECTION ) && ( n > 1 ) )
-fprintf( stderr, "bandwidth %p has %d peers\n", b, n );
-#endif
-
-    /* traverse & repeat for the subtree */
-    if( 1 ) {
-        int i;
-        struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase( &b->children );
-        const int n = tr_ptrArraySize( &b->children );
-        for( i=0; i<n; ++i )
-            allocateBandwidth( children[i], priority, dir, period_msec, peer_pool );
+static void
+ringRemove( tr_bandwidth * parent, tr_bandwidth * b, tr_direction dir )
+{
+    struct tr_band * band = &b->band[dir];
+    struct tr_band * pband = &parent->band[dir];
+
+    assert( band->isActive );
+    assert( pband->activeCount > 0 );
+
+    if( band->next == b )
+        pband->active = NULL;
+    else {
+        band->prev->band[dir].next = band->next;
+        band->next->band[dir].prev = band->prev;
+        if( pband->active == b )
+            pband->active = band->next;
     }
+
+    band->prev = band->next = NULL;
+    band->isActive = FALSE;
+    band->deficit = 0;
+    --pband->activeCount;
 }
 
+void
+tr_bandwidthActivate( tr_bandwidth * b, tr_direction dir )
+{
+    const uint64_t now = getNow( );
+    tr_bandwidth * leaf = b;
+
+    assert( tr_isBandwidth( b ) );
+    assert( tr_isDirection( dir ) );
+
+    for( ; b->parent && !b->band[dir].isActive; b = b->parent )
+        ringAdd( b->parent, b, dir );
+
+    if( isThrottled( leaf, dir, now ) )
+        scheduleRefill( leaf, dir, now );
+}
+
+/* set the available bandwidth and the turn sizes for b's busy subtree.
+ * idle subtrees keep what they had; they'll be topped off when they
+ * have something to move again. */
 static void
-phaseOne( tr_ptrArray * peerArray, tr_direction dir )
+allocateBandwidth( tr_bandwidth  * b,
+                   tr_direction    dir,
+                   size_t          share,
+                   unsigned int    period_msec,
+                   uint64_t        now )
 {
-    int i, n;
-    int peerCount = tr_ptrArraySize( peerArray );
-    struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase( peerArray );
-
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    n = peerCount;
-    dbgmsg( "%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download") );
-    i = n ? tr_cryptoWeakRandInt( n ) : 0; /* pick a random starting point */
-    while( n > 1 )
+    int i;
+    size_t capacity;
+    tr_bandwidth * child;
+    struct tr_band * band = &b->band[dir];
+
+    band->quantum = ( share * getWeight( b->priority ) ) / 2;
+
+    if( !band->activeCount )
+        return;
+
+    /* how much we expect to pass down in a turn: a bucketful, our turn,
+     * or -- at the top of an unlimited tree -- what we moved last period */
+    if( band->isLimited )
+        capacity = band->quantum ? MIN( getBurst( band ), band->quantum ) : getBurst( band );
+    else if( band->quantum )
+        capacity = band->quantum;
+    else
+        capacity = ( tr_bandwidthGetRawSpeed_Bps( b, now, dir ) * (uint64_t)period_msec ) / 1000u;
+
+    share = MAX( capacity / band->activeCount, QUANTUM_MIN );
+
+    for( i=0, child=band->active; i<band->activeCount; ++i, child=child->band[dir].next )
+        allocateBandwidth( child, dir, share, period_msec, now );
+}
+
+static size_t
+flushLeaf( tr_bandwidth * b, tr_direction dir, size_t limit )
+{
+    if( b->peer != NULL )
     {
-        const size_t increment = 1024;
-        const int bytesUsed = tr_peerIoFlush( peers[i], dir, increment );
-
-        dbgmsg( "peer #%d of %d used %d bytes in this pass", i, n, bytesUsed );
-
-        if( bytesUsed == (int)increment )
-            ++i;
-        else {
-            /* peer is done writing for now; move it to the end of the list */
-            tr_peerIo * pio = peers[i];
-            peers[i] = peers[n-1];
-            peers[n-1] = pio;
-            --n;
+        const int n = tr_peerIoFlush( b->peer, dir, limit );
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    return flushFunc != NULL ? flushFunc( b, dir, limit ) : 0;
+}
+
+/* give b's busy children their turns until budget is spent, b runs out
+ * of bandwidth, or none of them can move anything more */
+static size_t
+serve( tr_bandwidth * b, tr_direction dir, size_t budget )
+{
+    size_t used = 0;
+    int idleTurns = 0;
+    struct tr_band * band = &b->band[dir];
+
+    if( tr_ptrArrayEmpty( &b->children ) )
+        return flushLeaf( b, dir, budget );
+
+    while( ( band->active != NULL )
+        && ( used < budget )
+        && ( idleTurns < band->activeCount )
+        && !isThrottled( b, dir, getNow( ) ) )
+    {
+        size_t n, grant;
+        tr_bandwidth * child = band->active;
+        struct tr_band * cband = &child->band[dir];
+        tr_peerIo * io = child->peer;
+
+        if( !cband->deficit )
+            cband->deficit = MAX( cband->quantum, QUANTUM_MIN );
+
+        grant = MIN( cband->deficit, budget - used );
+
+        /* hold a ref: the io's callbacks may close it partway through */
+        if( io != NULL )
+            tr_peerIoRef( io );
+
+        n = serve( child, dir, grant );
+        used += n;
+        if( n )
+            idleTurns = 0;
+
+        if( cband->isActive && ( child->parent == b ) )
+        {
+            const uint64_t now = getNow( );
+            const tr_bool isLeaf = tr_ptrArrayEmpty( &child->children );
+            const tr_bool isStalled = ( n < grant ) && isLeaf && isThrottled( child, dir, now );
+
+            cband->deficit -= MIN( cband->deficit, n );
+
+            if( isLeaf ? ( ( n < grant ) && !isStalled ) : !cband->activeCount )
+            {
+                /* nothing left to move, so let its own events
+                 * take it from here until it needs another turn */
+                ringRemove( b, child, dir );
+                if( io != NULL )
+                    tr_peerIoSetEnabled( io, dir, TRUE );
+            }
+            else
+            {
+                if( isStalled )
+                    scheduleRefill( child, dir, now );
+
+                /* unless a limit above us cut it short, the turn's over */
+                if( !cband->deficit || ( ( n < grant ) && !isThrottled( b, dir, now ) ) )
+                {
+                    cband->deficit = 0;
+                    band->active = cband->next;
+                    if( !n )
+                        ++idleTurns;
+                }
+            }
         }
 
-        if( i == n )
-            i = 0;
+        if( io != NULL )
+            tr_peerIoUnref( io );
     }
+
+    return used;
 }
 
 void
@@ -239,57 +533,29 @@ tr_bandwidthAllocate( tr_bandwidth  * b,
                       tr_direction    dir,
                       unsigned int    period_msec )
 {
-    int i, peerCount;
-    tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-    tr_ptrArray low = TR_PTR_ARRAY_INIT;
-    tr_ptrArray high = TR_PTR_ARRAY_INIT;
-    tr_ptrArray normal = TR_PTR_ARRAY_INIT;
-    struct tr_peerIo ** peers;
-
-    /* allocateBandwidth() is a helper function with two purposes:
-     * 1. allocate bandwidth to b and its subtree
-     * 2. accumulate an array of all the peerIos from b and its subtree. */
-    allocateBandwidth( b, TR_PRI_LOW, dir, period_msec, &tmp );
-    peers = (struct tr_peerIo**) tr_ptrArrayBase( &tmp );
-    peerCount = tr_ptrArraySize( &tmp );
-
-    for( i=0; i<peerCount; ++i )
-    {
-        tr_peerIo * io = peers[i];
-        tr_peerIoRef( io );
+    assert( tr_isBandwidth( b ) );
+    assert( tr_isDirection( dir ) );
 
-        tr_peerIoFlushOutgoingProtocolMsgs( io );
+    allocateBandwidth( b, dir, 0, period_msec, tr_time_msec( ) );
 
-        switch( io->priority ) {
-            case TR_PRI_HIGH:   tr_ptrArrayAppend( &high,   io ); /* fall through */
-            case TR_PRI_NORMAL: tr_ptrArrayAppend( &normal, io ); /* fall through */
-            default:            tr_ptrArrayAppend( &low,    io );
-        }
-    }
+    serve( b, dir, clampAt( b, dir, UINT_MAX, getNow( ) ) );
+}
 
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    phaseOne( &high, dir );
-    phaseOne( &normal, dir );
-    phaseOne( &low, dir );
-
-    /* Second phase of IO. To help us scale in high bandwidth situations,
-     * enable on-demand IO for peers with bandwidth left to burn.
-     * This on-demand IO is enabled until (1) the peer runs out of bandwidth,
-     * or (2) the next tr_bandwidthAllocate() call, when we start over again. */
-    for( i=0; i<peerCount; ++i )
-        tr_peerIoSetEnabled( peers[i], dir, tr_peerIoHasBandwidthLeft( peers[i], dir ) );
-
-    for( i=0; i<peerCount; ++i )
-        tr_peerIoUnref( peers[i] );
-
-    /* cleanup */
-    tr_ptrArrayDestruct( &normal, NULL );
-    tr_ptrArrayDestruct( &high, NULL );
-    tr_ptrArrayDestruct( &low, NULL );
-    tr_ptrArrayDestruct( &tmp, NULL );
+static void
+onRefill( int fd UNUSED, short what UNUSED, void * vb )
+{
+    int dir;
+    tr_bandwidth * b = vb;
+
+    assert( tr_isBandwidth( b ) );
+
+    tr_sessionLock( b->session );
+
+    for( dir=0; dir<2; ++dir )
+        if( b->band[dir].activeCount > 0 )
+            serve( b, dir, clampAt( b, dir, UINT_MAX, getNow( ) ) );
+
+    tr_sessionUnlock( b->session );
 }
 
 void
@@ -313,16 +579,7 @@ tr_bandwidthClamp( const tr_bandwidth  * b,
     assert( tr_isBandwidth( b ) );
     assert( tr_isDirection( dir ) );
 
-    if( b )
-    {
-        if( b->band[dir].isLimited )
-            byteCount = MIN( byteCount, b->band[dir].bytesLeft );
-
-        if( b->parent && b->band[dir].honorParentLimits )
-            byteCount = tr_bandwidthClamp( b->parent, dir, byteCount );
-    }
-
-    return byteCount;
+    return clampAt( b, dir, byteCount, getNow( ) );
 }
 
 unsigned int
@@ -350,27 +607,21 @@ tr_bandwidthUsed( tr_bandwidth  * b,
                   tr_bool         isPieceData,
                   uint64_t        now )
 {
-    struct tr_band * band;
+    const uint64_t tokenNow = isPieceData ? getNow( ) : 0;
 
     assert( tr_isBandwidth( b ) );
     assert( tr_isDirection( dir ) );
 
-    band = &b->band[dir];
-
-    if( band->isLimited && isPieceData )
-        band->bytesLeft -= MIN( band->bytesLeft, byteCount );
-
-#ifdef DEBUG_DIRECTION
-if( ( dir == DEBUG_DIRECTION ) && ( band->isLimited ) )
-fprintf( stderr, "%p consumed %5zu bytes of %5s data... was %6zu, now %6zu left\n",
-         b, byteCount, (isPieceData?"piece":"raw"), oldBytesLeft, band->bytesLeft );
-#endif
+    for( ; b != NULL; b = b->parent )
+    {
+        struct tr_band * band = &b->band[dir];
 
-    bytesUsed( now, &band->raw, byteCount );
+        if( band->isLimited && isPieceData )
+            takeTokens( band, byteCount, tokenNow );
 
-    if( isPieceData )
-        bytesUsed( now, &band->piece, byteCount );
+        bytesUsed( now, &band->raw, byteCount );
 
-    if( b->parent != NULL )
-        tr_bandwidthUsed( b->parent, dir, byteCount, isPieceData, now );
+        if( isPieceData )
+            bytesUsed( now, &band->piece, byteCount );
+    }
 }
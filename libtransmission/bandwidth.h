@@ -17,10 +17,14 @@
 #ifndef TR_BANDWIDTH_H
 #define TR_BANDWIDTH_H
 
+#include <assert.h>
+
 #include "transmission.h"
 #include "ptrarray.h"
 #include "utils.h" /* tr_new(), tr_free() */
 
+struct event;
+struct tr_bandwidth;
 struct tr_peerIo;
 
 /**
@@ -53,10 +57,20 @@ struct tr_band
 {
     tr_bool isLimited;
     tr_bool honorParentLimits;
-    unsigned int bytesLeft;
     unsigned int desiredSpeed_Bps;
+    size_t tokens;                    /* token bucket, as of lastRefill */
+    uint64_t lastRefill;              /* tr_time_msec_monotonic() */
     struct bratecontrol raw;
     struct bratecontrol piece;
+
+    /* deficit round robin state, see tr_bandwidthAllocate() */
+    tr_bool isActive;                 /* in the parent's active ring */
+    size_t quantum;                   /* bytes per turn, set each period */
+    size_t deficit;                   /* bytes left in the current turn */
+    int activeCount;                  /* children in the active ring */
+    struct tr_bandwidth * active;     /* the child whose turn is next */
+    struct tr_bandwidth * prev;       /* neighbors in the parent's ring */
+    struct tr_bandwidth * next;
 };
 
 /**
@@ -86,13 +100,25 @@ struct tr_band
  *
  * CONSTRAINING
  *
- *   Call tr_bandwidthAllocate() periodically. tr_bandwidth knows its current
- *   speed and will decide how many bytes to make available over the
- *   user-specified period to reach the user-specified desired speed.
- *   If appropriate, it notifies its peer-ios that new bandwidth is available.
+ *   A limited bandwidth is a token bucket that fills continuously at the
+ *   desired speed and holds about a tenth of a second's worth (and never
+ *   less than a few blocks), so peers move data in a steady stream instead
+ *   of in bursts. tr_bandwidthClamp() and tr_bandwidthUsed() top it off
+ *   on demand from a monotonic clock.
+ *   When a peer-io runs it dry, a timer goes off once the bucket holds
+ *   enough for a worthwhile read or write and hands out the new tokens.
+ *
+ *   Call tr_bandwidthAllocate() periodically as well, for housekeeping.
+ *   It operates on the tr_bandwidth subtree, so usually you'll only need
+ *   to invoke it for the top-level tr_session bandwidth.
  *
- *   tr_bandwidthAllocate() operates on the tr_bandwidth subtree, so usually
- *   you'll only need to invoke it for the top-level tr_session bandwidth.
+ *   Each bandwidth keeps a ring of its children that have something to
+ *   move, and the scheduler walks only those rings, using deficit round
+ *   robin: every child's turn is an even share of its parent's bytes
+ *   for the period, weighted by its priority among its siblings. Peer-ios
+ *   join the ring with tr_bandwidthActivate() when they queue output or run
+ *   out of bandwidth, and leave it when a turn shows they have nothing left
+ *   to move.
  *
  *   The peer-ios all have a pointer to their associated tr_bandwidth object,
  *   and call tr_bandwidthClamp() before performing I/O to see how much
@@ -110,6 +136,7 @@ typedef struct tr_bandwidth
     tr_session * session;
     tr_ptrArray children; /* struct tr_bandwidth */
     struct tr_peerIo * peer;
+    struct event * refillTimer;
 }
 tr_bandwidth;
 
@@ -194,12 +221,19 @@ static inline tr_bool tr_bandwidthIsLimited( const tr_bandwidth  * bandwidth,
 }
 
 /**
- * @brief allocate the next period_msec's worth of bandwidth for the peer-ios to consume
+ * @brief resize the turns for the next period_msec and give waiting peer-ios a turn
  */
 void    tr_bandwidthAllocate          ( tr_bandwidth        * bandwidth,
                                         tr_direction          direction,
                                         unsigned int          period_msec );
 
+/**
+ * @brief note that this bandwidth has bytes waiting to move in this direction
+ * so that it gets a turn as soon as there's bandwidth for it
+ */
+void    tr_bandwidthActivate          ( tr_bandwidth        * bandwidth,
+                                        tr_direction          direction );
+
 /**
  * @brief clamps byteCount down to a number that this bandwidth will allow to be consumed
  */
@@ -270,5 +304,19 @@ static inline tr_bool tr_bandwidthAreParentLimitsHonored( tr_bandwidth  * bandwi
 void tr_bandwidthSetPeer( tr_bandwidth        * bandwidth,
                           struct tr_peerIo    * peerIo );
 
+/* PRIVATE: lets bandwidth-test run the scheduler over simulated peers.
+ * When set, leaves without a peer-io take their turns through this. */
+typedef size_t ( *tr_bandwidth_flush_func )( tr_bandwidth  * bandwidth,
+                                             tr_direction    direction,
+                                             size_t          limit );
+
+void tr_bandwidthSetFlushFunc( tr_bandwidth_flush_func func );
+
+/* PRIVATE: lets bandwidth-test fill the token buckets from a simulated
+ * clock instead of tr_time_msec_monotonic() */
+typedef uint64_t ( *tr_bandwidth_clock_func )( void );
+
+void tr_bandwidthSetClockFunc( tr_bandwidth_clock_func func );
+
 /* @} */
 #endif
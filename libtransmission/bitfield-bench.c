@@ -0,0 +1,100 @@
+/*
+ * Times the bitfield kernels that this CPU can run against each other.
+ *
+ *   bitfield-bench [bitCount]
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi, rand, srand */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "utils.h"
+
+#define LOOPS 2000
+
+static const char * kernelNames[] = { "word", "sse2", "avx2" };
+
+static volatile size_t sink;
+
+static void
+fill( tr_bitfield * b, int percent )
+{
+    size_t i;
+
+    for( i=0; i<b->bitCount; ++i )
+        if( rand( ) % 100 < percent )
+            tr_bitfieldAdd( b, i );
+}
+
+static void
+report( const char * kernel, const char * op, uint64_t begin, size_t bytes )
+{
+    const uint64_t msec = MAX( tr_time_msec( ) - begin, 1 );
+
+    printf( "%-6s %-18s %6lu msec %10.1f MiB/s\n",
+            kernel, op, (unsigned long)msec,
+            ( (double)bytes * LOOPS / ( 1024 * 1024 ) ) / ( msec / 1000.0 ) );
+}
+
+int
+main( int argc, char ** argv )
+{
+    int k;
+    const size_t bitCount = argc > 1 ? (size_t)atoi( argv[1] ) : 1024 * 1024;
+    tr_bitfield * a = tr_bitfieldNew( bitCount );
+    tr_bitfield * b = tr_bitfieldNew( bitCount );
+    tr_bitfield * sparse = tr_bitfieldNew( bitCount );
+    tr_bitfield * c = tr_bitfieldNew( bitCount );
+
+    srand( 1 );
+    fill( a, 50 );
+    fill( b, 50 );
+    tr_bitfieldAdd( sparse, bitCount - 1 );
+
+    printf( "%lu bits, best kernel is %s\n", (unsigned long)bitCount,
+            kernelNames[tr_bitfieldGetKernel( )] );
+
+    for( k=TR_BITFIELD_KERNEL_WORD; k<=TR_BITFIELD_KERNEL_AVX2; ++k )
+    {
+        int i;
+        uint64_t begin;
+        const char * name = kernelNames[k];
+
+        if( !tr_bitfieldSetKernel( k ) ) {
+            printf( "%-6s not supported by this CPU\n", name );
+            continue;
+        }
+
+        begin = tr_time_msec( );
+        for( i=0; i<LOOPS; ++i )
+            sink += tr_bitfieldCountTrueBits( a );
+        report( name, "count", begin, a->byteCount );
+
+        begin = tr_time_msec( );
+        for( i=0; i<LOOPS; ++i )
+            sink += tr_bitfieldCountRange( a, 3, bitCount - 3 );
+        report( name, "count range", begin, a->byteCount );
+
+        begin = tr_time_msec( );
+        for( i=0; i<LOOPS; ++i )
+            sink += tr_bitfieldCountAndNot( a, b );
+        report( name, "and-not count", begin, a->byteCount );
+
+        begin = tr_time_msec( );
+        for( i=0; i<LOOPS; ++i )
+            tr_bitfieldOr( c, a );
+        report( name, "or", begin, a->byteCount );
+
+        begin = tr_time_msec( );
+        for( i=0; i<LOOPS; ++i )
+            sink += tr_bitfieldNextSet( sparse, 0 );
+        report( name, "find next set", begin, sparse->byteCount );
+    }
+
+    tr_bitfieldFree( c );
+    tr_bitfieldFree( sparse );
+    tr_bitfieldFree( b );
+    tr_bitfieldFree( a );
+    return 0;
+}
@@ -11,13 +11,21 @@
  */
 
 #include <assert.h>
-#include <string.h> /* memset */
+#include <string.h> /* memcpy, memset */
 
 #include "transmission.h"
 #include "bitfield.h"
 #include "bitset.h"
 #include "utils.h" /* tr_new0() */
 
+/* GCC 4.9 is the first version that lets functions built for different
+ * instruction sets use the intrinsics side by side in one file */
+#if defined( __GNUC__ ) && ( ( __GNUC__ > 4 ) || ( ( __GNUC__ == 4 ) && ( __GNUC_MINOR__ >= 9 ) ) ) \
+    && ( defined( __x86_64__ ) || defined( __i386__ ) )
+ #define HAVE_X86_KERNELS 1
+ #include <immintrin.h>
+#endif
+
 const tr_bitfield TR_BITFIELD_INIT = { NULL, 0, 0 };
 
 tr_bitfield*
@@ -151,20 +159,6 @@ tr_bitfieldRemRange( tr_bitfield * b,
     return 0;
 }
 
-tr_bitfield*
-tr_bitfieldOr( tr_bitfield * a, const tr_bitfield * b )
-{
-    uint8_t * ait = a->bits;
-    const uint8_t * aend = ait + a->byteCount;
-    const uint8_t * bit = b->bits;
-    const uint8_t * bend = bit + b->byteCount;
-
-    while( ait!=aend && bit!=bend )
-        *ait++ |= *bit++;
-
-    return a;
-}
-
 static const int trueBitCount[256] =
 {
     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
@@ -185,19 +179,465 @@ static const int trueBitCount[256] =
     4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
 };
 
+/***
+****  Kernels
+***/
+
+struct bitfield_kernels
+{
+    size_t ( *popcount )( const uint8_t * bits, size_t n );
+    size_t ( *countAndNot )( const uint8_t * a, const uint8_t * b, size_t n );
+    void   ( *orBytes )( uint8_t * a, const uint8_t * b, size_t n );
+    size_t ( *findNonzero )( const uint8_t * bits, size_t n );
+};
+
+/**
+***  Portable 64-bit words
+**/
+
+static inline uint64_t
+loadWord( const uint8_t * p )
+{
+    uint64_t word;
+    memcpy( &word, p, sizeof( word ) );
+    return word;
+}
+
+static inline size_t
+popcount64( uint64_t x )
+{
+    x = x - ( ( x >> 1 ) & 0x5555555555555555ull );
+    x = ( x & 0x3333333333333333ull ) + ( ( x >> 2 ) & 0x3333333333333333ull );
+    x = ( x + ( x >> 4 ) ) & 0x0f0f0f0f0f0f0f0full;
+    return (size_t)( ( x * 0x0101010101010101ull ) >> 56 );
+}
+
+static size_t
+wordPopcount( const uint8_t * bits, size_t n )
+{
+    size_t i;
+    size_t ret = 0;
+
+    for( i=0; i+8<=n; i+=8 )
+        ret += popcount64( loadWord( bits + i ) );
+    for( ; i<n; ++i )
+        ret += trueBitCount[bits[i]];
+
+    return ret;
+}
+
+static size_t
+wordCountAndNot( const uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+    size_t ret = 0;
+
+    for( i=0; i+8<=n; i+=8 )
+        ret += popcount64( loadWord( a + i ) & ~loadWord( b + i ) );
+    for( ; i<n; ++i )
+        ret += trueBitCount[a[i] & ~b[i] & 0xff];
+
+    return ret;
+}
+
+static void
+wordOr( uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+
+    for( i=0; i+8<=n; i+=8 ) {
+        const uint64_t word = loadWord( a + i ) | loadWord( b + i );
+        memcpy( a + i, &word, sizeof( word ) );
+    }
+    for( ; i<n; ++i )
+        a[i] |= b[i];
+}
+
+static size_t
+wordFindNonzero( const uint8_t * bits, size_t n )
+{
+    size_t i;
+
+    for( i=0; i+8<=n; i+=8 )
+        if( loadWord( bits + i ) )
+            break;
+    for( ; i<n; ++i )
+        if( bits[i] )
+            break;
+
+    return i;
+}
+
+static const struct bitfield_kernels wordKernels =
+{
+    wordPopcount,
+    wordCountAndNot,
+    wordOr,
+    wordFindNonzero
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+***  SSE2, and POPCNT if the CPU has it
+**/
+
+__attribute__(( target( "popcnt" ) ))
+static size_t
+popcntPopcount( const uint8_t * bits, size_t n )
+{
+    size_t i;
+    size_t ret = 0;
+
+    for( i=0; i+8<=n; i+=8 )
+        ret += __builtin_popcountll( loadWord( bits + i ) );
+
+    return ret + wordPopcount( bits + i, n - i );
+}
+
+__attribute__(( target( "popcnt" ) ))
+static size_t
+popcntCountAndNot( const uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+    size_t ret = 0;
+
+    for( i=0; i+8<=n; i+=8 )
+        ret += __builtin_popcountll( loadWord( a + i ) & ~loadWord( b + i ) );
+
+    return ret + wordCountAndNot( a + i, b + i, n - i );
+}
+
+/* count the bits in each byte, then add the bytes up with psadbw */
+__attribute__(( target( "sse2" ) ))
+static inline __m128i
+sse2CountBytes( __m128i x )
+{
+    const __m128i m1 = _mm_set1_epi8( 0x55 );
+    const __m128i m2 = _mm_set1_epi8( 0x33 );
+    const __m128i m4 = _mm_set1_epi8( 0x0f );
+
+    x = _mm_sub_epi8( x, _mm_and_si128( _mm_srli_epi64( x, 1 ), m1 ) );
+    x = _mm_add_epi8( _mm_and_si128( x, m2 ), _mm_and_si128( _mm_srli_epi64( x, 2 ), m2 ) );
+    x = _mm_and_si128( _mm_add_epi8( x, _mm_srli_epi64( x, 4 ) ), m4 );
+    return _mm_sad_epu8( x, _mm_setzero_si128( ) );
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t
+sse2Sum( __m128i acc )
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128( (__m128i*)lanes, acc );
+    return (size_t)( lanes[0] + lanes[1] );
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t
+sse2Popcount( const uint8_t * bits, size_t n )
+{
+    size_t i;
+    __m128i acc = _mm_setzero_si128( );
+
+    for( i=0; i+16<=n; i+=16 )
+        acc = _mm_add_epi64( acc, sse2CountBytes( _mm_loadu_si128( (const __m128i*)( bits + i ) ) ) );
+
+    return sse2Sum( acc ) + wordPopcount( bits + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t
+sse2CountAndNot( const uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+    __m128i acc = _mm_setzero_si128( );
+
+    for( i=0; i+16<=n; i+=16 ) {
+        const __m128i x = _mm_loadu_si128( (const __m128i*)( a + i ) );
+        const __m128i y = _mm_loadu_si128( (const __m128i*)( b + i ) );
+        acc = _mm_add_epi64( acc, sse2CountBytes( _mm_andnot_si128( y, x ) ) );
+    }
+
+    return sse2Sum( acc ) + wordCountAndNot( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+static void
+sse2Or( uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+
+    for( i=0; i+16<=n; i+=16 ) {
+        const __m128i x = _mm_loadu_si128( (const __m128i*)( a + i ) );
+        const __m128i y = _mm_loadu_si128( (const __m128i*)( b + i ) );
+        _mm_storeu_si128( (__m128i*)( a + i ), _mm_or_si128( x, y ) );
+    }
+
+    wordOr( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t
+sse2FindNonzero( const uint8_t * bits, size_t n )
+{
+    size_t i;
+    const __m128i zero = _mm_setzero_si128( );
+
+    for( i=0; i+16<=n; i+=16 ) {
+        const __m128i x = _mm_loadu_si128( (const __m128i*)( bits + i ) );
+        const int zeroes = _mm_movemask_epi8( _mm_cmpeq_epi8( x, zero ) );
+        if( zeroes != 0xffff )
+            return i + __builtin_ctz( ~zeroes );
+    }
+
+    return i + wordFindNonzero( bits + i, n - i );
+}
+
+static const struct bitfield_kernels sse2Kernels =
+{
+    sse2Popcount,
+    sse2CountAndNot,
+    sse2Or,
+    sse2FindNonzero
+};
+
+static const struct bitfield_kernels sse2PopcntKernels =
+{
+    popcntPopcount,
+    popcntCountAndNot,
+    sse2Or,
+    sse2FindNonzero
+};
+
+/**
+***  AVX2
+**/
+
+/* count the bits in each byte with a nibble lookup table,
+ * then add the bytes up with vpsadbw */
+__attribute__(( target( "avx2" ) ))
+static inline __m256i
+avx2CountBytes( __m256i x )
+{
+    const __m256i table = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 );
+    const __m256i mask = _mm256_set1_epi8( 0x0f );
+    const __m256i lo = _mm256_shuffle_epi8( table, _mm256_and_si256( x, mask ) );
+    const __m256i hi = _mm256_shuffle_epi8( table, _mm256_and_si256( _mm256_srli_epi16( x, 4 ), mask ) );
+
+    return _mm256_sad_epu8( _mm256_add_epi8( lo, hi ), _mm256_setzero_si256( ) );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t
+avx2Sum( __m256i acc )
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256( (__m256i*)lanes, acc );
+    return (size_t)( lanes[0] + lanes[1] + lanes[2] + lanes[3] );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t
+avx2Popcount( const uint8_t * bits, size_t n )
+{
+    size_t i;
+    __m256i acc = _mm256_setzero_si256( );
+
+    for( i=0; i+32<=n; i+=32 )
+        acc = _mm256_add_epi64( acc, avx2CountBytes( _mm256_loadu_si256( (const __m256i*)( bits + i ) ) ) );
+
+    return avx2Sum( acc ) + popcntPopcount( bits + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t
+avx2CountAndNot( const uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+    __m256i acc = _mm256_setzero_si256( );
+
+    for( i=0; i+32<=n; i+=32 ) {
+        const __m256i x = _mm256_loadu_si256( (const __m256i*)( a + i ) );
+        const __m256i y = _mm256_loadu_si256( (const __m256i*)( b + i ) );
+        acc = _mm256_add_epi64( acc, avx2CountBytes( _mm256_andnot_si256( y, x ) ) );
+    }
+
+    return avx2Sum( acc ) + popcntCountAndNot( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void
+avx2Or( uint8_t * a, const uint8_t * b, size_t n )
+{
+    size_t i;
+
+    for( i=0; i+32<=n; i+=32 ) {
+        const __m256i x = _mm256_loadu_si256( (const __m256i*)( a + i ) );
+        const __m256i y = _mm256_loadu_si256( (const __m256i*)( b + i ) );
+        _mm256_storeu_si256( (__m256i*)( a + i ), _mm256_or_si256( x, y ) );
+    }
+
+    sse2Or( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t
+avx2FindNonzero( const uint8_t * bits, size_t n )
+{
+    size_t i;
+
+    for( i=0; i+32<=n; i+=32 ) {
+        const __m256i x = _mm256_loadu_si256( (const __m256i*)( bits + i ) );
+        if( !_mm256_testz_si256( x, x ) )
+            break;
+    }
+
+    return i + sse2FindNonzero( bits + i, n - i );
+}
+
+static const struct bitfield_kernels avx2Kernels =
+{
+    avx2Popcount,
+    avx2CountAndNot,
+    avx2Or,
+    avx2FindNonzero
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+/**
+***  Dispatch
+**/
+
+static const struct bitfield_kernels * kernels = NULL;
+static tr_bitfield_kernel kernelType = TR_BITFIELD_KERNEL_WORD;
+
+static tr_bool
+cpuSupports( tr_bitfield_kernel kernel )
+{
+    switch( kernel )
+    {
+        case TR_BITFIELD_KERNEL_WORD:
+            return TRUE;
+#ifdef HAVE_X86_KERNELS
+        case TR_BITFIELD_KERNEL_SSE2:
+            __builtin_cpu_init( );
+            return __builtin_cpu_supports( "sse2" );
+        case TR_BITFIELD_KERNEL_AVX2:
+            __builtin_cpu_init( );
+            /* the AVX2 tails use POPCNT, which every AVX2 CPU has */
+            return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "popcnt" );
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+tr_bool
+tr_bitfieldSetKernel( tr_bitfield_kernel kernel )
+{
+    if( !cpuSupports( kernel ) )
+        return FALSE;
+
+    switch( kernel )
+    {
+#ifdef HAVE_X86_KERNELS
+        case TR_BITFIELD_KERNEL_AVX2:
+            kernels = &avx2Kernels;
+            break;
+        case TR_BITFIELD_KERNEL_SSE2:
+            kernels = __builtin_cpu_supports( "popcnt" ) ? &sse2PopcntKernels : &sse2Kernels;
+            break;
+#endif
+        default:
+            kernels = &wordKernels;
+            break;
+    }
+
+    kernelType = kernel;
+    return TRUE;
+}
+
+static const struct bitfield_kernels *
+getKernels( void )
+{
+    /* If two threads get here at once, they'll both pick the same kernels */
+    if( kernels == NULL )
+    {
+        if( !tr_bitfieldSetKernel( TR_BITFIELD_KERNEL_AVX2 ) )
+            if( !tr_bitfieldSetKernel( TR_BITFIELD_KERNEL_SSE2 ) )
+                tr_bitfieldSetKernel( TR_BITFIELD_KERNEL_WORD );
+    }
+
+    return kernels;
+}
+
+tr_bitfield_kernel
+tr_bitfieldGetKernel( void )
+{
+    getKernels( );
+    return kernelType;
+}
+
+/***
+****
+***/
+
+tr_bitfield*
+tr_bitfieldOr( tr_bitfield * a, const tr_bitfield * b )
+{
+    getKernels( )->orBytes( a->bits, b->bits, MIN( a->byteCount, b->byteCount ) );
+
+    return a;
+}
+
 size_t
-tr_bitfieldCountTrueBits( const tr_bitfield* b )
+tr_bitfieldCountAndNot( const tr_bitfield * a, const tr_bitfield * b )
+{
+    const struct bitfield_kernels * k = getKernels( );
+    const size_t n = MIN( a->byteCount, b->byteCount );
+
+    /* the bits past the end of `b' count as unset */
+    return k->countAndNot( a->bits, b->bits, n )
+         + k->popcount( a->bits + n, a->byteCount - n );
+}
+
+size_t
+tr_bitfieldNextSet( const tr_bitfield * b, size_t start )
 {
-    size_t           ret = 0;
-    const uint8_t *  it, *end;
+    size_t i;
+    uint8_t byte;
+
+    if( start >= b->bitCount )
+        return b->bitCount;
+
+    /* the rest of the first byte */
+    i = start >> 3u;
+    byte = b->bits[i] & ( 0xff >> ( start & 7u ) );
+
+    /* the rest of the bytes */
+    if( !byte ) {
+        ++i;
+        i += getKernels( )->findNonzero( b->bits + i, b->byteCount - i );
+        if( i == b->byteCount )
+            return b->bitCount;
+        byte = b->bits[i];
+    }
+
+    for( start=i*8; !( byte & 0x80 ); byte<<=1 )
+        ++start;
+
+    return MIN( start, b->bitCount );
+}
 
+size_t
+tr_bitfieldCountTrueBits( const tr_bitfield* b )
+{
     if( !b )
         return 0;
 
-    for( it = b->bits, end = it + b->byteCount; it != end; ++it )
-        ret += trueBitCount[*it];
-
-    return ret;
+    return getKernels( )->popcount( b->bits, b->byteCount );
 }
 
 size_t
@@ -236,8 +676,9 @@ tr_bitfieldCountRange( const tr_bitfield * b, size_t begin, size_t end )
         ret += trueBitCount[val];
 
         /* middle bytes */
-        for( i=first_byte+1; i<last_byte; ++i )
-            ret += trueBitCount[b->bits[i]];
+        if( first_byte + 1 < last_byte )
+            ret += getKernels( )->popcount( b->bits + first_byte + 1,
+                                            last_byte - first_byte - 1 );
 
         /* last byte */
         i = (last_byte+1)*8 - end;
@@ -55,6 +55,32 @@ size_t       tr_bitfieldCountRange( const tr_bitfield * b, size_t begin, size_t
 
 tr_bitfield* tr_bitfieldOr( tr_bitfield*, const tr_bitfield* );
 
+/** @brief count the bits that are set in `a' but not in `b' */
+size_t       tr_bitfieldCountAndNot( const tr_bitfield * a, const tr_bitfield * b );
+
+/** @return the index of the first set bit at or after `start',
+            or the bitfield's bitCount if there isn't one */
+size_t       tr_bitfieldNextSet( const tr_bitfield * b, size_t start );
+
+/**
+ * The bulk operations -- counting, or-ing, and-not-ing, and searching --
+ * are done a word or a SIMD vector at a time. The fastest kernels that
+ * the CPU supports are picked the first time they're needed.
+ */
+typedef enum
+{
+    TR_BITFIELD_KERNEL_WORD, /* portable 64-bit words */
+    TR_BITFIELD_KERNEL_SSE2, /* SSE2, and POPCNT if the CPU has it */
+    TR_BITFIELD_KERNEL_AVX2
+}
+tr_bitfield_kernel;
+
+tr_bitfield_kernel tr_bitfieldGetKernel( void );
+
+/** @brief override the CPU dispatch. This is for tests and benchmarks.
+    @return FALSE if this CPU can't run that kernel */
+tr_bool      tr_bitfieldSetKernel( tr_bitfield_kernel kernel );
+
 /** A stripped-down version of bitfieldHas to be used
     for speed when you're looping quickly. This version
     has none of tr_bitfieldHas()'s safety checks, so you
@@ -163,22 +163,13 @@ tr_bitsetCountRange( const tr_bitset * b, const size_t begin, const size_t end )
 tr_bool
 tr_bitsetHasSet( const tr_bitset * b, const tr_bitset * set )
 {
-    const uint8_t * bit = b->bitfield.bits;
-    const uint8_t * bend = bit + b->bitfield.byteCount;
-    const uint8_t * sit = set->bitfield.bits;
-    const uint8_t * send = sit + set->bitfield.byteCount;
-    
     if( b->haveAll || set->haveAll )
         return b->haveAll;
 
     if( b->haveNone || set->haveNone )
         return set->haveNone;
 
-    for( ; bit!=bend && sit!=send; ++bit, ++sit )
-        if( ( *bit & *sit ) != *sit )
-            return FALSE;
-
-    return TRUE;
+    return !tr_bitfieldCountAndNot( &set->bitfield, &b->bitfield );
 }
 
 double
@@ -10,13 +10,21 @@
  * $Id$
  */
 
+#include <string.h> /* memcpy() */
+
 #include <event2/buffer.h>
 
+#include <openssl/sha.h>
+
 #include "transmission.h"
 #include "cache.h"
+#include "completion.h"
+#include "disk-io.h"
 #include "inout.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "peer-mgr.h" /* tr_peerMgrDiskReadDone() */
 #include "ptrarray.h"
+#include "session.h"
 #include "torrent.h"
 #include "utils.h"
 
@@ -47,6 +55,111 @@ struct cache_block
     struct evbuffer * evbuf;
 };
 
+/* A whole piece that has been read from disk to serve peers.
+ * These are kept in a 2Q cache: pieces that have been read once wait
+ * in the "recent" FIFO, and only pieces that are asked for again after
+ * falling out of it are promoted to the "frequent" LRU. This keeps a
+ * single pass over a big torrent from pushing out the popular pieces.
+ *
+ * Pieces that can't be cached whole are read a block at a time
+ * instead. Those entries have isBlock set and never become frequent. */
+struct read_piece
+{
+    int torrentId;
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t * data;
+
+    tr_bool isBlock;
+    tr_bool isFrequent;
+    struct read_piece * prev;
+    struct read_piece * next;
+
+    /* while isLoading is set, a disk I/O thread owns `data'
+     * and the entry isn't in either queue */
+    tr_bool isLoading;
+    tr_bool isStale;  /* dropped from the cache while it was loading */
+    tr_bool isFailed; /* couldn't be read; the next read will retry */
+    tr_torrent * tor; /* only valid while loading */
+    uint64_t queuedAt; /* when the load was handed to a disk I/O thread */
+    int err;
+};
+
+/* blocks that have been taken out of the write cache and
+ * are waiting for a disk I/O thread to write them */
+struct cache_write
+{
+    tr_cache * cache;
+    tr_torrent * tor;
+    int torrentId;
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint64_t begin; /* byte offset in the torrent */
+    uint32_t length;
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    /* the blocks' chains, moved here without copying them */
+    struct evbuffer * evbuf;
+    struct evbuffer_iovec * vec;
+    int vecCount;
+
+    /* a write isn't handed to the disk I/O threads until the older
+     * writes of the same blocks have landed, so that they can't
+     * overwrite it. isWritten is only set by waitForWrites(); the
+     * others are removed from `writes' when they're done */
+    tr_bool isQueued;
+    tr_bool isWritten;
+
+    int err;
+};
+
+/* a file that was completed while some of its blocks were still
+ * being written. `func' is called when the last of them lands */
+struct cache_file_flush
+{
+    int torrentId;
+    tr_file_index_t file;
+    tr_block_index_t first;
+    tr_block_index_t last;
+    tr_cache_flush_func func;
+};
+
+/* The SHA1 of a piece that's being downloaded, fed with its
+ * blocks in order as they arrive so that the piece doesn't have
+ * to be read back from disk to be checked when it's complete. */
+struct piece_hash
+{
+    int torrentId;
+    tr_piece_index_t piece;
+    uint32_t length; /* how many bytes of the piece have been hashed */
+    SHA_CTX sha;
+
+    /* the hashes, most recently fed first. pieces that stop getting
+     * blocks (a peer went away, endgame...) drift to the tail and make
+     * room for new ones */
+    struct piece_hash * prev;
+    struct piece_hash * next;
+};
+
+struct read_queue
+{
+    struct read_piece * head; /* most recently used */
+    struct read_piece * tail; /* least recently used */
+    size_t bytes;
+};
+
+/* the key of a piece that was recently pushed out of the "recent" FIFO.
+ * torrentId is -1 if the slot is unused, else the ghost is chained into
+ * a hash bucket through hash_next, which is the index of the next ghost */
+struct read_ghost
+{
+    int torrentId;
+    tr_piece_index_t piece;
+    int hash_next;
+};
+
 struct tr_cache
 {
     tr_ptrArray blocks;
@@ -57,6 +170,39 @@ struct tr_cache
     size_t disk_write_bytes;
     size_t cache_writes;
     size_t cache_write_bytes;
+
+    /* writes waiting for the disk I/O threads, oldest first */
+    tr_ptrArray writes;
+    size_t writing_bytes;
+    tr_ptrArray file_flushes;
+
+    /* read cache */
+    tr_ptrArray read_pieces;
+    struct read_queue recent;
+    struct read_queue frequent;
+    struct read_ghost * ghosts;
+    int ghost_count;
+    int ghost_pos;
+    int ghost_max;
+    int * ghost_buckets; /* each is the index of a ghost, or -1 */
+    unsigned int ghost_bucket_mask;
+    size_t loading_bytes;
+    int loading_count;
+
+    /* how long recent piece reads took, and how many
+     * of them the prefetcher may have in flight at once */
+    uint64_t read_latency_msec;
+    int prefetch_depth;
+
+    /* piece hashes */
+    tr_ptrArray hashes;
+    struct piece_hash * hash_head;
+    struct piece_hash * hash_tail;
+
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t disk_reads;
+    uint64_t disk_read_bytes;
 };
 
 /****
@@ -154,14 +300,190 @@ calcRuns( tr_cache * cache, struct run_info * runs )
     return i;
 }
 
+static tr_bool
+writeOverlaps( const struct cache_write * w, int torrentId,
+               tr_block_index_t first, tr_block_index_t last )
+{
+    return ( w->torrentId == torrentId ) && ( w->first <= last ) && ( first <= w->last );
+}
+
+/* find the newest write of any of these blocks */
+static struct cache_write *
+findWrite( tr_cache * cache, const tr_torrent * tor,
+           tr_block_index_t first, tr_block_index_t last )
+{
+    int i;
+    struct cache_write ** writes = (struct cache_write**) tr_ptrArrayBase( &cache->writes );
+
+    for( i=tr_ptrArraySize( &cache->writes )-1; i>=0; --i )
+        if( writeOverlaps( writes[i], tor->uniqueId, first, last ) )
+            return writes[i];
+
+    return NULL;
+}
+
+static void
+writeFree( struct cache_write * w )
+{
+    tr_free( w->vec );
+    evbuffer_free( w->evbuf );
+    tr_free( w );
+}
+
+/* copy `len' bytes, starting `offset' bytes into the write, into `setme' */
+static void
+writeCopyout( const struct cache_write * w, size_t offset, uint8_t * setme, size_t len )
+{
+    int i;
+
+    for( i=0; len>0 && i<w->vecCount; ++i )
+    {
+        const struct evbuffer_iovec * v = &w->vec[i];
+
+        if( offset >= v->iov_len )
+            offset -= v->iov_len;
+        else {
+            const size_t n = MIN( len, v->iov_len - offset );
+            memcpy( setme, (const uint8_t*)v->iov_base + offset, n );
+            setme += n;
+            len -= n;
+            offset = 0;
+        }
+    }
+}
+
+/* feed `len' bytes, starting `offset' bytes into the write, to `sha' */
+static void
+writeHash( const struct cache_write * w, size_t offset, size_t len, SHA_CTX * sha )
+{
+    int i;
+
+    for( i=0; len>0 && i<w->vecCount; ++i )
+    {
+        const struct evbuffer_iovec * v = &w->vec[i];
+
+        if( offset >= v->iov_len )
+            offset -= v->iov_len;
+        else {
+            const size_t n = MIN( len, v->iov_len - offset );
+            SHA1_Update( sha, (const uint8_t*)v->iov_base + offset, n );
+            len -= n;
+            offset = 0;
+        }
+    }
+}
+
+/* runs in a disk I/O thread.
+ * This only touches w->vec, never the evbuffer itself */
+static void
+writeWorkFunc( void * vw )
+{
+    struct cache_write * w = vw;
+    w->err = tr_ioWritev( w->tor, w->piece, w->offset, w->vec, w->vecCount );
+}
+
+static void writeDoneFunc( tr_session * session, void * vw );
+
+/* true if none of the older writes of w's blocks are still pending */
+static tr_bool
+writeIsReady( tr_cache * cache, int pos )
+{
+    int i;
+    struct cache_write ** writes = (struct cache_write**) tr_ptrArrayBase( &cache->writes );
+    const struct cache_write * w = writes[pos];
+
+    for( i=0; i<pos; ++i )
+        if( !writes[i]->isWritten && writeOverlaps( writes[i], w->torrentId, w->first, w->last ) )
+            return FALSE;
+
+    return TRUE;
+}
+
+/* hand the torrent's writes that are no longer waiting
+ * on older ones to the disk I/O threads */
+static void
+queueReadyWrites( tr_cache * cache, tr_session * session, int torrentId )
+{
+    int i;
+
+    /* without I/O threads the write's done callback runs right away
+     * and changes `writes', so start over after each one */
+    for( i=0; i<tr_ptrArraySize( &cache->writes ); ++i )
+    {
+        struct cache_write * w = tr_ptrArrayNth( &cache->writes, i );
+
+        if( ( w->torrentId == torrentId ) && !w->isQueued && writeIsReady( cache, i ) )
+        {
+            w->isQueued = TRUE;
+            tr_diskIoQueue( session, torrentId, writeWorkFunc, writeDoneFunc, w );
+            i = -1;
+        }
+    }
+}
+
+/* call the file flushes' callbacks once their blocks have all landed */
+static void
+fileFlushesUpdate( tr_cache * cache, tr_session * session, int torrentId )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( &cache->file_flushes ); )
+    {
+        struct cache_file_flush * ff = tr_ptrArrayNth( &cache->file_flushes, i );
+        int j;
+        tr_bool pending = FALSE;
+
+        for( j=0; !pending && j<tr_ptrArraySize( &cache->writes ); ++j )
+            pending = writeOverlaps( tr_ptrArrayNth( &cache->writes, j ), ff->torrentId, ff->first, ff->last );
+
+        if( ( ff->torrentId != torrentId ) || pending )
+            ++i;
+        else {
+            tr_torrent * tor = tr_torrentFindFromId( session, ff->torrentId );
+            tr_ptrArrayErase( &cache->file_flushes, i, i+1 );
+            if( tor != NULL )
+                ff->func( tor, ff->file );
+            tr_free( ff );
+            i = 0;
+        }
+    }
+}
+
+static void
+writeDoneFunc( tr_session * session, void * vw )
+{
+    int i;
+    struct cache_write * w = vw;
+    tr_cache * cache = w->cache;
+    tr_ptrArray * writes = &cache->writes;
+    const int torrentId = w->torrentId;
+    tr_torrent * tor;
+
+    cache->writing_bytes -= w->length;
+
+    for( i=0; i<tr_ptrArraySize( writes ); ++i ) {
+        if( tr_ptrArrayNth( writes, i ) == w ) {
+            tr_ptrArrayErase( writes, i, i+1 );
+            break;
+        }
+    }
+
+    if( w->err && (( tor = tr_torrentFindFromId( session, torrentId ))) )
+        if( tor->error != TR_STAT_LOCAL_ERROR )
+            tr_torrentSetLocalError( tor, "%s (%s)", tr_strerror( w->err ), tor->currentDir );
+
+    writeFree( w );
+
+    queueReadyWrites( cache, session, torrentId );
+    fileFlushesUpdate( cache, session, torrentId );
+}
+
 static int
 flushContiguous( tr_cache * cache, int pos, int n )
 {
     int i;
-    int err = 0;
-    uint8_t * buf = tr_new( uint8_t, n * MAX_BLOCK_SIZE );
-    uint8_t * walk = buf;
     struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase( &cache->blocks );
+    struct cache_write * w = tr_new0( struct cache_write, 1 );
 
     struct cache_block * b = blocks[pos];
     tr_torrent * tor             = b->tor;
@@ -170,28 +492,49 @@ flushContiguous( tr_cache * cache, int pos, int n )
 
 //fprintf( stderr, "flushing %d contiguous blocks [%d-%d) from cache to disk\n", n, pos, n+pos );
 
+    w->cache = cache;
+    w->tor = tor;
+    w->torrentId = tor->uniqueId;
+    w->piece = piece;
+    w->offset = offset;
+    w->begin = tr_pieceOffset( tor, piece, offset, 0 );
+    w->first = b->block;
+    w->last = blocks[pos+n-1]->block;
+
+    /* move the blocks' chains into one evbuffer and write them straight
+     * from there, rather than copying them into a new buffer first */
+    w->evbuf = evbuffer_new( );
     for( i=pos; i<pos+n; ++i ) {
         b = blocks[i];
-        evbuffer_copyout( b->evbuf, walk, b->length );
-        walk += b->length;
+        evbuffer_add_buffer( w->evbuf, b->evbuf );
         evbuffer_free( b->evbuf );
         tr_free( b );
     }
     tr_ptrArrayErase( &cache->blocks, pos, pos+n );
 
+    w->length = evbuffer_get_length( w->evbuf );
+    w->vecCount = evbuffer_peek( w->evbuf, -1, NULL, NULL, 0 );
+    w->vec = tr_new( struct evbuffer_iovec, w->vecCount );
+    evbuffer_peek( w->evbuf, -1, NULL, w->vec, w->vecCount );
+
 #if 0
-    tr_tordbg( tor, "Writing to disk piece %d, offset %d, len %d", (int)piece, (int)offset, (int)(walk-buf) );
+    tr_tordbg( tor, "Writing to disk piece %d, offset %d, len %d", (int)piece, (int)offset, (int)w->length );
     tr_ndbg( MY_NAME, "Removing %d blocks from cache, rank: %d - %d left", n, rank, tr_ptrArraySize(&cache->blocks) );
-    fprintf( stderr, "%s - Writing to disk piece %d, offset %d, len %d\n", tr_torrentName(tor), (int)piece, (int)offset, (int)(walk-buf) );
+    fprintf( stderr, "%s - Writing to disk piece %d, offset %d, len %d\n", tr_torrentName(tor), (int)piece, (int)offset, (int)w->length );
     fprintf( stderr, "%s - Removing %d blocks from cache; %d left\n", MY_NAME, n, tr_ptrArraySize(&cache->blocks) );
 #endif
 
-    err = tr_ioWrite( tor, piece, offset, walk-buf, buf );
-    tr_free( buf );
+    tr_ptrArrayAppend( &cache->writes, w );
+    cache->writing_bytes += w->length;
 
     ++cache->disk_writes;
-    cache->disk_write_bytes += walk-buf;
-    return err;
+    cache->disk_write_bytes += w->length;
+
+    /* if an older copy of these blocks hasn't been written yet, this
+     * one waits for it to land. errors are reported by writeDoneFunc() */
+    queueReadyWrites( cache, tor->session, tor->uniqueId );
+
+    return 0;
 }
 
 static int
@@ -233,6 +576,637 @@ cacheTrim( tr_cache * cache )
     return err;
 }
 
+/***
+****  Read cache
+***/
+
+static int
+cache_block_compare( const void * va, const void * vb )
+{
+    const struct cache_block * a = va;
+    const struct cache_block * b = vb;
+
+    /* primary key: torrent id */
+    if( a->tor->uniqueId != b->tor->uniqueId )
+        return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+    /* secondary key: block # */
+    if( a->block != b->block )
+        return a->block < b->block ? -1 : 1;
+
+    /* they're equal */
+    return 0;
+}
+
+static struct cache_block *
+findBlock( tr_cache           * cache,
+           tr_torrent         * torrent,
+           tr_piece_index_t     piece,
+           uint32_t             offset )
+{
+    struct cache_block key;
+    key.tor = torrent;
+    key.block = _tr_block( torrent, piece, offset );
+    return tr_ptrArrayFindSorted( &cache->blocks, &key, cache_block_compare );
+}
+
+enum
+{
+    /* percentage of the read cache that the "recent" FIFO may use */
+    READ_RECENT_PERCENT = 25,
+
+    /* don't cache pieces bigger than this fraction of the cache */
+    READ_MAX_PIECE_FRACTION = 4
+};
+
+static size_t
+getReadLimit( const tr_cache * cache )
+{
+    /* blocks waiting to be written take precedence */
+    const size_t dirty = (size_t)tr_ptrArraySize( &cache->blocks ) * MAX_BLOCK_SIZE
+                       + cache->writing_bytes;
+    return dirty < cache->max_bytes ? cache->max_bytes - dirty : 0;
+}
+
+static int
+read_piece_compare( const void * va, const void * vb )
+{
+    const struct read_piece * a = va;
+    const struct read_piece * b = vb;
+
+    /* primary key: torrent id */
+    if( a->torrentId != b->torrentId )
+        return a->torrentId < b->torrentId ? -1 : 1;
+
+    /* secondary key: piece # */
+    if( a->piece != b->piece )
+        return a->piece < b->piece ? -1 : 1;
+
+    /* tertiary key: offset, for pieces that are cached by the block */
+    if( a->offset != b->offset )
+        return a->offset < b->offset ? -1 : 1;
+
+    /* they're equal */
+    return 0;
+}
+
+static void
+readQueueRemove( struct read_queue * q, struct read_piece * rp )
+{
+    if( rp->prev ) rp->prev->next = rp->next; else q->head = rp->next;
+    if( rp->next ) rp->next->prev = rp->prev; else q->tail = rp->prev;
+    rp->prev = rp->next = NULL;
+    q->bytes -= rp->length;
+}
+
+static void
+readQueuePush( struct read_queue * q, struct read_piece * rp )
+{
+    rp->prev = NULL;
+    rp->next = q->head;
+    if( q->head ) q->head->prev = rp; else q->tail = rp;
+    q->head = rp;
+    q->bytes += rp->length;
+}
+
+static struct read_queue *
+getReadQueue( tr_cache * cache, const struct read_piece * rp )
+{
+    return rp->isFrequent ? &cache->frequent : &cache->recent;
+}
+
+static int *
+ghostBucket( tr_cache * cache, int torrentId, tr_piece_index_t piece )
+{
+    const unsigned int hash = ( (unsigned int)torrentId * 2654435761u ) ^ ( piece * 40503u );
+
+    return &cache->ghost_buckets[hash & cache->ghost_bucket_mask];
+}
+
+static void
+ghostHash( tr_cache * cache, int i )
+{
+    struct read_ghost * g = &cache->ghosts[i];
+    int * bucket = ghostBucket( cache, g->torrentId, g->piece );
+
+    g->hash_next = *bucket;
+    *bucket = i;
+}
+
+static void
+ghostUnhash( tr_cache * cache, int i )
+{
+    const struct read_ghost * g = &cache->ghosts[i];
+    int * walk;
+
+    for( walk=ghostBucket( cache, g->torrentId, g->piece ); *walk!=i; walk=&cache->ghosts[*walk].hash_next )
+        assert( *walk >= 0 );
+    *walk = g->hash_next;
+}
+
+static void
+ghostAdd( tr_cache * cache, const struct read_piece * rp )
+{
+    if( cache->ghost_max > 0 )
+    {
+        struct read_ghost * g = &cache->ghosts[cache->ghost_pos];
+
+        /* once the ring is full, the oldest ghost makes way */
+        if( ( cache->ghost_count == cache->ghost_max ) && ( g->torrentId >= 0 ) )
+            ghostUnhash( cache, cache->ghost_pos );
+
+        g->torrentId = rp->torrentId;
+        g->piece = rp->piece;
+        ghostHash( cache, cache->ghost_pos );
+        cache->ghost_pos = ( cache->ghost_pos + 1 ) % cache->ghost_max;
+        cache->ghost_count = MIN( cache->ghost_count + 1, cache->ghost_max );
+    }
+}
+
+static tr_bool
+ghostRemove( tr_cache * cache, int torrentId, tr_piece_index_t piece )
+{
+    int * walk;
+
+    if( cache->ghost_buckets == NULL )
+        return FALSE;
+
+    for( walk=ghostBucket( cache, torrentId, piece ); *walk>=0; walk=&cache->ghosts[*walk].hash_next )
+    {
+        struct read_ghost * g = &cache->ghosts[*walk];
+
+        if( ( g->torrentId == torrentId ) && ( g->piece == piece ) ) {
+            *walk = g->hash_next;
+            g->torrentId = -1;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void
+readPieceFree( tr_cache * cache, struct read_piece * rp )
+{
+    tr_ptrArrayRemoveSorted( &cache->read_pieces, rp, read_piece_compare );
+
+    if( rp->isLoading )
+    {
+        /* a disk I/O thread is still using it; readDoneFunc() frees it */
+        rp->isStale = TRUE;
+    }
+    else
+    {
+        if( !rp->isFailed )
+            readQueueRemove( getReadQueue( cache, rp ), rp );
+        tr_free( rp->data );
+        tr_free( rp );
+    }
+}
+
+static void
+readCacheEvictOne( tr_cache * cache )
+{
+    struct read_piece * rp;
+    const size_t recentMax = getReadLimit( cache ) * READ_RECENT_PERCENT / 100;
+
+    if( ( cache->recent.tail != NULL )
+        && ( ( cache->recent.bytes > recentMax ) || ( cache->frequent.tail == NULL ) ) )
+    {
+        rp = cache->recent.tail;
+        if( !rp->isBlock )
+            ghostAdd( cache, rp );
+    }
+    else
+    {
+        rp = cache->frequent.tail;
+    }
+
+    readPieceFree( cache, rp );
+}
+
+static void
+readCacheTrim( tr_cache * cache, size_t incoming )
+{
+    const size_t limit = getReadLimit( cache );
+
+    while( ( cache->recent.bytes + cache->frequent.bytes + cache->loading_bytes + incoming > limit )
+        && ( ( cache->recent.tail != NULL ) || ( cache->frequent.tail != NULL ) ) )
+        readCacheEvictOne( cache );
+}
+
+static void
+readCacheClear( tr_cache * cache, int torrentId )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( &cache->read_pieces ); )
+    {
+        struct read_piece * rp = tr_ptrArrayNth( &cache->read_pieces, i );
+
+        if( ( torrentId < 0 ) || ( rp->torrentId == torrentId ) )
+            readPieceFree( cache, rp );
+        else
+            ++i;
+    }
+}
+
+/* the piece is about to change on disk, so drop what we've read of it */
+static void
+readCacheClearPiece( tr_cache * cache, int torrentId, tr_piece_index_t piece )
+{
+    int pos;
+    struct read_piece key;
+
+    key.torrentId = torrentId;
+    key.piece = piece;
+    key.offset = 0;
+    pos = tr_ptrArrayLowerBound( &cache->read_pieces, &key, read_piece_compare, NULL );
+
+    while( pos < tr_ptrArraySize( &cache->read_pieces ) )
+    {
+        struct read_piece * rp = tr_ptrArrayNth( &cache->read_pieces, pos );
+        if( ( rp->torrentId != torrentId ) || ( rp->piece != piece ) )
+            break;
+        readPieceFree( cache, rp );
+    }
+}
+
+/* find the cached piece, or the cached block, that holds this request */
+static struct read_piece *
+findReadPiece( tr_cache * cache, const tr_torrent * tor,
+               tr_piece_index_t piece, uint32_t offset, uint32_t len )
+{
+    struct read_piece key;
+    struct read_piece * rp;
+
+    key.torrentId = tor->uniqueId;
+    key.piece = piece;
+    key.offset = 0;
+    rp = tr_ptrArrayFindSorted( &cache->read_pieces, &key, read_piece_compare );
+    if( ( rp != NULL ) && ( offset + len <= rp->length ) )
+        return rp;
+
+    key.offset = offset;
+    rp = offset ? tr_ptrArrayFindSorted( &cache->read_pieces, &key, read_piece_compare ) : NULL;
+    if( ( rp != NULL ) && ( len <= rp->length ) )
+        return rp;
+
+    return NULL;
+}
+
+static void
+readPieceTouch( tr_cache * cache, struct read_piece * rp )
+{
+    /* 2Q leaves hits in the "recent" FIFO alone */
+    if( rp->isFrequent ) {
+        readQueueRemove( &cache->frequent, rp );
+        readQueuePush( &cache->frequent, rp );
+    }
+}
+
+/* true if any of the piece's blocks haven't been written to disk yet */
+static tr_bool
+pieceHasDirtyBlocks( tr_cache * cache, tr_torrent * tor, tr_piece_index_t piece )
+{
+    tr_block_index_t first;
+    tr_block_index_t last;
+    struct cache_block key;
+    int pos;
+
+    tr_torGetPieceBlockRange( tor, piece, &first, &last );
+    if( findWrite( cache, tor, first, last ) != NULL )
+        return TRUE;
+
+    key.tor = tor;
+    key.block = first;
+    pos = tr_ptrArrayLowerBound( &cache->blocks, &key, cache_block_compare, NULL );
+
+    if( pos < tr_ptrArraySize( &cache->blocks ) ) {
+        const struct cache_block * b = tr_ptrArrayNth( &cache->blocks, pos );
+        return ( b->tor == tor ) && ( b->block <= last );
+    }
+
+    return FALSE;
+}
+
+enum
+{
+    /* the prefetcher keeps between this many... */
+    PREFETCH_DEPTH_MIN = 2,
+
+    /* ...and this many pieces loading at once */
+    PREFETCH_DEPTH_MAX = 64,
+
+    /* it reads further ahead while the disk answers faster than this */
+    PREFETCH_TARGET_LATENCY_MSEC = 100
+};
+
+static void
+readLatencyUpdate( tr_cache * cache, uint64_t msec )
+{
+    cache->read_latency_msec = ( cache->read_latency_msec * 7 + msec ) / 8;
+
+    /* additive increase, multiplicative decrease */
+    if( cache->read_latency_msec <= PREFETCH_TARGET_LATENCY_MSEC )
+        cache->prefetch_depth = MIN( cache->prefetch_depth + 1, PREFETCH_DEPTH_MAX );
+    else
+        cache->prefetch_depth = MAX( cache->prefetch_depth / 2, PREFETCH_DEPTH_MIN );
+}
+
+/* runs in a disk I/O thread */
+static void
+readWorkFunc( void * vrp )
+{
+    struct read_piece * rp = vrp;
+    rp->err = tr_ioRead( rp->tor, rp->piece, rp->offset, rp->length, rp->data );
+}
+
+static void
+readDoneFunc( tr_session * session, void * vrp )
+{
+    struct read_piece * rp = vrp;
+    tr_cache * cache = session->cache;
+    const int torrentId = rp->torrentId;
+    tr_torrent * tor;
+
+    rp->isLoading = FALSE;
+    rp->tor = NULL;
+    cache->loading_bytes -= rp->length;
+    --cache->loading_count;
+    readLatencyUpdate( cache, tr_time_msec( ) - rp->queuedAt );
+
+    if( rp->isStale )
+    {
+        tr_free( rp->data );
+        tr_free( rp );
+    }
+    else if( rp->err )
+    {
+        /* leave it in read_pieces so that waiting peers don't queue
+         * the same read over and over. tr_cacheReadBlock() retries it */
+        rp->isFailed = TRUE;
+        tr_free( rp->data );
+        rp->data = NULL;
+    }
+    else
+    {
+        /* pieces that were pushed out of the FIFO recently are popular */
+        rp->isFrequent = !rp->isBlock && ghostRemove( cache, rp->torrentId, rp->piece );
+        readQueuePush( getReadQueue( cache, rp ), rp );
+    }
+
+    /* wake up the peers that were waiting for this */
+    if(( tor = tr_torrentFindFromId( session, torrentId )))
+        tr_peerMgrDiskReadDone( tor );
+}
+
+/* Start reading a complete piece from disk into the read cache.
+ * If the piece can't be cached whole, just read the block instead.
+ * Returns FALSE if there's no room for it. */
+static tr_bool
+readPieceLoad( tr_cache * cache, tr_torrent * tor,
+               tr_piece_index_t piece, uint32_t offset, uint32_t len )
+{
+    struct read_piece * rp;
+    const uint32_t pieceSize = tr_torPieceCountBytes( tor, piece );
+
+    /* only cache whole pieces that have been verified and are completely on disk */
+    const tr_bool isBlock = !tr_cpPieceIsComplete( &tor->completion, piece )
+                         || ( pieceSize > cache->max_bytes / READ_MAX_PIECE_FRACTION )
+                         || pieceHasDirtyBlocks( cache, tor, piece );
+    const uint32_t length = isBlock ? len : pieceSize;
+
+    readCacheTrim( cache, length );
+    if( cache->recent.bytes + cache->frequent.bytes + cache->loading_bytes + length > getReadLimit( cache ) )
+        return FALSE;
+
+    rp = tr_new0( struct read_piece, 1 );
+    rp->torrentId = tor->uniqueId;
+    rp->piece = piece;
+    rp->offset = isBlock ? offset : 0;
+
+    /* make room for it in read_pieces */
+    if( !isBlock )
+        readCacheClearPiece( cache, tor->uniqueId, piece );
+    else {
+        struct read_piece * old = tr_ptrArrayFindSorted( &cache->read_pieces, rp, read_piece_compare );
+        if( old != NULL )
+            readPieceFree( cache, old );
+    }
+
+    rp->length = length;
+    rp->data = tr_valloc( length );
+    rp->isBlock = isBlock;
+    rp->isLoading = TRUE;
+    rp->tor = tor;
+    rp->queuedAt = tr_time_msec( );
+    tr_ptrArrayInsertSorted( &cache->read_pieces, rp, read_piece_compare );
+    cache->loading_bytes += length;
+    ++cache->loading_count;
+
+    ++cache->disk_reads;
+    cache->disk_read_bytes += length;
+    tr_diskIoQueue( tor->session, tor->uniqueId, readWorkFunc, readDoneFunc, rp );
+    return TRUE;
+}
+
+static void
+readCacheSetLimit( tr_cache * cache )
+{
+    struct read_ghost * old = cache->ghosts;
+    unsigned int bucket_count;
+    int i;
+
+    /* remember about as many pieces as the cache can hold blocks */
+    cache->ghost_max = MAX( 32, cache->max_blocks / 2 );
+    cache->ghosts = tr_new( struct read_ghost, cache->ghost_max );
+    cache->ghost_count = MIN( cache->ghost_count, cache->ghost_max );
+    cache->ghost_pos = cache->ghost_count % cache->ghost_max;
+
+    /* keep the buckets' chains short */
+    for( bucket_count=1; bucket_count < (unsigned int)cache->ghost_max * 2; bucket_count *= 2 );
+    tr_free( cache->ghost_buckets );
+    cache->ghost_buckets = tr_new( int, bucket_count );
+    cache->ghost_bucket_mask = bucket_count - 1;
+    for( i=0; i<(int)bucket_count; ++i )
+        cache->ghost_buckets[i] = -1;
+
+    for( i=0; i<cache->ghost_count; ++i ) {
+        cache->ghosts[i] = old[i];
+        if( cache->ghosts[i].torrentId >= 0 )
+            ghostHash( cache, i );
+    }
+    tr_free( old );
+
+    readCacheTrim( cache, 0 );
+}
+
+/***
+****  Piece hashes
+***/
+
+enum
+{
+    /* how many pieces can be hashed incrementally at once */
+    PIECE_HASH_MAX = 1024
+};
+
+static int
+piece_hash_compare( const void * va, const void * vb )
+{
+    const struct piece_hash * a = va;
+    const struct piece_hash * b = vb;
+
+    /* primary key: torrent id */
+    if( a->torrentId != b->torrentId )
+        return a->torrentId < b->torrentId ? -1 : 1;
+
+    /* secondary key: piece # */
+    if( a->piece != b->piece )
+        return a->piece < b->piece ? -1 : 1;
+
+    /* they're equal */
+    return 0;
+}
+
+static struct piece_hash *
+findPieceHash( tr_cache * cache, int torrentId, tr_piece_index_t piece )
+{
+    struct piece_hash key;
+    key.torrentId = torrentId;
+    key.piece = piece;
+    return tr_ptrArrayFindSorted( &cache->hashes, &key, piece_hash_compare );
+}
+
+static void
+pieceHashUnlink( tr_cache * cache, struct piece_hash * ph )
+{
+    if( ph->prev ) ph->prev->next = ph->next; else cache->hash_head = ph->next;
+    if( ph->next ) ph->next->prev = ph->prev; else cache->hash_tail = ph->prev;
+    ph->prev = ph->next = NULL;
+}
+
+static void
+pieceHashPush( tr_cache * cache, struct piece_hash * ph )
+{
+    ph->prev = NULL;
+    ph->next = cache->hash_head;
+    if( cache->hash_head ) cache->hash_head->prev = ph; else cache->hash_tail = ph;
+    cache->hash_head = ph;
+}
+
+static void
+pieceHashFree( tr_cache * cache, struct piece_hash * ph )
+{
+    pieceHashUnlink( cache, ph );
+    tr_ptrArrayRemoveSorted( &cache->hashes, ph, piece_hash_compare );
+    tr_free( ph );
+}
+
+static void
+pieceHashClear( tr_cache * cache, int torrentId )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( &cache->hashes ); )
+    {
+        struct piece_hash * ph = tr_ptrArrayNth( &cache->hashes, i );
+
+        if( ( torrentId < 0 ) || ( ph->torrentId == torrentId ) )
+            pieceHashFree( cache, ph );
+        else
+            ++i;
+    }
+}
+
+/* A block of the piece was just written at `offset'. Feed the piece's
+ * hash with as many of the following bytes as are still in memory. */
+static void
+pieceHashUpdate( tr_cache * cache, tr_torrent * tor, tr_piece_index_t piece, uint32_t offset )
+{
+    const uint32_t pieceSize = tr_torPieceCountBytes( tor, piece );
+    struct piece_hash * ph = findPieceHash( cache, tor->uniqueId, piece );
+
+    if( ph == NULL )
+    {
+        /* start hashing when the first block arrives */
+        if( offset != 0 )
+            return;
+
+        /* make room by giving up on the piece that went longest without a block */
+        if( tr_ptrArraySize( &cache->hashes ) >= PIECE_HASH_MAX ) {
+            dbgmsg( "dropping the partial hash of piece %zu", (size_t)cache->hash_tail->piece );
+            pieceHashFree( cache, cache->hash_tail );
+        }
+
+        ph = tr_new0( struct piece_hash, 1 );
+        ph->torrentId = tor->uniqueId;
+        ph->piece = piece;
+        ph->length = 0;
+        SHA1_Init( &ph->sha );
+        tr_ptrArrayInsertSorted( &cache->hashes, ph, piece_hash_compare );
+        pieceHashPush( cache, ph );
+    }
+    else if( offset < ph->length )
+    {
+        /* we've already hashed the old contents of that block,
+         * so fall back to reading the piece back when it's done */
+        pieceHashFree( cache, ph );
+        return;
+    }
+    else
+    {
+        pieceHashUnlink( cache, ph );
+        pieceHashPush( cache, ph );
+    }
+
+    while( ph->length < pieceSize )
+    {
+        struct cache_write * w;
+        struct cache_block * cb = findBlock( cache, tor, piece, ph->length );
+
+        if( cb != NULL )
+        {
+            int i;
+            const int n = evbuffer_peek( cb->evbuf, -1, NULL, NULL, 0 );
+            struct evbuffer_iovec * vec = tr_new( struct evbuffer_iovec, n );
+            evbuffer_peek( cb->evbuf, -1, NULL, vec, n );
+            for( i=0; i<n; ++i )
+                SHA1_Update( &ph->sha, vec[i].iov_base, vec[i].iov_len );
+            tr_free( vec );
+            ph->length += cb->length;
+        }
+        else
+        {
+            const tr_block_index_t block = _tr_block( tor, piece, ph->length );
+            const uint64_t begin = tr_pieceOffset( tor, piece, ph->length, 0 );
+
+            if(( w = findWrite( cache, tor, block, block )))
+            {
+                const uint32_t len = MIN( w->begin + w->length - begin, pieceSize - ph->length );
+                writeHash( w, begin - w->begin, len, &ph->sha );
+                ph->length += len;
+            }
+            else break;
+        }
+    }
+}
+
+void
+tr_cacheGetStats( const tr_cache * cache, tr_cache_stats * setme )
+{
+    setme->readHits = cache->read_hits;
+    setme->readMisses = cache->read_misses;
+    setme->readPieces = tr_ptrArraySize( &cache->read_pieces );
+    setme->readBytes = cache->recent.bytes + cache->frequent.bytes;
+    setme->diskReads = cache->disk_reads;
+    setme->diskReadBytes = cache->disk_read_bytes;
+    setme->dirtyBlocks = tr_ptrArraySize( &cache->blocks );
+    setme->readLatencyMsec = cache->read_latency_msec;
+    setme->prefetchDepth = cache->prefetch_depth;
+}
+
 /***
 ****
 ***/
@@ -254,6 +1228,7 @@ tr_cacheSetLimit( tr_cache * cache, int64_t max_bytes )
     tr_formatter_mem_B( buf, cache->max_bytes, sizeof( buf ) );
     tr_ndbg( MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks );
 
+    readCacheSetLimit( cache );
     return cacheTrim( cache );
 }
 
@@ -270,6 +1245,12 @@ tr_cacheNew( int64_t max_bytes )
     cache->blocks = TR_PTR_ARRAY_INIT;
     cache->max_bytes = max_bytes;
     cache->max_blocks = getMaxBlocks( max_bytes );
+    cache->read_pieces = TR_PTR_ARRAY_INIT;
+    cache->writes = TR_PTR_ARRAY_INIT;
+    cache->file_flushes = TR_PTR_ARRAY_INIT;
+    cache->hashes = TR_PTR_ARRAY_INIT;
+    cache->prefetch_depth = PREFETCH_DEPTH_MIN;
+    readCacheSetLimit( cache );
     return cache;
 }
 
@@ -278,6 +1259,15 @@ tr_cacheFree( tr_cache * cache )
 {
     assert( tr_ptrArrayEmpty( &cache->blocks ) );
     tr_ptrArrayDestruct( &cache->blocks, NULL );
+    readCacheClear( cache, -1 );
+    tr_ptrArrayDestruct( &cache->read_pieces, NULL );
+    assert( tr_ptrArrayEmpty( &cache->writes ) );
+    tr_ptrArrayDestruct( &cache->writes, NULL );
+    tr_ptrArrayDestruct( &cache->file_flushes, tr_free );
+    pieceHashClear( cache, -1 );
+    tr_ptrArrayDestruct( &cache->hashes, NULL );
+    tr_free( cache->ghosts );
+    tr_free( cache->ghost_buckets );
     tr_free( cache );
 }
 
@@ -285,36 +1275,6 @@ tr_cacheFree( tr_cache * cache )
 ****
 ***/
 
-static int
-cache_block_compare( const void * va, const void * vb )
-{
-    const struct cache_block * a = va;
-    const struct cache_block * b = vb;
-
-    /* primary key: torrent id */
-    if( a->tor->uniqueId != b->tor->uniqueId )
-        return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
-
-    /* secondary key: block # */
-    if( a->block != b->block )
-        return a->block < b->block ? -1 : 1;
-
-    /* they're equal */
-    return 0;
-}
-
-static struct cache_block *
-findBlock( tr_cache           * cache,
-           tr_torrent         * torrent,
-           tr_piece_index_t     piece,
-           uint32_t             offset )
-{
-    struct cache_block key;
-    key.tor = torrent;
-    key.block = _tr_block( torrent, piece, offset );
-    return tr_ptrArrayFindSorted( &cache->blocks, &key, cache_block_compare );
-}
-
 int
 tr_cacheWriteBlock( tr_cache         * cache,
                     tr_torrent       * torrent,
@@ -325,6 +1285,9 @@ tr_cacheWriteBlock( tr_cache         * cache,
 {
     struct cache_block * cb = findBlock( cache, torrent, piece, offset );
 
+    /* the piece is being rewritten, so what we read before is stale */
+    readCacheClearPiece( cache, torrent->uniqueId, piece );
+
     if( cb == NULL )
     {
         cb = tr_new( struct cache_block, 1 );
@@ -346,6 +1309,10 @@ tr_cacheWriteBlock( tr_cache         * cache,
     ++cache->cache_writes;
     cache->cache_write_bytes += cb->length;
 
+    /* hash it before it can be flushed */
+    pieceHashUpdate( cache, torrent, piece, offset );
+
+    readCacheTrim( cache, 0 );
     return cacheTrim( cache );
 }
 
@@ -358,28 +1325,148 @@ tr_cacheReadBlock( tr_cache         * cache,
                    uint8_t          * setme )
 {
     int err = 0;
-    struct cache_block * cb = findBlock( cache, torrent, piece, offset );
+    struct read_piece * rp;
+    struct cache_write * w;
+    const tr_block_index_t block = _tr_block( torrent, piece, offset );
+    const uint64_t begin = tr_pieceOffset( torrent, piece, offset, 0 );
+    const uint64_t blockEnd = (uint64_t)( block + 1 ) * torrent->blockSize;
+    struct cache_block * cb;
+
+    /* the blocks may be in different places, so read them one at a time */
+    if( begin + len > blockEnd )
+    {
+        const uint32_t n = blockEnd - begin;
+        err = tr_cacheReadBlock( cache, torrent, piece, offset, n, setme );
+        if( !err )
+            err = tr_cacheReadBlock( cache, torrent, piece, offset + n, len - n, setme + n );
+        return err;
+    }
+
+    cb = findBlock( cache, torrent, piece, offset );
 
     if( cb )
         evbuffer_copyout( cb->evbuf, setme, len );
-    else
+    else if(( w = findWrite( cache, torrent, block, block )))
+        writeCopyout( w, begin - w->begin, setme, len );
+    else if(( rp = findReadPiece( cache, torrent, piece, offset, len ))
+             && !rp->isLoading && !rp->isFailed ) {
+        ++cache->read_hits;
+        readPieceTouch( cache, rp );
+        memcpy( setme, rp->data + ( offset - rp->offset ), len );
+    }
+    else {
+        if( ( rp != NULL ) && rp->isFailed )
+            readPieceFree( cache, rp );
+        ++cache->read_misses;
         err = tr_ioRead( torrent, piece, offset, len, setme );
+    }
 
     return err;
 }
 
-int
-tr_cachePrefetchBlock( tr_cache         * cache,
+tr_bool
+tr_cacheLoadBlock( tr_cache         * cache,
+                   tr_torrent       * torrent,
+                   tr_piece_index_t   piece,
+                   uint32_t           offset,
+                   uint32_t           len )
+{
+    struct read_piece * rp;
+    const tr_block_index_t block = _tr_block( torrent, piece, offset );
+
+    /* without I/O threads, tr_cacheReadBlock() will have to read it */
+    if( torrent->session->diskIo == NULL )
+        return TRUE;
+
+    /* blocks that haven't been written to disk yet are still in memory */
+    if( findBlock( cache, torrent, piece, offset ) || findWrite( cache, torrent, block, block ) )
+        return TRUE;
+
+    if(( rp = findReadPiece( cache, torrent, piece, offset, len )))
+        return !rp->isLoading;
+
+    /* if there's no room to load it, tr_cacheReadBlock() will read it */
+    return !readPieceLoad( cache, torrent, piece, offset, len );
+}
+
+tr_bool
+tr_cacheIsBlockOnDisk( tr_cache         * cache,
                        tr_torrent       * torrent,
                        tr_piece_index_t   piece,
-                       uint32_t           offset,
-                       uint32_t           len )
+                       uint32_t           offset )
+{
+    const tr_block_index_t block = _tr_block( torrent, piece, offset );
+
+    return ( findBlock( cache, torrent, piece, offset ) == NULL )
+        && ( findWrite( cache, torrent, block, block ) == NULL );
+}
+
+tr_bool
+tr_cachePrefetchPiece( tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece )
+{
+    const uint32_t pieceSize = tr_torPieceCountBytes( torrent, piece );
+
+    /* pieces that can't be cached whole are left to tr_cacheLoadBlock() */
+    if( !tr_cpPieceIsComplete( &torrent->completion, piece )
+        || ( pieceSize > cache->max_bytes / READ_MAX_PIECE_FRACTION )
+        || pieceHasDirtyBlocks( cache, torrent, piece ) )
+        return TRUE;
+
+    /* is it already cached or on its way? */
+    if( findReadPiece( cache, torrent, piece, 0, pieceSize ) != NULL )
+        return TRUE;
+
+    if( cache->loading_count >= cache->prefetch_depth )
+        return FALSE;
+
+    return readPieceLoad( cache, torrent, piece, 0, pieceSize );
+}
+
+int
+tr_cacheHashPiece( tr_cache         * cache,
+                   tr_torrent       * torrent,
+                   tr_piece_index_t   piece,
+                   uint8_t          * setme )
 {
     int err = 0;
-    struct cache_block * cb = findBlock( cache, torrent, piece, offset );
+    SHA_CTX sha;
+    uint32_t offset = 0;
+    const uint32_t pieceSize = tr_torPieceCountBytes( torrent, piece );
+    struct piece_hash * ph = findPieceHash( cache, torrent->uniqueId, piece );
+
+    /* pick up where the blocks stopped arriving in order */
+    if( ph != NULL ) {
+        sha = ph->sha;
+        offset = ph->length;
+        pieceHashFree( cache, ph );
+    } else {
+        SHA1_Init( &sha );
+    }
 
-    if( cb == NULL )
-        err = tr_ioPrefetch( torrent, piece, offset, len );
+    if( offset < pieceSize )
+    {
+        const uint32_t buflen = torrent->blockSize;
+        uint8_t * buffer = tr_valloc( buflen );
+
+        tr_ioPrefetch( torrent, piece, offset, pieceSize - offset );
+
+        while( !err && ( offset < pieceSize ) )
+        {
+            const uint32_t len = MIN( pieceSize - offset, buflen );
+            err = tr_cacheReadBlock( cache, torrent, piece, offset, len, buffer );
+            if( !err ) {
+                SHA1_Update( &sha, buffer, len );
+                offset += len;
+            }
+        }
+
+        tr_free( buffer );
+    }
+
+    if( !err )
+        SHA1_Final( setme, &sha );
 
     return err;
 }
@@ -416,13 +1503,57 @@ int tr_cacheFlushDone( tr_cache * cache )
     return err;
 }
 
+/* Wait for the torrent's writes to land and return the first error, if any.
+ * This blocks the libtransmission thread, so it's only for when the
+ * torrent's files are about to be closed, moved, or deleted */
+static int
+waitForWrites( tr_cache * cache, tr_torrent * torrent )
+{
+    int i;
+    int err = 0;
+    tr_bool again;
+
+    do
+    {
+        tr_diskIoWaitTorrent( torrent->session, torrent->uniqueId );
+
+        /* their done callbacks haven't run yet, so mark the writes
+         * that have landed and queue the ones that waited on them */
+        again = FALSE;
+        for( i=0; i<tr_ptrArraySize( &cache->writes ); ++i ) {
+            struct cache_write * w = tr_ptrArrayNth( &cache->writes, i );
+            if( w->torrentId == torrent->uniqueId ) {
+                if( w->isQueued )
+                    w->isWritten = TRUE;
+                else
+                    again = TRUE;
+            }
+        }
+        if( again )
+            queueReadyWrites( cache, torrent->session, torrent->uniqueId );
+    }
+    while( again );
+
+    for( i=0; !err && i<tr_ptrArraySize( &cache->writes ); ++i ) {
+        const struct cache_write * w = tr_ptrArrayNth( &cache->writes, i );
+        if( w->torrentId == torrent->uniqueId )
+            err = w->err;
+    }
+
+    return err;
+}
+
 int
-tr_cacheFlushFile( tr_cache * cache, tr_torrent * torrent, tr_file_index_t i )
+tr_cacheFlushFile( tr_cache             * cache,
+                   tr_torrent           * torrent,
+                   tr_file_index_t        i,
+                   tr_cache_flush_func    func )
 {
     int pos;
     int err = 0;
     tr_block_index_t first;
     tr_block_index_t last;
+    struct cache_file_flush * ff;
     tr_torGetFileBlockRange( torrent, i, &first, &last );
     pos = findBlockPos( cache, torrent, first );
     dbgmsg( "flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last );
@@ -436,6 +1567,16 @@ tr_cacheFlushFile( tr_cache * cache, tr_torrent * torrent, tr_file_index_t i )
         err = flushContiguous( cache, pos, getBlockRun( cache, pos, NULL ) );
     }
 
+    /* let the disk I/O threads call `func' when they're done */
+    ff = tr_new( struct cache_file_flush, 1 );
+    ff->torrentId = torrent->uniqueId;
+    ff->file = i;
+    ff->first = first;
+    ff->last = last;
+    ff->func = func;
+    tr_ptrArrayAppend( &cache->file_flushes, ff );
+    fileFlushesUpdate( cache, torrent->session, torrent->uniqueId );
+
     return err;
 }
 
@@ -445,6 +1586,10 @@ tr_cacheFlushTorrent( tr_cache * cache, tr_torrent * torrent )
     int err = 0;
     const int pos = findBlockPos( cache, torrent, 0 );
 
+    /* the torrent's files are about to be closed, moved, or deleted */
+    readCacheClear( cache, torrent->uniqueId );
+    pieceHashClear( cache, torrent->uniqueId );
+
     /* flush out all the blocks in that torrent */
     while( !err && ( pos < tr_ptrArraySize( &cache->blocks ) ) )
     {
@@ -453,5 +1598,11 @@ tr_cacheFlushTorrent( tr_cache * cache, tr_torrent * torrent )
         err = flushContiguous( cache, pos, getBlockRun( cache, pos, NULL ) );
     }
 
-    return err;
+    return err ? err : waitForWrites( cache, torrent );
+}
+
+tr_bool
+tr_cacheIsWriteBacklogged( const tr_cache * cache )
+{
+    return cache->writing_bytes > cache->max_bytes;
 }
@@ -37,6 +37,8 @@ int tr_cacheSetLimit( tr_cache * cache, int64_t max_bytes );
 
 int64_t tr_cacheGetLimit( const tr_cache * );
 
+void tr_cacheGetStats( const tr_cache * cache, tr_cache_stats * setme );
+
 int tr_cacheWriteBlock( tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -51,12 +53,48 @@ int tr_cacheReadBlock( tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme );
 
-int tr_cachePrefetchBlock( tr_cache         * cache,
+/**
+ * Make sure the block can be read from memory without touching the disk.
+ * Returns true if tr_cacheReadBlock() can be called right away. Otherwise
+ * the block is being read by a disk I/O thread, and tr_peerMgrDiskReadDone()
+ * is called when it's ready.
+ */
+tr_bool tr_cacheLoadBlock( tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
                            uint32_t           offset,
                            uint32_t           len );
 
+/**
+ * Returns true if the block isn't waiting in the cache to be written,
+ * so that its file on disk can be read directly.
+ */
+tr_bool tr_cacheIsBlockOnDisk( tr_cache         * cache,
+                               tr_torrent       * torrent,
+                               tr_piece_index_t   piece,
+                               uint32_t           offset );
+
+/**
+ * Start reading a whole piece into the read cache ahead of the peers
+ * that have asked for it. Returns false if the prefetcher has as many
+ * reads in flight as the disk's recent latency allows, or if the cache
+ * is out of room, so that the caller can stop asking for now.
+ */
+tr_bool tr_cachePrefetchPiece( tr_cache         * cache,
+                               tr_torrent       * torrent,
+                               tr_piece_index_t   piece );
+
+/**
+ * Calculate the SHA1 checksum of a piece. Pieces whose blocks were
+ * written in order are hashed as they arrive; the rest of the piece,
+ * if any, is read back from the cache or disk.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_cacheHashPiece( tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint8_t          * setme );
+
 /***
 ****
 ***/
@@ -65,8 +103,23 @@ int tr_cacheFlushDone( tr_cache * cache );
 int tr_cacheFlushTorrent( tr_cache    * cache,
                           tr_torrent  * torrent );
 
-int tr_cacheFlushFile( tr_cache         * cache,
-                       tr_torrent       * torrent,
-                       tr_file_index_t    file );
+typedef void ( *tr_cache_flush_func )( tr_torrent * torrent, tr_file_index_t file );
+
+/**
+ * Start writing the file's blocks to disk. `func' is called in the
+ * libtransmission thread once all of them have landed, which may be
+ * right away.
+ */
+int tr_cacheFlushFile( tr_cache             * cache,
+                       tr_torrent           * torrent,
+                       tr_file_index_t        file,
+                       tr_cache_flush_func    func );
+
+/**
+ * Returns true if the disk I/O threads have more than the cache's
+ * worth of blocks still to write, so new blocks shouldn't be requested
+ * until they catch up.
+ */
+tr_bool tr_cacheIsWriteBacklogged( const tr_cache * cache );
 
 #endif
@@ -0,0 +1,240 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "disk-io.h"
+#include "list.h"
+#include "platform.h" /* tr_lock, tr_sem, tr_threadNew() */
+#include "session.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+
+#define MY_NAME "Disk IO"
+
+struct disk_job
+{
+    int                  torrentId;
+    tr_disk_work_func    work;
+    tr_disk_done_func    done;
+    void               * user_data;
+};
+
+struct tr_diskIo
+{
+    tr_session * session;
+    tr_lock * lock;
+
+    /* posted once for each queued job, and once per thread on shutdown */
+    tr_sem * jobSem;
+
+    /* posted when a job finishes while tr_diskIoWaitTorrent() is waiting */
+    tr_sem * waitSem;
+    tr_bool isWaiting;
+
+    tr_list * queued;   /* jobs waiting for a thread */
+    tr_list * running;  /* jobs whose work is being done */
+    tr_list * finished; /* jobs waiting for their done callbacks */
+
+    int threadCount;
+    tr_bool isClosing;
+};
+
+static void
+runDoneCallbacks( void * vsession )
+{
+    tr_session * session = vsession;
+    tr_diskIo * io = session->diskIo;
+
+    if( io != NULL )
+    {
+        tr_list * finished;
+        struct disk_job * job;
+
+        tr_lockLock( io->lock );
+        finished = io->finished;
+        io->finished = NULL;
+        tr_lockUnlock( io->lock );
+
+        while(( job = tr_list_pop_front( &finished )))
+        {
+            if( job->done != NULL )
+                job->done( session, job->user_data );
+            tr_free( job );
+        }
+    }
+}
+
+static void
+diskThreadFunc( void * vio )
+{
+    tr_diskIo * io = vio;
+
+    for( ;; )
+    {
+        tr_bool wasEmpty;
+        struct disk_job * job;
+
+        tr_semWait( io->jobSem );
+
+        tr_lockLock( io->lock );
+        job = tr_list_pop_front( &io->queued );
+        if( job == NULL )
+        {
+            /* we were woken up to shut down */
+            assert( io->isClosing );
+            --io->threadCount;
+            tr_lockUnlock( io->lock );
+            break;
+        }
+        tr_list_append( &io->running, job );
+        tr_lockUnlock( io->lock );
+
+        job->work( job->user_data );
+
+        tr_lockLock( io->lock );
+        tr_list_remove_data( &io->running, job );
+        wasEmpty = io->finished == NULL;
+        tr_list_append( &io->finished, job );
+        if( io->isWaiting ) {
+            io->isWaiting = FALSE;
+            tr_semPost( io->waitSem );
+        }
+        tr_lockUnlock( io->lock );
+
+        /* only the first finished job needs to wake up the
+         * libtransmission thread; it'll pick up the rest too */
+        if( wasEmpty )
+            tr_runInEventThread( io->session, runDoneCallbacks, io->session );
+    }
+}
+
+void
+tr_diskIoInit( tr_session * session, int threadCount )
+{
+    int i;
+    tr_diskIo * io;
+
+    assert( tr_isSession( session ) );
+    assert( session->diskIo == NULL );
+
+    io = tr_new0( tr_diskIo, 1 );
+    io->session = session;
+    io->lock = tr_lockNew( );
+    io->jobSem = tr_semNew( );
+    io->waitSem = tr_semNew( );
+    io->threadCount = MAX( 1, threadCount );
+    session->diskIo = io;
+
+    tr_ndbg( MY_NAME, "Starting %d I/O threads", io->threadCount );
+    for( i=0; i<io->threadCount; ++i )
+        tr_threadNew( diskThreadFunc, io );
+}
+
+void
+tr_diskIoClose( tr_session * session )
+{
+    int i;
+    tr_diskIo * io = session->diskIo;
+
+    assert( tr_amInEventThread( session ) );
+
+    if( io == NULL )
+        return;
+
+    /* let the threads finish the queue, then wait for them to exit */
+    tr_lockLock( io->lock );
+    io->isClosing = TRUE;
+    for( i=0; i<io->threadCount; ++i )
+        tr_semPost( io->jobSem );
+    while( io->threadCount > 0 ) {
+        tr_lockUnlock( io->lock );
+        tr_wait_msec( 10 );
+        tr_lockLock( io->lock );
+    }
+    tr_lockUnlock( io->lock );
+
+    runDoneCallbacks( session );
+
+    session->diskIo = NULL;
+    assert( io->queued == NULL );
+    assert( io->running == NULL );
+    tr_semFree( io->waitSem );
+    tr_semFree( io->jobSem );
+    tr_lockFree( io->lock );
+    tr_free( io );
+}
+
+void
+tr_diskIoQueue( tr_session         * session,
+                int                  torrentId,
+                tr_disk_work_func    work,
+                tr_disk_done_func    done,
+                void               * user_data )
+{
+    tr_diskIo * io = session->diskIo;
+
+    assert( tr_amInEventThread( session ) );
+    assert( work != NULL );
+
+    if( ( io == NULL ) || io->isClosing )
+    {
+        /* no I/O threads, so do the work ourselves */
+        work( user_data );
+        if( done != NULL )
+            done( session, user_data );
+    }
+    else
+    {
+        struct disk_job * job = tr_new( struct disk_job, 1 );
+        job->torrentId = torrentId;
+        job->work = work;
+        job->done = done;
+        job->user_data = user_data;
+
+        tr_lockLock( io->lock );
+        tr_list_append( &io->queued, job );
+        tr_lockUnlock( io->lock );
+
+        tr_semPost( io->jobSem );
+    }
+}
+
+static int
+compareJobToTorrentId( const void * vjob, const void * vid )
+{
+    const struct disk_job * job = vjob;
+    return job->torrentId - *(const int*)vid;
+}
+
+void
+tr_diskIoWaitTorrent( tr_session * session, int torrentId )
+{
+    tr_diskIo * io = session->diskIo;
+
+    assert( tr_amInEventThread( session ) );
+
+    if( io == NULL )
+        return;
+
+    tr_lockLock( io->lock );
+    while( tr_list_find( io->queued, &torrentId, compareJobToTorrentId )
+        || tr_list_find( io->running, &torrentId, compareJobToTorrentId ) )
+    {
+        io->isWaiting = TRUE;
+        tr_lockUnlock( io->lock );
+        tr_semWait( io->waitSem );
+        tr_lockLock( io->lock );
+    }
+    tr_lockUnlock( io->lock );
+}
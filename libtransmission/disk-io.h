@@ -0,0 +1,66 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DISK_IO_H
+#define TR_DISK_IO_H
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+typedef struct tr_diskIo tr_diskIo;
+
+/** @brief the part of a disk job that runs in one of the I/O threads */
+typedef void ( *tr_disk_work_func )( void * user_data );
+
+/** @brief the part of a disk job that runs in the libtransmission thread
+           after tr_disk_work_func has finished */
+typedef void ( *tr_disk_done_func )( tr_session * session, void * user_data );
+
+void tr_diskIoInit( tr_session * session, int threadCount );
+
+/**
+ * Finish all the queued jobs, run their done callbacks,
+ * and shut down the I/O threads.
+ */
+void tr_diskIoClose( tr_session * session );
+
+/**
+ * Queue a job to be run in one of the I/O threads.
+ *
+ * `work' must not touch anything that the libtransmission thread may
+ * change while it runs. The torrent it belongs to is guaranteed to stay
+ * alive because tr_diskIoWaitTorrent() is called before it's freed.
+ * `done' is called in the libtransmission thread afterwards.
+ */
+void tr_diskIoQueue( tr_session         * session,
+                     int                  torrentId,
+                     tr_disk_work_func    work,
+                     tr_disk_done_func    done,
+                     void               * user_data );
+
+/**
+ * Block until all of the torrent's queued and running jobs have
+ * finished their work. Their done callbacks may still be pending.
+ * This stalls the libtransmission thread, so it's only for when the
+ * torrent is being removed or its files are being closed.
+ */
+void tr_diskIoWaitTorrent( tr_session * session, int torrentId );
+
+/* @} */
+
+#endif
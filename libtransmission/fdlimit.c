@@ -21,9 +21,16 @@
  #define _XOPEN_SOURCE 600
 #endif
 
+#ifdef HAVE_PWRITEV
+ /* glibc's sys/uio.h needs these to pick up pwritev */
+ #define _BSD_SOURCE
+ #define _DEFAULT_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h> /* IOV_MAX */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,12 +55,29 @@
 #endif
 #include <fcntl.h> /* O_LARGEFILE posix_fadvise */
 #include <unistd.h>
+#ifdef HAVE_PWRITEV
+ #include <sys/uio.h> /* pwritev */
+#endif
+/* reads through mappings need a per-thread landing pad for SIGBUS */
+#if !defined( WIN32 ) && defined( HAVE_TLS )
+ #define WITH_MMAP_READS
+#endif
+
+#ifdef WITH_MMAP_READS
+ #include <setjmp.h> /* sigsetjmp */
+ #include <signal.h> /* sigaction */
+ #include <sys/mman.h> /* mmap */
+#endif
+
+#include <event2/buffer.h> /* struct evbuffer_iovec */
 
 #include "transmission.h"
 #include "fdlimit.h"
 #include "net.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent() */
+#include "trevent.h" /* tr_amInEventThread() */
 
 #define dbgmsg( ... ) \
     do { \
@@ -241,6 +265,48 @@ tr_pwrite( int fd, const void *buf, size_t count, off_t offset )
 #endif
 }
 
+#ifdef IOV_MAX
+ #define TR_IOV_MAX MIN( IOV_MAX, 64 )
+#else
+ #define TR_IOV_MAX 16
+#endif
+
+ssize_t
+tr_pwritev( int fd, const struct evbuffer_iovec * vec, int vec_count, off_t offset )
+{
+    int i = 0;
+    size_t skip = 0; /* how much of vec[i] has been written */
+    ssize_t total = 0;
+
+    while( i < vec_count )
+    {
+        ssize_t rc;
+#ifdef HAVE_PWRITEV
+        int n;
+        struct iovec iov[TR_IOV_MAX];
+        for( n=0; n<TR_IOV_MAX && i+n<vec_count; ++n ) {
+            iov[n].iov_base = (char*)vec[i+n].iov_base + ( n ? 0 : skip );
+            iov[n].iov_len = vec[i+n].iov_len - ( n ? 0 : skip );
+        }
+        rc = pwritev( fd, iov, n, offset + total );
+#else
+        rc = tr_pwrite( fd, (const char*)vec[i].iov_base + skip, vec[i].iov_len - skip, offset + total );
+#endif
+        if( rc < 0 )
+            return -1;
+        if( ( rc == 0 ) && ( vec[i].iov_len > skip ) )
+            break;
+
+        /* a short write leaves us partway through a vector */
+        total += rc;
+        skip += rc;
+        while( ( i < vec_count ) && ( skip >= vec[i].iov_len ) )
+            skip -= vec[i++].iov_len;
+    }
+
+    return total;
+}
+
 int
 tr_prefetch( int fd UNUSED, off_t offset UNUSED, size_t count UNUSED )
 {
@@ -323,9 +389,132 @@ struct tr_cached_file
     int              fd;
     int              torrent_id;
     tr_file_index_t  file_index;
-    time_t           used_at;
+
+    /* open files are chained in a hash bucket and linked into
+     * the LRU list. closed ones are kept in the free list, which
+     * reuses lru_next. */
+    struct tr_cached_file * hash_next;
+    struct tr_cached_file * lru_prev;
+    struct tr_cached_file * lru_next;
+
+    /* the parts of this file that are memory-mapped */
+    struct tr_mapped_window * windows;
+
+    /* how many threads are using the fd without holding the file lock.
+     * a pinned file that gets closed is taken out of the hash and the
+     * LRU list right away, but the last tr_fdFileRelease() closes it. */
+    int              pins;
+    tr_bool          is_closing;
+};
+
+/***
+****
+****  Memory-mapped windows
+****
+***/
+
+#ifdef WITH_MMAP_READS
+
+enum
+{
+    /* how much of a file to map at a time */
+    MAPPED_WINDOW_SIZE = ( 4 * 1024 * 1024 ),
+
+    /* how many windows to keep mapped at once */
+    MAPPED_WINDOW_COUNT = 32
 };
 
+struct tr_mapped_window
+{
+    /* the open file that this window maps, or NULL if it's unused.
+     * the file's windows are chained through file_next. */
+    struct tr_cached_file   * file;
+    struct tr_mapped_window * file_next;
+
+    uint64_t          offset;
+    size_t            length;
+    uint8_t         * base;
+    uint64_t          used_at;
+
+    /* how many threads are copying from this window */
+    int               pins;
+};
+
+/* set while a thread is copying from a mapping, so that a SIGBUS
+ * from a truncated file can be turned into an error */
+static __thread sigjmp_buf * sigbus_jmp = NULL;
+static struct sigaction old_sigbus_action;
+static tr_bool sigbus_handler_installed = FALSE;
+
+static void
+onSigbus( int sig, siginfo_t * info, void * context )
+{
+    if( sigbus_jmp != NULL )
+        siglongjmp( *sigbus_jmp, 1 );
+
+    /* not ours... hand it to whoever had it before us */
+    if( old_sigbus_action.sa_flags & SA_SIGINFO )
+        old_sigbus_action.sa_sigaction( sig, info, context );
+    else if( ( old_sigbus_action.sa_handler != SIG_DFL ) && ( old_sigbus_action.sa_handler != SIG_IGN ) )
+        old_sigbus_action.sa_handler( sig );
+    else /* restore the default so that the fault is fatal the next time around */
+        sigaction( SIGBUS, &old_sigbus_action, NULL );
+}
+
+static void
+window_install_sigbus_handler( void )
+{
+    if( !sigbus_handler_installed )
+    {
+        struct sigaction sa;
+        memset( &sa, 0, sizeof( sa ) );
+        sa.sa_sigaction = onSigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset( &sa.sa_mask );
+        sigaction( SIGBUS, &sa, &old_sigbus_action );
+        sigbus_handler_installed = TRUE;
+    }
+}
+
+/* returns 0 on success, or EIO if the file was truncated underneath us */
+static int
+window_copy( void * dst, const void * src, size_t len )
+{
+    sigjmp_buf jmp;
+
+    if( sigsetjmp( jmp, 1 ) )
+    {
+        sigbus_jmp = NULL;
+        return EIO;
+    }
+
+    sigbus_jmp = &jmp;
+    memcpy( dst, src, len );
+    sigbus_jmp = NULL;
+    return 0;
+}
+
+/* unmap a window and take it off its file's chain */
+static void
+window_unmap( struct tr_mapped_window * w )
+{
+    struct tr_mapped_window ** walk;
+
+    assert( w->file != NULL );
+    assert( w->pins == 0 );
+
+    for( walk=&w->file->windows; *walk!=w; walk=&(*walk)->file_next )
+        assert( *walk != NULL );
+    *walk = w->file_next;
+
+    munmap( w->base, w->length );
+    w->base = NULL;
+    w->file = NULL;
+    w->file_next = NULL;
+}
+
+#endif /* WITH_MMAP_READS */
+
 static inline tr_bool
 cached_file_is_open( const struct tr_cached_file * o )
 {
@@ -339,6 +528,11 @@ cached_file_close( struct tr_cached_file * o )
 {
     assert( cached_file_is_open( o ) );
 
+#ifdef WITH_MMAP_READS
+    while( o->windows != NULL )
+        window_unmap( o->windows );
+#endif
+
     tr_close_file( o->fd );
     o->fd = -1;
 }
@@ -425,49 +619,152 @@ struct tr_fileset
 {
     struct tr_cached_file * begin;
     const struct tr_cached_file * end;
+
+    /* open files, hashed by torrent id and file index */
+    struct tr_cached_file ** buckets;
+    unsigned int bucket_mask;
+
+    /* open files, most recently used first */
+    struct tr_cached_file * lru_head;
+    struct tr_cached_file * lru_tail;
+
+    /* closed files, ready to be reused */
+    struct tr_cached_file * free_list;
+
+    /* the sum of the open files' pins */
+    int pin_count;
 };
 
 static void
 fileset_construct( struct tr_fileset * set, int n )
 {
+    unsigned int bucket_count;
     struct tr_cached_file * o;
-    const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, 0 };
+    const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, NULL, NULL, NULL, NULL, 0, FALSE };
 
     set->begin = tr_new( struct tr_cached_file, n );
     set->end = set->begin + n;
+    set->lru_head = set->lru_tail = NULL;
+    set->free_list = NULL;
+    set->pin_count = 0;
 
-    for( o=set->begin; o!=set->end; ++o )
+    for( o=set->begin; o!=set->end; ++o ) {
         *o = TR_CACHED_FILE_INIT;
+        o->lru_next = set->free_list;
+        set->free_list = o;
+    }
+
+    /* keep the buckets' chains short */
+    for( bucket_count=1; bucket_count < (unsigned int)n * 2; bucket_count *= 2 );
+    set->buckets = tr_new0( struct tr_cached_file*, bucket_count );
+    set->bucket_mask = bucket_count - 1;
+}
+
+static struct tr_cached_file **
+fileset_bucket( struct tr_fileset * set, int torrent_id, tr_file_index_t i )
+{
+    const unsigned int hash = ( (unsigned int)torrent_id * 2654435761u ) ^ ( i * 40503u );
+
+    return &set->buckets[hash & set->bucket_mask];
 }
 
 static void
-fileset_close_all( struct tr_fileset * set )
+fileset_lru_unlink( struct tr_fileset * set, struct tr_cached_file * o )
 {
-    struct tr_cached_file * o;
+    if( o->lru_prev ) o->lru_prev->lru_next = o->lru_next;
+    else set->lru_head = o->lru_next;
 
-    if( set != NULL )
-        for( o=set->begin; o!=set->end; ++o )
-            if( cached_file_is_open( o ) )
-                cached_file_close( o );
+    if( o->lru_next ) o->lru_next->lru_prev = o->lru_prev;
+    else set->lru_tail = o->lru_prev;
+
+    o->lru_prev = o->lru_next = NULL;
 }
 
 static void
-fileset_destruct( struct tr_fileset * set )
+fileset_lru_push( struct tr_fileset * set, struct tr_cached_file * o )
 {
-    fileset_close_all( set );
-    tr_free( set->begin );
-    set->end = set->begin = NULL;
+    o->lru_prev = NULL;
+    o->lru_next = set->lru_head;
+
+    if( set->lru_head ) set->lru_head->lru_prev = o;
+    else set->lru_tail = o;
+
+    set->lru_head = o;
 }
 
+/* mark an open file as the most recently used */
 static void
-fileset_close_torrent( struct tr_fileset * set, int torrent_id )
+fileset_touch( struct tr_fileset * set, struct tr_cached_file * o )
 {
-    struct tr_cached_file * o;
+    if( set->lru_head != o )
+    {
+        fileset_lru_unlink( set, o );
+        fileset_lru_push( set, o );
+    }
+}
+
+/* add a newly-opened file to the hash and the LRU list */
+static void
+fileset_insert( struct tr_fileset * set, struct tr_cached_file * o )
+{
+    struct tr_cached_file ** bucket = fileset_bucket( set, o->torrent_id, o->file_index );
+
+    assert( cached_file_is_open( o ) );
 
+    o->hash_next = *bucket;
+    *bucket = o;
+    fileset_lru_push( set, o );
+}
+
+static void
+fileset_release_slot( struct tr_fileset * set, struct tr_cached_file * o )
+{
+    o->lru_prev = NULL;
+    o->lru_next = set->free_list;
+    set->free_list = o;
+}
+
+static void
+fileset_close_file( struct tr_fileset * set, struct tr_cached_file * o )
+{
+    struct tr_cached_file ** walk;
+
+    assert( cached_file_is_open( o ) );
+
+    for( walk=fileset_bucket( set, o->torrent_id, o->file_index ); *walk!=o; walk=&(*walk)->hash_next )
+        assert( *walk != NULL );
+    *walk = o->hash_next;
+    o->hash_next = NULL;
+
+    fileset_lru_unlink( set, o );
+
+    if( o->pins > 0 )
+        o->is_closing = TRUE;
+    else {
+        cached_file_close( o );
+        fileset_release_slot( set, o );
+    }
+}
+
+static void
+fileset_close_all( struct tr_fileset * set )
+{
     if( set != NULL )
-        for( o=set->begin; o!=set->end; ++o )
-            if( ( o->torrent_id == torrent_id ) && cached_file_is_open( o ) )
-                cached_file_close( o );
+        while( set->lru_head != NULL )
+            fileset_close_file( set, set->lru_head );
+}
+
+static void
+fileset_destruct( struct tr_fileset * set )
+{
+    assert( set->pin_count == 0 );
+
+    fileset_close_all( set );
+    tr_free( set->buckets );
+    tr_free( set->begin );
+    set->end = set->begin = NULL;
+    set->buckets = NULL;
+    set->free_list = NULL;
 }
 
 static struct tr_cached_file *
@@ -475,31 +772,39 @@ fileset_lookup( struct tr_fileset * set, int torrent_id, tr_file_index_t i )
 {
     struct tr_cached_file * o;
 
-    if( set != NULL )
-        for( o=set->begin; o!=set->end; ++o )
-            if( ( torrent_id == o->torrent_id ) && ( i == o->file_index ) && cached_file_is_open( o ) )
-                return o;
+    if( set == NULL || set->buckets == NULL )
+        return NULL;
+
+    for( o=*fileset_bucket( set, torrent_id, i ); o!=NULL; o=o->hash_next )
+        if( ( torrent_id == o->torrent_id ) && ( i == o->file_index ) )
+            return o;
 
     return NULL;
 }
 
+/* returns a closed slot that's been taken off the free list,
+ * or NULL if every file is open and pinned */
 static struct tr_cached_file *
 fileset_get_empty_slot( struct tr_fileset * set )
 {
     struct tr_cached_file * o;
-    struct tr_cached_file * cull;
 
-    /* try to find an unused slot */
-    for( o=set->begin; o!=set->end; ++o )
-        if( !cached_file_is_open( o ) )
-            return o;
+    /* if all slots are full, recycle the least recently used
+     * of the files that nobody is reading or writing right now */
+    if( set->free_list == NULL )
+    {
+        for( o=set->lru_tail; o!=NULL && o->pins>0; o=o->lru_prev );
 
-    /* all slots are full... recycle the least recently used */
-    for( cull=NULL, o=set->begin; o!=set->end; ++o )
-        if( !cull || o->used_at < cull->used_at )
-            cull = o;
-    cached_file_close( cull );
-    return cull;
+        if( o == NULL )
+            return NULL;
+
+        fileset_close_file( set, o );
+    }
+
+    o = set->free_list;
+    set->free_list = o->lru_next;
+    o->lru_next = NULL;
+    return o;
 }
 
 static int
@@ -508,6 +813,36 @@ fileset_get_size( const struct tr_fileset * set )
     return set ? set->end - set->begin : 0;
 }
 
+static void
+fileset_close_torrent( struct tr_fileset * set, int torrent_id, tr_file_index_t file_count )
+{
+    struct tr_cached_file * o;
+    struct tr_cached_file * next;
+
+    if( set == NULL )
+        return;
+
+    /* look up each of the torrent's files in the hash, unless
+     * there are more of them than the cache can hold open */
+    if( file_count <= (tr_file_index_t)fileset_get_size( set ) )
+    {
+        tr_file_index_t i;
+
+        for( i=0; i<file_count; ++i )
+            if(( o = fileset_lookup( set, torrent_id, i )))
+                fileset_close_file( set, o );
+    }
+    else
+    {
+        for( o=set->lru_head; o!=NULL; o=next )
+        {
+            next = o->lru_next;
+            if( o->torrent_id == torrent_id )
+                fileset_close_file( set, o );
+        }
+    }
+}
+
 /***
 ****
 ***/
@@ -518,6 +853,13 @@ struct tr_fdInfo
     int socket_limit;
     int public_socket_limit;
     struct tr_fileset fileset;
+
+    /* guards the fileset, which the disk I/O threads use too */
+    tr_lock * fileLock;
+
+    /* the memory-mapped windows of seeding torrents' files */
+    struct tr_mapped_window * windows;
+    uint64_t window_clock;
 };
 
 static struct tr_fileset*
@@ -526,38 +868,259 @@ get_fileset( tr_session * session )
     return session && session->fdInfo ? &session->fdInfo->fileset : NULL;
 }
 
+void
+tr_fdFileLock( tr_session * session )
+{
+    if( session && session->fdInfo )
+        tr_lockLock( session->fdInfo->fileLock );
+}
+
+void
+tr_fdFileUnlock( tr_session * session )
+{
+    if( session && session->fdInfo )
+        tr_lockUnlock( session->fdInfo->fileLock );
+}
+
+#ifdef WITH_MMAP_READS
+
+/* returns the window holding 'offset', mapping it if necessary.
+ * returns NULL and sets errno if the file can't be mapped, or to
+ * EBUSY if every window is being copied from. */
+static struct tr_mapped_window *
+window_get( struct tr_fdInfo      * gFd,
+            struct tr_cached_file * o,
+            uint64_t                file_size,
+            uint64_t                offset )
+{
+    void * base;
+    struct tr_mapped_window * w;
+    struct tr_mapped_window * cull = NULL;
+    const uint64_t window_offset = offset - ( offset % MAPPED_WINDOW_SIZE );
+
+    for( w=o->windows; w!=NULL; w=w->file_next )
+    {
+        if( w->offset == window_offset )
+        {
+            w->used_at = ++gFd->window_clock;
+            return w;
+        }
+    }
+
+    if( gFd->windows == NULL )
+        gFd->windows = tr_new0( struct tr_mapped_window, MAPPED_WINDOW_COUNT );
+
+    /* prefer an unused window, else the least recently used */
+    for( w=gFd->windows; w!=gFd->windows+MAPPED_WINDOW_COUNT; ++w )
+        if( !w->pins && ( !cull || !w->base || ( cull->base && ( w->used_at < cull->used_at ) ) ) )
+            cull = w;
+
+    if( cull == NULL ) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    if( cull->base != NULL )
+        window_unmap( cull );
+
+    cull->length = MIN( MAPPED_WINDOW_SIZE, file_size - window_offset );
+    base = mmap( NULL, cull->length, PROT_READ, MAP_SHARED, o->fd, (off_t)window_offset );
+    if( base == MAP_FAILED )
+        return NULL;
+
+    cull->file = o;
+    cull->file_next = o->windows;
+    o->windows = cull;
+    cull->offset = window_offset;
+    cull->base = base;
+    cull->used_at = ++gFd->window_clock;
+    return cull;
+}
+
+#endif /* WITH_MMAP_READS */
+
+int
+tr_fdFileMapRead( tr_session            * session,
+                  struct tr_cached_file * o,
+                  uint64_t                file_size,
+                  uint64_t                offset,
+                  void                  * buf,
+                  size_t                  buflen )
+{
+#ifdef WITH_MMAP_READS
+    int err = 0;
+    uint8_t * walk = buf;
+    struct tr_fdInfo * gFd = session->fdInfo;
+
+    assert( o->pins > 0 );
+    assert( offset + buflen <= file_size );
+
+    tr_fdFileLock( session );
+    window_install_sigbus_handler( );
+    tr_fdFileUnlock( session );
+
+    while( !err && ( buflen > 0 ) )
+    {
+        size_t n;
+        struct tr_mapped_window * w;
+
+        /* pin the window so that nobody unmaps it while we copy */
+        tr_fdFileLock( session );
+        if(( w = window_get( gFd, o, file_size, offset )))
+            ++w->pins;
+        else
+            err = errno;
+        tr_fdFileUnlock( session );
+
+        if( w == NULL )
+            break;
+
+        n = MIN( buflen, w->offset + w->length - offset );
+        err = window_copy( walk, w->base + ( offset - w->offset ), n );
+
+        tr_fdFileLock( session );
+        if( !--w->pins && err )
+            window_unmap( w );
+        tr_fdFileUnlock( session );
+
+        walk += n;
+        offset += n;
+        buflen -= n;
+    }
+
+    return err;
+#else
+    (void) session; (void) o; (void) file_size;
+    (void) offset; (void) buf; (void) buflen;
+    return ENOSYS;
+#endif
+}
+
 void
 tr_fdFileClose( tr_session * s, const tr_torrent * tor, tr_file_index_t i )
 {
     struct tr_cached_file * o;
+    struct tr_fileset * set;
 
-    if(( o = fileset_lookup( get_fileset( s ), tr_torrentId( tor ), i )))
+    tr_fdFileLock( s );
+
+    set = get_fileset( s );
+    if(( o = fileset_lookup( set, tr_torrentId( tor ), i )))
     {
         /* flush writable files so that their mtimes will be
          * up-to-date when this function returns to the caller... */
         if( o->is_writable )
             tr_fsync( o->fd );
 
-        cached_file_close( o );
+        fileset_close_file( set, o );
     }
+
+    tr_fdFileUnlock( s );
 }
 
 int
 tr_fdFileGetCached( tr_session * s, int torrent_id, tr_file_index_t i, tr_bool writable )
 {
-    struct tr_cached_file * o = fileset_lookup( get_fileset( s ), torrent_id, i );
+    struct tr_fileset * set = get_fileset( s );
+    struct tr_cached_file * o = fileset_lookup( set, torrent_id, i );
 
     if( !o || ( writable && !o->is_writable ) )
         return -1;
 
-    o->used_at = tr_time( );
+    fileset_touch( set, o );
     return o->fd;
 }
 
+struct tr_cached_file *
+tr_fdFilePin( tr_session * s, int torrent_id, tr_file_index_t i, int * setme_fd )
+{
+    struct tr_fileset * set = get_fileset( s );
+    struct tr_cached_file * o = fileset_lookup( set, torrent_id, i );
+
+    if( o != NULL )
+    {
+        ++o->pins;
+        ++set->pin_count;
+        *setme_fd = o->fd;
+    }
+
+    return o;
+}
+
+void
+tr_fdFileRelease( tr_session * s, struct tr_cached_file * o )
+{
+    struct tr_fileset * set;
+
+    tr_fdFileLock( s );
+
+    set = get_fileset( s );
+    assert( o->pins > 0 );
+    --set->pin_count;
+
+    if( !--o->pins && o->is_closing )
+    {
+        o->is_closing = FALSE;
+        cached_file_close( o );
+        fileset_release_slot( set, o );
+    }
+
+    tr_fdFileUnlock( s );
+}
+
 void
-tr_fdTorrentClose( tr_session * session, int torrent_id )
+tr_fdTorrentClose( tr_session * session, const tr_torrent * tor )
+{
+    tr_fdFileLock( session );
+    fileset_close_torrent( get_fileset( session ), tr_torrentId( tor ), tor->info.fileCount );
+    tr_fdFileUnlock( session );
+}
+
+static tr_bool
+cached_file_is_deleted( const struct tr_cached_file * o )
+{
+    struct stat sb;
+    return !fstat( o->fd, &sb ) && ( sb.st_nlink < 1 );
+}
+
+tr_bool
+tr_fdTorrentFindDeletedFile( tr_session       * session,
+                             int                torrent_id,
+                             tr_file_index_t    file_count,
+                             tr_file_index_t  * setme )
 {
-    fileset_close_torrent( get_fileset( session ), torrent_id );
+    struct tr_fileset * set;
+    struct tr_cached_file * o;
+    tr_bool found = FALSE;
+
+    tr_fdFileLock( session );
+
+    /* like fileset_close_torrent(), look up each of the torrent's
+     * files unless there are more of them than the cache holds */
+    if(( set = get_fileset( session )))
+    {
+        if( file_count <= (tr_file_index_t)fileset_get_size( set ) )
+        {
+            tr_file_index_t i;
+
+            for( i=0; !found && i<file_count; ++i )
+                if(( o = fileset_lookup( set, torrent_id, i )) && cached_file_is_deleted( o ))
+                    found = TRUE;
+        }
+        else
+        {
+            for( o=set->lru_head; o!=NULL; o=o->lru_next )
+                if( ( o->torrent_id == torrent_id ) && cached_file_is_deleted( o ) )
+                    break;
+            found = o != NULL;
+        }
+
+        if( found )
+            *setme = o->file_index;
+    }
+
+    tr_fdFileUnlock( session );
+    return found;
 }
 
 /* returns an fd on success, or a -1 on failure and sets errno */
@@ -574,26 +1137,41 @@ tr_fdFileCheckout( tr_session             * session,
     struct tr_cached_file * o = fileset_lookup( set, torrent_id, i );
 
     if( o && writable && !o->is_writable )
-        cached_file_close( o ); /* close it so we can reopen in rw mode */
-    else if( !o )
-        o = fileset_get_empty_slot( set );
+    {
+        fileset_close_file( set, o ); /* close it so we can reopen in rw mode */
+        o = NULL;
+    }
 
-    if( !cached_file_is_open( o ) )
+    if( o == NULL )
     {
-        const int err = cached_file_open( o, filename, writable, allocation, file_size );
+        int err;
+
+        if(( o = fileset_get_empty_slot( set )) == NULL ) {
+            errno = EMFILE;
+            return -1;
+        }
+
+        err = cached_file_open( o, filename, writable, allocation, file_size );
         if( err ) {
+            if( cached_file_is_open( o ) )
+                cached_file_close( o );
+            fileset_release_slot( set, o );
             errno = err;
             return -1;
         }
 
         dbgmsg( "opened '%s' writable %c", filename, writable?'y':'n' );
         o->is_writable = writable;
+        o->torrent_id = torrent_id;
+        o->file_index = i;
+        fileset_insert( set, o );
+    }
+    else
+    {
+        fileset_touch( set, o );
     }
 
     dbgmsg( "checking out '%s'", filename );
-    o->torrent_id = torrent_id;
-    o->file_index = i;
-    o->used_at = tr_time( );
     return o->fd;
 }
 
@@ -726,8 +1304,10 @@ ensureSessionFdInfoExists( tr_session * session )
 {
     assert( tr_isSession( session ) );
 
-    if( session->fdInfo == NULL )
+    if( session->fdInfo == NULL ) {
         session->fdInfo = tr_new0( struct tr_fdInfo, 1 );
+        session->fdInfo->fileLock = tr_lockNew( );
+    }
 }
 
 void
@@ -738,6 +1318,8 @@ tr_fdClose( tr_session * session )
     if( gFd != NULL )
     {
         fileset_destruct( &gFd->fileset );
+        tr_free( gFd->windows );
+        tr_lockFree( gFd->fileLock );
         tr_free( gFd );
     }
 
@@ -759,12 +1341,29 @@ tr_fdSetFileLimit( tr_session * session, int limit )
 {
     ensureSessionFdInfoExists( session );
 
+    /* each disk I/O thread and the event thread may have a file pinned,
+     * and there must still be a slot left to open another one in */
+    limit = MAX( limit, session->diskIoThreads + 2 );
+
+    tr_fdFileLock( session );
+
     if( limit != tr_fdGetFileLimit( session ) )
     {
         struct tr_fileset * set = get_fileset( session );
+
+        /* wait for the pinned files to be released */
+        while( set->pin_count > 0 )
+        {
+            tr_fdFileUnlock( session );
+            tr_wait_msec( 10 );
+            tr_fdFileLock( session );
+        }
+
         fileset_destruct( set );
         fileset_construct( set, limit );
     }
+
+    tr_fdFileUnlock( session );
 }
 
 void
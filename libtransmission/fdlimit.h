@@ -17,6 +17,9 @@
 #include "transmission.h"
 #include "net.h"
 
+struct evbuffer_iovec;
+struct tr_cached_file;
+
 /**
  * @addtogroup file_io File IO
  * @{
@@ -44,6 +47,7 @@ int tr_fsync(int fd);
 
 ssize_t tr_pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t tr_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t tr_pwritev(int fd, const struct evbuffer_iovec *vec, int vec_count, off_t offset);
 int tr_prefetch(int fd, off_t offset, size_t count);
 
 
@@ -70,11 +74,55 @@ int  tr_fdFileCheckout( tr_session             * session,
                         tr_preallocation_mode    preallocationMode,
                         uint64_t                 desiredFileSize );
 
+/**
+ * The file repository is shared with the disk I/O threads, so hold
+ * this lock while looking up, checking out, or closing files. To use
+ * an fd after letting go of the lock, pin it with tr_fdFilePin().
+ */
+void tr_fdFileLock( tr_session * session );
+
+void tr_fdFileUnlock( tr_session * session );
+
 int tr_fdFileGetCached( tr_session             * session,
                         int                      torrentId,
                         tr_file_index_t          fileNum,
                         tr_bool                  doWrite );
 
+/**
+ * Pins an open file so that its fd stays valid, and the file stays open,
+ * until tr_fdFileRelease() is called. The caller must hold the file lock,
+ * but the fd can be read from and written to after releasing it.
+ *
+ * Returns NULL if the file isn't open.
+ */
+struct tr_cached_file* tr_fdFilePin( tr_session             * session,
+                                     int                      torrentId,
+                                     tr_file_index_t          fileNum,
+                                     int                    * setme_fd );
+
+/**
+ * Unpins a file. If it was closed while pinned, it's closed now.
+ * Takes the file lock itself.
+ */
+void tr_fdFileRelease( tr_session            * session,
+                       struct tr_cached_file * file );
+
+/**
+ * Reads from a pinned file through a memory-mapped window instead of
+ * with pread(). The caller must not hold the file lock. The file's
+ * windows are unmapped when the file is closed.
+ *
+ * Returns 0 on success, or an errno value if the file couldn't be mapped
+ * or was truncated while we were reading it, in which case the caller
+ * should fall back to tr_pread().
+ */
+int tr_fdFileMapRead( tr_session             * session,
+                      struct tr_cached_file  * file,
+                      uint64_t                 fileSize,
+                      uint64_t                 offset,
+                      void                   * buf,
+                      size_t                   buflen );
+
 /**
  * Closes a file that's being held by our file repository.
  *
@@ -89,9 +137,21 @@ void tr_fdFileClose( tr_session        * session,
 
 
 /**
- * Closes all the files associated with a given torrent id
+ * Closes all the files associated with a given torrent
+ */
+void tr_fdTorrentClose( tr_session * session, const tr_torrent * tor );
+
+/**
+ * Looks through the torrent's open files for one that has been deleted
+ * out from under us. This fstat()s each of them, so it's meant to be
+ * called from a disk I/O thread rather than for every read or write.
+ *
+ * Returns true and sets `setme' to the file's index if one was found.
  */
-void tr_fdTorrentClose( tr_session * session, int torrentId );
+tr_bool tr_fdTorrentFindDeletedFile( tr_session       * session,
+                                     int                torrentId,
+                                     tr_file_index_t    fileCount,
+                                     tr_file_index_t  * setme );
 
 
 /***********************************************************************
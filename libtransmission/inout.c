@@ -22,6 +22,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+ #include <sys/sendfile.h>
+#endif
+#if defined( HAVE_SYS_SENDFILE_H ) && defined( HAVE_MINCORE )
+ #include <sys/mman.h> /* mmap(), mincore() */
+#endif
+
+#include <event2/buffer.h> /* struct evbuffer_iovec */
 
 #include <openssl/sha.h>
 
@@ -34,6 +42,7 @@
 #include "platform.h"
 #include "stats.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_amInEventThread() */
 #include "utils.h"
 
 /****
@@ -57,34 +66,28 @@ enum { TR_IO_READ, TR_IO_PREFETCH,
        TR_IO_WRITE
 };
 
-/* returns 0 on success, or an errno on failure */
-static int
-readOrWriteBytes( tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen )
+enum
 {
-    const tr_info * info = &tor->info;
-    const tr_file * file = &info->files[fileIndex];
+    /* readOrWritePiece() only goes to the heap for more vectors than this */
+    IO_STACK_IOVECS = 64
+};
 
-    int             fd = -1;
-    int             err = 0;
+/* find the file's fd in the fd cache, or open it if it's not there,
+ * and pin it so that it can be used without holding the file lock.
+ * the caller must hold the file lock, and release the file when done.
+ * returns 0 on success, or an errno on failure */
+static int
+getFileForIo( tr_session             * session,
+              tr_torrent             * tor,
+              int                      ioMode,
+              tr_file_index_t          fileIndex,
+              struct tr_cached_file ** setme_file,
+              int                    * setme_fd )
+{
+    const tr_file * file = &tor->info.files[fileIndex];
     const tr_bool doWrite = ioMode >= TR_IO_WRITE;
-
-//if( doWrite )
-//    fprintf( stderr, "in file %s at offset %zu, writing %zu bytes; file length is %zu\n", file->name, (size_t)fileOffset, buflen, (size_t)file->length );
-
-    assert( fileIndex < info->fileCount );
-    assert( !file->length || ( fileOffset < file->length ) );
-    assert( fileOffset + buflen <= file->length );
-
-    if( !file->length )
-        return 0;
-
-    fd = tr_fdFileGetCached( session, tr_torrentId( tor ), fileIndex, doWrite );
+    int err = 0;
+    int fd = tr_fdFileGetCached( session, tr_torrentId( tor ), fileIndex, doWrite );
 
     if( fd < 0 )
     {
@@ -136,22 +139,59 @@ readOrWriteBytes( tr_session       * session,
         tr_free( subpath );
     }
 
-    /* check that the file corresponding to 'fd' still exists */
-    if( fd >= 0 )
-    {
-        struct stat sb;
+    *setme_file = err ? NULL : tr_fdFilePin( session, tor->uniqueId, fileIndex, &fd );
+    *setme_fd = fd;
+    return err;
+}
 
-        if( !fstat( fd, &sb ) && sb.st_nlink < 1 )
-        {
-            tr_torrentSetLocalError( tor, "Please Verify Local Data! A file disappeared: \"%s\"", file->name );
-            err = ENOENT;
-        }
-    }
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWriteBytes( tr_session       * session,
+                  tr_torrent       * tor,
+                  int                ioMode,
+                  tr_file_index_t    fileIndex,
+                  uint64_t           fileOffset,
+                  const struct evbuffer_iovec * vec,
+                  int                vecCount,
+                  size_t             buflen )
+{
+    const tr_info * info = &tor->info;
+    const tr_file * file = &info->files[fileIndex];
+
+    int             fd = -1;
+    int             err = 0;
+    struct tr_cached_file * cached = NULL;
+
+//if( ioMode >= TR_IO_WRITE )
+//    fprintf( stderr, "in file %s at offset %zu, writing %zu bytes; file length is %zu\n", file->name, (size_t)fileOffset, buflen, (size_t)file->length );
+
+    assert( fileIndex < info->fileCount );
+    assert( !file->length || ( fileOffset < file->length ) );
+    assert( fileOffset + buflen <= file->length );
+
+    if( !file->length )
+        return 0;
+
+    /* only hold the file lock while looking up the file. the pin
+     * keeps it open while we read or write without the lock */
+    tr_fdFileLock( session );
+    err = getFileForIo( session, tor, ioMode, fileIndex, &cached, &fd );
+    tr_fdFileUnlock( session );
+
+    /* deleted files are caught by tr_torrentCheckFiles() */
 
     if( !err )
     {
         if( ioMode == TR_IO_READ ) {
-            const int rc = tr_pread( fd, buf, buflen, fileOffset );
+            int rc;
+            assert( vecCount == 1 );
+            /* seeds' files don't change, so they can be read through a mapping */
+            if( session->isMmapEnabled && tr_torrentIsSeed( tor )
+                && !tr_fdFileMapRead( session, cached, file->length,
+                                      fileOffset, vec[0].iov_base, buflen ) )
+                rc = 0;
+            else
+                rc = tr_pread( fd, vec[0].iov_base, buflen, fileOffset );
             if( rc < 0 ) {
                 err = errno;
                 tr_torerr( tor, "read failed for \"%s\": %s",
@@ -165,7 +205,8 @@ readOrWriteBytes( tr_session       * session,
                            file->name, tr_strerror( errno ) );
             }
         } else if( ioMode == TR_IO_WRITE ) {
-            const int rc = tr_pwrite( fd, buf, buflen, fileOffset );
+            const ssize_t rc = vecCount == 1 ? tr_pwrite( fd, vec[0].iov_base, buflen, fileOffset )
+                                             : tr_pwritev( fd, vec, vecCount, fileOffset );
             if( rc < 0 ) {
                 err = errno;
                 tr_torerr( tor, "write failed for \"%s\": %s",
@@ -176,6 +217,9 @@ readOrWriteBytes( tr_session       * session,
         }
     }
 
+    if( cached != NULL )
+        tr_fdFileRelease( session, cached );
+
     return err;
 }
 
@@ -223,35 +267,62 @@ readOrWritePiece( tr_torrent       * tor,
                   int                ioMode,
                   tr_piece_index_t   pieceIndex,
                   uint32_t           pieceOffset,
-                  uint8_t          * buf,
+                  const struct evbuffer_iovec * vec,
+                  int                vecCount,
                   size_t             buflen )
 {
     int             err = 0;
     tr_file_index_t fileIndex;
     uint64_t        fileOffset;
     const tr_info * info = &tor->info;
+    int             vecIndex = 0;
+    size_t          vecSkip = 0; /* how much of vec[vecIndex] has been used */
+    struct evbuffer_iovec passBuf[IO_STACK_IOVECS];
+    struct evbuffer_iovec * pass;
 
     if( pieceIndex >= tor->info.pieceCount )
         return EINVAL;
     //if( pieceOffset + buflen > tr_torPieceCountBytes( tor, pieceIndex ) )
     //    return EINVAL;
 
+    /* a whole run of blocks still fits on the stack */
+    pass = vecCount <= IO_STACK_IOVECS ? passBuf
+                                       : tr_new( struct evbuffer_iovec, vecCount );
+
     tr_ioFindFileLocation( tor, pieceIndex, pieceOffset,
                            &fileIndex, &fileOffset );
 
     while( buflen && !err )
     {
+        int n = 0;
         const tr_file * file = &info->files[fileIndex];
         const uint64_t bytesThisPass = MIN( buflen, file->length - fileOffset );
+        uint64_t left = bytesThisPass;
+
+        /* gather the parts of the vectors that land in this file */
+        while( left > 0 )
+        {
+            const size_t len = MIN( left, vec[vecIndex].iov_len - vecSkip );
+            pass[n].iov_base = vec[vecIndex].iov_base ? (char*)vec[vecIndex].iov_base + vecSkip : NULL;
+            pass[n].iov_len = len;
+            ++n;
+            left -= len;
+            vecSkip += len;
+            if( vecSkip == vec[vecIndex].iov_len ) {
+                ++vecIndex;
+                vecSkip = 0;
+            }
+        }
 
-        err = readOrWriteBytes( tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass );
-        buf += bytesThisPass;
+        err = readOrWriteBytes( tor->session, tor, ioMode, fileIndex, fileOffset, pass, n, bytesThisPass );
         buflen -= bytesThisPass;
 //fprintf( stderr, "++fileIndex to %d\n", (int)fileIndex );
         ++fileIndex;
         fileOffset = 0;
 
-        if( ( err != 0 ) && (ioMode == TR_IO_WRITE ) && ( tor->error != TR_STAT_LOCAL_ERROR ) )
+        /* the disk I/O threads leave this to their done callbacks */
+        if( ( err != 0 ) && (ioMode == TR_IO_WRITE ) && ( tor->error != TR_STAT_LOCAL_ERROR )
+                         && tr_amInEventThread( tor->session ) )
         {
             char * path = tr_buildPath( tor->downloadDir, file->name, NULL );
             tr_torrentSetLocalError( tor, "%s (%s)", tr_strerror( err ), path );
@@ -259,6 +330,8 @@ readOrWritePiece( tr_torrent       * tor,
         }
     }
 
+    if( pass != passBuf )
+        tr_free( pass );
     return err;
 }
 
@@ -269,7 +342,10 @@ tr_ioRead( tr_torrent       * tor,
            uint32_t           len,
            uint8_t          * buf )
 {
-    return readOrWritePiece( tor, TR_IO_READ, pieceIndex, begin, buf, len );
+    struct evbuffer_iovec vec;
+    vec.iov_base = buf;
+    vec.iov_len = len;
+    return readOrWritePiece( tor, TR_IO_READ, pieceIndex, begin, &vec, 1, len );
 }
 
 int
@@ -278,72 +354,173 @@ tr_ioPrefetch( tr_torrent       * tor,
                uint32_t           begin,
                uint32_t           len)
 {
-    return readOrWritePiece( tor, TR_IO_PREFETCH, pieceIndex, begin,
-                             NULL, len );
+    struct evbuffer_iovec vec;
+    vec.iov_base = NULL;
+    vec.iov_len = len;
+    return readOrWritePiece( tor, TR_IO_PREFETCH, pieceIndex, begin, &vec, 1, len );
 }
 
-int
-tr_ioWrite( tr_torrent       * tor,
-            tr_piece_index_t   pieceIndex,
-            uint32_t           begin,
-            uint32_t           len,
-            const uint8_t    * buf )
+#if defined( HAVE_SYS_SENDFILE_H ) && defined( HAVE_MINCORE )
+/* true if all of the file's bytes in [offset...offset+len) are in the OS cache */
+static tr_bool
+isFileRangeResident( int fd, uint64_t offset, uint32_t len )
 {
-    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin,
-                             (uint8_t*)buf,
-                             len );
-}
+    void * base;
+    tr_bool resident = FALSE;
+    const uint64_t pageSize = getpagesize( );
+    const uint64_t start = offset - ( offset % pageSize );
+    const size_t mapLen = offset + len - start;
+    const size_t pageCount = ( mapLen + pageSize - 1 ) / pageSize;
+    unsigned char vec[MAX_BLOCK_SIZE / 4096 + 2];
+
+    if( pageCount > sizeof( vec ) )
+        return FALSE;
+
+    /* mapping the range doesn't read it; mincore() just looks at the pages */
+    base = mmap( NULL, mapLen, PROT_READ, MAP_SHARED, fd, (off_t)start );
+    if( base != MAP_FAILED )
+    {
+        size_t i;
 
-/****
-*****
-****/
+        if( !mincore( base, mapLen, (void*)vec ) )
+            for( i=0, resident=TRUE; resident && i<pageCount; ++i )
+                resident = ( vec[i] & 1 ) != 0;
 
-static tr_bool
-recalculateHash( tr_torrent       * tor,
+        munmap( base, mapLen );
+    }
+
+    return resident;
+}
+#endif
+
+tr_bool
+tr_ioIsResident( tr_torrent       * tor,
                  tr_piece_index_t   pieceIndex,
-                 uint8_t          * setme )
+                 uint32_t           begin,
+                 uint32_t           len )
 {
-    size_t   bytesLeft;
-    uint32_t offset = 0;
-    tr_bool  success = TRUE;
-    const size_t buflen = tor->blockSize;
-    void * buffer = tr_valloc( buflen );
-    SHA_CTX  sha;
+#if defined( HAVE_SYS_SENDFILE_H ) && defined( HAVE_MINCORE )
+    tr_bool resident = TRUE;
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
 
-    assert( tor != NULL );
-    assert( pieceIndex < tor->info.pieceCount );
-    assert( buffer != NULL );
-    assert( buflen > 0 );
-    assert( setme != NULL );
+    tr_ioFindFileLocation( tor, pieceIndex, begin, &fileIndex, &fileOffset );
 
-    SHA1_Init( &sha );
-    bytesLeft = tr_torPieceCountBytes( tor, pieceIndex );
+    while( resident && ( len > 0 ) )
+    {
+        const tr_file * file = &tor->info.files[fileIndex];
+        const uint32_t n = MIN( len, file->length - fileOffset );
 
-    tr_ioPrefetch( tor, pieceIndex, offset, bytesLeft );
+        if( n > 0 )
+        {
+            int fd = -1;
+            struct tr_cached_file * cached;
+            int err;
+
+            tr_fdFileLock( tor->session );
+            err = getFileForIo( tor->session, tor, TR_IO_READ, fileIndex, &cached, &fd );
+            tr_fdFileUnlock( tor->session );
+
+            if( err )
+                resident = FALSE;
+            else {
+                resident = isFileRangeResident( fd, fileOffset, n );
+                tr_fdFileRelease( tor->session, cached );
+            }
+        }
 
-    while( bytesLeft )
-    {
-        const int len = MIN( bytesLeft, buflen );
-        success = !tr_cacheReadBlock( tor->session->cache, tor, pieceIndex, offset, len, buffer );
-        if( !success )
-            break;
-        SHA1_Update( &sha, buffer, len );
-        offset += len;
-        bytesLeft -= len;
+        len -= n;
+        ++fileIndex;
+        fileOffset = 0;
     }
 
-    if( success )
-        SHA1_Final( setme, &sha );
+    return resident;
+#else
+    /* without mincore() there's no telling, so assume the worst */
+    (void) tor; (void) pieceIndex; (void) begin; (void) len;
+    return FALSE;
+#endif
+}
+
+ssize_t
+tr_ioSendfile( tr_torrent       * tor,
+               tr_piece_index_t   pieceIndex,
+               uint32_t           begin,
+               uint32_t           len,
+               int                socket )
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    int err;
+    int fd = -1;
+    ssize_t n = -1;
+    struct tr_cached_file * cached;
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
+    const tr_file * file;
+
+    tr_ioFindFileLocation( tor, pieceIndex, begin, &fileIndex, &fileOffset );
+    file = &tor->info.files[fileIndex];
+    len = MIN( len, file->length - fileOffset );
+
+    tr_fdFileLock( tor->session );
+    err = getFileForIo( tor->session, tor, TR_IO_READ, fileIndex, &cached, &fd );
+    tr_fdFileUnlock( tor->session );
+
+    if( err )
+        errno = err;
+    else {
+        off_t offset = fileOffset;
+        n = sendfile( socket, fd, &offset, len );
+        err = errno;
+        tr_fdFileRelease( tor->session, cached );
+        errno = err;
+    }
 
-    tr_free( buffer );
-    return success;
+    return n;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
+int
+tr_ioWrite( tr_torrent       * tor,
+            tr_piece_index_t   pieceIndex,
+            uint32_t           begin,
+            uint32_t           len,
+            const uint8_t    * buf )
+{
+    struct evbuffer_iovec vec;
+    vec.iov_base = (uint8_t*)buf;
+    vec.iov_len = len;
+    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin, &vec, 1, len );
+}
+
+int
+tr_ioWritev( tr_torrent                  * tor,
+             tr_piece_index_t              pieceIndex,
+             uint32_t                      begin,
+             const struct evbuffer_iovec * vec,
+             int                           vecCount )
+{
+    int i;
+    size_t len = 0;
+
+    for( i=0; i<vecCount; ++i )
+        len += vec[i].iov_len;
+
+    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin, vec, vecCount, len );
+}
+
+/****
+*****
+****/
+
 tr_bool
 tr_ioTestPiece( tr_torrent * tor, tr_piece_index_t piece )
 {
     uint8_t hash[SHA_DIGEST_LENGTH];
 
-    return recalculateHash( tor, piece, hash )
+    return !tr_cacheHashPiece( tor->session->cache, tor, piece, hash )
            && !memcmp( hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH );
 }
@@ -17,6 +17,7 @@
 #ifndef TR_IO_H
 #define TR_IO_H 1
 
+struct evbuffer_iovec;
 struct tr_torrent;
 
 /**
@@ -40,6 +41,30 @@ tr_ioPrefetch( tr_torrent       * tor,
                uint32_t           begin,
                uint32_t           len );
 
+/**
+ * Returns true if the bytes are already in the OS's page cache,
+ * so that tr_ioSendfile() can send them without waiting on the disk.
+ * Always false where that can't be checked with mincore().
+ */
+tr_bool tr_ioIsResident( struct tr_torrent  * tor,
+                         tr_piece_index_t     pieceIndex,
+                         uint32_t             begin,
+                         uint32_t             len );
+
+/**
+ * Sends part of a block straight from its file to a socket with sendfile(),
+ * stopping at the end of the file that holds `begin'. This blocks the
+ * caller if the data has to come from the disk rather than the OS cache,
+ * so check tr_ioIsResident() first.
+ * @return the number of bytes sent, or -1 and sets errno on failure.
+ *         errno is ENOSYS if the platform doesn't support sendfile().
+ */
+ssize_t tr_ioSendfile( struct tr_torrent  * tor,
+                       tr_piece_index_t     pieceIndex,
+                       uint32_t             begin,
+                       uint32_t             len,
+                       int                  socket );
+
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -50,6 +75,17 @@ int tr_ioWrite( struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme );
 
+/**
+ * Like tr_ioWrite(), but gathers the data from several buffers,
+ * such as the chains of an evbuffer, without copying it first.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWritev( struct tr_torrent            * tor,
+                 tr_piece_index_t               pieceIndex,
+                 uint32_t                       offset,
+                 const struct evbuffer_iovec  * vec,
+                 int                            vecCount );
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -168,6 +168,8 @@ tr_metaInfoBuilderCreate( const char * topFile )
     if( ret->totalSize % ret->pieceSize )
         ++ret->pieceCount;
 
+    ret->hashThreads = 1;
+
     return ret;
 }
 
@@ -195,21 +197,166 @@ tr_metaInfoBuilderFree( tr_metainfo_builder * builder )
 *****
 ****/
 
+/* The builder's thread reads the pieces and a pool of workers hashes
+ * them. Piece buffers go around a ring: the reader takes a free one,
+ * fills it, and queues it; a worker hashes it into its place in the
+ * result array and frees it again. */
+struct hash_slot
+{
+    uint8_t * buf;
+    uint32_t length;
+    uint32_t pieceIndex;
+};
+
+struct hash_pool
+{
+    tr_metainfo_builder * b;
+    uint8_t * hashes;
+    int workerCount;
+
+    struct hash_slot * slots;
+    int slotCount;
+
+    tr_lock * lock;
+    tr_sem * freeCount;  /* how many slots are in `free' */
+    tr_sem * readyCount; /* how many slots are in `ready' */
+    tr_sem * exitCount;  /* how many workers have finished */
+
+    struct hash_slot ** free;
+    int freeSize;
+
+    /* FIFO of slots waiting to be hashed. NULL tells a worker to exit */
+    struct hash_slot ** ready;
+    int readyBegin;
+    int readySize;
+    int readyMax;
+};
+
+static void
+hashWorkerFunc( void * vpool )
+{
+    struct hash_pool * pool = vpool;
+
+    for( ;; )
+    {
+        struct hash_slot * slot;
+
+        tr_semWait( pool->readyCount );
+        tr_lockLock( pool->lock );
+        slot = pool->ready[pool->readyBegin];
+        pool->readyBegin = ( pool->readyBegin + 1 ) % pool->readyMax;
+        --pool->readySize;
+        tr_lockUnlock( pool->lock );
+
+        if( slot == NULL )
+            break;
+
+        tr_sha1( pool->hashes + SHA_DIGEST_LENGTH * slot->pieceIndex,
+                 slot->buf, slot->length, NULL );
+
+        tr_lockLock( pool->lock );
+        pool->free[pool->freeSize++] = slot;
+        ++pool->b->pieceIndex;
+        tr_lockUnlock( pool->lock );
+        tr_semPost( pool->freeCount );
+    }
+
+    tr_semPost( pool->exitCount );
+}
+
+static void
+hashPoolInit( struct hash_pool * pool, tr_metainfo_builder * b, uint8_t * hashes )
+{
+    int i;
+
+    pool->b = b;
+    pool->hashes = hashes;
+    pool->workerCount = MAX( 1, b->hashThreads );
+
+    /* enough buffers to keep every worker busy while the next piece is read */
+    pool->slotCount = pool->workerCount + 2;
+    pool->slots = tr_new0( struct hash_slot, pool->slotCount );
+    pool->free = tr_new( struct hash_slot*, pool->slotCount );
+    pool->freeSize = 0;
+    pool->readyMax = pool->slotCount + pool->workerCount;
+    pool->ready = tr_new( struct hash_slot*, pool->readyMax );
+    pool->readyBegin = pool->readySize = 0;
+
+    pool->lock = tr_lockNew( );
+    pool->freeCount = tr_semNew( );
+    pool->readyCount = tr_semNew( );
+    pool->exitCount = tr_semNew( );
+
+    for( i=0; i<pool->slotCount; ++i ) {
+        pool->slots[i].buf = tr_valloc( b->pieceSize );
+        pool->free[pool->freeSize++] = &pool->slots[i];
+        tr_semPost( pool->freeCount );
+    }
+
+    for( i=0; i<pool->workerCount; ++i )
+        tr_threadNew( hashWorkerFunc, pool );
+}
+
+static void
+hashPoolPush( struct hash_pool * pool, struct hash_slot * slot )
+{
+    tr_lockLock( pool->lock );
+    pool->ready[( pool->readyBegin + pool->readySize ) % pool->readyMax] = slot;
+    ++pool->readySize;
+    tr_lockUnlock( pool->lock );
+    tr_semPost( pool->readyCount );
+}
+
+static struct hash_slot *
+hashPoolGetFree( struct hash_pool * pool )
+{
+    struct hash_slot * slot;
+
+    tr_semWait( pool->freeCount );
+    tr_lockLock( pool->lock );
+    slot = pool->free[--pool->freeSize];
+    tr_lockUnlock( pool->lock );
+
+    return slot;
+}
+
+/* let the workers finish the queued pieces, then tear the pool down */
+static void
+hashPoolFree( struct hash_pool * pool )
+{
+    int i;
+
+    for( i=0; i<pool->workerCount; ++i )
+        hashPoolPush( pool, NULL );
+    for( i=0; i<pool->workerCount; ++i )
+        tr_semWait( pool->exitCount );
+
+    for( i=0; i<pool->slotCount; ++i )
+        tr_free( pool->slots[i].buf );
+    tr_free( pool->slots );
+    tr_free( pool->free );
+    tr_free( pool->ready );
+    tr_semFree( pool->exitCount );
+    tr_semFree( pool->readyCount );
+    tr_semFree( pool->freeCount );
+    tr_lockFree( pool->lock );
+}
+
 static uint8_t*
 getHashInfo( tr_metainfo_builder * b )
 {
     uint32_t fileIndex = 0;
     uint8_t *ret = tr_new0( uint8_t, SHA_DIGEST_LENGTH * b->pieceCount );
-    uint8_t *walk = ret;
-    uint8_t *buf = NULL;
     uint64_t totalRemain;
     uint64_t off = 0;
+    uint32_t pieceIndex;
+    tr_bool failed = FALSE;
+    struct hash_pool pool;
     int fd = -1;
 
     if( !b->totalSize )
         return ret;
 
-    buf = tr_valloc( b->pieceSize );
     b->pieceIndex = 0;
     totalRemain = b->totalSize;
     fd = tr_open_file_for_scanning( b->files[fileIndex].filename );
@@ -218,22 +365,27 @@ getHashInfo( tr_metainfo_builder * b )
         b->my_errno = errno;
         goto FAILED;
     }
-    while( totalRemain )
+
+    hashPoolInit( &pool, b, ret );
+
+    for( pieceIndex=0; totalRemain && !failed; ++pieceIndex )
     {
-        uint8_t * bufptr = buf;
+        struct hash_slot * slot = hashPoolGetFree( &pool );
+        uint8_t * bufptr = slot->buf;
         const uint32_t thisPieceSize = (uint32_t) MIN( b->pieceSize, totalRemain );
         uint32_t leftInPiece = thisPieceSize;
 
-        assert( b->pieceIndex < b->pieceCount );
+        assert( pieceIndex < b->pieceCount );
 
-        while( leftInPiece )
+        while( leftInPiece && !failed )
         {
             const size_t n_this_pass = (size_t) MIN( ( b->files[fileIndex].size - off ), leftInPiece );
             ssize_t n_read = read( fd, bufptr, n_this_pass );
             if( n_read == -1 )
             {
                 b->my_errno = errno;
-                goto FAILED;
+                failed = TRUE;
+                break;
             }
             /* NB: Assume a short read does not occur. */
             bufptr += n_this_pass;
@@ -250,16 +402,20 @@ getHashInfo( tr_metainfo_builder * b )
                     if( fd < 0 )
                     {
                         b->my_errno = errno;
-                        goto FAILED;
+                        failed = TRUE;
                     }
                 }
             }
         }
 
-        assert( bufptr - buf == (int)thisPieceSize );
+        if( failed )
+            break;
+
+        assert( bufptr - slot->buf == (int)thisPieceSize );
         assert( leftInPiece == 0 );
-        tr_sha1( walk, buf, thisPieceSize, NULL );
-        walk += SHA_DIGEST_LENGTH;
+        slot->length = thisPieceSize;
+        slot->pieceIndex = pieceIndex;
+        hashPoolPush( &pool, slot );
 
         if( b->abortFlag )
         {
@@ -268,27 +424,28 @@ getHashInfo( tr_metainfo_builder * b )
         }
 
         totalRemain -= thisPieceSize;
-        ++b->pieceIndex;
     }
 
-    assert( b->abortFlag
-          || ( walk - ret == (int)( SHA_DIGEST_LENGTH * b->pieceCount ) ) );
+    hashPoolFree( &pool );
+
+    if( failed )
+        goto FAILED;
+
+    assert( b->abortFlag || ( b->pieceIndex == b->pieceCount ) );
     assert( b->abortFlag || !totalRemain );
 
     if( fd >= 0 )
         tr_close_file( fd );
 
-    tr_free( buf );
     return ret;
 
 FAILED:
     if( fd >= 0 )
         tr_close_file( fd );
     tr_strlcpy( b->errfile,
-                b->files[fileIndex].filename,
+                b->files[MIN( fileIndex, b->fileCount - 1 )].filename,
                 sizeof( b->errfile ) );
     b->result = TR_MAKEMETA_IO_READ;
-    tr_free( buf );
     tr_free( ret );
     return NULL;
 }
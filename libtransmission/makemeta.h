@@ -50,6 +50,10 @@ typedef struct tr_metainfo_builder
     uint32_t                    pieceCount;
     int                         isSingleFile;
 
+    /* how many threads hash the pieces. this defaults to 1,
+     * and may be changed before calling tr_makeMetaInfo() */
+    int                         hashThreads;
+
     /**
     ***  These are set inside tr_makeMetaInfo()
     ***  by copying the arguments passed to it,
@@ -255,8 +255,13 @@ tr_convertAnnounceToScrape( const char * announce )
      * If the text immediately following that '/' isn't 'announce'
      * it will be taken as a sign that that tracker doesn't support
      * the scrape convention. If it does, substitute 'scrape' for
-     * 'announce' to find the scrape page. */
-    if( ( ( s = strrchr( announce, '/' ) ) ) && !strncmp( ++s, "announce", 8 ) )
+     * 'announce' to find the scrape page.
+     * UDP trackers (BEP 15) scrape at the same address they announce to. */
+    if( !strncmp( announce, "udp://", 6 ) )
+    {
+        scrape = tr_strdup( announce );
+    }
+    else if( ( ( s = strrchr( announce, '/' ) ) ) && !strncmp( ++s, "announce", 8 ) )
     {
         const char * prefix = announce;
         const size_t prefix_len = s - announce;
@@ -32,17 +32,20 @@ struct tr_bitfield;
 
 enum
 {
-    /** when we're making requests from another peer,
-        batch them together to send enough requests to
-        meet our bandwidth goals for the next N seconds */
-    REQUEST_BUF_SECS = 10,
-
     /** this is the maximum size of a block request.
         most bittorrent clients will reject requests
         larger than this size. */
     MAX_BLOCK_SIZE = ( 1024 * 16 )
 };
 
+/** @brief a block request from a peer */
+struct peer_request
+{
+    uint32_t    index;
+    uint32_t    offset;
+    uint32_t    length;
+};
+
 /**
 ***  Peer Publish / Subscribe
 **/
@@ -31,6 +31,7 @@
 #include "session.h"
 #include "bandwidth.h"
 #include "crypto.h"
+#include "inout.h" /* tr_ioSendfile() */
 #include "list.h"
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
@@ -92,6 +93,23 @@ struct tr_datatype
     size_t   length;
 };
 
+/* piece data that gets sent straight from its file with sendfile().
+ * it's queued behind `prefix' bytes of the outbuf. */
+struct tr_file_segment
+{
+    size_t            prefix;
+    int               torrentId;
+    tr_piece_index_t  piece;
+    uint32_t          offset;
+    uint32_t          length;
+};
+
+static size_t
+getOutputLength( const tr_peerIo * io )
+{
+    return evbuffer_get_length( io->outbuf ) + io->outbuf_segment_bytes;
+}
+
 
 /***
 ****
@@ -235,9 +253,11 @@ event_read_cb( int fd, short event UNUSED, void * vio )
 
     dbgmsg( io, "libevent says this peer is ready to read" );
 
-    /* if we don't have any bandwidth left, stop reading */
+    /* if we don't have any bandwidth left, stop reading
+     * and wait for our next turn once the bucket refills */
     if( howmuch < 1 ) {
         tr_peerIoSetEnabled( io, dir, FALSE );
+        tr_bandwidthActivate( &io->bandwidth, dir );
         return;
     }
 
@@ -275,15 +295,78 @@ event_read_cb( int fd, short event UNUSED, void * vio )
     }
 }
 
+static int
+writeSegment( tr_peerIo * io, int fd, struct tr_file_segment * seg, size_t howmuch )
+{
+    int n;
+    tr_torrent * tor = tr_torrentFindFromId( io->session, seg->torrentId );
+
+    if( tor == NULL ) {
+        EVUTIL_SET_SOCKET_ERROR( EIO );
+        return -1;
+    }
+
+    n = tr_ioSendfile( tor, seg->piece, seg->offset, MIN( howmuch, seg->length ), fd );
+
+    if( n > 0 )
+    {
+        seg->offset += n;
+        seg->length -= n;
+        io->outbuf_segment_bytes -= n;
+
+        if( !seg->length ) {
+            tr_list_pop_front( &io->outbuf_segments );
+            tr_free( seg );
+        }
+    }
+
+    return n;
+}
+
 static int
 tr_evbuffer_write( tr_peerIo * io, int fd, size_t howmuch )
 {
     int e;
-    int n;
+    int n = 0;
     char errstr[256];
 
     EVUTIL_SET_SOCKET_ERROR( 0 );
-    n = evbuffer_write_atmost( io->outbuf, fd, howmuch );
+
+    while( howmuch > 0 )
+    {
+        int res;
+        size_t want = howmuch;
+        struct tr_file_segment * seg = io->outbuf_segments ? io->outbuf_segments->data : NULL;
+
+        if( seg == NULL )
+        {
+            res = evbuffer_write_atmost( io->outbuf, fd, want );
+        }
+        else if( seg->prefix > 0 )
+        {
+            want = MIN( want, seg->prefix );
+            if(( res = evbuffer_write_atmost( io->outbuf, fd, want )) > 0 )
+                seg->prefix -= res;
+        }
+        else
+        {
+            want = MIN( want, seg->length );
+            res = writeSegment( io, fd, seg, want );
+        }
+
+        if( res <= 0 ) {
+            if( n == 0 )
+                n = res;
+            break;
+        }
+
+        n += res;
+        howmuch -= res;
+
+        if( (size_t)res < want ) /* the socket is full */
+            break;
+    }
+
     e = EVUTIL_SOCKET_ERROR( );
     dbgmsg( io, "wrote %d to peer (%s)", n, (n==-1?tr_net_strerror(errstr,sizeof(errstr),e):"") );
 
@@ -309,11 +392,14 @@ event_write_cb( int fd, short event UNUSED, void * vio )
 
     /* Write as much as possible, since the socket is non-blocking, write() will
      * return if it can't write any more data without blocking */
-    howmuch = tr_bandwidthClamp( &io->bandwidth, dir, evbuffer_get_length( io->outbuf ) );
+    howmuch = tr_bandwidthClamp( &io->bandwidth, dir, getOutputLength( io ) );
 
-    /* if we don't have any bandwidth left, stop writing */
+    /* if we don't have any bandwidth left, stop writing
+     * and wait for our next turn once the bucket refills */
     if( howmuch < 1 ) {
         tr_peerIoSetEnabled( io, dir, FALSE );
+        if( getOutputLength( io ) )
+            tr_bandwidthActivate( &io->bandwidth, dir );
         return;
     }
 
@@ -333,14 +419,14 @@ event_write_cb( int fd, short event UNUSED, void * vio )
     if (res <= 0)
         goto error;
 
-    if( evbuffer_get_length( io->outbuf ) )
+    if( getOutputLength( io ) )
         tr_peerIoSetEnabled( io, dir, TRUE );
 
     didWriteWrapper( io, res );
     return;
 
  reschedule:
-    if( evbuffer_get_length( io->outbuf ) )
+    if( getOutputLength( io ) )
         tr_peerIoSetEnabled( io, dir, TRUE );
     return;
 
@@ -417,6 +503,10 @@ utp_get_rb_size(void *closure)
 
     bytes = tr_bandwidthClamp( &io->bandwidth, TR_DOWN, UTP_READ_BUFFER_SIZE );
 
+    /* libutp won't reopen its window until UTP_RBDrained() */
+    if( bytes < UTP_READ_BUFFER_SIZE )
+        tr_bandwidthActivate( &io->bandwidth, TR_DOWN );
+
     dbgmsg( io, "utp_get_rb_size is saying it's ready to read %zu bytes", bytes );
     return UTP_READ_BUFFER_SIZE - bytes;
 }
@@ -772,6 +862,7 @@ io_dtor( void * vio )
     io_close_socket( io );
     tr_cryptoFree( io->crypto );
     tr_list_free( &io->outbuf_datatypes, tr_free );
+    tr_list_free( &io->outbuf_segments, tr_free );
 
     memset( io, ~0, sizeof( tr_peerIo ) );
     tr_free( io );
@@ -962,7 +1053,7 @@ size_t
 tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now )
 {
     const size_t desiredLen = getDesiredOutputBufferSize( io, now );
-    const size_t currentLen = evbuffer_get_length( io->outbuf );
+    const size_t currentLen = getOutputLength( io );
     size_t freeSpace = 0;
 
     if( desiredLen > currentLen )
@@ -971,6 +1062,12 @@ tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now )
     return freeSpace;
 }
 
+size_t
+tr_peerIoGetWriteBufferLength( const tr_peerIo * io )
+{
+    return getOutputLength( io );
+}
+
 /**
 ***
 **/
@@ -998,18 +1095,8 @@ addDatatype( tr_peerIo * io, size_t byteCount, tr_bool isPieceData )
     d->isPieceData = isPieceData != 0;
     d->length = byteCount;
     tr_list_append( &io->outbuf_datatypes, d );
-}
 
-static struct evbuffer_iovec *
-evbuffer_peek_all( struct evbuffer * buf, size_t * setme_vecCount )
-{
-    const size_t byteCount = evbuffer_get_length( buf );
-    const int vecCount = evbuffer_peek( buf, byteCount, NULL, NULL, 0 );
-    struct evbuffer_iovec * iovec = tr_new0( struct evbuffer_iovec, vecCount );
-    const int n = evbuffer_peek( buf, byteCount, NULL, iovec, vecCount );
-    assert( n == vecCount );
-    *setme_vecCount = n;
-    return iovec;
+    tr_bandwidthActivate( &io->bandwidth, TR_UP );
 }
 
 static void
@@ -1017,13 +1104,22 @@ maybeEncryptBuffer( tr_peerIo * io, struct evbuffer * buf )
 {
     if( io->encryptionMode == PEER_ENCRYPTION_RC4 )
     {
-        size_t i, n;
-        struct evbuffer_iovec * iovec = evbuffer_peek_all( buf, &n );
+        int i;
+        struct evbuffer_iovec stackvec[4];
+        struct evbuffer_iovec * iovec = stackvec;
+        int n = evbuffer_peek( buf, -1, NULL, stackvec, 4 );
+
+        /* protocol message batches usually fit in an arena or two */
+        if( n > 4 ) {
+            iovec = tr_new( struct evbuffer_iovec, n );
+            evbuffer_peek( buf, -1, NULL, iovec, n );
+        }
 
         for( i=0; i<n; ++i )
             tr_cryptoEncrypt( io->crypto, iovec[i].iov_len, iovec[i].iov_base, iovec[i].iov_base );
 
-        tr_free( iovec );
+        if( iovec != stackvec )
+            tr_free( iovec );
     }
 }
 
@@ -1036,6 +1132,44 @@ tr_peerIoWriteBuf( tr_peerIo * io, struct evbuffer * buf, tr_bool isPieceData )
     addDatatype( io, byteCount, isPieceData );
 }
 
+tr_bool
+tr_peerIoSupportsSendfile( const tr_peerIo * io )
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    return ( io->utp_socket == NULL ) && ( io->socket >= 0 ) && !tr_peerIoIsEncrypted( io );
+#else
+    return FALSE;
+#endif
+}
+
+void
+tr_peerIoWriteFileSegment( tr_peerIo        * io,
+                           int                torrentId,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           length )
+{
+    tr_list * l;
+    struct tr_file_segment * seg;
+    size_t prefix = evbuffer_get_length( io->outbuf );
+
+    assert( tr_peerIoSupportsSendfile( io ) );
+
+    /* the outbuf bytes ahead of the earlier segments don't count */
+    for( l=io->outbuf_segments; l!=NULL; l=l->next )
+        prefix -= ((struct tr_file_segment*)l->data)->prefix;
+
+    seg = tr_new( struct tr_file_segment, 1 );
+    seg->prefix = prefix;
+    seg->torrentId = torrentId;
+    seg->piece = piece;
+    seg->offset = offset;
+    seg->length = length;
+    tr_list_append( &io->outbuf_segments, seg );
+    io->outbuf_segment_bytes += length;
+    addDatatype( io, length, TRUE );
+}
+
 void
 tr_peerIoWriteBytes( tr_peerIo * io, const void * bytes, size_t byteCount, tr_bool isPieceData )
 {
@@ -1184,7 +1318,7 @@ static int
 tr_peerIoTryWrite( tr_peerIo * io, size_t howmuch )
 {
     int n = 0;
-    const size_t old_len = evbuffer_get_length( io->outbuf );
+    const size_t old_len = getOutputLength( io );
     dbgmsg( io, "in tr_peerIoTryWrite %zu", howmuch );
 
     if( howmuch > old_len )
@@ -1242,24 +1376,3 @@ tr_peerIoFlush( tr_peerIo  * io, tr_direction dir, size_t limit )
     dbgmsg( io, "flushing peer-io, direction %d, limit %zu, bytesUsed %d", (int)dir, limit, bytesUsed );
     return bytesUsed;
 }
-
-int
-tr_peerIoFlushOutgoingProtocolMsgs( tr_peerIo * io )
-{
-    size_t byteCount = 0;
-    tr_list * it;
-
-    /* count up how many bytes are used by non-piece-data messages
-       at the front of our outbound queue */
-    for( it=io->outbuf_datatypes; it!=NULL; it=it->next )
-    {
-        struct tr_datatype * d = it->data;
-
-        if( d->isPieceData )
-            break;
-
-        byteCount += d->length;
-    }
-
-    return tr_peerIoFlush( io, TR_UP, byteCount );
-}
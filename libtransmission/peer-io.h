@@ -73,8 +73,6 @@ typedef struct tr_peerIo
     tr_bool               dhtSupported;
     tr_bool               utpSupported;
 
-    tr_priority_t         priority;
-
     short int             pendingEvents;
 
     int                   magicNumber;
@@ -106,6 +104,8 @@ typedef struct tr_peerIo
     struct evbuffer     * inbuf;
     struct evbuffer     * outbuf;
     struct tr_list      * outbuf_datatypes; /* struct tr_datatype */
+    struct tr_list      * outbuf_segments; /* struct tr_file_segment */
+    size_t                outbuf_segment_bytes;
 
     struct event        * event_read;
     struct event        * event_write;
@@ -263,6 +263,20 @@ void    tr_peerIoWriteBuf       ( tr_peerIo         * io,
                                   struct evbuffer   * buf,
                                   tr_bool             isPieceData );
 
+/** @brief true if piece data can be sent to this peer with sendfile() */
+tr_bool tr_peerIoSupportsSendfile( const tr_peerIo  * io );
+
+/**
+ * Queue piece data to be sent straight from the torrent's files
+ * when the socket's ready, instead of being copied into the outbuf.
+ * @see tr_peerIoSupportsSendfile()
+ */
+void    tr_peerIoWriteFileSegment( tr_peerIo        * io,
+                                   int                torrentId,
+                                   tr_piece_index_t   piece,
+                                   uint32_t           offset,
+                                   uint32_t           length );
+
 /**
 ***
 **/
@@ -322,6 +336,9 @@ void      tr_peerIoDrain( tr_peerIo        * io,
 
 size_t    tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now );
 
+/** @brief how many bytes are queued to be written, including file segments */
+size_t    tr_peerIoGetWriteBufferLength( const tr_peerIo * io );
+
 static inline void tr_peerIoSetParent( tr_peerIo            * io,
                                           struct tr_bandwidth  * parent )
 {
@@ -364,8 +381,6 @@ int       tr_peerIoFlush( tr_peerIo     * io,
                           tr_direction    dir,
                           size_t          byteLimit );
 
-int       tr_peerIoFlushOutgoingProtocolMsgs( tr_peerIo * io );
-
 /**
 ***
 **/
@@ -33,6 +33,7 @@
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
+#include "picker.h"
 #include "ptrarray.h"
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
@@ -52,7 +53,8 @@ enum
        for this many calls to rechokeUploads(). */
     OPTIMISTIC_UNCHOKE_MULTIPLIER = 4,
 
-    /* how frequently to reallocate bandwidth */
+    /* how frequently to resize the bandwidth turns.
+       the token buckets refill and wake up peers on their own */
     BANDWIDTH_PERIOD_MSEC = 500,
 
     /* how frequently to age out old piece request lists */
@@ -96,7 +98,13 @@ enum
 
     NO_BLOCKS_CANCEL_HISTORY = 120,
 
-    CANCEL_HISTORY_SEC = 60
+    CANCEL_HISTORY_SEC = 60,
+
+    /* how many peer_atoms to allocate at a time */
+    ATOM_SLAB_SIZE = 16,
+
+    /* the smallest a torrent's atom index gets */
+    ATOM_BUCKETS_MIN = 64
 };
 
 const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, FALSE, 0 };
@@ -145,6 +153,37 @@ struct peer_atom
     time_t      shelf_date;
     tr_peer   * peer;               /* will be NULL if not connected */
     tr_address  addr;
+
+    /* the next atom in the same Torrent::atomBuckets chain,
+       or in tr_peerMgr::freeAtoms if this atom isn't in use */
+    struct peer_atom * hashNext;
+
+    /* where this atom is in Torrent::candidates, if anywhere.
+       See candidateAdd() for what the key means in each heap */
+    uint64_t    candidateKey;
+    int         candidatePos;
+    int8_t      candidateHeap;      /* CANDIDATES_READY, _WAITING, or -1 */
+};
+
+enum
+{
+    CANDIDATES_READY,   /* atoms we could connect to now, best first */
+    CANDIDATES_WAITING, /* atoms we can't yet, soonest available first */
+    CANDIDATE_HEAPS
+};
+
+/* a binary heap of peer_atoms, smallest candidateKey first */
+struct candidate_heap
+{
+    struct peer_atom ** atoms;
+    int count;
+    int alloc;
+};
+
+struct atom_slab
+{
+    struct atom_slab * next;
+    struct peer_atom atoms[ATOM_SLAB_SIZE];
 };
 
 #ifdef NDEBUG
@@ -171,6 +210,17 @@ struct block_request
     tr_block_index_t block;
     tr_peer * peer;
     time_t sentAt;
+
+    /* the next request in the same Torrent::requestBuckets chain */
+    struct block_request * hashNext;
+
+    /* the other requests made to the same peer */
+    struct block_request * peerPrev;
+    struct block_request * peerNext;
+
+    /* all of the torrent's requests, oldest first */
+    struct block_request * agePrev;
+    struct block_request * ageNext;
 };
 
 struct weighted_piece
@@ -191,7 +241,15 @@ enum piece_sort_state
 typedef struct tr_torrent_peers
 {
     tr_ptrArray                outgoingHandshakes; /* tr_handshake */
-    tr_ptrArray                pool; /* struct peer_atom */
+    tr_ptrArray                pool; /* struct peer_atom, unsorted */
+    struct peer_atom        ** atomBuckets; /* `pool' indexed by address */
+    size_t                     atomBucketMask;
+
+    /* the atoms in `pool' that we might make outgoing connections to.
+       When dirty, these are rebuilt before they're next used */
+    struct candidate_heap      candidates[CANDIDATE_HEAPS];
+    tr_bool                    candidatesDirty;
+    tr_bool                    candidatesAreForSeed;
     tr_ptrArray                peers; /* tr_peer */
     tr_ptrArray                webseeds; /* tr_webseed */
 
@@ -204,14 +262,22 @@ typedef struct tr_torrent_peers
     tr_bool                    isRunning;
     tr_bool                    needsCompletenessCheck;
 
-    struct block_request     * requests;
+    struct block_request    ** requestBuckets;
+    tr_block_index_t           requestBucketMask;
+    struct block_request     * oldestRequest;
+    struct block_request     * newestRequest;
+    struct block_request     * freeRequests;
     int                        requestCount;
-    int                        requestAlloc;
 
     struct weighted_piece    * pieces;
     int                        pieceCount;
+    int                        pieceAlloc;
     enum piece_sort_state      pieceSortState;
 
+    /* the pieces we want but haven't started yet. When we first
+       request one of their blocks, they move over to `pieces' */
+    tr_picker                  picker;
+
     /* An array of pieceCount items stating how many peers have each piece.
        This is used to help us for downloading pieces "rarest first."
        This may be NULL if we don't have metainfo yet, or if we're not
@@ -219,6 +285,18 @@ typedef struct tr_torrent_peers
     uint16_t                 * pieceReplication;
     size_t                     pieceReplicationSize;
 
+    /* An array of pieceCount items stating how many of the peers'
+       requests to us are for each piece. NULL until a peer asks */
+    uint32_t                 * prefetchDemand;
+    size_t                     prefetchDemandSize;
+
+    /* The pieces that are neither complete nor unwanted, used to keep
+       each peer's interestingCount current. When this is dirty, it and
+       the peers' counts are rebuilt the next time they're needed */
+    tr_bitfield                wantedPieces;
+    tr_piece_index_t           wantedPieceCount;
+    tr_bool                    wantedPiecesDirty;
+
     int                        interestedCount;
     int                        maxPeers;
     time_t                     lastCancel;
@@ -239,6 +317,21 @@ struct tr_peerMgr
     struct event  * rechokeTimer;
     struct event  * refillUpkeepTimer;
     struct event  * atomTimer;
+
+    /* every torrent's peer_atoms are carved out of these slabs */
+    struct atom_slab  * atomSlabs;
+    struct peer_atom  * freeAtoms;
+    size_t              atomSlabCount;
+    size_t              atomCount;
+    uint32_t            atomHashSeed;
+
+    /* the pieces the peers are waiting on, in the order they first asked.
+       Pieces are added as requests come in and handed to the cache by
+       prefetchPulse(); requests that go away leave stale entries behind,
+       which are skipped when they reach the front */
+    struct prefetch_piece * prefetch;
+    int                     prefetchCount;
+    int                     prefetchAlloc;
 };
 
 #define tordbg( t, ... ) \
@@ -314,24 +407,6 @@ getExistingHandshake( tr_ptrArray * handshakes, const tr_address * addr )
     return tr_ptrArrayFindSorted( handshakes, addr, handshakeCompareToAddr );
 }
 
-static int
-comparePeerAtomToAddress( const void * va, const void * vb )
-{
-    const struct peer_atom * a = va;
-
-    return tr_compareAddresses( &a->addr, vb );
-}
-
-static int
-compareAtomsByAddress( const void * va, const void * vb )
-{
-    const struct peer_atom * b = vb;
-
-    assert( tr_isAtom( b ) );
-
-    return comparePeerAtomToAddress( va, &b->addr );
-}
-
 /**
 ***
 **/
@@ -357,13 +432,277 @@ peerCompare( const void * a, const void * b )
     return tr_compareAddresses( tr_peerAddress( a ), tr_peerAddress( b ) );
 }
 
+/***
+****  The atom store.
+****
+****  Trackers and PEX can tell us about tens of thousands of peers, so
+****  the atoms are allocated from session-wide slabs and each torrent
+****  indexes its own with a hash table keyed by address. The hash is
+****  seeded per-session so that a peer list can't be crafted to fill
+****  one chain.
+***/
+
+static struct peer_atom*
+atomNew( tr_peerMgr * mgr )
+{
+    struct peer_atom * atom;
+
+    if( mgr->freeAtoms == NULL )
+    {
+        int i;
+        struct atom_slab * slab = tr_new( struct atom_slab, 1 );
+
+        slab->next = mgr->atomSlabs;
+        mgr->atomSlabs = slab;
+        ++mgr->atomSlabCount;
+
+        for( i=ATOM_SLAB_SIZE-1; i>=0; --i ) {
+            slab->atoms[i].hashNext = mgr->freeAtoms;
+            mgr->freeAtoms = &slab->atoms[i];
+        }
+    }
+
+    atom = mgr->freeAtoms;
+    mgr->freeAtoms = atom->hashNext;
+    ++mgr->atomCount;
+
+    memset( atom, 0, sizeof( struct peer_atom ) );
+    return atom;
+}
+
+static void
+atomFree( tr_peerMgr * mgr, struct peer_atom * atom )
+{
+    assert( mgr->atomCount > 0 );
+
+    atom->hashNext = mgr->freeAtoms;
+    mgr->freeAtoms = atom;
+    --mgr->atomCount;
+}
+
+static void
+atomSlabsFree( tr_peerMgr * mgr )
+{
+    struct atom_slab * slab;
+
+    assert( mgr->atomCount == 0 );
+
+    while(( slab = mgr->atomSlabs )) {
+        mgr->atomSlabs = slab->next;
+        tr_free( slab );
+    }
+
+    mgr->freeAtoms = NULL;
+    mgr->atomSlabCount = 0;
+}
+
+static int
+compareSlabPtrs( const void * va, const void * vb )
+{
+    const struct atom_slab * a = * (const struct atom_slab**) va;
+    const struct atom_slab * b = * (const struct atom_slab**) vb;
+
+    if( a != b )
+        return a < b ? -1 : 1;
+
+    return 0;
+}
+
+static int
+compareAtomToSlab( const void * vatom, const void * vslab )
+{
+    const struct peer_atom * atom = vatom;
+    const struct atom_slab * slab = * (const struct atom_slab**) vslab;
+
+    if( atom < slab->atoms )
+        return -1;
+    if( atom >= slab->atoms + ATOM_SLAB_SIZE )
+        return 1;
+    return 0;
+}
+
+/* give back the slabs that don't have any atoms in use */
+static void
+atomSlabsTrim( tr_peerMgr * mgr )
+{
+    size_t i;
+    struct peer_atom * atom;
+    struct atom_slab * slab;
+    struct atom_slab ** slabs;
+    int * freeCount;
+    const size_t n = mgr->atomSlabCount;
+
+    /* if there isn't a whole slab's worth of free atoms, none are empty */
+    if( mgr->atomCount + ATOM_SLAB_SIZE > n * ATOM_SLAB_SIZE )
+        return;
+
+    /* count the free atoms in each slab */
+    slabs = tr_new( struct atom_slab*, n );
+    freeCount = tr_new0( int, n );
+    for( i=0, slab=mgr->atomSlabs; slab!=NULL; slab=slab->next )
+        slabs[i++] = slab;
+    qsort( slabs, n, sizeof( struct atom_slab* ), compareSlabPtrs );
+    for( atom=mgr->freeAtoms; atom!=NULL; atom=atom->hashNext ) {
+        struct atom_slab ** found = bsearch( atom, slabs, n, sizeof( struct atom_slab* ), compareAtomToSlab );
+        assert( found != NULL );
+        ++freeCount[found - slabs];
+    }
+
+    /* take the empty slabs' atoms out of the free list... */
+    atom = mgr->freeAtoms;
+    mgr->freeAtoms = NULL;
+    while( atom != NULL ) {
+        struct peer_atom * next = atom->hashNext;
+        struct atom_slab ** found = bsearch( atom, slabs, n, sizeof( struct atom_slab* ), compareAtomToSlab );
+        if( freeCount[found - slabs] < ATOM_SLAB_SIZE ) {
+            atom->hashNext = mgr->freeAtoms;
+            mgr->freeAtoms = atom;
+        }
+        atom = next;
+    }
+
+    /* ...and then free them */
+    mgr->atomSlabs = NULL;
+    mgr->atomSlabCount = 0;
+    for( i=0; i<n; ++i ) {
+        if( freeCount[i] == ATOM_SLAB_SIZE )
+            tr_free( slabs[i] );
+        else {
+            slabs[i]->next = mgr->atomSlabs;
+            mgr->atomSlabs = slabs[i];
+            ++mgr->atomSlabCount;
+        }
+    }
+
+    tr_free( freeCount );
+    tr_free( slabs );
+}
+
+static uint32_t
+hashAddress( const tr_peerMgr * mgr, const tr_address * addr )
+{
+    int i;
+    uint32_t words[4];
+    const int n = addr->type == TR_AF_INET ? 1 : 4;
+    uint32_t h = mgr->atomHashSeed;
+
+    memcpy( words, &addr->addr, n * sizeof( uint32_t ) );
+
+    for( i=0; i<n; ++i ) {
+        h ^= words[i];
+        h *= 0x9E3779B1u;
+        h ^= h >> 15;
+    }
+
+    /* mix the high bits down, since the bucket is picked from the low ones */
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct peer_atom**
+atomBucket( const Torrent * t, const tr_address * addr )
+{
+    return &t->atomBuckets[hashAddress( t->manager, addr ) & t->atomBucketMask];
+}
+
+/* size the index for `count' atoms and refill it from Torrent.pool */
+static void
+atomIndexRebuild( Torrent * t, int count )
+{
+    int i;
+    const int n = tr_ptrArraySize( &t->pool );
+    size_t bucketCount = ATOM_BUCKETS_MIN;
+
+    while( bucketCount < (size_t)count )
+        bucketCount *= 2;
+
+    if( ( t->atomBuckets == NULL ) || ( t->atomBucketMask + 1 != bucketCount ) ) {
+        tr_free( t->atomBuckets );
+        t->atomBuckets = tr_new( struct peer_atom*, bucketCount );
+        t->atomBucketMask = bucketCount - 1;
+    }
+
+    memset( t->atomBuckets, 0, bucketCount * sizeof( struct peer_atom* ) );
+
+    for( i=0; i<n; ++i ) {
+        struct peer_atom * atom = tr_ptrArrayNth( &t->pool, i );
+        struct peer_atom ** bucket = atomBucket( t, &atom->addr );
+        atom->hashNext = *bucket;
+        *bucket = atom;
+    }
+}
+
+static void
+atomIndexAdd( Torrent * t, struct peer_atom * atom )
+{
+    struct peer_atom ** bucket;
+
+    tr_ptrArrayAppend( &t->pool, atom );
+
+    /* keep about one atom per bucket */
+    if( ( t->atomBuckets == NULL ) || ( (size_t)tr_ptrArraySize( &t->pool ) > t->atomBucketMask + 1 ) )
+        atomIndexRebuild( t, tr_ptrArraySize( &t->pool ) );
+    else {
+        bucket = atomBucket( t, &atom->addr );
+        atom->hashNext = *bucket;
+        *bucket = atom;
+    }
+}
+
+static void
+atomIndexFree( Torrent * t )
+{
+    int i;
+    const int n = tr_ptrArraySize( &t->pool );
+
+    for( i=0; i<n; ++i )
+        atomFree( t->manager, tr_ptrArrayNth( &t->pool, i ) );
+
+    tr_ptrArrayDestruct( &t->pool, NULL );
+    tr_free( t->atomBuckets );
+    t->atomBuckets = NULL;
+}
+
 static struct peer_atom*
 getExistingAtom( const Torrent    * t,
                  const tr_address * addr )
 {
-    Torrent * tt = (Torrent*)t;
+    struct peer_atom * atom;
     assert( torrentIsLocked( t ) );
-    return tr_ptrArrayFindSorted( &tt->pool, addr, comparePeerAtomToAddress );
+
+    if( t->atomBuckets == NULL )
+        return NULL;
+
+    for( atom=*atomBucket( t, addr ); atom!=NULL; atom=atom->hashNext )
+        if( !tr_compareAddresses( &atom->addr, addr ) )
+            break;
+
+    return atom;
+}
+
+void
+tr_peerMgrGetPoolStats( tr_peerMgr * mgr, tr_peer_pool_stats * setme )
+{
+    tr_torrent * tor = NULL;
+
+    managerLock( mgr );
+
+    setme->knownPeers = mgr->atomCount;
+    setme->poolBytes = mgr->atomSlabCount * sizeof( struct atom_slab );
+    setme->indexBytes = 0;
+
+    while(( tor = tr_torrentNext( mgr->session, tor ))) {
+        const Torrent * t = tor->torrentPeers;
+        if( t->atomBuckets != NULL )
+            setme->indexBytes += ( t->atomBucketMask + 1 ) * sizeof( struct peer_atom* );
+        setme->indexBytes += tr_ptrArraySize( &t->pool ) * sizeof( struct peer_atom* );
+    }
+
+    managerUnlock( mgr );
 }
 
 static tr_bool
@@ -424,7 +763,15 @@ peerDelete( Torrent * t, tr_peer * peer )
     peerDeclinedAllRequests( t, peer );
 
     if( peer->msgs != NULL )
+    {
+        int i, n;
+        const struct peer_request * reqs = tr_peerMsgsGetPeerRequests( peer->msgs, &n );
+
+        for( i=0; i<n; ++i )
+            tr_peerMgrPeerRequestRemoved( t->tor, reqs[i].index );
+
         tr_peerMsgsFree( peer->msgs );
+    }
 
     tr_peerIoClear( peer->io );
     tr_peerIoUnref( peer->io ); /* balanced by the ref in handshakeDoneCB() */
@@ -479,12 +826,133 @@ replicationNew( Torrent * t )
                 ++r;
 
         t->pieceReplication[piece_i] = r;
+        tr_pickerSetReplication( &t->picker, piece_i, r );
     }
 }
 
+/**
+***  Interest
+**/
+
+/* do we still want this piece? */
+static inline tr_bool
+isPieceWanted( const tr_torrent * tor, tr_piece_index_t index )
+{
+    return ( !tor->info.pieces[index].dnd )
+        && ( !tr_cpPieceIsComplete( &tor->completion, index ) );
+}
+
+static tr_bool
+wantedPiecesIsValid( const Torrent * t )
+{
+    return !t->wantedPiecesDirty
+        && ( t->wantedPieces.bitCount == t->tor->info.pieceCount );
+}
+
+/* count the wanted pieces in the peer's bitset */
+static void
+peerCountInteresting( const Torrent * t, tr_peer * peer )
+{
+    const tr_bitset * have = &peer->have;
+
+    if( have->haveAll )
+        peer->interestingCount = t->wantedPieceCount;
+    else if( have->haveNone || ( have->bitfield.bits == NULL ) )
+        peer->interestingCount = 0;
+    else
+        peer->interestingCount = tr_bitfieldCountTrueBits( &have->bitfield )
+                               - tr_bitfieldCountAndNot( &have->bitfield, &t->wantedPieces );
+}
+
+static void
+wantedPiecesRebuild( Torrent * t )
+{
+    int i;
+    tr_piece_index_t piece;
+    const tr_torrent * tor = t->tor;
+    const tr_piece_index_t n = tor->info.pieceCount;
+    const int peerCount = tr_ptrArraySize( &t->peers );
+
+    tr_bitfieldDestruct( &t->wantedPieces );
+    tr_bitfieldConstruct( &t->wantedPieces, n );
+    t->wantedPieceCount = 0;
+
+    for( piece=0; piece<n; ++piece ) {
+        if( isPieceWanted( tor, piece ) ) {
+            tr_bitfieldAdd( &t->wantedPieces, piece );
+            ++t->wantedPieceCount;
+        }
+    }
+
+    for( i=0; i<peerCount; ++i )
+        peerCountInteresting( t, tr_ptrArrayNth( &t->peers, i ) );
+
+    t->wantedPiecesDirty = FALSE;
+}
+
+/* a piece was completed or lost, so update the count
+   of every peer that has it */
+static void
+wantedPiecesUpdate( Torrent * t, tr_piece_index_t piece )
+{
+    int i;
+    int delta;
+    const int peerCount = tr_ptrArraySize( &t->peers );
+    const tr_bool wanted = isPieceWanted( t->tor, piece );
+
+    if( !wantedPiecesIsValid( t ) )
+        return;
+
+    if( wanted == tr_bitfieldHas( &t->wantedPieces, piece ) )
+        return;
+
+    if( wanted ) {
+        tr_bitfieldAdd( &t->wantedPieces, piece );
+        ++t->wantedPieceCount;
+        delta = 1;
+    } else {
+        tr_bitfieldRem( &t->wantedPieces, piece );
+        --t->wantedPieceCount;
+        delta = -1;
+    }
+
+    for( i=0; i<peerCount; ++i ) {
+        tr_peer * peer = tr_ptrArrayNth( &t->peers, i );
+        if( tr_bitsetHas( &peer->have, piece ) )
+            peer->interestingCount += delta;
+    }
+}
+
+static void requestListFree( Torrent * );
+
+struct prefetch_piece
+{
+    tr_torrent * tor;
+    tr_piece_index_t piece;
+};
+
+/* forget the torrent's pieces in the manager's prefetch queue */
+static void
+prefetchRemoveTorrent( Torrent * t )
+{
+    int i;
+    int n = 0;
+    tr_peerMgr * mgr = t->manager;
+
+    for( i=0; i<mgr->prefetchCount; ++i )
+        if( mgr->prefetch[i].tor != t->tor )
+            mgr->prefetch[n++] = mgr->prefetch[i];
+    mgr->prefetchCount = n;
+
+    tr_free( t->prefetchDemand );
+    t->prefetchDemand = NULL;
+    t->prefetchDemandSize = 0;
+}
+
 static void
 torrentFree( void * vt )
 {
+    int i;
     Torrent * t = vt;
 
     assert( t );
@@ -494,14 +962,19 @@ torrentFree( void * vt )
     assert( tr_ptrArrayEmpty( &t->peers ) );
 
     tr_ptrArrayDestruct( &t->webseeds, (PtrArrayForeachFunc)tr_webseedFree );
-    tr_ptrArrayDestruct( &t->pool, (PtrArrayForeachFunc)tr_free );
+    atomIndexFree( t );
+    for( i=0; i<CANDIDATE_HEAPS; ++i )
+        tr_free( t->candidates[i].atoms );
     tr_ptrArrayDestruct( &t->outgoingHandshakes, NULL );
     tr_ptrArrayDestruct( &t->peers, NULL );
 
     replicationFree( t );
+    prefetchRemoveTorrent( t );
 
-    tr_free( t->requests );
+    requestListFree( t );
     tr_free( t->pieces );
+    tr_pickerDestruct( &t->picker );
+    tr_bitfieldDestruct( &t->wantedPieces );
     tr_free( t );
 }
 
@@ -520,6 +993,8 @@ torrentNew( tr_peerMgr * manager, tr_torrent * tor )
     t->peers = TR_PTR_ARRAY_INIT;
     t->webseeds = TR_PTR_ARRAY_INIT;
     t->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+    t->wantedPiecesDirty = TRUE;
+    t->candidatesDirty = TRUE;
 
     for( i = 0; i < tor->info.webseedCount; ++i )
     {
@@ -536,6 +1011,7 @@ tr_peerMgrNew( tr_session * session )
 {
     tr_peerMgr * m = tr_new0( tr_peerMgr, 1 );
     m->session = session;
+    m->atomHashSeed = (uint32_t) tr_cryptoWeakRandInt( INT_MAX );
     m->incomingHandshakes = TR_PTR_ARRAY_INIT;
     return m;
 }
@@ -573,6 +1049,9 @@ tr_peerMgrFree( tr_peerMgr * manager )
 
     tr_ptrArrayDestruct( &manager->incomingHandshakes, NULL );
 
+    atomSlabsFree( manager );
+    tr_free( manager->prefetch );
+
     managerUnlock( manager );
     tr_free( manager );
 }
@@ -613,6 +1092,7 @@ tr_peerMgrOnBlocklistChanged( tr_peerMgr * mgr )
             struct peer_atom * atom = tr_ptrArrayNth( &t->pool, i );
             atom->blocklisted = -1;
         }
+        t->candidatesDirty = TRUE;
     }
 }
 
@@ -701,118 +1181,179 @@ tr_peerMgrSetUtpFailed( tr_torrent *tor, const tr_address *addr, tr_bool failed
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. Torrent::requests, an array of "struct block_request" which keeps
-***    track of which blocks have been requested, and when, and by which peers.
-***    This is list is used for (a) cancelling requests that have been pending
+*** 1. Torrent::requestBuckets, a hash of "struct block_request" keyed by
+***    block, which keeps track of which blocks have been requested, and when,
+***    and by which peers. Each request is also linked into its peer's list
+***    and into the torrent's list of requests sorted by age, so adding,
+***    removing, and looking up a request are all O(1).
+***    This is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
 *** 2. Torrent::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests() is called.
+***    pieces that we've started requesting, and Torrent::picker, which holds
+***    the rest of the pieces that we want in rarest-first buckets. They're
+***    used to decide which blocks to return next when
+***    tr_peerMgrGetBlockRequests() is called.
 **/
 
 /**
 *** struct block_request
 **/
 
-static int
-compareReqByBlock( const void * va, const void * vb )
+static inline struct block_request **
+requestBucket( const Torrent * t, tr_block_index_t block )
 {
-    const struct block_request * a = va;
-    const struct block_request * b = vb;
+    return &t->requestBuckets[block & t->requestBucketMask];
+}
 
-    /* primary key: block */
-    if( a->block < b->block ) return -1;
-    if( a->block > b->block ) return 1;
+/* keep about one request per bucket. Blocks are hashed by their low bits,
+ * so the blocks of neighboring pieces land in neighboring buckets */
+static void
+requestListGrow( Torrent * t )
+{
+    tr_block_index_t i;
+    const tr_block_index_t oldCount = t->requestBuckets ? t->requestBucketMask + 1 : 0;
+    const tr_block_index_t newCount = oldCount ? oldCount * 2 : 128;
+    struct block_request ** oldBuckets = t->requestBuckets;
 
-    /* secondary key: peer */
-    if( a->peer < b->peer ) return -1;
-    if( a->peer > b->peer ) return 1;
+    t->requestBuckets = tr_new0( struct block_request*, newCount );
+    t->requestBucketMask = newCount - 1;
 
-    return 0;
+    for( i=0; i<oldCount; ++i )
+    {
+        struct block_request * req = oldBuckets[i];
+
+        while( req != NULL )
+        {
+            struct block_request * next = req->hashNext;
+            struct block_request ** bucket = requestBucket( t, req->block );
+            req->hashNext = *bucket;
+            *bucket = req;
+            req = next;
+        }
+    }
+
+    tr_free( oldBuckets );
+}
+
+static void
+requestListFree( Torrent * t )
+{
+    struct block_request * req;
+
+    while(( req = t->oldestRequest )) {
+        t->oldestRequest = req->ageNext;
+        tr_free( req );
+    }
+
+    while(( req = t->freeRequests )) {
+        t->freeRequests = req->hashNext;
+        tr_free( req );
+    }
+
+    tr_free( t->requestBuckets );
 }
 
 static void
 requestListAdd( Torrent * t, tr_block_index_t block, tr_peer * peer )
 {
-    struct block_request key;
+    struct block_request * req;
+    struct block_request ** bucket;
 
     /* ensure enough room is available... */
-    if( t->requestCount + 1 >= t->requestAlloc )
-    {
-        const int CHUNK_SIZE = 128;
-        t->requestAlloc += CHUNK_SIZE;
-        t->requests = tr_renew( struct block_request,
-                                t->requests, t->requestAlloc );
-    }
+    if( ( t->requestBuckets == NULL )
+        || ( (tr_block_index_t)t->requestCount > t->requestBucketMask ) )
+        requestListGrow( t );
 
     /* populate the record we're inserting */
-    key.block = block;
-    key.peer = peer;
-    key.sentAt = tr_time( );
-
-    /* insert the request to our array... */
-    {
-        tr_bool exact;
-        const int pos = tr_lowerBound( &key, t->requests, t->requestCount,
-                                       sizeof( struct block_request ),
-                                       compareReqByBlock, &exact );
-        assert( !exact );
-        memmove( t->requests + pos + 1,
-                 t->requests + pos,
-                 sizeof( struct block_request ) * ( t->requestCount++ - pos ) );
-        t->requests[pos] = key;
-    }
+    if(( req = t->freeRequests ))
+        t->freeRequests = req->hashNext;
+    else
+        req = tr_new( struct block_request, 1 );
+    req->block = block;
+    req->peer = peer;
+    req->sentAt = tr_time( );
+
+    /* add it to the block's hash chain... */
+    bucket = requestBucket( t, block );
+    req->hashNext = *bucket;
+    *bucket = req;
+
+    /* to the end of the age list... */
+    req->ageNext = NULL;
+    req->agePrev = t->newestRequest;
+    if( t->newestRequest != NULL )
+        t->newestRequest->ageNext = req;
+    else
+        t->oldestRequest = req;
+    t->newestRequest = req;
 
+    /* and to the peer's list */
+    req->peerPrev = NULL;
+    req->peerNext = NULL;
     if( peer != NULL )
     {
+        req->peerNext = peer->blockRequests;
+        if( peer->blockRequests != NULL )
+            peer->blockRequests->peerPrev = req;
+        peer->blockRequests = req;
+
         ++peer->pendingReqsToPeer;
         assert( peer->pendingReqsToPeer >= 0 );
     }
 
+    ++t->requestCount;
+
     /*fprintf( stderr, "added request of block %lu from peer %s... "
                        "there are now %d block\n",
                        (unsigned long)block, tr_atomAddrStr( peer->atom ), t->requestCount );*/
 }
 
 static struct block_request *
-requestListLookup( Torrent * t, tr_block_index_t block, const tr_peer * peer )
+requestListLookup( const Torrent * t, tr_block_index_t block, const tr_peer * peer )
 {
-    struct block_request key;
-    key.block = block;
-    key.peer = (tr_peer*) peer;
+    struct block_request * req;
+
+    if( t->requestBuckets == NULL )
+        return NULL;
 
-    return bsearch( &key, t->requests, t->requestCount,
-                    sizeof( struct block_request ),
-                    compareReqByBlock );
+    for( req=*requestBucket( t, block ); req!=NULL; req=req->hashNext )
+        if( ( req->block == block ) && ( req->peer == peer ) )
+            break;
+
+    return req;
 }
 
 /**
- * Find the peers are we currently requesting the block
- * with index @a block from and append them to @a peerArr.
+ * Returns the first of the requests we've made for the block
+ * with index @a block, or NULL if there aren't any.
+ * Use blockRequestNext() to walk the others.
  */
-static void
-getBlockRequestPeers( Torrent * t, tr_block_index_t block,
-                      tr_ptrArray * peerArr )
+static struct block_request *
+blockRequestFirst( const Torrent * t, tr_block_index_t block )
 {
-    tr_bool exact;
-    int i, pos;
-    struct block_request key;
+    struct block_request * req;
 
-    key.block = block;
-    key.peer = NULL;
-    pos = tr_lowerBound( &key, t->requests, t->requestCount,
-                         sizeof( struct block_request ),
-                         compareReqByBlock, &exact );
+    if( t->requestBuckets == NULL )
+        return NULL;
 
-    assert( !exact ); /* shouldn't have a request with .peer == NULL */
+    for( req=*requestBucket( t, block ); req!=NULL; req=req->hashNext )
+        if( req->block == block )
+            break;
 
-    for( i = pos; i < t->requestCount; ++i )
-    {
-        if( t->requests[i].block != block )
+    return req;
+}
+
+static struct block_request *
+blockRequestNext( const struct block_request * prev )
+{
+    struct block_request * req;
+
+    for( req=prev->hashNext; req!=NULL; req=req->hashNext )
+        if( req->block == prev->block )
             break;
-        tr_ptrArrayAppend( peerArr, t->requests[i].peer );
-    }
+
+    return req;
 }
 
 static void
@@ -823,21 +1364,51 @@ decrementPendingReqCount( const struct block_request * b )
             --b->peer->pendingReqsToPeer;
 }
 
+static void
+requestListRemoveRequest( Torrent * t, struct block_request * req )
+{
+    struct block_request ** walk;
+
+    assert( t->requestCount > 0 );
+
+    decrementPendingReqCount( req );
+
+    /* unlink it from the block's hash chain... */
+    for( walk=requestBucket( t, req->block ); *walk!=req; walk=&(*walk)->hashNext )
+        assert( *walk != NULL );
+    *walk = req->hashNext;
+
+    /* from the age list... */
+    if( req->agePrev != NULL )
+        req->agePrev->ageNext = req->ageNext;
+    else
+        t->oldestRequest = req->ageNext;
+    if( req->ageNext != NULL )
+        req->ageNext->agePrev = req->agePrev;
+    else
+        t->newestRequest = req->agePrev;
+
+    /* and from the peer's list */
+    if( req->peerPrev != NULL )
+        req->peerPrev->peerNext = req->peerNext;
+    else if( req->peer != NULL )
+        req->peer->blockRequests = req->peerNext;
+    if( req->peerNext != NULL )
+        req->peerNext->peerPrev = req->peerPrev;
+
+    /* recycle it */
+    req->hashNext = t->freeRequests;
+    t->freeRequests = req;
+    --t->requestCount;
+}
+
 static void
 requestListRemove( Torrent * t, tr_block_index_t block, const tr_peer * peer )
 {
-    const struct block_request * b = requestListLookup( t, block, peer );
+    struct block_request * b = requestListLookup( t, block, peer );
     if( b != NULL )
     {
-        const int pos = b - t->requests;
-        assert( pos < t->requestCount );
-
-        decrementPendingReqCount( b );
-
-        tr_removeElementFromArray( t->requests,
-                                   pos,
-                                   sizeof( struct block_request ),
-                                   t->requestCount-- );
+        requestListRemoveRequest( t, b );
 
         /*fprintf( stderr, "removing request of block %lu from peer %s... "
                            "there are now %d block requests left\n",
@@ -1048,6 +1619,58 @@ pieceListLookup( Torrent * t, tr_piece_index_t index )
     return NULL;
 }
 
+static uint16_t
+getReplication( const Torrent * t, tr_piece_index_t index )
+{
+    return replicationExists( t ) ? t->pieceReplication[index] : 0;
+}
+
+/* true if we haven't got or requested any of the piece's blocks */
+static tr_bool
+pieceIsUntouched( const Torrent * t, tr_piece_index_t index )
+{
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    tr_torGetPieceBlockRange( t->tor, index, &first, &last );
+
+    return tr_cpMissingBlocksInPiece( &t->tor->completion, index ) == (int)( last + 1 - first );
+}
+
+static inline tr_bool
+pieceIsFullyRequested( const Torrent * t, const struct weighted_piece * p )
+{
+    return tr_cpMissingBlocksInPiece( &t->tor->completion, p->index ) <= p->requestCount;
+}
+
+static void
+pickerAddPiece( Torrent * t, tr_piece_index_t index )
+{
+    tr_pickerAdd( &t->picker, index,
+                  t->tor->info.pieces[index].priority,
+                  getReplication( t, index ) );
+}
+
+/* Appends a piece to Torrent::pieces.
+ * The caller is responsible for re-sorting the list afterwards. */
+static struct weighted_piece *
+pieceListAddPiece( Torrent * t, tr_piece_index_t index )
+{
+    struct weighted_piece * piece;
+
+    if( t->pieceCount == t->pieceAlloc )
+    {
+        t->pieceAlloc = MAX( 16, t->pieceAlloc * 2 );
+        t->pieces = tr_renew( struct weighted_piece, t->pieces, t->pieceAlloc );
+    }
+
+    piece = t->pieces + t->pieceCount++;
+    piece->index = index;
+    piece->requestCount = 0;
+    piece->salt = tr_cryptoWeakRandInt( 4096 );
+    return piece;
+}
+
 static void
 pieceListRebuild( Torrent * t )
 {
@@ -1055,58 +1678,56 @@ pieceListRebuild( Torrent * t )
     if( !tr_torrentIsSeed( t->tor ) )
     {
         tr_piece_index_t i;
-        tr_piece_index_t * pool;
-        tr_piece_index_t poolCount = 0;
         const tr_torrent * tor = t->tor;
         const tr_info * inf = tr_torrentInfo( tor );
-        struct weighted_piece * pieces;
-        int pieceCount;
+        struct weighted_piece * old = t->pieces;
+        const struct weighted_piece * o = NULL;
+        const struct weighted_piece * oend = NULL;
 
-        /* build the new list */
-        pool = tr_new( tr_piece_index_t, inf->pieceCount );
-        for( i=0; i<inf->pieceCount; ++i )
-            if( !inf->pieces[i].dnd )
-                if( !tr_cpPieceIsComplete( &tor->completion, i ) )
-                    pool[poolCount++] = i;
-        pieceCount = poolCount;
-        pieces = tr_new0( struct weighted_piece, pieceCount );
-        for( i=0; i<poolCount; ++i ) {
-            struct weighted_piece * piece = pieces + i;
-            piece->index = pool[i];
-            piece->requestCount = 0;
-            piece->salt = tr_cryptoWeakRandInt( 4096 );
+        if( !replicationExists( t ) )
+            replicationNew( t );
+
+        if( t->picker.pieceCount != inf->pieceCount ) {
+            tr_pickerDestruct( &t->picker );
+            tr_pickerConstruct( &t->picker, inf->pieceCount );
         }
+        else
+            tr_pickerClear( &t->picker );
 
         /* if we already had a list of pieces, merge it into
          * the new list so we don't lose its requestCounts */
-        if( t->pieces != NULL )
+        if( old != NULL )
         {
-            struct weighted_piece * o = t->pieces;
-            struct weighted_piece * oend = o + t->pieceCount;
-            struct weighted_piece * n = pieces;
-            struct weighted_piece * nend = n + pieceCount;
-
             pieceListSort( t, PIECES_SORTED_BY_INDEX );
+            o = old;
+            oend = o + t->pieceCount;
+        }
 
-            while( o!=oend && n!=nend ) {
-                if( o->index < n->index )
-                    ++o;
-                else if( o->index > n->index )
-                    ++n;
-                else
-                    *n++ = *o++;
-            }
+        t->pieces = NULL;
+        t->pieceCount = 0;
+        t->pieceAlloc = 0;
 
-            tr_free( t->pieces );
+        /* build the new list. pieces we've started go into t->pieces,
+         * and the rest of the ones we want go into the picker */
+        for( i=0; i<inf->pieceCount; ++i )
+        {
+            while( o!=oend && o->index < i )
+                ++o;
+
+            if( inf->pieces[i].dnd || tr_cpPieceIsComplete( &tor->completion, i ) )
+                continue;
+
+            if( ( o != oend ) && ( o->index == i ) && ( o->requestCount > 0 ) )
+                *pieceListAddPiece( t, i ) = *o;
+            else if( !pieceIsUntouched( t, i ) )
+                pieceListAddPiece( t, i );
+            else
+                pickerAddPiece( t, i );
         }
 
-        t->pieces = pieces;
-        t->pieceCount = pieceCount;
+        tr_free( old );
 
         pieceListSort( t, PIECES_SORTED_BY_WEIGHT );
-
-        /* cleanup */
-        tr_free( pool );
     }
 }
 
@@ -1115,6 +1736,8 @@ pieceListRemovePiece( Torrent * t, tr_piece_index_t piece )
 {
     struct weighted_piece * p;
 
+    tr_pickerRemove( &t->picker, piece );
+
     if(( p = pieceListLookup( t, piece )))
     {
         const int pos = p - t->pieces;
@@ -1128,6 +1751,7 @@ pieceListRemovePiece( Torrent * t, tr_piece_index_t piece )
         {
             tr_free( t->pieces );
             t->pieces = NULL;
+            t->pieceAlloc = 0;
         }
     }
 }
@@ -1188,9 +1812,31 @@ pieceListRemoveRequest( Torrent * t, tr_block_index_t block )
 
     if( ((p = pieceListLookup( t, index ))) && ( p->requestCount > 0 ) )
     {
-        --p->requestCount;
-        pieceListResortPiece( t, p );
+        if( !--p->requestCount && pieceIsUntouched( t, index ) )
+        {
+            /* nothing's come of it, so give it back to the picker */
+            pieceListRemovePiece( t, index );
+            pickerAddPiece( t, index );
+        }
+        else
+            pieceListResortPiece( t, p );
+    }
+}
+
+/* a block arrived, so make sure its piece is in the started list */
+static void
+pieceListBlockAdded( Torrent * t, tr_piece_index_t index )
+{
+    struct weighted_piece * p;
+
+    if( !tr_pickerHas( &t->picker, index ) )
+        p = pieceListLookup( t, index );
+    else {
+        tr_pickerRemove( &t->picker, index );
+        p = pieceListAddPiece( t, index );
     }
+
+    pieceListResortPiece( t, p );
 }
 
 
@@ -1213,8 +1859,10 @@ tr_incrReplicationOfPiece( Torrent * t, const size_t index )
     /* One more replication of this piece is present in the swarm */
     ++t->pieceReplication[index];
 
+    if( tr_pickerHas( &t->picker, index ) )
+        tr_pickerSetReplication( &t->picker, index, t->pieceReplication[index] );
     /* we only resort the piece if the list is already sorted */
-    if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
+    else if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
         pieceListResortPiece( t, pieceListLookup( t, index ) );
 }
 
@@ -1232,9 +1880,10 @@ tr_incrReplicationFromBitfield( Torrent * t, const tr_bitfield * b )
     assert( n == t->pieceReplicationSize );
     assert( tr_bitfieldTestFast( b, n-1 ) );
 
-    for( i=0; i<n; ++i )
-        if( tr_bitfieldHas( b, i ) )
-            ++rep[i];
+    for( i=tr_bitfieldNextSet( b, 0 ); i<n; i=tr_bitfieldNextSet( b, i+1 ) ) {
+        ++rep[i];
+        tr_pickerSetReplication( &t->picker, i, rep[i] );
+    }
 
     if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
         invalidatePieceSorting( t );
@@ -1252,8 +1901,10 @@ tr_incrReplication( Torrent * t )
     assert( replicationExists( t ) );
     assert( t->pieceReplicationSize == t->tor->info.pieceCount );
 
-    for( i=0; i<n; ++i )
+    for( i=0; i<n; ++i ) {
         ++t->pieceReplication[i];
+        tr_pickerSetReplication( &t->picker, i, t->pieceReplication[i] );
+    }
 }
 
 /**
@@ -1270,16 +1921,19 @@ tr_decrReplicationFromBitset( Torrent * t, const tr_bitset * bitset )
 
     if( bitset->haveAll )
     {
-        for( i=0; i<n; ++i )
+        for( i=0; i<n; ++i ) {
             --t->pieceReplication[i];
+            tr_pickerSetReplication( &t->picker, i, t->pieceReplication[i] );
+        }
     }
     else if ( !bitset->haveNone )
     {
         const tr_bitfield * const b = &bitset->bitfield;
 
-        for( i=0; i<n; ++i )
-            if( tr_bitfieldHas( b, i ) )
-                --t->pieceReplication[i];
+        for( i=tr_bitfieldNextSet( b, 0 ); i<n; i=tr_bitfieldNextSet( b, i+1 ) ) {
+            --t->pieceReplication[i];
+            tr_pickerSetReplication( &t->picker, i, t->pieceReplication[i] );
+        }
 
         if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
             invalidatePieceSorting( t );
@@ -1296,6 +1950,67 @@ tr_peerMgrRebuildRequests( tr_torrent * tor )
     assert( tr_isTorrent( tor ) );
 
     pieceListRebuild( tor->torrentPeers );
+
+    /* files may have been marked as unwanted or wanted */
+    tor->torrentPeers->wantedPiecesDirty = TRUE;
+}
+
+/* add the blocks in piece `p' that we should request from `peer' to `setme' */
+static int
+requestBlocksFromPiece( Torrent                * t,
+                        tr_peer                * peer,
+                        struct weighted_piece  * p,
+                        int                      numwant,
+                        tr_block_index_t       * setme,
+                        int                      got )
+{
+    tr_block_index_t b;
+    tr_block_index_t first;
+    tr_block_index_t last;
+    const tr_torrent * tor = t->tor;
+
+    tr_torGetPieceBlockRange( tor, p->index, &first, &last );
+
+    for( b=first; b<=last && got<numwant; ++b )
+    {
+        const struct block_request * req;
+
+        /* don't request blocks we've already got */
+        if( tr_cpBlockIsComplete( &tor->completion, b ) )
+            continue;
+
+        /* always add peer if this block has no peers yet */
+        req = blockRequestFirst( t, b );
+        if( req != NULL )
+        {
+            /* don't make a second block request until the endgame */
+            if( !t->endgame )
+                continue;
+
+            /* don't have more than two peers requesting this block */
+            if( blockRequestNext( req ) != NULL )
+                continue;
+
+            /* don't send the same request to the same peer twice */
+            if( peer == req->peer )
+                continue;
+
+            /* in the endgame allow an additional peer to download a
+               block but only if the peer seems to be handling requests
+               relatively fast */
+            if( peer->pendingReqsToPeer + numwant - got < t->endgame )
+                continue;
+        }
+
+        /* update the caller's table */
+        setme[got++] = b;
+
+        /* update our own tables */
+        requestListAdd( t, b, peer );
+        ++p->requestCount;
+    }
+
+    return got;
 }
 
 void
@@ -1307,8 +2022,9 @@ tr_peerMgrGetNextRequests( tr_torrent           * tor,
 {
     int i;
     int got;
+    int oldCount;
+    int resortFrom;
     Torrent * t;
-    struct weighted_piece * pieces;
     const tr_bitset * have = &peer->have;
 
     /* sanity clause */
@@ -1321,8 +2037,14 @@ tr_peerMgrGetNextRequests( tr_torrent           * tor,
     got = 0;
     t = tor->torrentPeers;
 
+    /* if the disk can't keep up, wait for it to catch up */
+    if( tr_cacheIsWriteBacklogged( tor->session->cache ) ) {
+        *numgot = 0;
+        return;
+    }
+
     /* prep the pieces list */
-    if( t->pieces == NULL )
+    if( ( t->pieces == NULL ) && !tr_pickerCount( &t->picker ) )
         pieceListRebuild( t );
 
     if( t->pieceSortState != PIECES_SORTED_BY_WEIGHT )
@@ -1332,73 +2054,60 @@ tr_peerMgrGetNextRequests( tr_torrent           * tor,
     assertWeightedPiecesAreSorted( t );
 
     updateEndgame( t );
-    pieces = t->pieces;
+    oldCount = t->pieceCount;
+
+    /* first, the pieces we've already started. The ones whose blocks
+     * have all been requested are sorted to the end */
     for( i=0; i<t->pieceCount && got<numwant; ++i )
     {
-        struct weighted_piece * p = pieces + i;
+        struct weighted_piece * p = t->pieces + i;
+
+        if( pieceIsFullyRequested( t, p ) )
+            break;
 
         /* if the peer has this piece that we want... */
         if( tr_bitsetHas( have, p->index ) )
-        {
-            tr_block_index_t b;
-            tr_block_index_t first;
-            tr_block_index_t last;
-            tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
-
-            tr_torGetPieceBlockRange( tor, p->index, &first, &last );
-
-            for( b=first; b<=last && got<numwant; ++b )
-            {
-                int peerCount;
-                tr_peer ** peers;
-
-                /* don't request blocks we've already got */
-                if( tr_cpBlockIsComplete( &tor->completion, b ) )
-                    continue;
+            got = requestBlocksFromPiece( t, peer, p, numwant, setme, got );
+    }
+    resortFrom = i;
 
-                /* always add peer if this block has no peers yet */
-                tr_ptrArrayClear( &peerArr );
-                getBlockRequestPeers( t, b, &peerArr );
-                peers = (tr_peer **) tr_ptrArrayPeek( &peerArr, &peerCount );
-                if( peerCount != 0 )
-                {
-                    /* don't make a second block request until the endgame */
-                    if( !t->endgame )
-                        continue;
-
-                    /* don't have more than two peers requesting this block */
-                    if( peerCount > 1 )
-                        continue;
-
-                    /* don't send the same request to the same peer twice */
-                    if( peer == peers[0] )
-                        continue;
-
-                    /* in the endgame allow an additional peer to download a
-                       block but only if the peer seems to be handling requests
-                       relatively fast */
-                    if( peer->pendingReqsToPeer + numwant - got < t->endgame )
-                        continue;
-                }
+    /* then start new pieces, rarest first */
+    if( got < numwant )
+    {
+        tr_piece_index_t index;
+        const unsigned int salt = tr_cryptoWeakRandInt( INT_MAX );
 
-                /* update the caller's table */
-                setme[got++] = b;
+        while( ( got < numwant ) && tr_pickerNext( &t->picker, have, salt, &index ) )
+        {
+            tr_pickerRemove( &t->picker, index );
+            got = requestBlocksFromPiece( t, peer, pieceListAddPiece( t, index ),
+                                          numwant, setme, got );
+        }
+    }
 
-                /* update our own tables */
-                requestListAdd( t, b, peer );
-                ++p->requestCount;
-            }
+    /* in the endgame, also look at the blocks we're getting from other peers */
+    if( t->endgame )
+    {
+        for( ; i<oldCount && got<numwant; ++i )
+        {
+            struct weighted_piece * p = t->pieces + i;
 
-            tr_ptrArrayDestruct( &peerArr, NULL );
+            if( tr_bitsetHas( have, p->index ) )
+                got = requestBlocksFromPiece( t, peer, p, numwant, setme, got );
         }
+        resortFrom = i;
     }
 
+    if( t->pieceCount != oldCount )
+        resortFrom = t->pieceCount;
+
     /* In most cases we've just changed the weights of a small number of pieces.
      * So rather than qsort()ing the entire array, it's faster to apply an
      * adaptive insertion sort algorithm. */
-    if( got > 0 )
+    if( ( got > 0 ) || ( t->pieceCount != oldCount ) )
     {
         /* not enough requests || last piece modified */
+        i = resortFrom;
         if ( i == t->pieceCount ) --i;
 
         setComparePieceByWeightTorrent( t );
@@ -1432,7 +2141,7 @@ tr_peerMgrDidPeerRequest( const tr_torrent  * tor,
                           tr_block_index_t    block )
 {
     const Torrent * t = tor->torrentPeers;
-    return requestListLookup( (Torrent*)t, block, peer ) != NULL;
+    return requestListLookup( t, block, peer ) != NULL;
 }
 
 /* cancel requests that are too old */
@@ -1452,45 +2161,27 @@ refillUpkeep( int foo UNUSED, short bar UNUSED, void * vmgr )
     while(( tor = tr_torrentNext( mgr->session, tor )))
     {
         Torrent * t = tor->torrentPeers;
-        const int n = t->requestCount;
-        if( n > 0 )
+        struct block_request * it = t->oldestRequest;
+
+        /* the age list is oldest-first, so stop at the first young request */
+        while( ( it != NULL ) && ( it->sentAt <= too_old ) )
         {
-            int keepCount = 0;
-            int cancelCount = 0;
-            struct block_request * cancel = tr_new( struct block_request, n );
-            const struct block_request * it;
-            const struct block_request * end;
+            struct block_request * next = it->ageNext;
+            tr_peer * peer = it->peer;
+            const tr_block_index_t block = it->block;
 
-            for( it=t->requests, end=it+n; it!=end; ++it )
+            if( ( peer != NULL ) && ( peer->msgs != NULL ) && !tr_peerMsgsIsReadingBlock( peer->msgs, block ) )
             {
-                if( ( it->sentAt <= too_old ) && it->peer->msgs && !tr_peerMsgsIsReadingBlock( it->peer->msgs, it->block ) )
-                    cancel[cancelCount++] = *it;
-                else
-                {
-                    if( it != &t->requests[keepCount] )
-                        t->requests[keepCount] = *it;
-                    keepCount++;
-                }
-            }
+                /* send a cancel message and forget the request */
+                tr_historyAdd( &peer->cancelsSentToPeer, now, 1 );
+                tr_peerMsgsCancel( peer->msgs, block );
+                requestListRemoveRequest( t, it );
 
-            /* prune out the ones we aren't keeping */
-            t->requestCount = keepCount;
-
-            /* send cancel messages for all the "cancel" ones */
-            for( it=cancel, end=it+cancelCount; it!=end; ++it ) {
-                if( ( it->peer != NULL ) && ( it->peer->msgs != NULL ) ) {
-                    tr_historyAdd( &it->peer->cancelsSentToPeer, now, 1 );
-                    tr_peerMsgsCancel( it->peer->msgs, it->block );
-                    decrementPendingReqCount( it );
-                }
+                /* decrement the pending request count for the timed-out block */
+                pieceListRemoveRequest( t, block );
             }
 
-            /* decrement the pending request counts for the timed-out blocks */
-            for( it=cancel, end=it+cancelCount; it!=end; ++it )
-                pieceListRemoveRequest( t, it->block );
-
-            /* cleanup loop */
-            tr_free( cancel );
+            it = next;
         }
     }
 
@@ -1587,17 +2278,14 @@ removeRequestFromTables( Torrent * t, tr_block_index_t block, const tr_peer * pe
 static void
 peerDeclinedAllRequests( Torrent * t, const tr_peer * peer )
 {
-    int i, n;
-    tr_block_index_t * blocks = tr_new( tr_block_index_t, t->requestCount );
-
-    for( i=n=0; i<t->requestCount; ++i )
-        if( peer == t->requests[i].peer )
-            blocks[n++] = t->requests[i].block;
-
-    for( i=0; i<n; ++i )
-        removeRequestFromTables( t, blocks[i], peer );
+    struct block_request * req;
 
-    tr_free( blocks );
+    while(( req = peer->blockRequests ))
+    {
+        const tr_block_index_t block = req->block;
+        requestListRemoveRequest( t, req );
+        pieceListRemoveRequest( t, block );
+    }
 }
 
 static void
@@ -1641,6 +2329,8 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
                 tr_incrReplicationOfPiece( t, e->pieceIndex );
                 assertReplicationCountIsExact( t );
             }
+            if( wantedPiecesIsValid( t ) && tr_bitfieldHas( &t->wantedPieces, e->pieceIndex ) )
+                ++peer->interestingCount;
             break;
 
         case TR_PEER_CLIENT_GOT_HAVE_ALL:
@@ -1648,10 +2338,13 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
                 tr_incrReplication( t );
                 assertReplicationCountIsExact( t );
             }
+            if( wantedPiecesIsValid( t ) )
+                peerCountInteresting( t, peer );
             break;
 
         case TR_PEER_CLIENT_GOT_HAVE_NONE:
-            /* noop */
+            if( wantedPiecesIsValid( t ) )
+                peerCountInteresting( t, peer );
             break;
 
         case TR_PEER_CLIENT_GOT_BITFIELD:
@@ -1660,6 +2353,8 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
                 tr_incrReplicationFromBitfield( t, e->bitfield );
                 assertReplicationCountIsExact( t );
             }
+            if( wantedPiecesIsValid( t ) )
+                peerCountInteresting( t, peer );
             break;
 
         case TR_PEER_CLIENT_GOT_REJ:
@@ -1710,27 +2405,22 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
         {
             tr_torrent * tor = t->tor;
             tr_block_index_t block = _tr_block( tor, e->pieceIndex, e->offset );
-            int i, peerCount;
-            tr_peer ** peers;
-            tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
+            struct block_request * req;
 
             removeRequestFromTables( t, block, peer );
-            getBlockRequestPeers( t, block, &peerArr );
-            peers = (tr_peer **) tr_ptrArrayPeek( &peerArr, &peerCount );
 
             /* remove additional block requests and send cancel to peers */
-            for( i=0; i<peerCount; i++ ) {
-                tr_peer * p = peers[i];
+            while(( req = blockRequestFirst( t, block ) )) {
+                tr_peer * p = req->peer;
                 assert( p != peer );
-                if( p->msgs ) {
+                if( p && p->msgs ) {
                     tr_historyAdd( &p->cancelsSentToPeer, tr_time( ), 1 );
                     tr_peerMsgsCancel( p->msgs, block );
                 }
-                removeRequestFromTables( t, block, p );
+                requestListRemoveRequest( t, req );
+                pieceListRemoveRequest( t, block );
             }
 
-            tr_ptrArrayDestruct( &peerArr, FALSE );
-
             if( peer->atom )
                 tr_historyAdd( &peer->blocksSentToClient, tr_time( ), 1 );
 
@@ -1744,7 +2434,7 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
             else
             {
                 tr_cpBlockAdd( &tor->completion, block );
-                pieceListResortPiece( t, pieceListLookup( t, e->pieceIndex ) );
+                pieceListBlockAdded( t, e->pieceIndex );
                 tr_torrentSetDirty( tor );
 
                 if( tr_cpPieceIsComplete( &tor->completion, e->pieceIndex ) )
@@ -1766,9 +2456,11 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
                     {
                         gotBadPiece( t, p );
                     }
-                    else
+
+                    wantedPiecesUpdate( t, p );
+
+                    if( ok )
                     {
-                        int i;
                         int peerCount;
                         tr_peer ** peers;
                         tr_file_index_t fileIndex;
@@ -1786,16 +2478,14 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
 
                         peerCount = tr_ptrArraySize( &t->peers );
                         peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
-                        for( i=0; i<peerCount; ++i )
-                            tr_peerMsgsHave( peers[i]->msgs, p );
+                        tr_peerMsgsBroadcastHave( peers, peerCount, p );
 
                         for( fileIndex=0; fileIndex<tor->info.fileCount; ++fileIndex ) {
                             const tr_file * file = &tor->info.files[fileIndex];
                             if( ( file->firstPiece <= p ) && ( p <= file->lastPiece ) ) {
-                                if( tr_cpFileIsComplete( &tor->completion, fileIndex ) ) {
-                                    tr_cacheFlushFile( tor->session->cache, tor, fileIndex );
-                                    tr_torrentFileCompleted( tor, fileIndex );
-                                }
+                                if( tr_cpFileIsComplete( &tor->completion, fileIndex ) )
+                                    tr_cacheFlushFile( tor->session->cache, tor, fileIndex,
+                                                       tr_torrentFileCompleted );
                             }
                         }
 
@@ -1847,6 +2537,9 @@ getDefaultShelfLife( uint8_t from )
     }
 }
 
+static void candidateAdd( Torrent *, struct peer_atom *, time_t );
+static void candidateUpdate( Torrent *, struct peer_atom * );
+
 static void
 ensureAtomExists( Torrent           * t,
                   const tr_address  * addr,
@@ -1865,7 +2558,7 @@ ensureAtomExists( Torrent           * t,
     if( a == NULL )
     {
         const int jitter = tr_cryptoWeakRandInt( 60*10 );
-        a = tr_new0( struct peer_atom, 1 );
+        a = atomNew( t->manager );
         a->addr = *addr;
         a->port = port;
         a->flags = flags;
@@ -1874,7 +2567,9 @@ ensureAtomExists( Torrent           * t,
         a->shelf_date = tr_time( ) + getDefaultShelfLife( from ) + jitter;
         a->blocklisted = -1;
         atomSetSeedProbability( a, seedProbability );
-        tr_ptrArrayInsertSorted( &t->pool, a, compareAtomsByAddress );
+        a->candidateHeap = -1;
+        atomIndexAdd( t, a );
+        candidateAdd( t, a, tr_time( ) );
 
         tordbg( t, "got a new atom: %s", tr_atomAddrStr( a ) );
     }
@@ -1887,6 +2582,7 @@ ensureAtomExists( Torrent           * t,
             atomSetSeedProbability( a, seedProbability );
 
         a->flags |= flags;
+        candidateUpdate( t, a );
     }
 }
 
@@ -2104,6 +2800,8 @@ tr_peerMgrMarkAllAsSeeds( tr_torrent * tor )
 
     while( it != end )
         atomSetSeed( t, *it++ );
+
+    t->candidatesDirty = TRUE;
 }
 
 tr_pex *
@@ -2382,6 +3080,8 @@ tr_peerMgrStartTorrent( tr_torrent * tor )
     t->isRunning = TRUE;
     t->maxPeers = t->tor->maxConnectedPeers;
     t->pieceSortState = PIECES_UNSORTED;
+    t->wantedPiecesDirty = TRUE; /* the files may have been verified */
+    t->candidatesDirty = TRUE;
 
     rechokePulse( 0, 0, t->manager );
 }
@@ -2723,22 +3423,34 @@ tr_peerMgrClearInterest( tr_torrent * tor )
         const tr_peer * peer = tr_ptrArrayNth( &t->peers, i );
         tr_peerMsgsSetInterested( peer->msgs, FALSE );
     }
+
+    t->wantedPiecesDirty = TRUE;
 }
 
-/* do we still want this piece and does the peer have it? */
-static tr_bool
-isPieceInteresting( const tr_torrent * tor, const tr_peer * peer, tr_piece_index_t index )
+void
+tr_peerMgrDiskReadDone( tr_torrent * tor )
 {
-    return ( !tor->info.pieces[index].dnd ) /* we want it */
-        && ( !tr_cpPieceIsComplete( &tor->completion, index ) )  /* we don't have it */
-        && ( tr_bitsetHas( &peer->have, index ) ); /* peer has it */
+    int i;
+    Torrent * t = tor->torrentPeers;
+
+    assert( tr_isTorrent( tor ) );
+
+    torrentLock( t );
+
+    for( i=0; i<tr_ptrArraySize( &t->peers ); ++i )
+    {
+        tr_peer * peer = tr_ptrArrayNth( &t->peers, i );
+        tr_peerMsgsDiskReadDone( peer->msgs );
+    }
+
+    torrentUnlock( t );
 }
 
 /* does this peer have any pieces that we want? */
 static tr_bool
-isPeerInteresting( const tr_torrent * tor, const tr_peer * peer )
+isPeerInteresting( Torrent * t, const tr_peer * peer )
 {
-    tr_piece_index_t i, n;
+    const tr_torrent * tor = t->tor;
 
     if ( tr_torrentIsSeed( tor ) )
         return FALSE;
@@ -2746,11 +3458,10 @@ isPeerInteresting( const tr_torrent * tor, const tr_peer * peer )
     if( !tr_torrentIsPieceTransferAllowed( tor, TR_PEER_TO_CLIENT ) )
         return FALSE;
 
-    for( i=0, n=tor->info.pieceCount; i<n; ++i )
-        if( isPieceInteresting( tor, peer, i ) )
-            return TRUE;
+    if( !wantedPiecesIsValid( t ) )
+        wantedPiecesRebuild( t );
 
-    return FALSE;
+    return peer->interestingCount > 0;
 }
 
 /* determines who we send "interested" messages to */
@@ -2851,7 +3562,7 @@ rechokeDownloads( Torrent * t )
             const int i = tr_cryptoWeakRandInt( n );
             tr_peer * peer = tr_ptrArrayNth( &t->peers, i );
 
-            if( !isPeerInteresting( t->tor, peer ) )
+            if( !isPeerInteresting( t, peer ) )
             {
                 tr_peerMsgsSetInterested( peer->msgs, FALSE );
             }
@@ -3484,6 +4195,93 @@ pumpAllPeers( tr_peerMgr * mgr )
     }
 }
 
+/***
+****
+****  Prefetching
+****
+***/
+
+void
+tr_peerMgrPeerRequestAdded( tr_torrent * tor, tr_piece_index_t piece )
+{
+    Torrent * t = tor->torrentPeers;
+    tr_peerMgr * mgr = t->manager;
+
+    if( t->prefetchDemand == NULL )
+    {
+        t->prefetchDemandSize = tor->info.pieceCount;
+        t->prefetchDemand = tr_new0( uint32_t, t->prefetchDemandSize );
+    }
+
+    if( piece >= t->prefetchDemandSize )
+        return;
+
+    /* the first request for this piece queues it for prefetching */
+    if( ( t->prefetchDemand[piece]++ == 0 ) && tor->session->isPrefetchEnabled )
+    {
+        struct prefetch_piece * p;
+
+        if( mgr->prefetchCount == mgr->prefetchAlloc )
+        {
+            mgr->prefetchAlloc = mgr->prefetchAlloc ? mgr->prefetchAlloc * 2 : 64;
+            mgr->prefetch = tr_renew( struct prefetch_piece, mgr->prefetch, mgr->prefetchAlloc );
+        }
+
+        p = &mgr->prefetch[mgr->prefetchCount++];
+        p->tor = tor;
+        p->piece = piece;
+    }
+}
+
+void
+tr_peerMgrPeerRequestRemoved( tr_torrent * tor, tr_piece_index_t piece )
+{
+    Torrent * t = tor->torrentPeers;
+
+    if( ( piece < t->prefetchDemandSize ) && ( t->prefetchDemand[piece] > 0 ) )
+        --t->prefetchDemand[piece];
+}
+
+/* Read the pieces the peers are waiting on into the cache before the
+ * peers' requests reach them, in the order the peers first asked.
+ * Requests for the same piece become a single whole-piece read, so
+ * busy seeds read from disk sequentially instead of a block at a time.
+ * The cache decides how far ahead to read based on how fast the disk is. */
+static void
+prefetchPulse( tr_peerMgr * mgr )
+{
+    int i;
+
+    if( !mgr->session->isPrefetchEnabled )
+    {
+        mgr->prefetchCount = 0;
+        return;
+    }
+
+    for( i=0; i<mgr->prefetchCount; ++i )
+    {
+        const struct prefetch_piece * p = &mgr->prefetch[i];
+        tr_torrent * tor = p->tor;
+        const Torrent * t = tor->torrentPeers;
+
+        if( !tor->isRunning )
+            continue;
+
+        /* skip the pieces nobody's waiting on anymore */
+        if( ( p->piece >= t->prefetchDemandSize ) || !t->prefetchDemand[p->piece] )
+            continue;
+
+        /* the cache is reading as far ahead as it wants to;
+         * leave the rest for the next pulse */
+        if( !tr_cachePrefetchPiece( mgr->session->cache, tor, p->piece ) )
+            break;
+    }
+
+    /* drop the pieces that were handed off or skipped */
+    mgr->prefetchCount -= i;
+    memmove( mgr->prefetch, mgr->prefetch + i, sizeof( struct prefetch_piece ) * mgr->prefetchCount );
+}
+
 static void
 bandwidthPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 {
@@ -3521,6 +4319,8 @@ bandwidthPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 
     reconnectPulse( 0, 0, mgr );
 
+    prefetchPulse( mgr );
+
     tr_timerAddMsec( mgr->bandwidthTimer, BANDWIDTH_PERIOD_MSEC );
     managerUnlock( mgr );
 }
@@ -3529,18 +4329,6 @@ bandwidthPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 ****
 ***/
 
-static int
-compareAtomPtrsByAddress( const void * va, const void *vb )
-{
-    const struct peer_atom * a = * (const struct peer_atom**) va;
-    const struct peer_atom * b = * (const struct peer_atom**) vb;
-
-    assert( tr_isAtom( a ) );
-    assert( tr_isAtom( b ) );
-
-    return tr_compareAddresses( &a->addr, &b->addr );
-}
-
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate( const void * va, const void *vb )
@@ -3568,6 +4356,40 @@ compareAtomPtrsByShelfDate( const void * va, const void *vb )
     return 0;
 }
 
+/* heap[0] is the worst of the atoms in the heap */
+static void
+atomHeapSiftDown( struct peer_atom ** heap, int heapCount, int i )
+{
+    for( ;; )
+    {
+        int worst = i;
+        const int left = 2 * i + 1;
+        const int right = left + 1;
+        struct peer_atom * tmp;
+
+        if( left < heapCount && compareAtomPtrsByShelfDate( &heap[left], &heap[worst] ) > 0 )
+            worst = left;
+        if( right < heapCount && compareAtomPtrsByShelfDate( &heap[right], &heap[worst] ) > 0 )
+            worst = right;
+        if( worst == i )
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void
+atomHeapify( struct peer_atom ** heap, int heapCount )
+{
+    int i;
+
+    for( i=heapCount/2-1; i>=0; --i )
+        atomHeapSiftDown( heap, heapCount, i );
+}
+
 static int
 getMaxAtomCount( const tr_torrent * tor )
 {
@@ -3595,47 +4417,61 @@ atomPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
         if( atomCount > maxAtomCount ) /* we've got too many atoms... time to prune */
         {
             int i;
+            int room;
             int keepCount = 0;
-            int testCount = 0;
+            int heapCount = 0;
             struct peer_atom ** keep = tr_new( struct peer_atom*, atomCount );
-            struct peer_atom ** test = tr_new( struct peer_atom*, atomCount );
 
             /* keep the ones that are in use */
-            for( i=0; i<atomCount; ++i ) {
+            for( i=0; i<atomCount; ++i )
+                if( peerIsInUse( t, atoms[i] ) )
+                    keep[keepCount++] = atoms[i];
+
+            /* if there's room, keep the best of what's left. The candidates
+             * for the remaining room are held in a heap with the worst one
+             * on top, so each newcomer only has to beat that one to get in */
+            room = MAX( maxAtomCount - keepCount, 0 );
+            for( i=0; i<atomCount; ++i )
+            {
+                struct peer_atom ** heap = keep + keepCount;
                 struct peer_atom * atom = atoms[i];
+
                 if( peerIsInUse( t, atom ) )
-                    keep[keepCount++] = atom;
-                else
-                    test[testCount++] = atom;
-            }
+                    continue;
 
-            /* if there's room, keep the best of what's left */
-            i = 0;
-            if( keepCount < maxAtomCount ) {
-                qsort( test, testCount, sizeof( struct peer_atom * ), compareAtomPtrsByShelfDate );
-                while( i<testCount && keepCount<maxAtomCount )
-                    keep[keepCount++] = test[i++];
+                if( heapCount < room ) {
+                    heap[heapCount++] = atom;
+                    if( heapCount == room )
+                        atomHeapify( heap, heapCount );
+                }
+                else if( room && compareAtomPtrsByShelfDate( &atom, &heap[0] ) < 0 ) {
+                    atomFree( mgr, heap[0] );
+                    heap[0] = atom;
+                    atomHeapSiftDown( heap, heapCount, 0 );
+                }
+                else {
+                    atomFree( mgr, atom );
+                }
             }
+            keepCount += heapCount;
 
-            /* free the culled atoms */
-            while( i<testCount )
-                tr_free( test[i++] );
-
-            /* rebuild Torrent.pool with what's left */
+            /* rebuild Torrent.pool and its index with what's left */
             tr_ptrArrayDestruct( &t->pool, NULL );
             t->pool = TR_PTR_ARRAY_INIT;
-            qsort( keep, keepCount, sizeof( struct peer_atom * ), compareAtomPtrsByAddress );
             for( i=0; i<keepCount; ++i )
                 tr_ptrArrayAppend( &t->pool, keep[i] );
+            atomIndexRebuild( t, keepCount );
+            t->candidatesDirty = TRUE;
 
             tordbg( t, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount );
 
             /* cleanup */
-            tr_free( test );
             tr_free( keep );
         }
     }
 
+    atomSlabsTrim( mgr );
+
     tr_timerAddMsec( mgr->atomTimer, ATOM_PERIOD_MSEC );
     managerUnlock( mgr );
 }
@@ -3646,32 +4482,54 @@ atomPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 ****
 ***/
 
-/* is this atom someone that we'd want to initiate a connection to? */
-static tr_bool
-isPeerCandidate( const tr_torrent * tor, struct peer_atom * atom, const time_t now )
+enum
 {
+    CANDIDATE_YES,
+    CANDIDATE_LATER,
+    CANDIDATE_NO
+};
+
+/**
+ * Is this atom someone that we'd want to initiate a connection to?
+ * If it's CANDIDATE_LATER, `setmeWakeTime' is set to when to ask again.
+ * CANDIDATE_NO won't change until candidatesRebuild() is called.
+ */
+static int
+getCandidateState( const tr_torrent  * tor,
+                   struct peer_atom  * atom,
+                   const time_t        now,
+                   time_t            * setmeWakeTime )
+{
+    int interval;
+
+    /* not if we've already got a connection to them...
+       but see if we do again once they've had time to finish */
+    if( peerIsInUse( tor->torrentPeers, atom ) ) {
+        *setmeWakeTime = now + MINIMUM_RECONNECT_INTERVAL_SECS;
+        return CANDIDATE_LATER;
+    }
+
     /* not if we're both seeds */
     if( tr_torrentIsSeed( tor ) )
         if( atomIsSeed( atom ) || ( atom->uploadOnly == UPLOAD_ONLY_YES ) )
-            return FALSE;
-
-    /* not if we've already got a connection to them... */
-    if( peerIsInUse( tor->torrentPeers, atom ) )
-        return FALSE;
-
-    /* not if we just tried them already */
-    if( ( now - atom->time ) < getReconnectIntervalSecs( atom, now ) )
-        return FALSE;
+            return CANDIDATE_NO;
 
     /* not if they're blocklisted */
     if( isAtomBlocklisted( tor->session, atom ) )
-        return FALSE;
+        return CANDIDATE_NO;
 
     /* not if they're banned... */
     if( atom->flags2 & MYFLAG_BANNED )
-        return FALSE;
+        return CANDIDATE_NO;
+
+    /* not if we just tried them already */
+    interval = getReconnectIntervalSecs( atom, now );
+    if( ( now - atom->time ) < interval ) {
+        *setmeWakeTime = atom->time + interval;
+        return CANDIDATE_LATER;
+    }
 
-    return TRUE;
+    return CANDIDATE_YES;
 }
 
 struct peer_candidate
@@ -3695,7 +4553,9 @@ addValToKey( uint64_t value, int width, uint64_t addme )
     return value;
 }
 
-/* smaller value is better */
+/* smaller value is better. If `tor' is NULL, the torrent's fields are
+ * left zeroed. They're the same for all of a torrent's atoms, so that
+ * score still ranks the atoms within the torrent */
 static uint64_t
 getPeerCandidateScore( const tr_torrent * tor, const struct peer_atom * atom, uint8_t salt  )
 {
@@ -3712,7 +4572,8 @@ getPeerCandidateScore( const tr_torrent * tor, const struct peer_atom * atom, ui
     score = addValToKey( score, 32, i );
 
     /* prefer peers belonging to a torrent of a higher priority */
-    switch( tr_torrentGetPriority( tor ) ) {
+    if( tor == NULL ) i = 0;
+    else switch( tr_torrentGetPriority( tor ) ) {
         case TR_PRI_HIGH:    i = 0; break;
         case TR_PRI_NORMAL:  i = 1; break;
         case TR_PRI_LOW:     i = 2; break;
@@ -3720,11 +4581,11 @@ getPeerCandidateScore( const tr_torrent * tor, const struct peer_atom * atom, ui
     score = addValToKey( score, 4, i );
 
     /* prefer recently-started torrents */
-    i = torrentWasRecentlyStarted( tor ) ? 0 : 1;
+    i = ( tor != NULL ) && !torrentWasRecentlyStarted( tor ) ? 1 : 0;
     score = addValToKey( score, 1, i );
 
     /* prefer torrents we're downloading with */
-    i = tr_torrentIsSeed( tor ) ? 1 : 0;
+    i = ( tor != NULL ) && tr_torrentIsSeed( tor ) ? 1 : 0;
     score = addValToKey( score, 1, i );
 
     /* prefer peers that are known to be connectible */
@@ -3748,87 +4609,220 @@ getPeerCandidateScore( const tr_torrent * tor, const struct peer_atom * atom, ui
     return score;
 }
 
-/* sort an array of peer candidates */
-static int
-comparePeerCandidates( const void * va, const void * vb )
+/***
+****  Each torrent keeps the atoms it might connect to in two heaps:
+****  the ones it could connect to now, keyed by their score without
+****  the torrent's fields, and the ones it can't yet, keyed by when
+****  they might be ready. Scores and states are updated where that's
+****  cheap and rechecked when an atom reaches the top, so picking the
+****  best atoms doesn't have to look at the rest of them.
+***/
+
+static void
+candidateHeapSet( struct candidate_heap * heap, int pos, struct peer_atom * atom )
+{
+    heap->atoms[pos] = atom;
+    atom->candidatePos = pos;
+}
+
+/* move the atom at `pos' up or down to where its key belongs */
+static void
+candidateHeapFix( struct candidate_heap * heap, int pos )
 {
-    const struct peer_candidate * a = va;
-    const struct peer_candidate * b = vb;
+    struct peer_atom * atom = heap->atoms[pos];
 
-    if( a->score < b->score ) return -1;
-    if( a->score > b->score ) return 1;
+    while( pos > 0 )
+    {
+        const int parent = ( pos - 1 ) / 2;
 
-    return 0;
+        if( heap->atoms[parent]->candidateKey <= atom->candidateKey )
+            break;
+
+        candidateHeapSet( heap, pos, heap->atoms[parent] );
+        pos = parent;
+    }
+
+    for( ;; )
+    {
+        int child = 2 * pos + 1;
+
+        if( child >= heap->count )
+            break;
+        if( ( child + 1 < heap->count ) && ( heap->atoms[child+1]->candidateKey < heap->atoms[child]->candidateKey ) )
+            ++child;
+        if( atom->candidateKey <= heap->atoms[child]->candidateKey )
+            break;
+
+        candidateHeapSet( heap, pos, heap->atoms[child] );
+        pos = child;
+    }
+
+    candidateHeapSet( heap, pos, atom );
 }
 
-/** @return an array of all the atoms we might want to connect to */
-static struct peer_candidate*
-getPeerCandidates( tr_session * session, int * candidateCount )
+static void
+candidatePush( Torrent * t, int which, struct peer_atom * atom, uint64_t key )
 {
-    int n;
-    tr_torrent * tor;
-    struct peer_candidate * candidates;
-    struct peer_candidate * walk;
-    const time_t now = tr_time( );
-    const uint64_t now_msec = tr_time_msec( );
-    /* leave 5% of connection slots for incoming connections -- ticket #2609 */
-    const int maxCandidates = tr_sessionGetPeerLimit( session ) * 0.95;
+    struct candidate_heap * heap = &t->candidates[which];
 
-    /* don't start any new handshakes if we're full up */
-    n = 0;
-    tor= NULL;
-    while(( tor = tr_torrentNext( session, tor )))
-        n += tr_ptrArraySize( &tor->torrentPeers->peers );
-    if( maxCandidates <= n ) {
-        *candidateCount = 0;
-        return NULL;
+    if( heap->count == heap->alloc ) {
+        heap->alloc = heap->alloc ? heap->alloc * 2 : 64;
+        heap->atoms = tr_renew( struct peer_atom*, heap->atoms, heap->alloc );
     }
 
-    /* allocate an array of candidates */
-    n = 0;
-    tor= NULL;
-    while(( tor = tr_torrentNext( session, tor )))
-        n += tr_ptrArraySize( &tor->torrentPeers->pool );
-    walk = candidates = tr_new( struct peer_candidate, n );
+    atom->candidateKey = key;
+    atom->candidateHeap = which;
+    candidateHeapSet( heap, heap->count++, atom );
+    candidateHeapFix( heap, atom->candidatePos );
+}
 
-    /* populate the candidate array */
-    tor = NULL;
-    while(( tor = tr_torrentNext( session, tor )))
+static void
+candidateRemove( Torrent * t, struct peer_atom * atom )
+{
+    if( atom->candidateHeap >= 0 )
     {
-        int i, nAtoms;
-        struct peer_atom ** atoms;
+        struct candidate_heap * heap = &t->candidates[atom->candidateHeap];
+        struct peer_atom * last = heap->atoms[--heap->count];
 
-        if( !tor->torrentPeers->isRunning )
-            continue;
+        if( last != atom ) {
+            candidateHeapSet( heap, atom->candidatePos, last );
+            candidateHeapFix( heap, last->candidatePos );
+        }
 
-        /* if we've already got enough peers in this torrent... */
-        if( tr_torrentGetPeerLimit( tor ) <= tr_ptrArraySize( &tor->torrentPeers->peers ) )
-            continue;
+        atom->candidateHeap = -1;
+    }
+}
 
-        /* if we've already got enough speed in this torrent... */
-        if( tr_torrentIsSeed( tor ) && isBandwidthMaxedOut( tor->bandwidth, now_msec, TR_UP ) )
-            continue;
+static void
+candidateAdd( Torrent * t, struct peer_atom * atom, time_t now )
+{
+    time_t wake;
 
-        atoms = (struct peer_atom**) tr_ptrArrayPeek( &tor->torrentPeers->pool, &nAtoms );
-        for( i=0; i<nAtoms; ++i )
-        {
-            struct peer_atom * atom = atoms[i];
+    if( t->candidatesDirty )
+        return;
 
-            if( isPeerCandidate( tor, atom, now ) )
-            {
-                const uint8_t salt = tr_cryptoWeakRandInt( 1024 );
-                walk->tor = tor;
-                walk->atom = atom;
-                walk->score = getPeerCandidateScore( tor, atom, salt );
-                ++walk;
-            }
+    assert( atom->candidateHeap < 0 );
+
+    switch( getCandidateState( t->tor, atom, now, &wake ) )
+    {
+        case CANDIDATE_YES: {
+            const uint8_t salt = tr_cryptoWeakRandInt( 256 );
+            candidatePush( t, CANDIDATES_READY, atom, getPeerCandidateScore( NULL, atom, salt ) );
+            break;
+        }
+
+        case CANDIDATE_LATER:
+            candidatePush( t, CANDIDATES_WAITING, atom, (uint64_t)wake );
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* the salt is the low byte of the score, so it survives rescoring */
+static uint64_t
+candidateRescore( const struct peer_atom * atom )
+{
+    return getPeerCandidateScore( NULL, atom, (uint8_t)atom->candidateKey );
+}
+
+/* call this when an atom's score may have changed */
+static void
+candidateUpdate( Torrent * t, struct peer_atom * atom )
+{
+    if( !t->candidatesDirty && ( atom->candidateHeap == CANDIDATES_READY ) )
+    {
+        const uint64_t key = candidateRescore( atom );
+
+        if( atom->candidateKey != key ) {
+            atom->candidateKey = key;
+            candidateHeapFix( &t->candidates[CANDIDATES_READY], atom->candidatePos );
+        }
+    }
+}
+
+static void
+candidatesRebuild( Torrent * t, time_t now )
+{
+    int i;
+    const int n = tr_ptrArraySize( &t->pool );
+
+    for( i=0; i<CANDIDATE_HEAPS; ++i )
+        t->candidates[i].count = 0;
+
+    t->candidatesDirty = FALSE;
+    t->candidatesAreForSeed = tr_torrentIsSeed( t->tor );
+
+    for( i=0; i<n; ++i ) {
+        struct peer_atom * atom = tr_ptrArrayNth( &t->pool, i );
+        atom->candidateHeap = -1;
+        candidateAdd( t, atom, now );
+    }
+}
+
+/** @return the torrent's best candidate, or NULL if it hasn't got one */
+static struct peer_atom*
+candidatesPeek( Torrent * t, time_t now )
+{
+    struct candidate_heap * ready = &t->candidates[CANDIDATES_READY];
+    struct candidate_heap * waiting = &t->candidates[CANDIDATES_WAITING];
+
+    if( t->candidatesDirty || ( t->candidatesAreForSeed != tr_torrentIsSeed( t->tor ) ) )
+        candidatesRebuild( t, now );
+
+    /* look at the atoms whose wait is over */
+    while( waiting->count && ( waiting->atoms[0]->candidateKey <= (uint64_t)now ) )
+    {
+        struct peer_atom * atom = waiting->atoms[0];
+        candidateRemove( t, atom );
+        candidateAdd( t, atom, now );
+    }
+
+    /* make sure the one on top is still current */
+    while( ready->count )
+    {
+        time_t wake;
+        struct peer_atom * atom = ready->atoms[0];
+        const uint64_t key = candidateRescore( atom );
+
+        if( getCandidateState( t->tor, atom, now, &wake ) != CANDIDATE_YES ) {
+            candidateRemove( t, atom );
+            candidateAdd( t, atom, now );
+        }
+        else if( atom->candidateKey != key ) {
+            atom->candidateKey = key;
+            candidateHeapFix( ready, 0 );
+        }
+        else {
+            return atom;
         }
     }
 
-    *candidateCount = walk - candidates;
-    if( *candidateCount > 1 )
-        qsort( candidates, *candidateCount, sizeof( struct peer_candidate ), comparePeerCandidates );
-    return candidates;
+    return NULL;
+}
+
+/* keep the session's best candidate on top of a heap of the torrents' best */
+static void
+peerCandidatesSiftDown( struct peer_candidate * heap, int count, int pos )
+{
+    for( ;; )
+    {
+        struct peer_candidate tmp;
+        int child = 2 * pos + 1;
+
+        if( child >= count )
+            break;
+        if( ( child + 1 < count ) && ( heap[child+1].score < heap[child].score ) )
+            ++child;
+        if( heap[pos].score <= heap[child].score )
+            break;
+
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
 }
 
 static void
@@ -3902,12 +4896,72 @@ static void
 makeNewPeerConnections( struct tr_peerMgr * mgr, const int max )
 {
     int i, n;
-    struct peer_candidate * candidates;
+    tr_torrent * tor;
+    struct peer_candidate * best;
+    tr_session * session = mgr->session;
+    const time_t now = tr_time( );
+    const uint64_t now_msec = tr_time_msec( );
+    /* leave 5% of connection slots for incoming connections -- ticket #2609 */
+    const int maxCandidates = tr_sessionGetPeerLimit( session ) * 0.95;
+
+    /* don't start any new handshakes if we're full up */
+    n = 0;
+    tor = NULL;
+    while(( tor = tr_torrentNext( session, tor )))
+        n += tr_ptrArraySize( &tor->torrentPeers->peers );
+    if( maxCandidates <= n )
+        return;
+
+    /* get each torrent's best candidate */
+    n = 0;
+    tor = NULL;
+    best = tr_new( struct peer_candidate, session->torrentCount );
+    while(( tor = tr_torrentNext( session, tor )))
+    {
+        struct peer_atom * atom;
+        Torrent * t = tor->torrentPeers;
+
+        if( !t->isRunning )
+            continue;
+
+        /* if we've already got enough peers in this torrent... */
+        if( tr_torrentGetPeerLimit( tor ) <= tr_ptrArraySize( &t->peers ) )
+            continue;
+
+        /* if we've already got enough speed in this torrent... */
+        if( tr_torrentIsSeed( tor ) && isBandwidthMaxedOut( tor->bandwidth, now_msec, TR_UP ) )
+            continue;
+
+        if(( atom = candidatesPeek( t, now ))) {
+            best[n].tor = tor;
+            best[n].atom = atom;
+            best[n].score = getPeerCandidateScore( tor, atom, (uint8_t)atom->candidateKey );
+            ++n;
+        }
+    }
+
+    for( i=n/2-1; i>=0; --i )
+        peerCandidatesSiftDown( best, n, i );
+
+    /* connect to the best of them */
+    for( i=0; i<max && n>0; ++i )
+    {
+        struct peer_candidate * c = &best[0];
+        Torrent * t = c->tor->torrentPeers;
 
-    candidates = getPeerCandidates( mgr->session, &n );
+        initiateCandidateConnection( mgr, c );
 
-    for( i=0; i<n && i<max; ++i )
-        initiateCandidateConnection( mgr, &candidates[i] );
+        /* the atom's in use now, so this moves it to the waiting heap */
+        candidateRemove( t, c->atom );
+        candidateAdd( t, c->atom, now );
+
+        if(( c->atom = candidatesPeek( t, now )))
+            c->score = getPeerCandidateScore( c->tor, c->atom, (uint8_t)c->atom->candidateKey );
+        else
+            *c = best[--n];
+
+        peerCandidatesSiftDown( best, n, 0 );
+    }
 
-    tr_free( candidates );
+    tr_free( best );
 }
@@ -108,6 +108,12 @@ typedef struct tr_peer
     /* how many requests we've made and are currently awaiting a response for */
     int                      pendingReqsToPeer;
 
+    /* the requests we've made to this peer. owned by peer-mgr.c */
+    struct block_request   * blockRequests;
+
+    /* how many of the pieces we still want this peer has. owned by peer-mgr.c */
+    int                      interestingCount;
+
     struct tr_peerIo       * io;
     struct peer_atom       * atom;
 
@@ -146,6 +152,8 @@ tr_peerMgr* tr_peerMgrNew( tr_session * );
 
 void tr_peerMgrFree( tr_peerMgr * manager );
 
+void tr_peerMgrGetPoolStats( tr_peerMgr * manager, tr_peer_pool_stats * setme );
+
 tr_bool tr_peerMgrPeerIsSeed( const tr_torrent * tor,
                               const tr_address * addr );
 
@@ -168,6 +176,14 @@ tr_bool tr_peerMgrDidPeerRequest( const tr_torrent  * torrent,
 
 void tr_peerMgrRebuildRequests( tr_torrent * torrent );
 
+/** @brief a peer asked us for a block in this piece. The pieces that
+    peers are waiting on are read into the cache ahead of their requests */
+void tr_peerMgrPeerRequestAdded( tr_torrent * torrent, tr_piece_index_t piece );
+
+/** @brief a peer's request for a block in this piece was sent, cancelled,
+    or dropped */
+void tr_peerMgrPeerRequestRemoved( tr_torrent * torrent, tr_piece_index_t piece );
+
 void tr_peerMgrAddIncoming( tr_peerMgr  * manager,
                             tr_address  * addr,
                             tr_port       port,
@@ -258,6 +274,10 @@ int tr_peerGetPieceSpeed_Bps( const tr_peer    * peer,
 
 void tr_peerMgrClearInterest( tr_torrent * tor );
 
+/** @brief called when the cache has finished reading some of the torrent's
+           blocks from disk, so that peers waiting for them can continue */
+void tr_peerMgrDiskReadDone( tr_torrent * tor );
+
 /* @} */
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h> /* memset */
 #include "transmission.h"
 #include "net.h"
 #include "peer-msgs.h"
@@ -40,6 +41,7 @@ main( void )
     size_t             numgot;
     tr_piece_index_t pieces[] = { 1059, 431, 808, 1217, 287, 376, 1188, 353, 508 };
     tr_piece_index_t buf[16];
+    tr_request_window  w;
 
     for( i = 0; i < SHA_DIGEST_LENGTH; ++i )
         infohash[i] = 0xaa;
@@ -57,6 +59,48 @@ main( void )
     for( i=0; i<numgot; ++i )
         check( buf[i] == pieces[i] );
 
+    /* request pipelining: slow start doubles the window every round trip */
+    memset( &w, 0, sizeof( w ) );
+    tr_requestWindowReset( &w );
+    check( tr_requestWindowUpdate( &w, 0, -1, 16384, 512 ) == 4 );
+    for( i=0; i<4; ++i )
+        tr_requestWindowGotBlock( &w );
+    check( tr_requestWindowUpdate( &w, 0, -1, 16384, 512 ) == 8 );
+
+    /* ...until requests start waiting in line at the peer */
+    tr_requestWindowGotRTT( &w, 100, 1000 );
+    check( w.isSlowStart );
+    tr_requestWindowGotRTT( &w, 200, 1000 );
+    check( !w.isSlowStart );
+    check( w.srtt_msec == 112 );
+
+    /* then it grows by a block per window's worth of blocks */
+    for( i=0; i<7; ++i )
+        tr_requestWindowGotBlock( &w );
+    check( w.size == 8 );
+    tr_requestWindowGotBlock( &w );
+    check( tr_requestWindowUpdate( &w, 0, -1, 16384, 512 ) == 9 );
+
+    /* a fast peer gets twice its bandwidth-delay product... */
+    check( tr_requestWindowUpdate( &w, 1024 * 1024, -1, 16384, 512 ) == 14 );
+
+    /* ...unless its share of a speed limit or its reqq says otherwise */
+    check( tr_requestWindowUpdate( &w, 1024 * 1024, 256 * 1024, 16384, 512 ) == 4 );
+    check( tr_requestWindowUpdate( &w, 1024 * 1024, -1, 16384, 2 ) == 2 );
+
+    /* a growing line at the peer shrinks the window */
+    tr_requestWindowReset( &w );
+    for( i=0; i<12; ++i )
+        tr_requestWindowGotBlock( &w );
+    tr_requestWindowGotRTT( &w, 300, 1000 );
+    check( w.size == 16 );
+    tr_requestWindowGotRTT( &w, 300, 1000 );
+    check( w.size == 14 );
+
+    /* and an old fastest round trip gives way to newer ones */
+    tr_requestWindowGotRTT( &w, 300, 1031 );
+    check( w.rttMin_msec == 300 );
+
     return 0;
 }
 
@@ -22,10 +22,12 @@
 #include <event2/event.h>
 
 #include "transmission.h"
+#include "bandwidth.h"
 #include "bencode.h"
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h"
+#include "inout.h" /* tr_ioIsResident() */
 #ifdef WIN32
 #include "net.h" /* for ECONN */
 #endif
@@ -81,6 +83,17 @@ enum
 
     REQQ                    = 512,
 
+    /* room set aside in outMessages at the start of each batch, so that
+     * its fixed-size messages are encoded into one contiguous chunk */
+    OUT_ARENA_SIZE          = 1024,
+
+    /* request pipelining, see tr_request_window */
+    REQUEST_WINDOW_MIN         = 4,
+    REQUEST_RTT_DEFAULT_MSEC   = 500, /* until we've timed one */
+    REQUEST_RTT_SLACK_MSEC     = 25,
+    REQUEST_RTT_MIN_SECS       = 30, /* how long the fastest round trip is trusted */
+    REQUEST_PROBE_TIMEOUT_SECS = 60,
+
     METADATA_REQQ           = 64,
 
     /* used in lowering the outMessages queue period */
@@ -113,13 +126,6 @@ enum
 ***
 **/
 
-struct peer_request
-{
-    uint32_t    index;
-    uint32_t    offset;
-    uint32_t    length;
-};
-
 static void
 blockToReq( const tr_torrent     * tor,
             tr_block_index_t       block,
@@ -168,14 +174,19 @@ struct tr_peermsgs
     /*tr_bool         haveFastSet;*/
 
     int             desiredRequestCount;
+    tr_request_window requestWindow;
 
-    int             prefetchCount;
+    /* true if the next block the peer asked for is being read from disk */
+    tr_bool         isWaitingForDisk;
 
     /* how long the outMessages batch should be allowed to grow before
      * it's flushed -- some messages (like requests >:) should be sent
      * very quickly; others aren't as urgent. */
     int8_t          outMessagesBatchPeriod;
 
+    /* how many messages are in the outMessages batch */
+    int             outMessagesCount;
+
     uint8_t         state;
     uint8_t         ut_pex_id;
     uint8_t         ut_metadata_id;
@@ -207,6 +218,17 @@ struct tr_peermsgs
     /*time_t                 clientSentPexAt;*/
     time_t                 clientSentAnythingAt;
 
+    /* the request we're timing to measure the round trip to the peer.
+     * It's timed from when it's written to the socket, not when it's
+     * queued, so it goes through three stages: batched in outMessages
+     * (rttProbeQueuedLen is outMessages' length up to its end), waiting
+     * in the peer-io's outbuf (rttProbeBytesLeft is how much has to be
+     * written before it's out), and sent (rttProbeSentAt is nonzero) */
+    struct peer_request    rttProbe;
+    size_t                 rttProbeQueuedLen;
+    size_t                 rttProbeBytesLeft;
+    uint64_t               rttProbeSentAt;
+
     /* when we started batching the outMessages */
     time_t                outMessagesBatchedAt;
 
@@ -301,18 +323,117 @@ dbgOutMessageLen( tr_peermsgs * msgs )
     dbgmsg( msgs, "outMessage size is now %zu", evbuffer_get_length( msgs->outMessages ) );
 }
 
-static void
-protocolSendReject( tr_peermsgs * msgs, const struct peer_request * req )
+/**
+***  Fixed-size messages are encoded straight into the outMessages arena
+**/
+
+enum
+{
+    MESSAGE_HEADER_LEN = sizeof( uint32_t ) + sizeof( uint8_t ),
+
+    /* HAVE is the only fixed-size message that's broadcast */
+    HAVE_MESSAGE_LEN = MESSAGE_HEADER_LEN + sizeof( uint32_t )
+};
+
+static uint8_t*
+putUint16( uint8_t * walk, uint16_t hs )
+{
+    const uint16_t ns = htons( hs );
+    memcpy( walk, &ns, sizeof( ns ) );
+    return walk + sizeof( ns );
+}
+
+static uint8_t*
+putUint32( uint8_t * walk, uint32_t hl )
+{
+    const uint32_t nl = htonl( hl );
+    memcpy( walk, &nl, sizeof( nl ) );
+    return walk + sizeof( nl );
+}
+
+static uint8_t*
+putMessageHeader( uint8_t * walk, uint8_t id, size_t payloadLen )
+{
+    walk = putUint32( walk, sizeof( uint8_t ) + payloadLen );
+    *walk++ = id;
+    return walk;
+}
+
+/* reserve len contiguous bytes at the end of outMessages,
+ * setting aside a fresh arena if this starts a new batch */
+static uint8_t*
+reserveMessage( tr_peermsgs * msgs, struct evbuffer_iovec * iov, size_t len )
 {
     struct evbuffer * out = msgs->outMessages;
 
+    if( !evbuffer_get_length( out ) )
+        evbuffer_expand( out, MAX( len, OUT_ARENA_SIZE ) );
+
+    evbuffer_reserve_space( out, len, iov, 1 );
+    iov->iov_len = len;
+    return iov->iov_base;
+}
+
+/* returns a pointer to where the message's payload should be written */
+static uint8_t*
+beginMessage( tr_peermsgs           * msgs,
+              struct evbuffer_iovec * iov,
+              uint8_t                 id,
+              size_t                  payloadLen )
+{
+    uint8_t * walk = reserveMessage( msgs, iov, MESSAGE_HEADER_LEN + payloadLen );
+
+    return putMessageHeader( walk, id, payloadLen );
+}
+
+static void
+commitMessage( tr_peermsgs * msgs, struct evbuffer_iovec * iov )
+{
+    evbuffer_commit_space( msgs->outMessages, iov, 1 );
+    ++msgs->outMessagesCount;
+}
+
+/* add a message that was already encoded */
+static void
+addMessage( tr_peermsgs * msgs, const uint8_t * message, size_t len )
+{
+    struct evbuffer_iovec iov;
+
+    memcpy( reserveMessage( msgs, &iov, len ), message, len );
+    commitMessage( msgs, &iov );
+}
+
+static void
+addRequestMessage( tr_peermsgs * msgs, uint8_t id, const struct peer_request * req )
+{
+    struct evbuffer_iovec iov;
+    uint8_t * walk = beginMessage( msgs, &iov, id, 3 * sizeof( uint32_t ) );
+
+    walk = putUint32( walk, req->index );
+    walk = putUint32( walk, req->offset );
+    putUint32( walk, req->length );
+    commitMessage( msgs, &iov );
+}
+
+static void
+addEmptyMessage( tr_peermsgs * msgs, uint8_t id )
+{
+    struct evbuffer_iovec iov;
+
+    beginMessage( msgs, &iov, id, 0 );
+    commitMessage( msgs, &iov );
+}
+
+/**
+***
+**/
+
+static void
+protocolSendReject( tr_peermsgs * msgs, const struct peer_request * req )
+{
     assert( tr_peerIoSupportsFEXT( msgs->peer->io ) );
 
-    evbuffer_add_uint32( out, sizeof( uint8_t ) + 3 * sizeof( uint32_t ) );
-    evbuffer_add_uint8 ( out, BT_FEXT_REJECT );
-    evbuffer_add_uint32( out, req->index );
-    evbuffer_add_uint32( out, req->offset );
-    evbuffer_add_uint32( out, req->length );
+    addRequestMessage( msgs, BT_FEXT_REJECT, req );
 
     dbgmsg( msgs, "rejecting %u:%u->%u...", req->index, req->offset, req->length );
     dbgOutMessageLen( msgs );
@@ -321,29 +442,38 @@ protocolSendReject( tr_peermsgs * msgs, const struct peer_request * req )
 static void
 protocolSendRequest( tr_peermsgs * msgs, const struct peer_request * req )
 {
-    struct evbuffer * out = msgs->outMessages;
-
-    evbuffer_add_uint32( out, sizeof( uint8_t ) + 3 * sizeof( uint32_t ) );
-    evbuffer_add_uint8 ( out, BT_REQUEST );
-    evbuffer_add_uint32( out, req->index );
-    evbuffer_add_uint32( out, req->offset );
-    evbuffer_add_uint32( out, req->length );
+    addRequestMessage( msgs, BT_REQUEST, req );
 
     dbgmsg( msgs, "requesting %u:%u->%u...", req->index, req->offset, req->length );
     dbgOutMessageLen( msgs );
     pokeBatchPeriod( msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS );
+
+    if( !msgs->rttProbeQueuedLen && !msgs->rttProbeBytesLeft && !msgs->rttProbeSentAt ) {
+        msgs->rttProbe = *req;
+        msgs->rttProbeQueuedLen = evbuffer_get_length( msgs->outMessages );
+    }
 }
 
 static void
-protocolSendCancel( tr_peermsgs * msgs, const struct peer_request * req )
+resetRttProbe( tr_peermsgs * msgs )
 {
-    struct evbuffer * out = msgs->outMessages;
+    msgs->rttProbeQueuedLen = 0;
+    msgs->rttProbeBytesLeft = 0;
+    msgs->rttProbeSentAt = 0;
+}
 
-    evbuffer_add_uint32( out, sizeof( uint8_t ) + 3 * sizeof( uint32_t ) );
-    evbuffer_add_uint8 ( out, BT_CANCEL );
-    evbuffer_add_uint32( out, req->index );
-    evbuffer_add_uint32( out, req->offset );
-    evbuffer_add_uint32( out, req->length );
+/* the probe's answer isn't coming, so stop timing it */
+static void
+clearRttProbe( tr_peermsgs * msgs, const struct peer_request * req )
+{
+    if( ( req->index == msgs->rttProbe.index ) && ( req->offset == msgs->rttProbe.offset ) )
+        resetRttProbe( msgs );
+}
+
+static void
+protocolSendCancel( tr_peermsgs * msgs, const struct peer_request * req )
+{
+    addRequestMessage( msgs, BT_CANCEL, req );
 
     dbgmsg( msgs, "cancelling %u:%u->%u...", req->index, req->offset, req->length );
     dbgOutMessageLen( msgs );
@@ -353,22 +483,17 @@ protocolSendCancel( tr_peermsgs * msgs, const struct peer_request * req )
 static void
 protocolSendPort(tr_peermsgs *msgs, uint16_t port)
 {
-    struct evbuffer * out = msgs->outMessages;
+    struct evbuffer_iovec iov;
 
     dbgmsg( msgs, "sending Port %u", port);
-    evbuffer_add_uint32( out, 3 );
-    evbuffer_add_uint8 ( out, BT_PORT );
-    evbuffer_add_uint16( out, port);
+    putUint16( beginMessage( msgs, &iov, BT_PORT, sizeof( uint16_t ) ), port );
+    commitMessage( msgs, &iov );
 }
 
 static void
-protocolSendHave( tr_peermsgs * msgs, uint32_t index )
+protocolSendHave( tr_peermsgs * msgs, const uint8_t * have, uint32_t index )
 {
-    struct evbuffer * out = msgs->outMessages;
-
-    evbuffer_add_uint32( out, sizeof(uint8_t) + sizeof(uint32_t) );
-    evbuffer_add_uint8 ( out, BT_HAVE );
-    evbuffer_add_uint32( out, index );
+    addMessage( msgs, have, HAVE_MESSAGE_LEN );
 
     dbgmsg( msgs, "sending Have %u", index );
     dbgOutMessageLen( msgs );
@@ -396,10 +521,7 @@ protocolSendAllowedFast( tr_peermsgs * msgs, uint32_t pieceIndex )
 static void
 protocolSendChoke( tr_peermsgs * msgs, int choke )
 {
-    struct evbuffer * out = msgs->outMessages;
-
-    evbuffer_add_uint32( out, sizeof( uint8_t ) );
-    evbuffer_add_uint8 ( out, choke ? BT_CHOKE : BT_UNCHOKE );
+    addEmptyMessage( msgs, choke ? BT_CHOKE : BT_UNCHOKE );
 
     dbgmsg( msgs, "sending %s...", choke ? "Choke" : "Unchoke" );
     dbgOutMessageLen( msgs );
@@ -409,12 +531,9 @@ protocolSendChoke( tr_peermsgs * msgs, int choke )
 static void
 protocolSendHaveAll( tr_peermsgs * msgs )
 {
-    struct evbuffer * out = msgs->outMessages;
-
     assert( tr_peerIoSupportsFEXT( msgs->peer->io ) );
 
-    evbuffer_add_uint32( out, sizeof( uint8_t ) );
-    evbuffer_add_uint8 ( out, BT_FEXT_HAVE_ALL );
+    addEmptyMessage( msgs, BT_FEXT_HAVE_ALL );
 
     dbgmsg( msgs, "sending HAVE_ALL..." );
     dbgOutMessageLen( msgs );
@@ -424,12 +543,9 @@ protocolSendHaveAll( tr_peermsgs * msgs )
 static void
 protocolSendHaveNone( tr_peermsgs * msgs )
 {
-    struct evbuffer * out = msgs->outMessages;
-
     assert( tr_peerIoSupportsFEXT( msgs->peer->io ) );
 
-    evbuffer_add_uint32( out, sizeof( uint8_t ) );
-    evbuffer_add_uint8 ( out, BT_FEXT_HAVE_NONE );
+    addEmptyMessage( msgs, BT_FEXT_HAVE_NONE );
 
     dbgmsg( msgs, "sending HAVE_NONE..." );
     dbgOutMessageLen( msgs );
@@ -668,15 +784,12 @@ updateFastSet( tr_peermsgs * msgs UNUSED )
 static void
 sendInterest( tr_peermsgs * msgs, tr_bool clientIsInterested )
 {
-    struct evbuffer * out = msgs->outMessages;
-
     assert( msgs );
     assert( tr_isBool( clientIsInterested ) );
 
     msgs->peer->clientIsInterested = clientIsInterested;
     dbgmsg( msgs, "Sending %s", clientIsInterested ? "Interested" : "Not Interested" );
-    evbuffer_add_uint32( out, sizeof( uint8_t ) );
-    evbuffer_add_uint8 ( out, clientIsInterested ? BT_INTERESTED : BT_NOT_INTERESTED );
+    addEmptyMessage( msgs, clientIsInterested ? BT_INTERESTED : BT_NOT_INTERESTED );
 
     pokeBatchPeriod( msgs, HIGH_PRIORITY_INTERVAL_SECS );
     dbgOutMessageLen( msgs );
@@ -721,6 +834,7 @@ popNextRequest( tr_peermsgs * msgs, struct peer_request * setme )
 
     tr_removeElementFromArray( msgs->peerAskedFor, 0, sizeof( struct peer_request ),
                                msgs->peer->pendingReqsToClient-- );
+    tr_peerMgrPeerRequestRemoved( msgs->torrent, setme->index );
 
     return TRUE;
 }
@@ -766,13 +880,25 @@ tr_peerMsgsSetChoke( tr_peermsgs * msgs,
 **/
 
 void
-tr_peerMsgsHave( tr_peermsgs * msgs,
-                 uint32_t      index )
+tr_peerMsgsBroadcastHave( struct tr_peer ** peers,
+                          int               peerCount,
+                          uint32_t          index )
 {
-    protocolSendHave( msgs, index );
+    int i;
+    uint8_t have[HAVE_MESSAGE_LEN];
 
-    /* since we have more pieces now, we might not be interested in this peer */
-    updateInterest( msgs );
+    /* every peer gets the same bytes, so encode them just once */
+    putUint32( putMessageHeader( have, BT_HAVE, sizeof( uint32_t ) ), index );
+
+    for( i=0; i<peerCount; ++i )
+    {
+        tr_peermsgs * msgs = peers[i]->msgs;
+
+        protocolSendHave( msgs, have, index );
+
+        /* since we have more pieces now, we might not be interested in this peer */
+        updateInterest( msgs );
+    }
 }
 
 /**
@@ -801,6 +927,7 @@ tr_peerMsgsCancel( tr_peermsgs * msgs, tr_block_index_t block )
 /*fprintf( stderr, "SENDING CANCEL MESSAGE FOR BLOCK %zu\n\t\tFROM PEER %p ------------------------------------\n", (size_t)block, msgs->peer );*/
     blockToReq( msgs->torrent, block, &req );
     protocolSendCancel( msgs, &req );
+    clearRttProbe( msgs, &req );
 }
 
 /**
@@ -857,6 +984,7 @@ sendLtepHandshake( tr_peermsgs * msgs )
 
     buf = tr_bencToStr( &val, TR_FMT_BENC, &len );
 
+    ++msgs->outMessagesCount;
     evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + len );
     evbuffer_add_uint8 ( out, BT_LTEP );
     evbuffer_add_uint8 ( out, LTEP_HANDSHAKE );
@@ -1032,6 +1160,7 @@ parseUtMetadata( tr_peermsgs * msgs, int msglen, struct evbuffer * inbuf )
             tr_bencFree( &tmp );
 
             /* write it out as a LTEP message to our outMessages buffer */
+            ++msgs->outMessagesCount;
             evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + payloadLen );
             evbuffer_add_uint8 ( out, BT_LTEP );
             evbuffer_add_uint8 ( out, msgs->ut_metadata_id );
@@ -1209,26 +1338,6 @@ updatePeerProgress( tr_peermsgs * msgs )
     updateInterest( msgs );
 }
 
-static void
-prefetchPieces( tr_peermsgs *msgs )
-{
-    int i;
-
-    if( !getSession(msgs)->isPrefetchEnabled )
-        return;
-
-    /* Maintain 12 prefetched blocks per unchoked peer */
-    for( i=msgs->prefetchCount; i<msgs->peer->pendingReqsToClient && i<12; ++i )
-    {
-        const struct peer_request * req = msgs->peerAskedFor + i;
-        if( requestIsValid( msgs, req ) )
-        {
-            tr_cachePrefetchBlock( getSession(msgs)->cache, msgs->torrent, req->index, req->offset, req->length );
-            ++msgs->prefetchCount;
-        }
-    }
-}
-
 static void
 peerMadeRequest( tr_peermsgs *               msgs,
                  const struct peer_request * req )
@@ -1253,7 +1362,7 @@ peerMadeRequest( tr_peermsgs *               msgs,
 
     if( allow ) {
         msgs->peerAskedFor[msgs->peer->pendingReqsToClient++] = *req;
-        prefetchPieces( msgs );
+        tr_peerMgrPeerRequestAdded( msgs->torrent, req->index );
     } else if( fext ) {
         protocolSendReject( msgs, req );
     }
@@ -1325,6 +1434,17 @@ readBtPiece( tr_peermsgs      * msgs,
         tr_peerIoReadUint32( msgs->peer->io, inbuf, &req->offset );
         req->length = msgs->incoming.length - 9;
         dbgmsg( msgs, "got incoming block header %u:%u->%u", req->index, req->offset, req->length );
+
+        /* the first bytes of the block we were timing */
+        if( msgs->rttProbeSentAt
+            && ( req->index == msgs->rttProbe.index )
+            && ( req->offset == msgs->rttProbe.offset ) )
+        {
+            const int msec = tr_time_msec_monotonic( ) - msgs->rttProbeSentAt;
+            tr_requestWindowGotRTT( &msgs->requestWindow, msec, tr_time( ) );
+            resetRttProbe( msgs );
+        }
+
         return READ_NOW;
     }
     else
@@ -1401,6 +1521,7 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
         case BT_CHOKE:
             dbgmsg( msgs, "got Choke" );
             msgs->peer->clientIsChoked = 1;
+            resetRttProbe( msgs );
             if( !fext )
                 fireGotChoke( msgs );
             break;
@@ -1483,9 +1604,11 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
                     break;
             }
 
-            if( i < msgs->peer->pendingReqsToClient )
+            if( i < msgs->peer->pendingReqsToClient ) {
                 tr_removeElementFromArray( msgs->peerAskedFor, i, sizeof( struct peer_request ),
                                            msgs->peer->pendingReqsToClient-- );
+                tr_peerMgrPeerRequestRemoved( msgs->torrent, r.index );
+            }
             break;
         }
 
@@ -1555,6 +1678,7 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
             tr_peerIoReadUint32( msgs->peer->io, inbuf, &r.index );
             tr_peerIoReadUint32( msgs->peer->io, inbuf, &r.offset );
             tr_peerIoReadUint32( msgs->peer->io, inbuf, &r.length );
+            clearRttProbe( msgs, &r );
             if( fext )
                 fireGotRej( msgs, &r );
             else {
@@ -1615,6 +1739,8 @@ clientGotBlock( tr_peermsgs *               msgs,
         dbgmsg( msgs, "we didn't ask for this message..." );
         return 0;
     }
+
+    tr_requestWindowGotBlock( &msgs->requestWindow );
     if( tr_cpPieceIsComplete( &msgs->torrent->completion, req->index ) ) {
         dbgmsg( msgs, "we did ask for this message, but the piece is already complete..." );
         return 0;
@@ -1638,6 +1764,18 @@ static void
 didWrite( tr_peerIo * io UNUSED, size_t bytesWritten, int wasPieceData, void * vmsgs )
 {
     tr_peermsgs * msgs = vmsgs;
+
+    /* start the probe's clock once it's actually on the wire */
+    if( msgs->rttProbeBytesLeft )
+    {
+        if( bytesWritten < msgs->rttProbeBytesLeft )
+            msgs->rttProbeBytesLeft -= bytesWritten;
+        else {
+            msgs->rttProbeBytesLeft = 0;
+            msgs->rttProbeSentAt = tr_time_msec_monotonic( );
+        }
+    }
+
     firePeerGotData( msgs, bytesWritten, wasPieceData );
 
     if ( tr_isPeerIo( io ) && io->userData )
@@ -1708,52 +1846,138 @@ tr_peerMsgsIsReadingBlock( const tr_peermsgs * msgs, tr_block_index_t block )
 ***
 **/
 
-static void
-updateDesiredRequestCount( tr_peermsgs * msgs )
+void
+tr_requestWindowReset( tr_request_window * w )
 {
-    const tr_torrent * const torrent = msgs->torrent;
+    w->size = REQUEST_WINDOW_MIN;
+    w->credit = 0;
+    w->isSlowStart = TRUE;
+}
+
+void
+tr_requestWindowGotRTT( tr_request_window * w, int msec, time_t now )
+{
+    msec = MAX( msec, 1 );
+
+    if( !w->srtt_msec )
+        w->srtt_msec = msec;
+    else
+        w->srtt_msec = ( w->srtt_msec * 7 + msec ) / 8;
 
-    if( tr_torrentIsSeed( msgs->torrent ) )
+    if( !w->rttMin_msec
+        || ( msec <= w->rttMin_msec )
+        || ( w->rttMinAt + REQUEST_RTT_MIN_SECS < now ) )
     {
-        msgs->desiredRequestCount = 0;
+        w->rttMin_msec = msec;
+        w->rttMinAt = now;
     }
-    else if( msgs->peer->clientIsChoked )
+
+    /* if our requests are waiting in line at the peer, stop growing */
+    if( msec > w->rttMin_msec + MAX( w->rttMin_msec / 2, REQUEST_RTT_SLACK_MSEC ) )
     {
-        msgs->desiredRequestCount = 0;
+        if( w->isSlowStart )
+            w->isSlowStart = FALSE;
+        else
+            w->size = MAX( w->size - w->size / 8, REQUEST_WINDOW_MIN );
+    }
+}
+
+void
+tr_requestWindowGotBlock( tr_request_window * w )
+{
+    if( w->isSlowStart )
+        ++w->size;
+    else if( ++w->credit >= w->size ) {
+        w->credit = 0;
+        ++w->size;
     }
-    else if( !msgs->peer->clientIsInterested )
+}
+
+/* how many requests keep rate_Bps flowing for a round trip, doubled
+ * so that there's room for the speed to keep climbing */
+static int
+getBdpBlocks( uint64_t rate_Bps, int rtt_msec, int blockSize )
+{
+    return ( 2 * rate_Bps * rtt_msec ) / ( 1000u * blockSize );
+}
+
+int
+tr_requestWindowUpdate( tr_request_window * w,
+                        int                 rate_Bps,
+                        int                 cap_Bps,
+                        int                 blockSize,
+                        int                 maxRequests )
+{
+    int n;
+    const int rtt = w->srtt_msec ? w->srtt_msec : REQUEST_RTT_DEFAULT_MSEC;
+
+    if( cap_Bps >= 0 )
+        maxRequests = MIN( maxRequests, MAX( REQUEST_WINDOW_MIN, getBdpBlocks( cap_Bps, rtt, blockSize ) ) );
+
+    w->size = MIN( w->size, maxRequests );
+
+    n = MAX( w->size, getBdpBlocks( rate_Bps, rtt, blockSize ) );
+    n = MAX( n, REQUEST_WINDOW_MIN );
+    return MIN( n, maxRequests );
+}
+
+/* this peer's part of a speed limit, in proportion to
+ * how much of the limited traffic it's carrying */
+static int
+getLimitShare( int rate_Bps, int limit_Bps, const tr_bandwidth * b, uint64_t now )
+{
+    const unsigned int total_Bps = tr_bandwidthGetPieceSpeed_Bps( b, now, TR_DOWN );
+
+    if( total_Bps <= (unsigned int)rate_Bps )
+        return limit_Bps;
+
+    return ( (uint64_t)limit_Bps * rate_Bps ) / total_Bps;
+}
+
+static void
+updateDesiredRequestCount( tr_peermsgs * msgs )
+{
+    const tr_torrent * const torrent = msgs->torrent;
+
+    if( tr_torrentIsSeed( msgs->torrent )
+        || msgs->peer->clientIsChoked
+        || !msgs->peer->clientIsInterested )
     {
         msgs->desiredRequestCount = 0;
+        tr_requestWindowReset( &msgs->requestWindow );
     }
     else
     {
-        int estimatedBlocksInPeriod;
         int rate_Bps;
         int irate_Bps;
-        const int floor = 4;
-        const int seconds = REQUEST_BUF_SECS;
+        int cap_Bps = -1;
+        int maxRequests = REQQ;
         const uint64_t now = tr_time_msec( );
 
-        /* Get the rate limit we should use.
-         * FIXME: this needs to consider all the other peers as well... */
+        /* give up on a round trip we've waited too long for */
+        if( msgs->rttProbeSentAt && ( tr_time_msec_monotonic( ) - msgs->rttProbeSentAt > REQUEST_PROBE_TIMEOUT_SECS * 1000u ) )
+            resetRttProbe( msgs );
+
         rate_Bps = tr_peerGetPieceSpeed_Bps( msgs->peer, now, TR_PEER_TO_CLIENT );
+
+        /* split the tightest download limit among the peers, so that
+         * all the requests in flight add up to what the limit allows */
         if( tr_torrentUsesSpeedLimit( torrent, TR_PEER_TO_CLIENT ) )
-            rate_Bps = MIN( rate_Bps, tr_torrentGetSpeedLimit_Bps( torrent, TR_PEER_TO_CLIENT ) );
+            cap_Bps = getLimitShare( rate_Bps, tr_torrentGetSpeedLimit_Bps( torrent, TR_PEER_TO_CLIENT ), torrent->bandwidth, now );
 
         /* honor the session limits, if enabled */
         if( tr_torrentUsesSessionLimits( torrent ) )
-            if( tr_sessionGetActiveSpeedLimit_Bps( torrent->session, TR_PEER_TO_CLIENT, &irate_Bps ) )
-                rate_Bps = MIN( rate_Bps, irate_Bps );
-
-        /* use this desired rate to figure out how
-         * many requests we should send to this peer */
-        estimatedBlocksInPeriod = ( rate_Bps * seconds ) / torrent->blockSize;
-        msgs->desiredRequestCount = MAX( floor, estimatedBlocksInPeriod );
+            if( tr_sessionGetActiveSpeedLimit_Bps( torrent->session, TR_PEER_TO_CLIENT, &irate_Bps ) ) {
+                const int share_Bps = getLimitShare( rate_Bps, irate_Bps, torrent->session->bandwidth, now );
+                cap_Bps = cap_Bps < 0 ? share_Bps : MIN( cap_Bps, share_Bps );
+            }
 
         /* honor the peer's maximum request count, if specified */
         if( msgs->reqq > 0 )
-            if( msgs->desiredRequestCount > msgs->reqq )
-                msgs->desiredRequestCount = msgs->reqq;
+            maxRequests = MIN( maxRequests, msgs->reqq );
+
+        msgs->desiredRequestCount = tr_requestWindowUpdate( &msgs->requestWindow, rate_Bps, cap_Bps,
+                                                            torrent->blockSize, maxRequests );
     }
 }
 
@@ -1780,6 +2004,7 @@ updateMetadataRequests( tr_peermsgs * msgs, time_t now )
         dbgmsg( msgs, "requesting metadata piece #%d", piece );
 
         /* write it out as a LTEP message to our outMessages buffer */
+        ++msgs->outMessagesCount;
         evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + payloadLen );
         evbuffer_add_uint8 ( out, BT_LTEP );
         evbuffer_add_uint8 ( out, msgs->ut_metadata_id );
@@ -1816,12 +2041,56 @@ updateBlockRequests( tr_peermsgs * msgs )
     }
 }
 
+/* Can the block go straight from its file to the peer's socket?
+ * sendfile() runs in this thread, so only blocks that are already
+ * in the OS cache are sent that way. The rest go through the cache,
+ * which reads them in a disk I/O thread. */
+static tr_bool
+canSendFromFile( tr_peermsgs * msgs, const struct peer_request * req )
+{
+    return tr_peerIoSupportsSendfile( msgs->peer->io )
+        && !tr_torrentPieceNeedsCheck( msgs->torrent, req->index )
+        && tr_cacheIsBlockOnDisk( getSession(msgs)->cache, msgs->torrent, req->index, req->offset )
+        && tr_ioIsResident( msgs->torrent, req->index, req->offset, req->length );
+}
+
+/* Returns false if the next block the peer asked for is still being
+ * read from disk. In that case the request is deferred until the
+ * read finishes, so that we don't block waiting for it.
+ * Otherwise, setme_fromFile tells whether to send it with sendfile(). */
+static tr_bool
+nextRequestIsLoaded( tr_peermsgs * msgs, tr_bool * setme_fromFile )
+{
+    const struct peer_request * req = &msgs->peerAskedFor[0];
+
+    *setme_fromFile = FALSE;
+
+    if( msgs->peer->pendingReqsToClient == 0 )
+        return TRUE;
+
+    /* bad requests get rejected without touching the disk */
+    if( !requestIsValid( msgs, req )
+        || !tr_cpPieceIsComplete( &msgs->torrent->completion, req->index ) )
+        return TRUE;
+
+    if(( *setme_fromFile = canSendFromFile( msgs, req )))
+        return TRUE;
+
+    if( tr_cacheLoadBlock( getSession(msgs)->cache, msgs->torrent, req->index, req->offset, req->length ) )
+        return TRUE;
+
+    dbgmsg( msgs, "waiting for block %u:%u->%u to be read", req->index, req->offset, req->length );
+    msgs->isWaitingForDisk = TRUE;
+    return FALSE;
+}
+
 static size_t
 fillOutputBuffer( tr_peermsgs * msgs, time_t now )
 {
     int piece;
     size_t bytesWritten = 0;
     struct peer_request req;
+    tr_bool fromFile;
     const tr_bool haveMessages = evbuffer_get_length( msgs->outMessages ) != 0;
     const tr_bool fext = tr_peerIoSupportsFEXT( msgs->peer->io );
 
@@ -1836,10 +2105,18 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
     }
     else if( haveMessages && ( ( now - msgs->outMessagesBatchedAt ) >= msgs->outMessagesBatchPeriod ) )
     {
+        tr_session * session = getSession( msgs );
         const size_t len = evbuffer_get_length( msgs->outMessages );
         /* flush the protocol messages */
         dbgmsg( msgs, "flushing outMessages... to %p (length is %zu)", msgs->peer->io, len );
+        if( msgs->rttProbeQueuedLen ) {
+            msgs->rttProbeBytesLeft = tr_peerIoGetWriteBufferLength( msgs->peer->io ) + msgs->rttProbeQueuedLen;
+            msgs->rttProbeQueuedLen = 0;
+        }
         tr_peerIoWriteBuf( msgs->peer->io, msgs->outMessages, FALSE );
+        session->peerMessageCount += msgs->outMessagesCount;
+        ++session->peerMessageFlushCount;
+        msgs->outMessagesCount = 0;
         msgs->clientSentAnythingAt = now;
         msgs->outMessagesBatchedAt = 0;
         msgs->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
@@ -1874,6 +2151,7 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
             tr_bencFree( &tmp );
 
             /* write it out as a LTEP message to our outMessages buffer */
+            ++msgs->outMessagesCount;
             evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + payloadLen + dataLen );
             evbuffer_add_uint8 ( out, BT_LTEP );
             evbuffer_add_uint8 ( out, msgs->ut_metadata_id );
@@ -1903,6 +2181,7 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
             tr_bencFree( &tmp );
 
             /* write it out as a LTEP message to our outMessages buffer */
+            ++msgs->outMessagesCount;
             evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + payloadLen );
             evbuffer_add_uint8 ( out, BT_LTEP );
             evbuffer_add_uint8 ( out, msgs->ut_metadata_id );
@@ -1919,30 +2198,33 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
     **/
 
     if( ( tr_peerIoGetWriteBufferSpace( msgs->peer->io, now ) >= msgs->torrent->blockSize )
+        && nextRequestIsLoaded( msgs, &fromFile )
         && popNextRequest( msgs, &req ) )
     {
-        --msgs->prefetchCount;
-
         if( requestIsValid( msgs, &req )
             && tr_cpPieceIsComplete( &msgs->torrent->completion, req.index ) )
         {
-            int err;
+            int err = 0;
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
             struct evbuffer * out;
             struct evbuffer_iovec iovec[1];
 
             out = evbuffer_new( );
-            evbuffer_expand( out, msglen );
+            evbuffer_expand( out, fromFile ? msglen - req.length : msglen );
 
             evbuffer_add_uint32( out, sizeof( uint8_t ) + 2 * sizeof( uint32_t ) + req.length );
             evbuffer_add_uint8 ( out, BT_PIECE );
             evbuffer_add_uint32( out, req.index );
             evbuffer_add_uint32( out, req.offset );
 
-            evbuffer_reserve_space( out, req.length, iovec, 1 );
-            err = tr_cacheReadBlock( getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base );
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space( out, iovec, 1 );
+            /* unless it's sent with sendfile(), copy the block into the message */
+            if( !fromFile )
+            {
+                evbuffer_reserve_space( out, req.length, iovec, 1 );
+                err = tr_cacheReadBlock( getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base );
+                iovec[0].iov_len = req.length;
+                evbuffer_commit_space( out, iovec, 1 );
+            }
 
             /* check the piece if it needs checking... */
             if( !err && tr_torrentPieceNeedsCheck( msgs->torrent, req.index ) )
@@ -1956,10 +2238,12 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
             }
             else
             {
-                const size_t n = evbuffer_get_length( out );
-                dbgmsg( msgs, "sending block %u:%u->%u", req.index, req.offset, req.length );
+                const size_t n = evbuffer_get_length( out ) + ( fromFile ? req.length : 0 );
+                dbgmsg( msgs, "sending block %u:%u->%u%s", req.index, req.offset, req.length, fromFile ? " from its file" : "" );
                 assert( n == msglen );
                 tr_peerIoWriteBuf( msgs->peer->io, out, TRUE );
+                if( fromFile )
+                    tr_peerIoWriteFileSegment( msgs->peer->io, tr_torrentId( msgs->torrent ), req.index, req.offset, req.length );
                 bytesWritten += n;
                 msgs->clientSentAnythingAt = now;
                 tr_historyAdd( &msgs->peer->blocksSentToPeer, tr_time( ), 1 );
@@ -1977,9 +2261,6 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
         {
             protocolSendReject( msgs, &req );
         }
-
-        if( msgs != NULL )
-            prefetchPieces( msgs );
     }
 
     /**
@@ -1991,6 +2272,7 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
         && ( ( now - msgs->clientSentAnythingAt ) > KEEPALIVE_INTERVAL_SECS ) )
     {
         dbgmsg( msgs, "sending a keepalive message" );
+        ++msgs->outMessagesCount;
         evbuffer_add_uint32( msgs->outMessages, 0 );
         pokeBatchPeriod( msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS );
     }
@@ -2024,6 +2306,23 @@ tr_peerMsgsPulse( tr_peermsgs * msgs )
         peerPulse( msgs );
 }
 
+const struct peer_request *
+tr_peerMsgsGetPeerRequests( const tr_peermsgs * msgs, int * setme_count )
+{
+    *setme_count = msgs->peer->pendingReqsToClient;
+    return msgs->peerAskedFor;
+}
+
+void
+tr_peerMsgsDiskReadDone( tr_peermsgs * msgs )
+{
+    if( ( msgs != NULL ) && msgs->isWaitingForDisk )
+    {
+        msgs->isWaitingForDisk = FALSE;
+        peerPulse( msgs );
+    }
+}
+
 static void
 gotError( tr_peerIo  * io UNUSED,
           short        what,
@@ -2043,6 +2342,7 @@ sendBitfield( tr_peermsgs * msgs )
     struct evbuffer * out = msgs->outMessages;
     tr_bitfield * bf = tr_cpCreatePieceBitfield( &msgs->torrent->completion );
 
+    ++msgs->outMessagesCount;
     evbuffer_add_uint32( out, sizeof( uint8_t ) + bf->byteCount );
     evbuffer_add_uint8 ( out, BT_BITFIELD );
     evbuffer_add       ( out, bf->bits, bf->byteCount );
@@ -2273,6 +2573,7 @@ sendPex( tr_peermsgs * msgs )
 
             /* write the pex message */
             benc = tr_bencToStr( &val, TR_FMT_BENC, &bencLen );
+            ++msgs->outMessagesCount;
             evbuffer_add_uint32( out, 2 * sizeof( uint8_t ) + bencLen );
             evbuffer_add_uint8 ( out, BT_LTEP );
             evbuffer_add_uint8 ( out, msgs->ut_pex_id );
@@ -42,16 +42,67 @@ int          tr_peerMsgsIsReadingBlock( const tr_peermsgs * msgs, tr_block_index
 
 void         tr_peerMsgsSetInterested( tr_peermsgs *, int isInterested );
 
-void         tr_peerMsgsHave( tr_peermsgs * msgs,
-                              uint32_t      pieceIndex );
+/** @brief tell all these peers that we now have the piece */
+void         tr_peerMsgsBroadcastHave( struct tr_peer ** peers,
+                                       int               peerCount,
+                                       uint32_t          pieceIndex );
 
 void         tr_peerMsgsPulse( tr_peermsgs * msgs );
 
+/** @brief the requests the peer is waiting for us to answer, oldest first */
+const struct peer_request * tr_peerMsgsGetPeerRequests( const tr_peermsgs * msgs,
+                                                        int               * setme_count );
+
+/** @brief resume sending blocks if the peer was waiting on a disk read */
+void         tr_peerMsgsDiskReadDone( tr_peermsgs * msgs );
+
 void         tr_peerMsgsCancel( tr_peermsgs * msgs,
                                 tr_block_index_t block );
 
 void         tr_peerMsgsFree( tr_peermsgs* );
 
+/**
+ * How many block requests to keep in flight to a peer.
+ *
+ * After an unchoke the window starts small and grows by a block for each
+ * block that arrives, doubling every round trip, until the round trips
+ * show our requests waiting in line at the peer. From then on it grows by
+ * a block per round trip and backs off when the line gets longer. It never
+ * drops below twice the bandwidth-delay product of the peer's speed.
+ *
+ * PRIVATE: exposed here so that peer-msgs-test can exercise it.
+ */
+typedef struct tr_request_window
+{
+    int size;              /* blocks */
+    int credit;            /* blocks received towards the next +1 */
+    tr_bool isSlowStart;
+    int srtt_msec;         /* smoothed request round trip, or 0 */
+    int rttMin_msec;       /* the fastest recent round trip */
+    time_t rttMinAt;
+}
+tr_request_window;
+
+void         tr_requestWindowReset( tr_request_window * window );
+
+/** @brief a request took msec from being sent to its block's first bytes */
+void         tr_requestWindowGotRTT( tr_request_window * window,
+                                     int                 msec,
+                                     time_t              now );
+
+void         tr_requestWindowGotBlock( tr_request_window * window );
+
+/**
+ * @brief resize the window for the peer's current speed
+ * @param cap_Bps this peer's share of a speed limit, or -1 if unlimited
+ * @return the number of requests to keep in flight
+ */
+int          tr_requestWindowUpdate( tr_request_window * window,
+                                     int                 rate_Bps,
+                                     int                 cap_Bps,
+                                     int                 blockSize,
+                                     int                 maxRequests );
+
 size_t       tr_generateAllowedSet( tr_piece_index_t  * setmePieces,
                                     size_t              desiredSetSize,
                                     size_t              pieceCount,
@@ -0,0 +1,511 @@
+/*
+ * Replays a swarm's piece announcements against the rarest-first picker.
+ *
+ *   picker-bench                   replay a synthetic swarm
+ *   picker-bench -w <file>         ...and record it to <file>
+ *   picker-bench <file>            replay a recorded swarm
+ *
+ * A recording is a text file with one event per line:
+ *
+ *   pieces <count>                 must come first
+ *   bitfield <peer> <hex>          a peer connected and sent its bitfield
+ *   haveall <peer>                 a peer connected and sent HAVE ALL
+ *   have <peer> <piece>            a peer got a new piece
+ *   gone <peer>                    a peer disconnected
+ *   pick <peer>                    we want to start a piece from this peer
+ *
+ * Each replay is run twice: once against tr_picker, and once against a
+ * list sorted by rarity that's scanned from the front, which is how
+ * peer-mgr used to pick pieces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* qsort, rand, srand */
+#include <string.h> /* memmove, strcmp */
+
+#include "transmission.h"
+#include "bitset.h"
+#include "picker.h"
+#include "utils.h"
+
+#define MAX_PEERS 1024
+
+enum event_type { EV_BITFIELD, EV_HAVE_ALL, EV_HAVE, EV_GONE, EV_PICK };
+
+struct event
+{
+    enum event_type type;
+    int peer;
+    tr_piece_index_t piece;
+    tr_bitfield * bitfield;
+};
+
+struct swarm
+{
+    tr_piece_index_t pieceCount;
+    struct event * events;
+    int eventCount;
+    int eventAlloc;
+};
+
+static struct event*
+addEvent( struct swarm * s, enum event_type type, int peer )
+{
+    struct event * e;
+
+    if( s->eventCount == s->eventAlloc ) {
+        s->eventAlloc = MAX( 1024, s->eventAlloc * 2 );
+        s->events = tr_renew( struct event, s->events, s->eventAlloc );
+    }
+
+    e = s->events + s->eventCount++;
+    e->type = type;
+    e->peer = peer;
+    e->piece = 0;
+    e->bitfield = NULL;
+    return e;
+}
+
+/***
+****  Building a swarm
+***/
+
+static tr_bitfield*
+dupBitfield( const tr_bitfield * in )
+{
+    tr_bitfield * out = tr_bitfieldNew( in->bitCount );
+    memcpy( out->bits, in->bits, in->byteCount );
+    return out;
+}
+
+/* peers come and go, most of them leechers with a fraction of the
+ * torrent, and a few seeds. We ask for a piece every few events. */
+static void
+synthesizeSwarm( struct swarm * s, tr_piece_index_t pieceCount, int peerCount, int rounds )
+{
+    int i;
+    tr_bool connected[MAX_PEERS];
+    tr_bitfield * have[MAX_PEERS];
+
+    srand( 1 );
+    s->pieceCount = pieceCount;
+
+    for( i=0; i<peerCount; ++i ) {
+        connected[i] = FALSE;
+        have[i] = tr_bitfieldNew( pieceCount );
+    }
+
+    for( i=0; i<rounds; ++i )
+    {
+        const int peer = rand( ) % peerCount;
+        const int r = rand( ) % 100;
+
+        if( !connected[peer] )
+        {
+            if( peer % 20 == 0 )
+                addEvent( s, EV_HAVE_ALL, peer );
+            else {
+                tr_piece_index_t j;
+                const int percent = rand( ) % 100;
+                tr_bitfieldClear( have[peer] );
+                for( j=0; j<pieceCount; ++j )
+                    if( rand( ) % 100 < percent )
+                        tr_bitfieldAdd( have[peer], j );
+                addEvent( s, EV_BITFIELD, peer )->bitfield = dupBitfield( have[peer] );
+            }
+            connected[peer] = TRUE;
+        }
+        else if( r < 1 )
+        {
+            addEvent( s, EV_GONE, peer );
+            connected[peer] = FALSE;
+        }
+        else if( r < 75 )
+        {
+            if( peer % 20 != 0 ) {
+                const tr_piece_index_t piece = rand( ) % pieceCount;
+                if( !tr_bitfieldHas( have[peer], piece ) ) {
+                    tr_bitfieldAdd( have[peer], piece );
+                    addEvent( s, EV_HAVE, peer )->piece = piece;
+                }
+            }
+        }
+        else
+        {
+            addEvent( s, EV_PICK, peer );
+        }
+    }
+
+    for( i=0; i<peerCount; ++i )
+        tr_bitfieldFree( have[i] );
+}
+
+static int
+readSwarm( struct swarm * s, const char * filename )
+{
+    char line[1024 * 64];
+    FILE * fp = fopen( filename, "r" );
+
+    if( fp == NULL ) {
+        perror( filename );
+        return -1;
+    }
+
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        char word[16];
+        unsigned int a = 0, b = 0;
+        int offset = 0;
+
+        if( sscanf( line, "%15s %u%n", word, &a, &offset ) < 2 )
+            continue;
+
+        if( !strcmp( word, "pieces" ) )
+            s->pieceCount = a;
+        else if( a >= MAX_PEERS )
+            continue;
+        else if( !strcmp( word, "have" ) && ( sscanf( line + offset, "%u", &b ) == 1 ) && ( b < s->pieceCount ) )
+            addEvent( s, EV_HAVE, a )->piece = b;
+        else if( !strcmp( word, "haveall" ) )
+            addEvent( s, EV_HAVE_ALL, a );
+        else if( !strcmp( word, "gone" ) )
+            addEvent( s, EV_GONE, a );
+        else if( !strcmp( word, "pick" ) )
+            addEvent( s, EV_PICK, a );
+        else if( !strcmp( word, "bitfield" ) ) {
+            const char * walk = line + offset;
+            tr_bitfield * bitfield = tr_bitfieldNew( s->pieceCount );
+            size_t i;
+            while( *walk == ' ' )
+                ++walk;
+            for( i=0; i<bitfield->byteCount && walk[0] && walk[1]; ++i, walk+=2 ) {
+                unsigned int byte;
+                if( sscanf( walk, "%2x", &byte ) != 1 )
+                    break;
+                bitfield->bits[i] = byte;
+            }
+            addEvent( s, EV_BITFIELD, a )->bitfield = bitfield;
+        }
+    }
+
+    fclose( fp );
+    return 0;
+}
+
+static int
+writeSwarm( const struct swarm * s, const char * filename )
+{
+    int i;
+    FILE * fp = fopen( filename, "w" );
+
+    if( fp == NULL ) {
+        perror( filename );
+        return -1;
+    }
+
+    fprintf( fp, "pieces %u\n", (unsigned int)s->pieceCount );
+
+    for( i=0; i<s->eventCount; ++i )
+    {
+        const struct event * e = &s->events[i];
+
+        switch( e->type )
+        {
+            case EV_BITFIELD: {
+                size_t j;
+                fprintf( fp, "bitfield %d ", e->peer );
+                for( j=0; j<e->bitfield->byteCount; ++j )
+                    fprintf( fp, "%02x", (unsigned int)e->bitfield->bits[j] );
+                fputc( '\n', fp );
+                break;
+            }
+            case EV_HAVE_ALL: fprintf( fp, "haveall %d\n", e->peer ); break;
+            case EV_HAVE: fprintf( fp, "have %d %u\n", e->peer, (unsigned int)e->piece ); break;
+            case EV_GONE: fprintf( fp, "gone %d\n", e->peer ); break;
+            case EV_PICK: fprintf( fp, "pick %d\n", e->peer ); break;
+        }
+    }
+
+    fclose( fp );
+    return 0;
+}
+
+/***
+****  The two pickers.
+****
+****  Whenever a piece is picked we stop wanting it, as if we'd started
+****  downloading it. When we run out of pieces, we start wanting them
+****  all again.
+***/
+
+struct bench
+{
+    const struct swarm * swarm;
+    tr_bitset have[MAX_PEERS];
+    uint16_t * replication;
+    tr_bool * wanted;
+    size_t wantedCount;
+    size_t picks;
+    size_t misses;
+
+    /* tr_picker */
+    tr_picker picker;
+
+    /* sorted list */
+    tr_piece_index_t * list;
+    int listCount;
+    tr_bool listIsSorted;
+    int16_t * salt;
+};
+
+static const struct bench * compareBench = NULL;
+
+static int
+compareByRarity( const void * va, const void * vb )
+{
+    const tr_piece_index_t a = *(const tr_piece_index_t*)va;
+    const tr_piece_index_t b = *(const tr_piece_index_t*)vb;
+    const struct bench * bench = compareBench;
+
+    if( bench->replication[a] != bench->replication[b] )
+        return bench->replication[a] < bench->replication[b] ? -1 : 1;
+    if( bench->salt[a] != bench->salt[b] )
+        return bench->salt[a] < bench->salt[b] ? -1 : 1;
+    return 0;
+}
+
+static int
+listFind( const struct bench * bench, tr_piece_index_t piece )
+{
+    int i;
+
+    for( i=0; i<bench->listCount; ++i )
+        if( bench->list[i] == piece )
+            return i;
+
+    return -1;
+}
+
+static void
+listResort( struct bench * bench, tr_piece_index_t piece )
+{
+    tr_bool exact;
+    int pos;
+
+    if( !bench->listIsSorted || ( ( pos = listFind( bench, piece ) ) < 0 ) )
+        return;
+
+    tr_removeElementFromArray( bench->list, pos, sizeof( tr_piece_index_t ), bench->listCount-- );
+    compareBench = bench;
+    pos = tr_lowerBound( &piece, bench->list, bench->listCount,
+                         sizeof( tr_piece_index_t ), compareByRarity, &exact );
+    memmove( bench->list + pos + 1, bench->list + pos,
+             sizeof( tr_piece_index_t ) * ( bench->listCount++ - pos ) );
+    bench->list[pos] = piece;
+}
+
+static void
+benchWantAll( struct bench * bench, tr_bool usePicker )
+{
+    tr_piece_index_t i;
+    const tr_piece_index_t n = bench->swarm->pieceCount;
+
+    for( i=0; i<n; ++i ) {
+        bench->wanted[i] = TRUE;
+        if( usePicker )
+            tr_pickerAdd( &bench->picker, i, TR_PRI_NORMAL, bench->replication[i] );
+        else
+            bench->list[i] = i;
+    }
+
+    bench->wantedCount = n;
+    bench->listCount = n;
+    bench->listIsSorted = FALSE;
+}
+
+static void
+benchSetReplication( struct bench * bench, tr_piece_index_t piece, int delta, tr_bool usePicker )
+{
+    bench->replication[piece] += delta;
+
+    if( !bench->wanted[piece] )
+        return;
+
+    if( usePicker )
+        tr_pickerSetReplication( &bench->picker, piece, bench->replication[piece] );
+    else
+        listResort( bench, piece );
+}
+
+/* like peer-mgr, don't resort the list one piece at a time for a whole
+ * bitfield. Just mark it unsorted, unless every piece's count went up */
+static void
+benchBitset( struct bench * bench, const tr_bitset * have, int delta, tr_bool usePicker )
+{
+    tr_piece_index_t i;
+
+    for( i=0; i<bench->swarm->pieceCount; ++i ) {
+        if( tr_bitsetHas( have, i ) ) {
+            bench->replication[i] += delta;
+            if( usePicker && bench->wanted[i] )
+                tr_pickerSetReplication( &bench->picker, i, bench->replication[i] );
+        }
+    }
+
+    if( !usePicker && !have->haveAll )
+        bench->listIsSorted = FALSE;
+}
+
+static void
+benchPick( struct bench * bench, const tr_bitset * have, tr_bool usePicker )
+{
+    tr_bool found = FALSE;
+    tr_piece_index_t piece = 0;
+
+    if( usePicker )
+    {
+        found = tr_pickerNext( &bench->picker, have, rand( ), &piece );
+        if( found )
+            tr_pickerRemove( &bench->picker, piece );
+    }
+    else
+    {
+        int i;
+
+        if( !bench->listIsSorted ) {
+            compareBench = bench;
+            qsort( bench->list, bench->listCount, sizeof( tr_piece_index_t ), compareByRarity );
+            bench->listIsSorted = TRUE;
+        }
+
+        for( i=0; i<bench->listCount; ++i ) {
+            if( tr_bitsetHas( have, bench->list[i] ) ) {
+                piece = bench->list[i];
+                found = TRUE;
+                tr_removeElementFromArray( bench->list, i, sizeof( tr_piece_index_t ), bench->listCount-- );
+                break;
+            }
+        }
+    }
+
+    if( !found )
+        ++bench->misses;
+    else {
+        ++bench->picks;
+        bench->wanted[piece] = FALSE;
+        if( !--bench->wantedCount )
+            benchWantAll( bench, usePicker );
+    }
+}
+
+static void
+replay( const struct swarm * swarm, tr_bool usePicker )
+{
+    int i;
+    uint64_t begin;
+    uint64_t msec;
+    struct bench bench;
+    const tr_piece_index_t n = swarm->pieceCount;
+
+    memset( &bench, 0, sizeof( bench ) );
+    bench.swarm = swarm;
+    bench.replication = tr_new0( uint16_t, n );
+    bench.wanted = tr_new0( tr_bool, n );
+    bench.list = tr_new( tr_piece_index_t, n );
+    bench.salt = tr_new( int16_t, n );
+    for( i=0; i<(int)n; ++i )
+        bench.salt[i] = rand( ) % 4096;
+    for( i=0; i<MAX_PEERS; ++i ) {
+        tr_bitsetConstruct( &bench.have[i], n );
+        tr_bitsetSetHaveNone( &bench.have[i] );
+    }
+    tr_pickerConstruct( &bench.picker, n );
+    benchWantAll( &bench, usePicker );
+
+    begin = tr_time_msec( );
+
+    for( i=0; i<swarm->eventCount; ++i )
+    {
+        const struct event * e = &swarm->events[i];
+        tr_bitset * have = &bench.have[e->peer];
+
+        switch( e->type )
+        {
+            case EV_BITFIELD:
+                benchBitset( &bench, have, -1, usePicker );
+                tr_bitsetSetBitfield( have, e->bitfield );
+                benchBitset( &bench, have, 1, usePicker );
+                break;
+
+            case EV_HAVE_ALL:
+                benchBitset( &bench, have, -1, usePicker );
+                tr_bitsetSetHaveAll( have );
+                benchBitset( &bench, have, 1, usePicker );
+                break;
+
+            case EV_HAVE:
+                if( !tr_bitsetHas( have, e->piece ) ) {
+                    tr_bitsetAdd( have, e->piece );
+                    benchSetReplication( &bench, e->piece, 1, usePicker );
+                }
+                break;
+
+            case EV_GONE:
+                benchBitset( &bench, have, -1, usePicker );
+                tr_bitsetSetHaveNone( have );
+                break;
+
+            case EV_PICK:
+                benchPick( &bench, have, usePicker );
+                break;
+        }
+    }
+
+    msec = tr_time_msec( ) - begin;
+    printf( "%-12s %8d events %8lu picks %8lu misses %8lu msec\n",
+            usePicker ? "tr_picker" : "sorted list",
+            swarm->eventCount,
+            (unsigned long)bench.picks,
+            (unsigned long)bench.misses,
+            (unsigned long)msec );
+
+    for( i=0; i<MAX_PEERS; ++i )
+        tr_bitsetDestruct( &bench.have[i] );
+    tr_pickerDestruct( &bench.picker );
+    tr_free( bench.salt );
+    tr_free( bench.list );
+    tr_free( bench.wanted );
+    tr_free( bench.replication );
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+    struct swarm swarm;
+
+    memset( &swarm, 0, sizeof( swarm ) );
+
+    if( ( argc == 2 ) && strcmp( argv[1], "-w" ) )
+    {
+        if( readSwarm( &swarm, argv[1] ) )
+            return 1;
+    }
+    else
+    {
+        synthesizeSwarm( &swarm, 20000, 300, 200000 );
+
+        if( ( argc == 3 ) && !strcmp( argv[1], "-w" ) )
+            if( writeSwarm( &swarm, argv[2] ) )
+                return 1;
+    }
+
+    replay( &swarm, TRUE );
+    replay( &swarm, FALSE );
+
+    for( i=0; i<swarm.eventCount; ++i )
+        if( swarm.events[i].bitfield != NULL )
+            tr_bitfieldFree( swarm.events[i].bitfield );
+    tr_free( swarm.events );
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h> /* rand, srand */
+
+#include "transmission.h"
+#include "bitset.h"
+#include "picker.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+static int
+testSimple( void )
+{
+    tr_picker picker;
+    tr_bitset have;
+    tr_piece_index_t piece;
+    const tr_piece_index_t pieceCount = 100;
+
+    tr_pickerConstruct( &picker, pieceCount );
+    tr_bitsetConstruct( &have, pieceCount );
+
+    /* nothing to pick */
+    tr_bitsetSetHaveAll( &have );
+    check( !tr_pickerNext( &picker, &have, 0, &piece ) )
+
+    tr_pickerAdd( &picker, 10, TR_PRI_NORMAL, 5 );
+    tr_pickerAdd( &picker, 20, TR_PRI_NORMAL, 2 );
+    tr_pickerAdd( &picker, 99, TR_PRI_LOW, 1 );
+    check( tr_pickerCount( &picker ) == 3 )
+    check( tr_pickerHas( &picker, 20 ) )
+    check( !tr_pickerHas( &picker, 21 ) )
+
+    /* rarest first */
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 20 )
+
+    /* ...unless the rarity changes */
+    tr_pickerSetReplication( &picker, 20, 6 );
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 10 )
+
+    /* only pick pieces that the peer has */
+    tr_bitsetSetHaveNone( &have );
+    check( !tr_pickerNext( &picker, &have, 0, &piece ) )
+    tr_bitsetAdd( &have, 99 );
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 99 )
+    tr_bitsetAdd( &have, 20 );
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 20 )
+
+    /* higher priority beats rarity */
+    tr_pickerAdd( &picker, 0, TR_PRI_HIGH, 40 );
+    tr_bitsetAdd( &have, 0 );
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 0 )
+
+    tr_pickerRemove( &picker, 0 );
+    check( !tr_pickerHas( &picker, 0 ) )
+    check( tr_pickerCount( &picker ) == 3 )
+    check( tr_pickerNext( &picker, &have, 0, &piece ) )
+    check( piece == 20 )
+
+    tr_pickerClear( &picker );
+    check( tr_pickerCount( &picker ) == 0 )
+    check( !tr_pickerNext( &picker, &have, 0, &piece ) )
+
+    tr_bitsetDestruct( &have );
+    tr_pickerDestruct( &picker );
+    return 0;
+}
+
+/* the same ranking the picker uses, done the slow way */
+static int
+getRank( tr_priority_t priority, uint16_t replication )
+{
+    int c = replication;
+
+    if( replication >= 8 )
+        for( c=8, replication>>=4; replication && c<TR_PICKER_CLASSES-1; ++c )
+            replication >>= 1;
+
+    return ( 1 - priority ) * TR_PICKER_CLASSES + c;
+}
+
+static int
+testRandom( void )
+{
+    int i;
+    tr_picker picker;
+    tr_bitset have;
+    tr_priority_t priority[333];
+    uint16_t replication[333];
+    tr_bool wanted[333];
+    const tr_piece_index_t pieceCount = 333;
+
+    srand( 1 );
+    tr_pickerConstruct( &picker, pieceCount );
+    tr_bitsetConstruct( &have, pieceCount );
+    tr_bitsetSetHaveNone( &have );
+
+    for( i=0; i<(int)pieceCount; ++i ) {
+        priority[i] = ( rand( ) % 3 ) - 1;
+        replication[i] = rand( ) % 300;
+        wanted[i] = FALSE;
+    }
+
+    for( i=0; i<20000; ++i )
+    {
+        const tr_piece_index_t n = rand( ) % pieceCount;
+        tr_piece_index_t piece;
+        tr_bool found;
+        int best = -1;
+        tr_piece_index_t j;
+
+        switch( rand( ) % 4 )
+        {
+            case 0:
+                tr_pickerAdd( &picker, n, priority[n], replication[n] );
+                wanted[n] = TRUE;
+                break;
+            case 1:
+                tr_pickerRemove( &picker, n );
+                wanted[n] = FALSE;
+                break;
+            case 2:
+                replication[n] = rand( ) % 300;
+                tr_pickerSetReplication( &picker, n, replication[n] );
+                break;
+            default:
+                if( tr_bitsetHas( &have, n ) )
+                    tr_bitsetRem( &have, n );
+                else
+                    tr_bitsetAdd( &have, n );
+                break;
+        }
+
+        for( j=0; j<pieceCount; ++j ) {
+            if( wanted[j] && tr_bitsetHas( &have, j ) ) {
+                const int rank = getRank( priority[j], replication[j] );
+                if( ( best < 0 ) || ( rank < best ) )
+                    best = rank;
+            }
+        }
+
+        found = tr_pickerNext( &picker, &have, rand( ), &piece );
+        check( found == ( best >= 0 ) )
+        if( found ) {
+            check( wanted[piece] )
+            check( tr_bitsetHas( &have, piece ) )
+            check( getRank( priority[piece], replication[piece] ) == best )
+        }
+    }
+
+    tr_bitsetDestruct( &have );
+    tr_pickerDestruct( &picker );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    if(( i = testSimple( )))
+        return i;
+
+    if(( i = testRandom( )))
+        return i;
+
+    return 0;
+}
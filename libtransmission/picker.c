@@ -0,0 +1,262 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memcpy, memset */
+
+#include "transmission.h"
+#include "bitset.h"
+#include "picker.h"
+#include "utils.h"
+
+typedef uint64_t picker_word;
+
+#define WORD_SIZE ( sizeof( picker_word ) )
+
+/***
+****
+***/
+
+static int
+replicationClass( uint16_t replication )
+{
+    int c;
+
+    if( replication < 8 )
+        return replication;
+
+    for( c=8, replication>>=4; replication && c<TR_PICKER_CLASSES-1; ++c )
+        replication >>= 1;
+
+    return c;
+}
+
+static int
+getBucketIndex( tr_priority_t priority, uint16_t replication )
+{
+    int tier;
+
+    switch( priority ) {
+        case TR_PRI_HIGH: tier = 0; break;
+        case TR_PRI_LOW:  tier = 2; break;
+        default:          tier = 1; break;
+    }
+
+    return tier * TR_PICKER_CLASSES + replicationClass( replication );
+}
+
+static void
+bucketAdd( tr_picker * picker, int bucketIndex, tr_piece_index_t piece )
+{
+    struct tr_picker_bucket * bucket = &picker->buckets[bucketIndex];
+
+    if( bucket->bits == NULL )
+        bucket->bits = tr_new0( uint8_t, picker->byteCount );
+
+    bucket->bits[piece >> 3u] |= ( 0x80 >> ( piece & 7u ) );
+    ++bucket->count;
+    picker->bucketOf[piece] = bucketIndex;
+}
+
+static void
+bucketRemove( tr_picker * picker, int bucketIndex, tr_piece_index_t piece )
+{
+    struct tr_picker_bucket * bucket = &picker->buckets[bucketIndex];
+
+    assert( bucket->count > 0 );
+
+    bucket->bits[piece >> 3u] &= ~( 0x80 >> ( piece & 7u ) );
+    --bucket->count;
+    picker->bucketOf[piece] = TR_PICKER_NONE;
+}
+
+/***
+****
+***/
+
+void
+tr_pickerConstruct( tr_picker * picker, tr_piece_index_t pieceCount )
+{
+    memset( picker, 0, sizeof( tr_picker ) );
+
+    picker->pieceCount = pieceCount;
+    picker->byteCount = ( ( pieceCount + 7u ) / 8u + WORD_SIZE - 1 ) / WORD_SIZE * WORD_SIZE;
+    picker->bucketOf = tr_new( uint8_t, pieceCount );
+    memset( picker->bucketOf, TR_PICKER_NONE, pieceCount );
+}
+
+void
+tr_pickerDestruct( tr_picker * picker )
+{
+    int i;
+
+    for( i=0; i<TR_PICKER_BUCKETS; ++i )
+        tr_free( picker->buckets[i].bits );
+    tr_free( picker->bucketOf );
+
+    memset( picker, 0, sizeof( tr_picker ) );
+}
+
+void
+tr_pickerClear( tr_picker * picker )
+{
+    int i;
+
+    for( i=0; i<TR_PICKER_BUCKETS; ++i ) {
+        struct tr_picker_bucket * bucket = &picker->buckets[i];
+        if( bucket->count )
+            memset( bucket->bits, 0, picker->byteCount );
+        bucket->count = 0;
+    }
+
+    memset( picker->bucketOf, TR_PICKER_NONE, picker->pieceCount );
+    picker->count = 0;
+}
+
+void
+tr_pickerAdd( tr_picker         * picker,
+              tr_piece_index_t    piece,
+              tr_priority_t       priority,
+              uint16_t            replication )
+{
+    assert( piece < picker->pieceCount );
+
+    if( !tr_pickerHas( picker, piece ) )
+    {
+        bucketAdd( picker, getBucketIndex( priority, replication ), piece );
+        ++picker->count;
+    }
+}
+
+void
+tr_pickerRemove( tr_picker * picker, tr_piece_index_t piece )
+{
+    if( tr_pickerHas( picker, piece ) )
+    {
+        bucketRemove( picker, picker->bucketOf[piece], piece );
+        --picker->count;
+    }
+}
+
+void
+tr_pickerSetReplication( tr_picker        * picker,
+                         tr_piece_index_t   piece,
+                         uint16_t           replication )
+{
+    if( tr_pickerHas( picker, piece ) )
+    {
+        const int oldIndex = picker->bucketOf[piece];
+        const int tier = oldIndex / TR_PICKER_CLASSES;
+        const int newIndex = tier * TR_PICKER_CLASSES + replicationClass( replication );
+
+        if( oldIndex != newIndex )
+        {
+            bucketRemove( picker, oldIndex, piece );
+            bucketAdd( picker, newIndex, piece );
+        }
+    }
+}
+
+/***
+****
+***/
+
+/* the peer's bits for the nth word, zero-padded past the end of its bitfield */
+static inline picker_word
+getPeerWord( const tr_bitfield * b, size_t n )
+{
+    picker_word word = 0;
+    const size_t offset = n * WORD_SIZE;
+
+    if( offset + WORD_SIZE <= b->byteCount )
+        memcpy( &word, b->bits + offset, WORD_SIZE );
+    else if( offset < b->byteCount )
+        memcpy( &word, b->bits + offset, b->byteCount - offset );
+
+    return word;
+}
+
+/* the bits are stored big-endian within each byte, as in tr_bitfield,
+ * so find the first set bit in memory order */
+static inline tr_piece_index_t
+getFirstPiece( picker_word word, size_t n )
+{
+    size_t i;
+    int bit;
+    uint8_t bytes[WORD_SIZE];
+
+    memcpy( bytes, &word, WORD_SIZE );
+
+    for( i=0; !bytes[i]; ++i )
+        ;
+    for( bit=0; !( bytes[i] & ( 0x80 >> bit ) ); ++bit )
+        ;
+
+    return ( n * WORD_SIZE + i ) * 8 + bit;
+}
+
+static tr_bool
+bucketFind( const tr_picker                * picker,
+            const struct tr_picker_bucket  * bucket,
+            const tr_bitset                * have,
+            unsigned int                     salt,
+            tr_piece_index_t               * setme )
+{
+    size_t i;
+    const size_t wordCount = picker->byteCount / WORD_SIZE;
+    size_t n = salt % wordCount;
+
+    for( i=0; i<wordCount; ++i, ++n )
+    {
+        picker_word word;
+
+        if( n == wordCount )
+            n = 0;
+
+        memcpy( &word, bucket->bits + n * WORD_SIZE, WORD_SIZE );
+        if( !word )
+            continue;
+
+        if( !have->haveAll )
+            word &= getPeerWord( &have->bitfield, n );
+
+        if( word )
+        {
+            *setme = getFirstPiece( word, n );
+            assert( *setme < picker->pieceCount );
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+tr_bool
+tr_pickerNext( const tr_picker         * picker,
+               const tr_bitset         * have,
+               unsigned int              salt,
+               tr_piece_index_t        * setme )
+{
+    int i;
+
+    if( !picker->count || have->haveNone )
+        return FALSE;
+    if( !have->haveAll && ( have->bitfield.bits == NULL ) )
+        return FALSE;
+
+    for( i=0; i<TR_PICKER_BUCKETS; ++i )
+        if( picker->buckets[i].count )
+            if( bucketFind( picker, &picker->buckets[i], have, salt, setme ) )
+                return TRUE;
+
+    return FALSE;
+}
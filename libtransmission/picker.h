@@ -0,0 +1,110 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_PICKER_H
+#define TR_PICKER_H 1
+
+#include "transmission.h"
+
+struct tr_bitset;
+
+/**
+ * A rarest-first set of pieces that we want but haven't started yet.
+ *
+ * Pieces are kept in buckets keyed by priority and by how many peers
+ * have them, so finding the best piece that a peer can give us means
+ * walking the buckets in order and intersecting each one with the
+ * peer's bitfield a word at a time, instead of testing every piece.
+ * Changes in priority or replication move a piece between buckets
+ * in constant time.
+ *
+ * Replication counts below 8 each get their own bucket; above that,
+ * the buckets double in width, so the very rarest pieces are ordered
+ * exactly and the common ones approximately.
+ */
+
+enum
+{
+    TR_PICKER_TIERS = 3,    /* high, normal, and low priority */
+    TR_PICKER_CLASSES = 13, /* replication counts 0-7, 8-15, ..., 128+ */
+    TR_PICKER_BUCKETS = TR_PICKER_TIERS * TR_PICKER_CLASSES
+};
+
+struct tr_picker_bucket
+{
+    uint8_t * bits;    /* allocated the first time the bucket is used */
+    size_t count;
+};
+
+typedef struct tr_picker
+{
+    tr_piece_index_t pieceCount;
+    size_t byteCount;  /* rounded up to a whole number of words */
+    size_t count;
+
+    /* which bucket each piece is in, or TR_PICKER_NONE */
+    uint8_t * bucketOf;
+
+    struct tr_picker_bucket buckets[TR_PICKER_BUCKETS];
+}
+tr_picker;
+
+#define TR_PICKER_NONE 0xFF
+
+void tr_pickerConstruct( tr_picker * picker, tr_piece_index_t pieceCount );
+
+void tr_pickerDestruct( tr_picker * picker );
+
+/** @brief remove all the pieces */
+void tr_pickerClear( tr_picker * picker );
+
+void tr_pickerAdd( tr_picker         * picker,
+                   tr_piece_index_t    piece,
+                   tr_priority_t       priority,
+                   uint16_t            replication );
+
+void tr_pickerRemove( tr_picker * picker, tr_piece_index_t piece );
+
+/** @brief move the piece if its replication count changed buckets */
+void tr_pickerSetReplication( tr_picker        * picker,
+                              tr_piece_index_t   piece,
+                              uint16_t           replication );
+
+/**
+ * @brief find the highest-priority, rarest piece that the peer has
+ * @param salt where in each bucket to start looking, so that peers
+ *             with the same pieces don't all get the same answer
+ * @return TRUE if a piece was found
+ */
+tr_bool tr_pickerNext( const tr_picker         * picker,
+                       const struct tr_bitset  * have,
+                       unsigned int              salt,
+                       tr_piece_index_t        * setme );
+
+static inline tr_bool
+tr_pickerHas( const tr_picker * picker, tr_piece_index_t piece )
+{
+    return ( piece < picker->pieceCount )
+        && ( picker->bucketOf[piece] != TR_PICKER_NONE );
+}
+
+static inline size_t
+tr_pickerCount( const tr_picker * picker )
+{
+    return picker->count;
+}
+
+#endif
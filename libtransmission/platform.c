@@ -30,6 +30,7 @@
 #endif
 
 #include <assert.h>
+#include <limits.h> /* LONG_MAX */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -232,6 +233,76 @@ tr_lockUnlock( tr_lock * l )
 #endif
 }
 
+/***
+****  SEMAPHORES
+***/
+
+/** @brief portability wrapper around OS-dependent counting semaphores */
+struct tr_sem
+{
+#ifdef WIN32
+    HANDLE              sem;
+#else
+    int                 count;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+#endif
+};
+
+tr_sem*
+tr_semNew( void )
+{
+    tr_sem * s = tr_new0( tr_sem, 1 );
+
+#ifdef WIN32
+    s->sem = CreateSemaphore( NULL, 0, LONG_MAX, NULL );
+#else
+    pthread_mutex_init( &s->lock, NULL );
+    pthread_cond_init( &s->cond, NULL );
+#endif
+
+    return s;
+}
+
+void
+tr_semFree( tr_sem * s )
+{
+#ifdef WIN32
+    CloseHandle( s->sem );
+#else
+    pthread_cond_destroy( &s->cond );
+    pthread_mutex_destroy( &s->lock );
+#endif
+    tr_free( s );
+}
+
+void
+tr_semPost( tr_sem * s )
+{
+#ifdef WIN32
+    ReleaseSemaphore( s->sem, 1, NULL );
+#else
+    pthread_mutex_lock( &s->lock );
+    ++s->count;
+    pthread_cond_signal( &s->cond );
+    pthread_mutex_unlock( &s->lock );
+#endif
+}
+
+void
+tr_semWait( tr_sem * s )
+{
+#ifdef WIN32
+    WaitForSingleObject( s->sem, INFINITE );
+#else
+    pthread_mutex_lock( &s->lock );
+    while( s->count < 1 )
+        pthread_cond_wait( &s->cond, &s->lock );
+    --s->count;
+    pthread_mutex_unlock( &s->lock );
+#endif
+}
+
 /***
 ****  PATHS
 ***/
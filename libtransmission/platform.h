@@ -96,6 +96,24 @@ void tr_lockUnlock( tr_lock * );
 /** @brief return nonzero if the specified lock is locked */
 int tr_lockHave( const tr_lock * );
 
+/***
+****
+***/
+
+typedef struct tr_sem tr_sem;
+
+/** @brief Create a new counting semaphore with a count of zero */
+tr_sem * tr_semNew( void );
+
+/** @brief Destroy a counting semaphore */
+void tr_semFree( tr_sem * );
+
+/** @brief Increment the semaphore, waking up a thread waiting on it */
+void tr_semPost( tr_sem * );
+
+/** @brief Wait until the semaphore is positive, then decrement it */
+void tr_semWait( tr_sem * );
+
 #ifdef WIN32
 void * mmap( void *ptr, long  size, long  prot, long  type, long  handle, long  arg );
 
@@ -846,7 +846,7 @@ addTrackerUrls( tr_torrent * tor, tr_benc * urls )
         const char * announce = NULL;
 
         if(    tr_bencGetStr( val, &announce )
-            && tr_urlIsValid( announce, -1 )
+            && tr_urlIsValidTracker( announce )
             && !findAnnounceUrl( trackers, n, announce, NULL ) )
         {
             trackers[n].tier = ++tier; /* add a new tier */
@@ -890,7 +890,7 @@ replaceTrackers( tr_torrent * tor, tr_benc * urls )
 
         if(    tr_bencGetInt( pair[0], &pos )
             && tr_bencGetStr( pair[1], &newval )
-            && tr_urlIsValid( newval, -1 )
+            && tr_urlIsValidTracker( newval )
             && pos < n
             && pos >= 0 )
         {
@@ -1541,6 +1541,12 @@ sessionStats( tr_session               * session,
     tr_benc * d;
     tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
     tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+    tr_cache_stats cacheStats;
+    tr_peer_pool_stats poolStats;
+    tr_message_stats messageStats;
+    tr_udp_stats udpStats;
+    tr_announcer_stats announcerStats;
+    tr_web_stats webStats;
     tr_torrent * tor = NULL;
 
     assert( idle_data == NULL );
@@ -1553,6 +1559,12 @@ sessionStats( tr_session               * session,
 
     tr_sessionGetStats( session, &currentStats );
     tr_sessionGetCumulativeStats( session, &cumulativeStats );
+    tr_sessionGetCacheStats( session, &cacheStats );
+    tr_sessionGetPeerPoolStats( session, &poolStats );
+    tr_sessionGetMessageStats( session, &messageStats );
+    tr_sessionGetUdpStats( session, &udpStats );
+    tr_sessionGetAnnouncerStats( session, &announcerStats );
+    tr_sessionGetWebStats( session, &webStats );
 
     tr_bencDictAddInt ( args_out, "activeTorrentCount", running );
     tr_bencDictAddReal( args_out, "downloadSpeed", tr_sessionGetPieceSpeed_Bps( session, TR_DOWN ) );
@@ -1574,6 +1586,51 @@ sessionStats( tr_session               * session,
     tr_bencDictAddInt( d, "sessionCount", currentStats.sessionCount );
     tr_bencDictAddInt( d, "uploadedBytes", currentStats.uploadedBytes );
 
+    d = tr_bencDictAddDict( args_out, "cache-stats", 9 );
+    tr_bencDictAddInt( d, "dirtyBlocks", cacheStats.dirtyBlocks );
+    tr_bencDictAddInt( d, "diskReadBytes", cacheStats.diskReadBytes );
+    tr_bencDictAddInt( d, "diskReads", cacheStats.diskReads );
+    tr_bencDictAddInt( d, "prefetchDepth", cacheStats.prefetchDepth );
+    tr_bencDictAddInt( d, "readBytes", cacheStats.readBytes );
+    tr_bencDictAddInt( d, "readHits", cacheStats.readHits );
+    tr_bencDictAddInt( d, "readLatencyMsec", cacheStats.readLatencyMsec );
+    tr_bencDictAddInt( d, "readMisses", cacheStats.readMisses );
+    tr_bencDictAddInt( d, "readPieces", cacheStats.readPieces );
+
+    d = tr_bencDictAddDict( args_out, "peer-pool-stats", 3 );
+    tr_bencDictAddInt( d, "indexBytes", poolStats.indexBytes );
+    tr_bencDictAddInt( d, "knownPeers", poolStats.knownPeers );
+    tr_bencDictAddInt( d, "poolBytes", poolStats.poolBytes );
+
+    d = tr_bencDictAddDict( args_out, "message-stats", 3 );
+    tr_bencDictAddInt ( d, "flushes", messageStats.flushes );
+    tr_bencDictAddInt ( d, "messages", messageStats.messages );
+    tr_bencDictAddReal( d, "messagesPerFlush", messageStats.flushes ? (double)messageStats.messages / messageStats.flushes : 0.0 );
+
+    d = tr_bencDictAddDict( args_out, "udp-stats", 6 );
+    tr_bencDictAddInt ( d, "recvCalls", udpStats.recvCalls );
+    tr_bencDictAddInt ( d, "recvPackets", udpStats.recvPackets );
+    tr_bencDictAddReal( d, "recvPacketsPerCall", udpStats.recvCalls ? (double)udpStats.recvPackets / udpStats.recvCalls : 0.0 );
+    tr_bencDictAddInt ( d, "sendCalls", udpStats.sendCalls );
+    tr_bencDictAddInt ( d, "sendPackets", udpStats.sendPackets );
+    tr_bencDictAddReal( d, "sendPacketsPerCall", udpStats.sendCalls ? (double)udpStats.sendPackets / udpStats.sendCalls : 0.0 );
+
+    d = tr_bencDictAddDict( args_out, "announcer-stats", 5 );
+    tr_bencDictAddInt ( d, "dueItems", announcerStats.dueItems );
+    tr_bencDictAddInt ( d, "lagSeconds", announcerStats.lagSeconds );
+    tr_bencDictAddReal( d, "lagSecondsPerItem", announcerStats.dueItems ? (double)announcerStats.lagSeconds / announcerStats.dueItems : 0.0 );
+    tr_bencDictAddInt ( d, "maxLagSeconds", announcerStats.maxLagSeconds );
+    tr_bencDictAddInt ( d, "scheduledItems", announcerStats.scheduledItems );
+
+    d = tr_bencDictAddDict( args_out, "web-stats", 7 );
+    tr_bencDictAddInt ( d, "connections", webStats.connections );
+    tr_bencDictAddInt ( d, "latencyMsec", webStats.latencyMsec );
+    tr_bencDictAddReal( d, "latencyMsecPerRequest", webStats.requests ? (double)webStats.latencyMsec / webStats.requests : 0.0 );
+    tr_bencDictAddInt ( d, "maxLatencyMsec", webStats.maxLatencyMsec );
+    tr_bencDictAddInt ( d, "queuedRequests", webStats.queuedRequests );
+    tr_bencDictAddInt ( d, "requests", webStats.requests );
+    tr_bencDictAddReal( d, "requestsPerConnection", webStats.connections ? (double)webStats.requests / webStats.connections : 0.0 );
+
     return NULL;
 }
 
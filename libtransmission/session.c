@@ -26,11 +26,13 @@
 //#define TR_SHOW_DEPRECATED
 #include "transmission.h"
 #include "announcer.h"
+#include "announcer-udp.h"
 #include "bandwidth.h"
 #include "bencode.h"
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto.h"
+#include "disk-io.h"
 #include "fdlimit.h"
 #include "list.h"
 #include "metainfo.h" /* tr_metainfoFree */
@@ -43,6 +45,7 @@
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
+#include "tr-dht.h"
 #include "tr-udp.h"
 #include "tr-utp.h"
 #include "tr-lpd.h"
@@ -57,10 +60,15 @@ enum
 #ifdef TR_LIGHTWEIGHT
     DEFAULT_CACHE_SIZE_MB = 2,
     DEFAULT_PREFETCH_ENABLED = FALSE,
+    DEFAULT_VERIFY_THREADS = 1,
 #else
     DEFAULT_CACHE_SIZE_MB = 4,
     DEFAULT_PREFETCH_ENABLED = TRUE,
+    DEFAULT_VERIFY_THREADS = 4,
 #endif
+    DEFAULT_VERIFY_THREADS_PER_DEVICE = 2,
+    DEFAULT_DISK_IO_THREADS = 1,
+    DEFAULT_SCRAPE_URL_MAX_LENGTH = 4096,
     SAVE_INTERVAL_SECS = 360
 };
 
@@ -345,6 +353,7 @@ tr_sessionGetDefaultSettings( const char * configDir UNUSED, tr_benc * d )
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PROXY_TYPE,               TR_PROXY_HTTP );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_PROXY_USERNAME,           "" );
     tr_bencDictAddBool( d, TR_PREFS_KEY_PREFETCH_ENABLED,         DEFAULT_PREFETCH_ENABLED );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_MMAP_ENABLED,             FALSE );
     tr_bencDictAddReal( d, TR_PREFS_KEY_RATIO,                    2.0 );
     tr_bencDictAddBool( d, TR_PREFS_KEY_RATIO_ENABLED,            FALSE );
     tr_bencDictAddBool( d, TR_PREFS_KEY_RENAME_PARTIAL_FILES,     TRUE );
@@ -374,6 +383,10 @@ tr_sessionGetDefaultSettings( const char * configDir UNUSED, tr_benc * d )
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV6,        TR_DEFAULT_BIND_ADDRESS_IPV6 );
     tr_bencDictAddBool( d, TR_PREFS_KEY_START,                    TRUE );
     tr_bencDictAddBool( d, TR_PREFS_KEY_TRASH_ORIGINAL,           FALSE );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_VERIFY_THREADS,           DEFAULT_VERIFY_THREADS );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_VERIFY_THREADS_PER_DEVICE, DEFAULT_VERIFY_THREADS_PER_DEVICE );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_DISK_IO_THREADS,          DEFAULT_DISK_IO_THREADS );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_SCRAPE_URL_MAX_LENGTH,    DEFAULT_SCRAPE_URL_MAX_LENGTH );
 }
 
 void
@@ -417,6 +430,7 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PROXY_TYPE,               s->proxyType );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_PROXY_USERNAME,           s->proxyUsername );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PREFETCH_ENABLED,         s->isPrefetchEnabled );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_MMAP_ENABLED,             s->isMmapEnabled );
     tr_bencDictAddReal( d, TR_PREFS_KEY_RATIO,                    s->desiredRatio );
     tr_bencDictAddBool( d, TR_PREFS_KEY_RATIO_ENABLED,            s->isRatioLimited );
     tr_bencDictAddBool( d, TR_PREFS_KEY_RENAME_PARTIAL_FILES,     tr_sessionIsIncompleteFileNamingEnabled( s ) );
@@ -446,6 +460,10 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV6,        tr_ntop_non_ts( &s->public_ipv6->addr ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_START,                    !tr_sessionGetPaused( s ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_TRASH_ORIGINAL,           tr_sessionGetDeleteSource( s ) );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_VERIFY_THREADS,           s->verifyThreads );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_VERIFY_THREADS_PER_DEVICE, s->verifyThreadsPerDevice );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_DISK_IO_THREADS,          s->diskIoThreads );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_SCRAPE_URL_MAX_LENGTH,    s->scrapeUrlMaxLength );
 }
 
 tr_bool
@@ -648,6 +666,7 @@ onNowTimer( int foo UNUSED, short bar UNUSED, void * vsession )
                 ++tor->secondsSeeding;
             else
                 ++tor->secondsDownloading;
+            tr_torrentCheckFiles( tor );
         }
     }
 
@@ -729,6 +748,8 @@ tr_sessionInitImpl( void * vdata )
 
     tr_sessionSet( session, &settings );
 
+    tr_diskIoInit( session, session->diskIoThreads );
+
     tr_udpInit( session );
 
     if( session->isLPDEnabled )
@@ -800,6 +821,8 @@ sessionSetImpl( void * vdata )
     /* files and directories */
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_PREFETCH_ENABLED, &boolVal ) )
         session->isPrefetchEnabled = boolVal;
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_MMAP_ENABLED, &boolVal ) )
+        session->isMmapEnabled = boolVal;
     if( tr_bencDictFindInt( settings, TR_PREFS_KEY_PREALLOCATION, &i ) )
         session->preallocationMode = i;
     if( tr_bencDictFindStr( settings, TR_PREFS_KEY_DOWNLOAD_DIR, &str ) )
@@ -810,6 +833,14 @@ sessionSetImpl( void * vdata )
         tr_sessionSetIncompleteDirEnabled( session, boolVal );
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_RENAME_PARTIAL_FILES, &boolVal ) )
         tr_sessionSetIncompleteFileNamingEnabled( session, boolVal );
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_VERIFY_THREADS, &i ) )
+        session->verifyThreads = MAX( 1, i );
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_VERIFY_THREADS_PER_DEVICE, &i ) )
+        session->verifyThreadsPerDevice = MAX( 1, i );
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_DISK_IO_THREADS, &i ) )
+        session->diskIoThreads = MAX( 1, i );
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_SCRAPE_URL_MAX_LENGTH, &i ) )
+        session->scrapeUrlMaxLength = MAX( 0, i );
 
     /* proxies */
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_PROXY_ENABLED, &boolVal ) )
@@ -1765,8 +1796,10 @@ sessionCloseImpl( void * vsession )
     if( session->isLPDEnabled )
         tr_lpdUninit( session );
 
+    /* the UDP socket stays open until the UDP trackers
+     * have heard our "stopped" announces; see tr_sessionClose() */
     tr_utpClose( session );
-    tr_udpUninit( session );
+    tr_dhtUninit( session );
 
     event_free( session->saveTimer );
     session->saveTimer = NULL;
@@ -1791,6 +1824,9 @@ sessionCloseImpl( void * vsession )
         tr_torrentFree( torrents[i] );
     tr_free( torrents );
 
+    /* the torrents flushed their blocks when they were freed,
+     * so this just waits for those writes to finish */
+    tr_diskIoClose( session );
     tr_cacheFree( session->cache );
     session->cache = NULL;
     tr_announcerClose( session );
@@ -1805,6 +1841,19 @@ sessionCloseImpl( void * vsession )
     session->isClosed = TRUE;
 }
 
+static void
+sessionCloseUdpImpl( void * vsession )
+{
+    tr_session * session = vsession;
+
+    assert( tr_isSession( session ) );
+
+    tr_tauClose( session, TR_TAU_CLOSE_NOW );
+    tr_udpUninit( session );
+
+    session->isUdpClosed = TRUE;
+}
+
 static int
 deadlineReached( const time_t deadline )
 {
@@ -1834,11 +1883,19 @@ tr_sessionClose( tr_session * session )
      * so we need to keep the transmission thread alive
      * for a bit while they tell the router & tracker
      * that we're closing now */
-    while( ( session->shared || session->web || session->announcer )
+    while( ( session->shared || session->web || session->announcer || session->announcer_udp )
            && !deadlineReached( deadline ) )
     {
-        dbgmsg( "waiting on port unmap (%p) or announcer (%p)... now %zu deadline %zu",
-                session->shared, session->announcer, (size_t)time(NULL), (size_t)deadline );
+        dbgmsg( "waiting on port unmap (%p) or announcer (%p, %p)... now %zu deadline %zu",
+                session->shared, session->announcer, session->announcer_udp, (size_t)time(NULL), (size_t)deadline );
+        tr_wait_msec( 100 );
+    }
+
+    /* now that the UDP trackers are done, close the UDP socket */
+    tr_runInEventThread( session, sessionCloseUdpImpl, session );
+    while( !session->isUdpClosed && !deadlineReached( deadline ) )
+    {
+        dbgmsg( "waiting for the UDP socket to close" );
         tr_wait_msec( 100 );
     }
 
@@ -2102,6 +2159,61 @@ tr_sessionGetCacheLimit_MB( const tr_session * session )
     return toMemMB( tr_cacheGetLimit( session->cache ) );
 }
 
+void
+tr_sessionGetCacheStats( const tr_session * session, tr_cache_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    tr_cacheGetStats( session->cache, setme );
+}
+
+void
+tr_sessionGetPeerPoolStats( const tr_session * session, tr_peer_pool_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    tr_peerMgrGetPoolStats( session->peerMgr, setme );
+}
+
+void
+tr_sessionGetMessageStats( const tr_session * session, tr_message_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    setme->messages = session->peerMessageCount;
+    setme->flushes = session->peerMessageFlushCount;
+}
+
+void
+tr_sessionGetUdpStats( const tr_session * session, tr_udp_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    *setme = session->udp_stats;
+}
+
+void
+tr_sessionGetAnnouncerStats( const tr_session * session, tr_announcer_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    tr_announcerGetStats( session->announcer, setme );
+}
+
+void
+tr_sessionGetWebStats( const tr_session * session, tr_web_stats * setme )
+{
+    assert( tr_isSession( session ) );
+    assert( setme != NULL );
+
+    tr_webGetStats( session, setme );
+}
+
 /***
 ****
 ***/
@@ -40,9 +40,11 @@ const uint8_t* tr_getPeerId( void );
 struct event_base;
 struct tr_address;
 struct tr_announcer;
+struct tr_announcer_udp;
 struct tr_bandwidth;
 struct tr_bindsockets;
 struct tr_cache;
+struct tr_diskIo;
 struct tr_fdInfo;
 
 typedef void ( tr_web_config_func )( tr_session * session, void * curl_pointer, const char * url );
@@ -95,8 +97,10 @@ struct tr_session
     tr_bool                      isProxyEnabled;
     tr_bool                      isProxyAuthEnabled;
     tr_bool                      isPrefetchEnabled;
+    tr_bool                      isMmapEnabled;
     tr_bool                      isTorrentDoneScriptEnabled;
     tr_bool                      isClosed;
+    tr_bool                      isUdpClosed;
     tr_bool                      useLazyBitfield;
     tr_bool                      isIncompleteFileNamingEnabled;
     tr_bool                      isRatioLimited;
@@ -122,6 +126,18 @@ struct tr_session
 
     tr_preallocation_mode        preallocationMode;
 
+    /* how many threads may verify local data, and how many of
+     * those may read from the same device at the same time */
+    int                          verifyThreads;
+    int                          verifyThreadsPerDevice;
+
+    /* how many threads read and write piece data for peers */
+    int                          diskIoThreads;
+
+    /* HTTP scrapes to the same tracker are batched into one
+     * request until its URL would grow longer than this */
+    int                          scrapeUrlMaxLength;
+
     struct event_base          * event_base;
     struct tr_event_handle     * events;
 
@@ -134,6 +150,8 @@ struct tr_session
     int                          udp_socket;
     int                          udp6_socket;
     unsigned char *              udp6_bound;
+    struct tr_udp_io *           udp_io;
+    tr_udp_stats                 udp_stats;
     struct event                 *udp_event;
     struct event                 *udp6_event;
 
@@ -178,7 +196,12 @@ struct tr_session
     struct tr_peerMgr *          peerMgr;
     struct tr_shared *           shared;
 
+    /* protocol messages sent to peers, and the batches they went out in */
+    uint64_t                     peerMessageCount;
+    uint64_t                     peerMessageFlushCount;
+
     struct tr_cache *            cache;
+    struct tr_diskIo *           diskIo;
 
     struct tr_lock *             lock;
 
@@ -191,6 +214,7 @@ struct tr_session
     struct tr_stats_handle     * sessionStats;
 
     struct tr_announcer        * announcer;
+    struct tr_announcer_udp    * announcer_udp;
 
     tr_benc                    * metainfoLookup;
 
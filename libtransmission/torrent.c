@@ -38,6 +38,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* for tr_sha1 */
+#include "disk-io.h" /* tr_diskIoQueue(), tr_diskIoWaitTorrent() */
 #include "resume.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "inout.h" /* tr_ioTestPiece() */
@@ -1503,6 +1504,9 @@ freeTorrent( tr_torrent * tor )
 
     tr_sessionLock( session );
 
+    /* don't pull the rug out from under any pending disk jobs */
+    tr_diskIoWaitTorrent( session, tor->uniqueId );
+
     tr_peerMgrRemoveTorrent( tor );
 
     tr_cpDestruct( &tor->completion );
@@ -1558,9 +1562,9 @@ torrentStartImpl( void * vtor )
     tor->finishedSeedingByIdle = FALSE;
 
     tr_torrentResetTransferStats( tor );
-    tr_announcerTorrentStarted( tor );
     tor->dhtAnnounceAt = now + tr_cryptoWeakRandInt( 20 );
     tor->dhtAnnounce6At = now + tr_cryptoWeakRandInt( 20 );
+    tr_announcerTorrentStarted( tor );
     tor->lpdAnnounceAt = now;
     tr_peerMgrStartTorrent( tor );
 
@@ -1719,7 +1723,7 @@ stopTorrent( void * vtor )
     tr_announcerTorrentStopped( tor );
     tr_cacheFlushTorrent( tor->session->cache, tor );
 
-    tr_fdTorrentClose( tor->session, tor->uniqueId );
+    tr_fdTorrentClose( tor->session, tor );
 
     if( !tor->isDeleting )
         tr_torrentSave( tor );
@@ -1988,7 +1992,7 @@ tr_torrentRecheckCompleteness( tr_torrent * tor )
         }
 
         tor->completeness = completeness;
-        tr_fdTorrentClose( tor->session, tor->uniqueId );
+        tr_fdTorrentClose( tor->session, tor );
 
         if( tr_torrentIsSeed( tor ) )
         {
@@ -2801,7 +2805,7 @@ tr_torrentDeleteLocalData( tr_torrent * tor, tr_fileFunc fileFunc )
 
     /* close all the files because we're about to delete them */
     tr_cacheFlushTorrent( tor->session->cache, tor );
-    tr_fdTorrentClose( tor->session, tor->uniqueId );
+    tr_fdTorrentClose( tor->session, tor );
 
     if( tor->info.fileCount > 1 )
     {
@@ -2858,8 +2862,10 @@ setLocation( void * vdata )
     {
         tr_file_index_t i;
 
-        /* bad idea to move files while they're being verified... */
+        /* bad idea to move files while they're being verified
+         * or while the disk I/O threads are writing to them... */
         tr_verifyRemove( tor );
+        tr_diskIoWaitTorrent( tor->session, tor->uniqueId );
 
         /* try to move the files.
          * FIXME: there are still all kinds of nasty cases, like what
@@ -3001,6 +3007,67 @@ tr_torrentFileCompleted( tr_torrent * tor, tr_file_index_t fileNum )
 ****
 ***/
 
+struct file_check
+{
+    tr_session * session;
+    int torrentId;
+    tr_file_index_t fileCount;
+    tr_file_index_t deletedFile;
+    tr_bool foundDeleted;
+};
+
+/* runs in a disk I/O thread */
+static void
+fileCheckWorkFunc( void * vcheck )
+{
+    struct file_check * check = vcheck;
+
+    check->foundDeleted = tr_fdTorrentFindDeletedFile( check->session,
+                                                       check->torrentId,
+                                                       check->fileCount,
+                                                       &check->deletedFile );
+}
+
+static void
+fileCheckDoneFunc( tr_session * session, void * vcheck )
+{
+    struct file_check * check = vcheck;
+    tr_torrent * tor = tr_torrentFindFromId( session, check->torrentId );
+
+    if( tor != NULL )
+    {
+        tor->isCheckingFiles = FALSE;
+
+        if( check->foundDeleted && ( tor->error != TR_STAT_LOCAL_ERROR ) )
+            tr_torrentSetLocalError( tor, "Please Verify Local Data! A file disappeared: \"%s\"",
+                                     tor->info.files[check->deletedFile].name );
+    }
+
+    tr_free( check );
+}
+
+void
+tr_torrentCheckFiles( tr_torrent * tor )
+{
+    assert( tr_isTorrent( tor ) );
+
+    /* don't pile up checks if the disk is slow */
+    if( !tor->isCheckingFiles )
+    {
+        struct file_check * check = tr_new0( struct file_check, 1 );
+        check->session = tor->session;
+        check->torrentId = tor->uniqueId;
+        check->fileCount = tor->info.fileCount;
+
+        tor->isCheckingFiles = TRUE;
+        tr_diskIoQueue( tor->session, tor->uniqueId, fileCheckWorkFunc, fileCheckDoneFunc, check );
+    }
+}
+
+/***
+****
+***/
+
 static tr_bool
 fileExists( const char * filename )
 {
@@ -237,6 +237,7 @@ struct tr_torrent
     tr_bool                    isRunning;
     tr_bool                    isStopping;
     tr_bool                    isDeleting;
+    tr_bool                    isCheckingFiles;
     tr_bool                    startAfterVerify;
     tr_bool                    isDirty;
 
@@ -380,6 +381,13 @@ uint32_t tr_getBlockSize( uint32_t pieceSize );
  */
 void tr_torrentFileCompleted( tr_torrent * tor, tr_file_index_t fileNo );
 
+/**
+ * Have a disk I/O thread look for open files that were deleted out
+ * from under us, and set a local error if one was. The session calls
+ * this once per second for each running torrent.
+ */
+void tr_torrentCheckFiles( tr_torrent * tor );
+
 
 /**
  * @brief Like tr_torrentFindFile(), but splits the filename into base and subpath;
@@ -21,17 +21,23 @@ THE SOFTWARE.
 
 */
 
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+
+#include <errno.h>
+#include <string.h> /* memcpy(), memset() */
 #include <unistd.h>
 #include <assert.h>
 
 #include <event2/event.h>
 
 #include "transmission.h"
+#include "announcer-udp.h"
 #include "net.h"
 #include "session.h"
 #include "tr-dht.h"
 #include "tr-utp.h"
 #include "tr-udp.h"
+#include "utils.h"
 
 /* Since we use a single UDP socket in order to implement multiple
    uTP sockets, try to set up huge buffers. */
@@ -183,43 +189,339 @@ rebind_ipv6(tr_session *ss, tr_bool force)
     }
 }
 
+/* We move up to UDP_BATCH datagrams per system call, through buffers
+   that are allocated once rather than for every packet.  DHT packets
+   are smaller than UDP_PACKET_SIZE, and so are uTP packets, which are
+   sized to fit the path MTU. */
+
+#define UDP_BATCH 32
+#define UDP_PACKET_SIZE 4096
+
+struct tr_udp_packet {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    unsigned char buf[UDP_PACKET_SIZE];
+};
+
+struct tr_udp_io {
+    /* the receive ring, reused on every wakeup */
+    struct tr_udp_packet in[UDP_BATCH];
+
+    /* outgoing uTP packets, sent together at the end of the
+       event loop's current pass */
+    struct tr_udp_packet out[UDP_BATCH];
+    int out_count;
+    tr_bool flush_pending;
+    struct event *flush_event;
+
+    /* set once the kernel has said it doesn't support recvmmsg() or
+       sendmmsg() at all, e.g. because it's too old to have them */
+    tr_bool no_recvmmsg;
+    tr_bool no_sendmmsg;
+};
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+/* Whether errno, as set by recvmmsg() or sendmmsg(), means that we
+   can't use that call at all.  Other errors, such as EINVAL, may only
+   be about this one batch. */
+static tr_bool
+mmsg_unsupported(int err)
+{
+    return err == ENOSYS
+#ifdef EOPNOTSUPP
+        || err == EOPNOTSUPP
+#endif
+        ;
+}
+#endif
+
+static tr_bool
+would_block(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+static int
+udp_socket(const tr_session *ss, int family)
+{
+    if(family == AF_INET)
+        return ss->udp_socket;
+    if(family == AF_INET6)
+        return ss->udp6_socket;
+    return -1;
+}
+
+/* Send packets[0..n) one at a time. */
 static void
-event_callback(int s, short type UNUSED, void *sv)
+send_packets_one(tr_session *ss, int s, struct tr_udp_packet *packets, int n)
 {
-    tr_session *ss = (tr_session*)sv;
-    unsigned char *buf;
-    struct sockaddr_storage from;
-    socklen_t fromlen;
-    int rc;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        const int rc = sendto(s, packets[i].buf, packets[i].len, 0,
+                              (struct sockaddr*)&packets[i].addr,
+                              packets[i].addrlen);
+        ss->udp_stats.sendCalls++;
+        if(rc >= 0)
+            ss->udp_stats.sendPackets++;
+        else if(would_block(errno))
+            break;
+    }
+}
 
-    assert(tr_isSession(sv));
-    assert(type == EV_READ);
+/* Send packets[0..n), which all go out through socket s.  When the
+   socket buffer is full, the rest are dropped like lost datagrams;
+   uTP will resend them. */
+static void
+send_packets(tr_session *ss, int s, struct tr_udp_packet *packets, int n)
+{
+#ifdef HAVE_SENDMMSG
+    int i;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
 
-    buf = malloc(4096);
-    if(buf == NULL) {
-        tr_nerr("UDP", "Couldn't allocate buffer");
+    if(ss->udp_io->no_sendmmsg) {
+        send_packets_one(ss, s, packets, n);
         return;
     }
 
-    fromlen = sizeof(from);
-    rc = recvfrom(s, buf, 4096 - 1, 0,
-                  (struct sockaddr*)&from, &fromlen);
-    if(rc <= 0)
-        goto out;
+    memset(msgs, 0, sizeof(struct mmsghdr) * n);
+    for(i = 0; i < n; i++) {
+        iov[i].iov_base = packets[i].buf;
+        iov[i].iov_len = packets[i].len;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &packets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = packets[i].addrlen;
+    }
 
-    if( buf[0] == 'd' ) {
-        /* DHT packet. */
-        buf[rc] = '\0';
-        tr_dhtCallback(buf, rc, (struct sockaddr*)&from, fromlen, sv);
-    } else {
-        rc = tr_utpPacket(buf, rc, (struct sockaddr*)&from, fromlen, ss);
-        if(!rc)
-            tr_ndbg("UDP", "Unexpected UDP packet");
+    i = 0;
+    while(i < n) {
+        const int rc = sendmmsg(s, msgs + i, n - i, 0);
+        ss->udp_stats.sendCalls++;
+        if(rc > 0) {
+            ss->udp_stats.sendPackets += rc;
+            i += rc;
+        } else if(rc == 0 || would_block(errno)) {
+            break;
+        } else if(errno == EINTR) {
+            continue;
+        } else if(i == 0 && mmsg_unsupported(errno)) {
+            tr_ninf("UDP", "sendmmsg() failed (%s); sending one packet "
+                    "at a time", tr_strerror(errno));
+            ss->udp_io->no_sendmmsg = TRUE;
+            send_packets_one(ss, s, packets, n);
+            break;
+        } else if(errno == EINVAL || errno == EPERM) {
+            /* Something in the rest of this batch upset the kernel.
+               Send it one packet at a time, so that only the bad
+               packets are lost, and keep batching after this. */
+            send_packets_one(ss, s, packets + i, n - i);
+            break;
+        } else {
+            /* The first packet was refused, e.g. because its
+               destination is unreachable.  Skip just that one. */
+            i++;
+        }
+    }
+#else
+    send_packets_one(ss, s, packets, n);
+#endif
+}
+
+static void
+flush_output(tr_session *ss)
+{
+    struct tr_udp_io *io = ss->udp_io;
+    int i = 0;
+
+    /* One batch per run of packets bound for the same socket. */
+    while(i < io->out_count) {
+        const int family = io->out[i].addr.ss_family;
+        int j = i + 1;
+        int s;
+
+        while(j < io->out_count && io->out[j].addr.ss_family == family)
+            j++;
+
+        s = udp_socket(ss, family);
+        if(s >= 0)
+            send_packets(ss, s, &io->out[i], j - i);
+        i = j;
+    }
+
+    io->out_count = 0;
+}
+
+static void
+flush_callback(int fd UNUSED, short type UNUSED, void *sv)
+{
+    tr_session *ss = sv;
+
+    ss->udp_io->flush_pending = FALSE;
+    flush_output(ss);
+}
+
+void
+tr_udpSendTo(tr_session *ss, const unsigned char *buf, size_t buflen,
+             const struct sockaddr *to, socklen_t tolen)
+{
+    struct tr_udp_io *io = ss->udp_io;
+    struct tr_udp_packet *p;
+    const int s = udp_socket(ss, to->sa_family);
+
+    if(s < 0)
+        return;
+
+    if(io == NULL || buflen > UDP_PACKET_SIZE ||
+       tolen > sizeof(struct sockaddr_storage)) {
+        sendto(s, buf, buflen, 0, to, tolen);
+        ss->udp_stats.sendCalls++;
+        ss->udp_stats.sendPackets++;
+        return;
+    }
+
+    if(io->out_count == UDP_BATCH)
+        flush_output(ss);
+
+    p = &io->out[io->out_count++];
+    memcpy(p->buf, buf, buflen);
+    p->len = buflen;
+    memcpy(&p->addr, to, tolen);
+    p->addrlen = tolen;
+
+    /* Whatever else the event loop is running right now may have
+       packets to send too, so wait for it to finish. */
+    if(!io->flush_pending) {
+        io->flush_pending = TRUE;
+        event_active(io->flush_event, EV_TIMEOUT, 0);
+    }
+}
+
+/* Fill the receive ring from socket s with recvfrom(), returning how
+   many packets were read. */
+static int
+receive_packets_one(tr_session *ss, int s)
+{
+    struct tr_udp_io *io = ss->udp_io;
+    int n;
+
+    for(n = 0; n < UDP_BATCH; n++) {
+        struct tr_udp_packet *p = &io->in[n];
+        int rc;
+
+        p->addrlen = sizeof(p->addr);
+        rc = recvfrom(s, p->buf, UDP_PACKET_SIZE - 1, MSG_DONTWAIT,
+                      (struct sockaddr*)&p->addr, &p->addrlen);
+        ss->udp_stats.recvCalls++;
+        if(rc < 0)
+            break;
+        p->len = rc;
     }
 
-out:
-    free(buf);
-}    
+    return n;
+}
+
+/* Fill the receive ring from socket s, returning how many packets
+   were read. */
+static int
+receive_packets(tr_session *ss, int s)
+{
+#ifdef HAVE_RECVMMSG
+    struct tr_udp_io *io = ss->udp_io;
+    int i, n;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+
+    if(io->no_recvmmsg)
+        return receive_packets_one(ss, s);
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < UDP_BATCH; i++) {
+        /* Leave room to NUL-terminate DHT packets. */
+        iov[i].iov_base = io->in[i].buf;
+        iov[i].iov_len = UDP_PACKET_SIZE - 1;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &io->in[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(io->in[i].addr);
+    }
+
+    n = recvmmsg(s, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    ss->udp_stats.recvCalls++;
+
+    if(n < 0 && mmsg_unsupported(errno)) {
+        /* Otherwise the socket would stay readable and we'd be
+           called again right away, forever. */
+        tr_ninf("UDP", "recvmmsg() failed (%s); reading one packet "
+                "at a time", tr_strerror(errno));
+        io->no_recvmmsg = TRUE;
+        return receive_packets_one(ss, s);
+    }
+
+    if(n < 0 && !would_block(errno) && errno != EINTR) {
+        /* Something else went wrong, maybe just this once.  Read this
+           wakeup's packets one at a time, for the same reason. */
+        return receive_packets_one(ss, s);
+    }
+
+    for(i = 0; i < n; i++) {
+        io->in[i].len = msgs[i].msg_len;
+        io->in[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+
+    return MAX(n, 0);
+#else
+    return receive_packets_one(ss, s);
+#endif
+}
+
+static void
+event_callback(int s, short type UNUSED, void *sv)
+{
+    tr_session *ss = (tr_session*)sv;
+    struct tr_udp_io *io = ss->udp_io;
+    int i, n;
+
+    assert(tr_isSession(sv));
+    assert(type == EV_READ);
+
+    n = receive_packets(ss, s);
+    ss->udp_stats.recvPackets += n;
+
+    for(i = 0; i < n; i++) {
+        struct tr_udp_packet *p = &io->in[i];
+
+        if(p->len == 0)
+            continue;
+
+        if( p->buf[0] == 'd' ) {
+            /* DHT packet. */
+            p->buf[p->len] = '\0';
+            tr_dhtCallback(p->buf, p->len, (struct sockaddr*)&p->addr,
+                           p->addrlen, sv);
+        } else {
+            /* UDP tracker replies start with the action, in network
+               byte order. Anything that isn't a reply to one of our
+               requests might still be uTP, so pass it on. */
+            const tr_bool maybe_tracker =
+                p->len >= 8 && p->buf[0] == 0 && p->buf[1] == 0 &&
+                p->buf[2] == 0 && p->buf[3] <= 3;
+
+            if(!maybe_tracker ||
+               !tr_tauHandleMessage(ss, p->buf, p->len,
+                                    (struct sockaddr*)&p->addr,
+                                    p->addrlen)) {
+                const int rc = tr_utpPacket(p->buf, p->len,
+                                            (struct sockaddr*)&p->addr,
+                                            p->addrlen, ss);
+                if(!rc)
+                    tr_ndbg("UDP", "Unexpected UDP packet");
+            }
+        }
+    }
+}
 
 void
 tr_udpInit(tr_session *ss)
@@ -236,6 +538,9 @@ tr_udpInit(tr_session *ss)
     if(ss->udp_port <= 0)
         return;
 
+    ss->udp_io = tr_new0(struct tr_udp_io, 1);
+    ss->udp_io->flush_event = evtimer_new(ss->event_base, flush_callback, ss);
+
     ss->udp_socket = socket(PF_INET, SOCK_DGRAM, 0);
     if(ss->udp_socket < 0) {
         tr_nerr("UDP", "Couldn't create IPv4 socket");
@@ -288,6 +593,13 @@ tr_udpUninit(tr_session *ss)
 {
     tr_dhtUninit(ss);
 
+    if(ss->udp_io) {
+        flush_output(ss);
+        event_free(ss->udp_io->flush_event);
+        tr_free(ss->udp_io);
+        ss->udp_io = NULL;
+    }
+
     if(ss->udp_socket >= 0) {
         tr_netCloseSocket( ss->udp_socket );
         ss->udp_socket = -1;
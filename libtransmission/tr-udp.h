@@ -28,3 +28,8 @@ THE SOFTWARE.
 void tr_udpInit( tr_session * );
 void tr_udpUninit( tr_session * );
 void tr_udpSetSocketBuffers(tr_session *);
+
+/* Queue a packet to go out with the rest of this
+   event loop pass's packets. */
+void tr_udpSendTo(tr_session *, const unsigned char *buf, size_t buflen,
+                  const struct sockaddr *to, socklen_t tolen);
@@ -33,6 +33,7 @@ THE SOFTWARE.
 #include "crypto.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
+#include "tr-udp.h"
 #include "tr-utp.h"
 #include "utils.h"
 
@@ -137,12 +138,7 @@ void
 tr_utpSendTo(void *closure, const unsigned char *buf, size_t buflen,
              const struct sockaddr *to, socklen_t tolen)
 {
-    tr_session *ss = (tr_session*)closure;
-
-    if(to->sa_family == AF_INET && ss->udp_socket)
-        sendto(ss->udp_socket, buf, buflen, 0, to, tolen);
-    else if(to->sa_family == AF_INET6 && ss->udp_socket)
-        sendto(ss->udp6_socket, buf, buflen, 0, to, tolen);
+    tr_udpSendTo(closure, buf, buflen, to, tolen);
 }
 
 static void
@@ -169,6 +169,7 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_BLOCKLIST_URL                 "blocklist-url"
 #define TR_PREFS_KEY_MAX_CACHE_SIZE_MB             "cache-size-mb"
 #define TR_PREFS_KEY_DHT_ENABLED                   "dht-enabled"
+#define TR_PREFS_KEY_DISK_IO_THREADS               "disk-io-threads"
 #define TR_PREFS_KEY_UTP_ENABLED                   "utp-enabled"
 #define TR_PREFS_KEY_LPD_ENABLED                   "lpd-enabled"
 #define TR_PREFS_KEY_PREFETCH_ENABLED              "prefetch-enabled"
@@ -179,6 +180,7 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_INCOMPLETE_DIR                "incomplete-dir"
 #define TR_PREFS_KEY_INCOMPLETE_DIR_ENABLED        "incomplete-dir-enabled"
 #define TR_PREFS_KEY_MSGLEVEL                      "message-level"
+#define TR_PREFS_KEY_MMAP_ENABLED                  "mmap-enabled"
 #define TR_PREFS_KEY_OPEN_FILE_LIMIT               "open-file-limit"
 #define TR_PREFS_KEY_PEER_LIMIT_GLOBAL             "peer-limit-global"
 #define TR_PREFS_KEY_PEER_LIMIT_TORRENT            "peer-limit-per-torrent"
@@ -209,6 +211,7 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_RPC_USERNAME                  "rpc-username"
 #define TR_PREFS_KEY_RPC_URL                       "rpc-url"
 #define TR_PREFS_KEY_RPC_WHITELIST_ENABLED         "rpc-whitelist-enabled"
+#define TR_PREFS_KEY_SCRAPE_URL_MAX_LENGTH         "scrape-url-max-length"
 #define TR_PREFS_KEY_SCRIPT_TORRENT_DONE_FILENAME  "script-torrent-done-filename"
 #define TR_PREFS_KEY_SCRIPT_TORRENT_DONE_ENABLED   "script-torrent-done-enabled"
 #define TR_PREFS_KEY_RPC_WHITELIST                 "rpc-whitelist"
@@ -220,6 +223,8 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT      "upload-slots-per-torrent"
 #define TR_PREFS_KEY_START                         "start-added-torrents"
 #define TR_PREFS_KEY_TRASH_ORIGINAL                "trash-original-torrent-files"
+#define TR_PREFS_KEY_VERIFY_THREADS                "verify-threads"
+#define TR_PREFS_KEY_VERIFY_THREADS_PER_DEVICE     "verify-threads-per-device"
 
 
 /**
@@ -614,6 +619,88 @@ void tr_sessionGetCumulativeStats( const tr_session * session, tr_session_stats
 
 void tr_sessionClearStats( tr_session * session );
 
+/** @brief Used by tr_sessionGetCacheStats() to give disk cache statistics */
+typedef struct tr_cache_stats
+{
+    uint64_t    readHits;      /* block reads served from the read cache */
+    uint64_t    readMisses;    /* block reads that had to go to disk */
+    uint64_t    readPieces;    /* pieces currently in the read cache */
+    uint64_t    readBytes;     /* bytes currently in the read cache */
+    uint64_t    diskReads;     /* whole pieces read from disk into the cache */
+    uint64_t    diskReadBytes; /* bytes read from disk into the cache */
+    uint64_t    dirtyBlocks;   /* blocks waiting to be written to disk */
+    uint64_t    readLatencyMsec; /* recent average time to read from disk */
+    uint64_t    prefetchDepth; /* how many pieces may be read ahead at once */
+}
+tr_cache_stats;
+
+/** @brief Get statistics about the session's disk cache */
+void tr_sessionGetCacheStats( const tr_session * session, tr_cache_stats * setme );
+
+/** @brief Used by tr_sessionGetPeerPoolStats() to describe the known peers */
+typedef struct tr_peer_pool_stats
+{
+    uint64_t    knownPeers;    /* peer addresses remembered across all torrents */
+    uint64_t    poolBytes;     /* memory allocated to remember them */
+    uint64_t    indexBytes;    /* memory used to look them up by address */
+}
+tr_peer_pool_stats;
+
+/** @brief Get statistics about the peers that the session knows of */
+void tr_sessionGetPeerPoolStats( const tr_session * session, tr_peer_pool_stats * setme );
+
+/** @brief Used by tr_sessionGetMessageStats() to describe outgoing protocol messages */
+typedef struct tr_message_stats
+{
+    uint64_t    messages;      /* protocol messages sent to peers */
+    uint64_t    flushes;       /* batches they were written out in */
+}
+tr_message_stats;
+
+/** @brief Get statistics about the protocol messages sent to peers */
+void tr_sessionGetMessageStats( const tr_session * session, tr_message_stats * setme );
+
+/** @brief Used by tr_sessionGetUdpStats() to describe the DHT and uTP socket traffic */
+typedef struct tr_udp_stats
+{
+    uint64_t    recvPackets;   /* datagrams received */
+    uint64_t    recvCalls;     /* system calls made to receive them */
+    uint64_t    sendPackets;   /* uTP datagrams sent */
+    uint64_t    sendCalls;     /* system calls made to send them */
+}
+tr_udp_stats;
+
+/** @brief Get statistics about the session's UDP sockets */
+void tr_sessionGetUdpStats( const tr_session * session, tr_udp_stats * setme );
+
+/** @brief Used by tr_sessionGetAnnouncerStats() to describe how far behind
+           the tracker and DHT announce scheduler is running */
+typedef struct tr_announcer_stats
+{
+    uint64_t    scheduledItems; /* tiers and DHT announces waiting for their time */
+    uint64_t    dueItems;       /* times one of them came due and was sent */
+    uint64_t    lagSeconds;     /* total time they waited past their due time before being sent */
+    uint64_t    maxLagSeconds;  /* longest that one of them waited */
+}
+tr_announcer_stats;
+
+/** @brief Get statistics about the session's announce scheduler */
+void tr_sessionGetAnnouncerStats( const tr_session * session, tr_announcer_stats * setme );
+
+/** @brief Used by tr_sessionGetWebStats() to describe HTTP requests to trackers and web seeds */
+typedef struct tr_web_stats
+{
+    uint64_t    requests;       /* requests that finished */
+    uint64_t    connections;    /* new connections opened for them */
+    uint64_t    latencyMsec;    /* total time they took */
+    uint64_t    maxLatencyMsec; /* longest that one of them took */
+    uint64_t    queuedRequests; /* requests waiting for a free connection to their host */
+}
+tr_web_stats;
+
+/** @brief Get statistics about the session's HTTP requests */
+void tr_sessionGetWebStats( const tr_session * session, tr_web_stats * setme );
+
 /**
  * @brief Set whether or not torrents are allowed to do peer exchanges.
  *
@@ -141,6 +141,66 @@ test_bitfields( void )
     return 0;
 }
 
+/* check each kernel this CPU can run against the byte-at-a-time answers */
+static int
+test_bitfield_kernels( void )
+{
+    int k;
+    const tr_bitfield_kernel best = tr_bitfieldGetKernel( );
+
+    for( k=TR_BITFIELD_KERNEL_WORD; k<=TR_BITFIELD_KERNEL_AVX2; ++k )
+    {
+        int loop;
+
+        if( !tr_bitfieldSetKernel( k ) )
+            continue;
+
+        for( loop=0; loop<200; ++loop )
+        {
+            size_t i, j;
+            size_t count, andNot;
+            const size_t bitCount = 1 + tr_cryptoWeakRandInt( 2000 );
+            tr_bitfield * a = tr_bitfieldNew( bitCount );
+            tr_bitfield * b = tr_bitfieldNew( bitCount );
+            tr_bitfield * c = tr_bitfieldNew( bitCount );
+
+            /* some sparse fields and some dense ones */
+            for( i=0, j=tr_cryptoWeakRandInt( bitCount ); i<j; ++i ) {
+                tr_bitfieldAdd( a, tr_cryptoWeakRandInt( bitCount ) );
+                tr_bitfieldAdd( b, tr_cryptoWeakRandInt( bitCount ) );
+            }
+
+            count = andNot = 0;
+            for( i=0; i<bitCount; ++i ) {
+                if( tr_bitfieldHas( a, i ) ) ++count;
+                if( tr_bitfieldHas( a, i ) && !tr_bitfieldHas( b, i ) ) ++andNot;
+            }
+            check( tr_bitfieldCountTrueBits( a ) == count );
+            check( tr_bitfieldCountAndNot( a, b ) == andNot );
+
+            /* walk the set bits */
+            for( i=0, j=tr_bitfieldNextSet( a, 0 ); i<bitCount; ++i ) {
+                if( tr_bitfieldHas( a, i ) ) {
+                    check( j == i );
+                    j = tr_bitfieldNextSet( a, i+1 );
+                }
+            }
+            check( j == bitCount );
+
+            tr_bitfieldOr( tr_bitfieldOr( c, a ), b );
+            for( i=0; i<bitCount; ++i )
+                check( tr_bitfieldHas( c, i ) == ( tr_bitfieldHas( a, i ) || tr_bitfieldHas( b, i ) ) );
+
+            tr_bitfieldFree( c );
+            tr_bitfieldFree( b );
+            tr_bitfieldFree( a );
+        }
+    }
+
+    tr_bitfieldSetKernel( best );
+    return 0;
+}
+
 static int
 test_strip_positional_args( void )
 {
@@ -517,6 +577,9 @@ main( void )
         if(( i = test_bitfield_count_range( )))
             return i;
 
+    if(( i = test_bitfield_kernels( )))
+        return i;
+
     return 0;
 }
 
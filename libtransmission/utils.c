@@ -872,6 +872,29 @@ tr_time_msec( void )
     return (uint64_t) tv.tv_sec * 1000 + ( tv.tv_usec / 1000 );
 }
 
+uint64_t
+tr_time_msec_monotonic( void )
+{
+#if defined( HAVE_CLOCK_GETTIME ) && defined( CLOCK_MONOTONIC )
+    struct timespec ts;
+
+    if( !clock_gettime( CLOCK_MONOTONIC, &ts ) )
+        return (uint64_t) ts.tv_sec * 1000 + ( ts.tv_nsec / 1000000 );
+#endif
+
+    /* no monotonic clock, so fall back to the wall clock but
+     * don't let it go backwards if the date is set back */
+    {
+        static uint64_t last = 0;
+        const uint64_t now = tr_time_msec( );
+
+        if( now > last )
+            last = now;
+
+        return last;
+    }
+}
+
 void
 tr_wait_msec( long int msec )
 {
@@ -1019,7 +1042,7 @@ isValidURLChars( const char * url, int url_len )
     return TRUE;
 }
 
-/** @brief return TRUE if the url is a http or https url that Transmission understands */
+/** @brief return TRUE if the url is a http, https, or udp url that Transmission understands */
 tr_bool
 tr_urlIsValidTracker( const char * url )
 {
@@ -1030,7 +1053,7 @@ tr_urlIsValidTracker( const char * url )
     valid = isValidURLChars( url, len )
          && !tr_urlParse( url, len, &scheme, NULL, NULL, NULL )
          && ( scheme != NULL )
-         && ( !strcmp(scheme,"http") || !strcmp(scheme,"https") );
+         && ( !strcmp(scheme,"http") || !strcmp(scheme,"https") || !strcmp(scheme,"udp") );
 
     tr_free( scheme );
     return valid;
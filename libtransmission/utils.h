@@ -270,6 +270,12 @@ void tr_timerAddMsec( struct event * timer, int milliseconds ) TR_GNUC_NONNULL(1
 /** @brief return the current date in milliseconds */
 uint64_t tr_time_msec( void );
 
+/** @brief return milliseconds since an arbitrary point. Unlike
+ *         tr_time_msec(), this never goes backwards when the clock is set.
+ *         On systems without a monotonic clock it falls back to the wall
+ *         clock, so setting the clock ahead still makes it jump forward. */
+uint64_t tr_time_msec_monotonic( void );
+
 /** @brief sleep the specified number of milliseconds */
 void tr_wait_msec( long int delay_milliseconds );
 
@@ -454,7 +460,7 @@ void tr_hex_to_sha1( uint8_t * out, const char * hex ) TR_GNUC_NONNULL(1,2);
 /** @brief convenience function to determine if an address is an IP address (IPv4 or IPv6) */
 tr_bool tr_addressIsIP( const char * address );
 
-/** @brief return TRUE if the url is a http or https url that Transmission understands */
+/** @brief return TRUE if the url is a http, https, or udp url that Transmission understands */
 tr_bool tr_urlIsValidTracker( const char * url ) TR_GNUC_NONNULL(1);
 
 /** @brief return TRUE if the url is a [ http, https, ftp, ftps ] url that Transmission understands */
@@ -15,15 +15,19 @@
  #include <fcntl.h> /* posix_fadvise() */
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h> /* stat() */
+
 #include <openssl/sha.h>
 
 #include "transmission.h"
 #include "completion.h"
 #include "fdlimit.h"
+#include "inout.h" /* tr_ioFindFileLocation() */
 #include "list.h"
 #include "platform.h" /* tr_lock() */
 #include "torrent.h"
-#include "utils.h" /* tr_valloc(), tr_free() */
+#include "utils.h" /* tr_valloc(), tr_free(), tr_time_msec() */
 #include "verify.h"
 
 /***
@@ -32,139 +36,234 @@
 
 enum
 {
-    MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+    /* how long to let the disk rest, as a percentage of the time we
+     * actually spent waiting on it. Reads that come straight from the
+     * OS cache cost next to nothing, so we barely pause for them,
+     * while a seeking disk gets proportionally more breathing room */
+    VERIFY_IDLE_PERCENT = 10,
+
+    /* don't bother sleeping until we owe the disk at least this much */
+    VERIFY_MIN_SLEEP_MSEC = 20,
+
+    VERIFY_BUFLEN = 1024 * 128 /* 128 KiB buffer */
+};
+
+struct verify_node
+{
+    tr_torrent *         torrent;
+    tr_verify_done_cb    verify_done_cb;
+    uint64_t             current_size;
+    dev_t                device;
+
+    /* tells this verification apart from any earlier or later
+     * one of the same torrent, e.g. after its files were moved */
+    unsigned int         serial;
+
+    /* the next piece to be handed out to a worker */
+    tr_piece_index_t     nextPiece;
+
+    /* how many workers are hashing this torrent's pieces right now */
+    int                  activeWorkers;
+
+    tr_bool              changed;
+    tr_bool              stopped;
+    tr_bool              finishing;
+    time_t               begin;
+};
+
+/* per-thread state of a verify worker */
+struct verify_worker
+{
+    uint8_t * buffer;
+
+    /* the last file we read from. It's kept open between pieces
+     * because neighboring pieces usually live in the same file */
+    int fd;
+    unsigned int nodeSerial;
+    tr_file_index_t fileIndex;
+
+    /* msec of idle time that we still owe the disk */
+    uint64_t idleDebt;
 };
 
+/* torrents waiting for their turn, sorted by priority and size */
+static tr_list * verifyList = NULL;
+
+/* torrents whose pieces are being handed out to the workers */
+static tr_list * activeList = NULL;
+
+static int workerCount = 0;
+
+static unsigned int nextSerial = 0;
+
+static tr_lock*
+getVerifyLock( void )
+{
+    static tr_lock * lock = NULL;
+    if( lock == NULL )
+        lock = tr_lockNew( );
+    return lock;
+}
+
+static dev_t
+getTorrentDevice( const tr_torrent * tor )
+{
+    struct stat sb;
+
+    if( tor->currentDir && !stat( tor->currentDir, &sb ) )
+        return sb.st_dev;
+
+    return 0;
+}
+
+static int
+getDeviceLoad( dev_t device )
+{
+    int load = 0;
+    tr_list * l;
+
+    for( l=activeList; l!=NULL; l=l->next ) {
+        const struct verify_node * node = l->data;
+        if( node->device == device )
+            load += node->activeWorkers;
+    }
+
+    return load;
+}
+
+/**
+ * Find the next piece that a worker can hash without pushing its
+ * device over the session's per-device limit. Pieces of torrents
+ * that are already being verified are handed out before a new torrent
+ * is started, so a single disk is read as sequentially as possible.
+ *
+ * Must be called with the verify lock held.
+ */
+static struct verify_node*
+claimPiece( tr_piece_index_t * setme_piece )
+{
+    tr_list * l;
+    struct verify_node * node = NULL;
+
+    for( l=activeList; l!=NULL && node==NULL; l=l->next ) {
+        struct verify_node * n = l->data;
+        const int limit = n->torrent->session->verifyThreadsPerDevice;
+        if( !n->stopped
+            && ( n->nextPiece < n->torrent->info.pieceCount )
+            && ( getDeviceLoad( n->device ) < limit ) )
+                node = n;
+    }
+
+    if( node == NULL ) {
+        for( l=verifyList; l!=NULL && node==NULL; l=l->next ) {
+            struct verify_node * n = l->data;
+            const int limit = n->torrent->session->verifyThreadsPerDevice;
+            if( getDeviceLoad( n->device ) < limit )
+                node = n;
+        }
+
+        /* if we're starting a new torrent... */
+        if( node != NULL ) {
+            tr_list_remove_data( &verifyList, node );
+            tr_list_append( &activeList, node );
+            node->begin = tr_time( );
+            tr_torinf( node->torrent, "%s", _( "Verifying torrent" ) );
+            tr_torrentSetVerifyState( node->torrent, TR_VERIFY_NOW );
+            tr_torrentSetChecked( node->torrent, 0 );
+        }
+    }
+
+    if( node != NULL ) {
+        *setme_piece = node->nextPiece++;
+        ++node->activeWorkers;
+    }
+
+    return node;
+}
+
+static int
+getWorkerFile( struct verify_worker     * w,
+               const struct verify_node * node,
+               tr_file_index_t            fileIndex )
+{
+    if( ( w->fd >= 0 ) && ( w->nodeSerial == node->serial )
+                       && ( w->fileIndex == fileIndex ) )
+        return w->fd;
+
+    if( w->fd >= 0 )
+        tr_close_file( w->fd );
+
+    {
+        char * filename = tr_torrentFindFile( node->torrent, fileIndex );
+        w->fd = filename == NULL ? -1 : tr_open_file_for_scanning( filename );
+        w->nodeSerial = node->serial;
+        w->fileIndex = fileIndex;
+        tr_free( filename );
+    }
+
+    return w->fd;
+}
+
 static tr_bool
-verifyTorrent( tr_torrent * tor, tr_bool * stopFlag )
+verifyPiece( struct verify_worker     * w,
+             const struct verify_node * node,
+             tr_piece_index_t           pieceIndex,
+             uint64_t                 * ioMsec )
 {
-    time_t end;
     SHA_CTX sha;
-    int fd = -1;
-    int64_t filePos = 0;
-    tr_bool changed = 0;
-    tr_bool hadPiece = 0;
-    time_t lastSleptAt = 0;
-    uint32_t piecePos = 0;
-    tr_file_index_t fileIndex = 0;
-    tr_file_index_t prevFileIndex = !fileIndex;
-    tr_piece_index_t pieceIndex = 0;
-    const time_t begin = tr_time( );
-    const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-    uint8_t * buffer = tr_valloc( buflen );
+    tr_torrent * tor = node->torrent;
+    uint64_t filePos;
+    tr_file_index_t fileIndex;
+    tr_bool readOk = TRUE;
+    uint32_t leftInPiece = tr_torPieceCountBytes( tor, pieceIndex );
+    uint8_t hash[SHA_DIGEST_LENGTH];
 
     SHA1_Init( &sha );
+    tr_ioFindFileLocation( tor, pieceIndex, 0, &fileIndex, &filePos );
 
-    tr_tordbg( tor, "%s", "verifying torrent..." );
-    tr_torrentSetChecked( tor, 0 );
-    while( !*stopFlag && ( pieceIndex < tor->info.pieceCount ) )
+    while( readOk && ( leftInPiece > 0 ) )
     {
-        uint32_t leftInPiece;
-        uint32_t bytesThisPass;
-        uint64_t leftInFile;
         const tr_file * file = &tor->info.files[fileIndex];
+        uint32_t bytesThisPass = MIN( leftInPiece, file->length - filePos );
+        bytesThisPass = MIN( bytesThisPass, VERIFY_BUFLEN );
 
-        /* if we're starting a new piece... */
-        if( piecePos == 0 )
-            hadPiece = tr_cpPieceIsComplete( &tor->completion, pieceIndex );
-
-        /* if we're starting a new file... */
-        if( !filePos && (fd<0) && (fileIndex!=prevFileIndex) )
+        if( bytesThisPass > 0 )
         {
-            char * filename = tr_torrentFindFile( tor, fileIndex );
-            fd = filename == NULL ? -1 : tr_open_file_for_scanning( filename );
-            tr_free( filename );
-            prevFileIndex = fileIndex;
-        }
-
-        /* figure out how much we can read this pass */
-        leftInPiece = tr_torPieceCountBytes( tor, pieceIndex ) - piecePos;
-        leftInFile = file->length - filePos;
-        bytesThisPass = MIN( leftInFile, leftInPiece );
-        bytesThisPass = MIN( bytesThisPass, buflen );
-
-        /* read a bit */
-        if( fd >= 0 ) {
-            const ssize_t numRead = tr_pread( fd, buffer, bytesThisPass, filePos );
-            if( numRead > 0 ) {
-                bytesThisPass = (uint32_t)numRead;
-                SHA1_Update( &sha, buffer, bytesThisPass );
+            const int fd = getWorkerFile( w, node, fileIndex );
+
+            if( fd < 0 )
+                readOk = FALSE;
+            else {
+                const uint64_t begin = tr_time_msec( );
+                const ssize_t numRead = tr_pread( fd, w->buffer, bytesThisPass, filePos );
+                *ioMsec += tr_time_msec( ) - begin;
+
+                if( numRead != (ssize_t)bytesThisPass )
+                    readOk = FALSE;
+                else {
+                    SHA1_Update( &sha, w->buffer, bytesThisPass );
 #if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
-                posix_fadvise( fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED );
+                    posix_fadvise( fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED );
 #endif
+                }
             }
         }
 
         /* move our offsets */
         leftInPiece -= bytesThisPass;
-        leftInFile -= bytesThisPass;
-        piecePos += bytesThisPass;
         filePos += bytesThisPass;
 
-        /* if we're finishing a piece... */
-        if( leftInPiece == 0 )
-        {
-            time_t now;
-            tr_bool hasPiece;
-            uint8_t hash[SHA_DIGEST_LENGTH];
-
-            SHA1_Final( hash, &sha );
-            hasPiece = !memcmp( hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH );
-
-            if( hasPiece || hadPiece ) {
-                tr_torrentSetHasPiece( tor, pieceIndex, hasPiece );
-                changed |= hasPiece != hadPiece;
-            }
-            tr_torrentSetPieceChecked( tor, pieceIndex );
-            now = tr_time( );
-            tor->anyDate = now;
-
-            /* sleeping even just a few msec per second goes a long
-             * way towards reducing IO load... */
-            if( lastSleptAt != now ) {
-                lastSleptAt = now;
-                tr_wait_msec( MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY );
-            }
-
-            SHA1_Init( &sha );
-            ++pieceIndex;
-            piecePos = 0;
-        }
-
         /* if we're finishing a file... */
-        if( leftInFile == 0 )
-        {
-            if( fd >= 0 ) { tr_close_file( fd ); fd = -1; }
+        if( filePos == file->length ) {
             ++fileIndex;
             filePos = 0;
         }
     }
 
-    /* cleanup */
-    if( fd >= 0 )
-        tr_close_file( fd );
-    free( buffer );
-
-    /* stopwatch */
-    end = tr_time( );
-    tr_tordbg( tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
-               (int)(end-begin), tor->info.totalSize,
-               (uint64_t)(tor->info.totalSize/(1+(end-begin))) );
-
-    return changed;
+    SHA1_Final( hash, &sha );
+    return readOk && !memcmp( hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH );
 }
 
-/***
-****
-***/
-
-struct verify_node
-{
-    tr_torrent *         torrent;
-    tr_verify_done_cb    verify_done_cb;
-    uint64_t             current_size;
-};
-
 static void
 fireCheckDone( tr_torrent * tor, tr_verify_done_cb verify_done_cb )
 {
@@ -174,60 +273,110 @@ fireCheckDone( tr_torrent * tor, tr_verify_done_cb verify_done_cb )
         verify_done_cb( tor );
 }
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static tr_bool stopCurrent = FALSE;
-
-static tr_lock*
-getVerifyLock( void )
+static void
+finishNode( struct verify_node * node )
 {
-    static tr_lock * lock = NULL;
-    if( lock == NULL )
-        lock = tr_lockNew( );
-    return lock;
+    tr_torrent * tor = node->torrent;
+
+    tr_torrentSetVerifyState( tor, TR_VERIFY_NONE );
+    assert( tr_isTorrent( tor ) );
+
+    if( !node->stopped )
+    {
+        const time_t end = tr_time( );
+        tr_tordbg( tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
+                   (int)(end-node->begin), tor->info.totalSize,
+                   (uint64_t)(tor->info.totalSize/(1+(end-node->begin))) );
+
+        if( node->changed )
+            tr_torrentSetDirty( tor );
+        fireCheckDone( tor, node->verify_done_cb );
+    }
 }
 
 static void
 verifyThreadFunc( void * unused UNUSED )
 {
+    struct verify_worker w;
+
+    w.buffer = tr_valloc( VERIFY_BUFLEN );
+    w.fd = -1;
+    w.nodeSerial = 0;
+    w.fileIndex = 0;
+    w.idleDebt = 0;
+
     for( ;; )
     {
-        int changed = 0;
-        tr_torrent * tor;
+        tr_bool done;
+        tr_bool hasPiece;
+        uint64_t ioMsec = 0;
+        tr_piece_index_t pieceIndex;
         struct verify_node * node;
 
         tr_lockLock( getVerifyLock( ) );
-        stopCurrent = FALSE;
-        node = (struct verify_node*) verifyList ? verifyList->data : NULL;
+        node = claimPiece( &pieceIndex );
         if( node == NULL )
         {
-            currentNode.torrent = NULL;
+            /* Nothing we're allowed to work on. Any pieces that are left
+             * belong to devices that are already busy with other workers,
+             * and tr_verifyAdd() starts new workers when needed. */
+            --workerCount;
+            tr_lockUnlock( getVerifyLock( ) );
             break;
         }
-
-        currentNode = *node;
-        tor = currentNode.torrent;
-        tr_list_remove_data( &verifyList, node );
-        tr_free( node );
         tr_lockUnlock( getVerifyLock( ) );
 
-        tr_torinf( tor, "%s", _( "Verifying torrent" ) );
-        tr_torrentSetVerifyState( tor, TR_VERIFY_NOW );
-        changed = verifyTorrent( tor, &stopCurrent );
-        tr_torrentSetVerifyState( tor, TR_VERIFY_NONE );
-        assert( tr_isTorrent( tor ) );
+        hasPiece = verifyPiece( &w, node, pieceIndex, &ioMsec );
 
-        if( !stopCurrent )
+        tr_lockLock( getVerifyLock( ) );
+        if( !node->stopped )
         {
-            if( changed )
-                tr_torrentSetDirty( tor );
-            fireCheckDone( tor, currentNode.verify_done_cb );
+            tr_torrent * tor = node->torrent;
+            const tr_bool hadPiece = tr_cpPieceIsComplete( &tor->completion, pieceIndex );
+
+            if( hasPiece || hadPiece ) {
+                tr_torrentSetHasPiece( tor, pieceIndex, hasPiece );
+                node->changed |= hasPiece != hadPiece;
+            }
+            tr_torrentSetPieceChecked( tor, pieceIndex );
+            tor->anyDate = tr_time( );
+        }
+        --node->activeWorkers;
+        done = !node->finishing
+            && !node->activeWorkers
+            && ( node->stopped || ( node->nextPiece >= node->torrent->info.pieceCount ) );
+        if( done )
+            node->finishing = TRUE;
+        tr_lockUnlock( getVerifyLock( ) );
+
+        if( done )
+        {
+            /* the node stays in activeList until we're done with it
+             * so that tr_verifyRemove() knows to wait for us */
+            if( ( w.fd >= 0 ) && ( w.nodeSerial == node->serial ) ) {
+                tr_close_file( w.fd );
+                w.fd = -1;
+            }
+            finishNode( node );
+            tr_lockLock( getVerifyLock( ) );
+            tr_list_remove_data( &activeList, node );
+            tr_lockUnlock( getVerifyLock( ) );
+            tr_free( node );
+        }
+
+        /* sleeping in proportion to the time spent reading
+         * goes a long way towards reducing IO load... */
+        w.idleDebt += ioMsec * VERIFY_IDLE_PERCENT / 100;
+        if( w.idleDebt >= VERIFY_MIN_SLEEP_MSEC ) {
+            tr_wait_msec( w.idleDebt );
+            w.idleDebt = 0;
         }
     }
 
-    verifyThread = NULL;
-    tr_lockUnlock( getVerifyLock( ) );
+    /* cleanup */
+    if( w.fd >= 0 )
+        tr_close_file( w.fd );
+    tr_free( w.buffer );
 }
 
 static int
@@ -256,16 +405,20 @@ tr_verifyAdd( tr_torrent * tor, tr_verify_done_cb verify_done_cb )
     assert( tr_isTorrent( tor ) );
     tr_torinf( tor, "%s", _( "Queued for verification" ) );
 
-    node = tr_new( struct verify_node, 1 );
+    node = tr_new0( struct verify_node, 1 );
     node->torrent = tor;
     node->verify_done_cb = verify_done_cb;
     node->current_size = tr_torrentGetCurrentSizeOnDisk( tor );
+    node->device = getTorrentDevice( tor );
 
     tr_lockLock( getVerifyLock( ) );
+    node->serial = ++nextSerial;
     tr_torrentSetVerifyState( tor, TR_VERIFY_WAIT );
     tr_list_insert_sorted( &verifyList, node, compareVerifyByPriorityAndSize );
-    if( verifyThread == NULL )
-        verifyThread = tr_threadNew( verifyThreadFunc, NULL );
+    while( workerCount < tor->session->verifyThreads ) {
+        ++workerCount;
+        tr_threadNew( verifyThreadFunc, NULL );
+    }
     tr_lockUnlock( getVerifyLock( ) );
 }
 
@@ -277,18 +430,40 @@ compareVerifyByTorrent( const void * va, const void * vb )
     return a->torrent - b;
 }
 
+/**
+ * Stop an active node. If no worker is hashing one of its pieces,
+ * none of them will ever get around to finishing it, so we do it here.
+ *
+ * Must be called with the verify lock held.
+ */
+static void
+stopNode( struct verify_node * node )
+{
+    node->stopped = TRUE;
+
+    if( !node->activeWorkers && !node->finishing )
+    {
+        tr_list_remove_data( &activeList, node );
+        finishNode( node );
+        tr_free( node );
+    }
+}
+
 void
 tr_verifyRemove( tr_torrent * tor )
 {
+    tr_list * l;
     tr_lock * lock = getVerifyLock( );
     tr_lockLock( lock );
 
     assert( tr_isTorrent( tor ) );
 
-    if( tor == currentNode.torrent )
+    if(( l = tr_list_find( activeList, tor, compareVerifyByTorrent )))
     {
-        stopCurrent = TRUE;
-        while( stopCurrent )
+        stopNode( l->data );
+
+        /* wait for the workers to let go of it */
+        while( tr_list_find( activeList, tor, compareVerifyByTorrent ) )
         {
             tr_lockUnlock( lock );
             tr_wait_msec( 100 );
@@ -307,10 +482,27 @@ tr_verifyRemove( tr_torrent * tor )
 void
 tr_verifyClose( tr_session * session UNUSED )
 {
-    tr_lockLock( getVerifyLock( ) );
+    tr_list * l;
+    tr_list * next;
+    tr_lock * lock = getVerifyLock( );
+
+    tr_lockLock( lock );
 
-    stopCurrent = TRUE;
     tr_list_free( &verifyList, tr_free );
+    for( l=activeList; l!=NULL; l=next ) {
+        next = l->next;
+        stopNode( l->data );
+    }
 
-    tr_lockUnlock( getVerifyLock( ) );
+    /* With nothing left to claim, the workers exit as soon as they're
+     * done with their current piece. Wait for them so that none of them
+     * touches a torrent while the session is tearing it down. */
+    while( ( activeList != NULL ) || ( workerCount > 0 ) )
+    {
+        tr_lockUnlock( lock );
+        tr_wait_msec( 100 );
+        tr_lockLock( lock );
+    }
+
+    tr_lockUnlock( lock );
 }
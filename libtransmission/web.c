@@ -12,18 +12,17 @@
 
 #ifdef WIN32
   #include <ws2tcpip.h>
-#else
-  #include <sys/select.h>
 #endif
 
 #include <curl/curl.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
 
 #include "transmission.h"
 #include "list.h"
 #include "net.h" /* tr_address */
-#include "platform.h" /* mutex */
+#include "ptrarray.h"
 #include "session.h"
 #include "trevent.h" /* tr_runInEventThread() */
 #include "utils.h"
@@ -36,7 +35,12 @@
 
 enum
 {
-    THREADFUNC_MAX_SLEEP_MSEC = 1000,
+    /* how many idle easy handles to keep for reuse */
+    MAX_POOLED_HANDLES = 16,
+
+    /* how many requests may be running at once to the same host.
+       the rest wait for one of them to finish and reuse its connection */
+    MAX_CONNECTIONS_PER_HOST = 8
 };
 
 #if 0
@@ -57,11 +61,27 @@ enum
 ****
 ***/
 
+/* the requests to one host:port */
+struct tr_web_host
+{
+    char * key;
+    int running;        /* tasks that are in the multi handle */
+    tr_list * queue;    /* tasks waiting for one of those to finish */
+};
+
 struct tr_web
 {
     int close_mode;
-    tr_list * tasks;
-    tr_lock * taskLock;
+    int taskCount;      /* tasks that are running or queued */
+    int queuedCount;    /* tasks that are queued */
+    CURLM * multi;
+    struct event * timer_event;
+    tr_session * session;
+    tr_list * running;  /* struct tr_web_task */
+    tr_ptrArray hosts;  /* struct tr_web_host, sorted by key */
+    CURL * pool[MAX_POOLED_HANDLES];
+    int poolCount;
+    tr_web_stats stats;
 };
 
 
@@ -80,6 +100,8 @@ struct tr_web_task
     char * url;
     char * range;
     tr_session * session;
+    struct tr_web_host * host;
+    CURL * easy;
     tr_web_done_func * done_func;
     void * done_func_user_data;
 };
@@ -163,15 +185,23 @@ getTimeoutFromURL( const struct tr_web_task * task )
     return timeout;
 }
 
+/* Handles go back into the pool when their task is done.
+ * They're reset first, which clears their options but keeps the
+ * connections, DNS entries, and SSL sessions that they've cached */
 static CURL *
-createEasy( tr_session * s, struct tr_web_task * task )
+createEasy( tr_session * s, struct tr_web * web, struct tr_web_task * task )
 {
+    CURL * e;
     const tr_address * addr;
     tr_bool is_default_value;
-    CURL * e = curl_easy_init( );
     const long verbose = getenv( "TR_CURL_VERBOSE" ) != NULL;
     char * cookie_filename = tr_buildPath( s->configDir, "cookies.txt", NULL );
 
+    if( web->poolCount > 0 )
+        e = web->pool[--web->poolCount];
+    else
+        e = curl_easy_init( );
+
     if( !task->range && tr_sessionIsProxyEnabled( s ) )
     {
         const tr_proxy_type type = tr_sessionGetProxyType( s );
@@ -229,16 +259,112 @@ createEasy( tr_session * s, struct tr_web_task * task )
     return e;
 }
 
+static void
+releaseEasy( struct tr_web * web, CURL * e )
+{
+    if( web->poolCount < MAX_POOLED_HANDLES )
+    {
+        curl_easy_reset( e );
+        web->pool[web->poolCount++] = e;
+    }
+    else
+    {
+        curl_easy_cleanup( e );
+    }
+}
+
 /***
 ****
 ***/
 
+static int
+compareHosts( const void * va, const void * vb )
+{
+    const struct tr_web_host * a = va;
+    const struct tr_web_host * b = vb;
+
+    return strcmp( a->key, b->key );
+}
+
+static struct tr_web_host *
+getHost( struct tr_web * web, const char * url )
+{
+    int port = 0;
+    char * host = NULL;
+    struct tr_web_host tmp;
+    struct tr_web_host * h;
+
+    tr_urlParse( url, -1, NULL, &host, &port, NULL );
+    tmp.key = tr_strdup_printf( "%s:%d", host ? host : "", port );
+    h = tr_ptrArrayFindSorted( &web->hosts, &tmp, compareHosts );
+
+    if( h != NULL )
+        tr_free( tmp.key );
+    else {
+        h = tr_new0( struct tr_web_host, 1 );
+        h->key = tmp.key;
+        tr_ptrArrayInsertSorted( &web->hosts, h, compareHosts );
+    }
+
+    tr_free( host );
+    return h;
+}
+
 static void
-task_finish_func( void * vtask )
+hostFree( void * vhost )
 {
-    struct tr_web_task * task = vtask;
+    struct tr_web_host * host = vhost;
+
+    tr_list_free( &host->queue, (TrListForeachFunc)task_free );
+    tr_free( host->key );
+    tr_free( host );
+}
+
+static void
+task_start( struct tr_web * web, struct tr_web_task * task )
+{
+    dbgmsg( "adding task to curl: [%s]", task->url );
+
+    ++task->host->running;
+    task->easy = createEasy( web->session, web, task );
+    tr_list_prepend( &web->running, task );
+    curl_multi_add_handle( web->multi, task->easy );
+}
+
+static void
+task_add( struct tr_web * web, struct tr_web_task * task )
+{
+    ++web->taskCount;
+    task->host = getHost( web, task->url );
+
+    if( task->host->running < MAX_CONNECTIONS_PER_HOST )
+        task_start( web, task );
+    else {
+        dbgmsg( "queueing task for %s: [%s]", task->host->key, task->url );
+        ++web->queuedCount;
+        tr_list_append( &task->host->queue, task );
+    }
+}
+
+/* start the next task waiting on this one's host, invoke its callback,
+ * and free it. */
+static void
+task_finish( struct tr_web * web, struct tr_web_task * task )
+{
+    struct tr_web_host * host = task->host;
+    struct tr_web_task * next;
+
     dbgmsg( "finished web task %p; got %ld", task, task->code );
 
+    --host->running;
+    if(( next = tr_list_pop_front( &host->queue ))) {
+        --web->queuedCount;
+        task_start( web, next );
+    } else if( !host->running ) {
+        tr_ptrArrayRemoveSorted( &web->hosts, host, compareHosts );
+        hostFree( host );
+    }
+
     if( task->done_func != NULL )
         task->done_func( task->session,
                          task->did_connect,
@@ -248,13 +374,148 @@ task_finish_func( void * vtask )
                          evbuffer_get_length( task->response ),
                          task->done_func_user_data );
 
+    --web->taskCount;
     task_free( task );
 }
 
+/***
+****  Drive curl from the session's event loop.
+****  curl tells us which sockets to watch and when it next needs
+****  to time something out; we tell it when any of that happens.
+***/
+
+static void web_free( tr_session * session );
+
+static void
+check_multi_info( struct tr_web * web )
+{
+    int unused;
+    CURLMsg * msg;
+
+    while(( msg = curl_multi_info_read( web->multi, &unused )))
+    {
+        if(( msg->msg == CURLMSG_DONE ) && ( msg->easy_handle != NULL ))
+        {
+            double total_time;
+            struct tr_web_task * task;
+            long req_bytes_sent;
+            long num_connects;
+            uint64_t msec;
+            CURL * e = msg->easy_handle;
+            curl_easy_getinfo( e, CURLINFO_PRIVATE, (void*)&task );
+            curl_easy_getinfo( e, CURLINFO_RESPONSE_CODE, &task->code );
+            curl_easy_getinfo( e, CURLINFO_REQUEST_SIZE, &req_bytes_sent );
+            curl_easy_getinfo( e, CURLINFO_TOTAL_TIME, &total_time );
+            curl_easy_getinfo( e, CURLINFO_NUM_CONNECTS, &num_connects );
+            task->did_connect = task->code>0 || req_bytes_sent>0;
+            task->did_timeout = !task->code && ( total_time >= task->timeout_secs );
+            curl_multi_remove_handle( web->multi, e );
+            releaseEasy( web, e );
+            tr_list_remove_data( &web->running, task );
+
+            msec = total_time * 1000;
+            ++web->stats.requests;
+            web->stats.connections += num_connects;
+            web->stats.latencyMsec += msec;
+            if( web->stats.maxLatencyMsec < msec )
+                web->stats.maxLatencyMsec = msec;
+            dbgmsg( "%s took %"PRIu64" msec on %s connection", task->host->key,
+                    msec, num_connects ? "a new" : "a reused" );
+
+            task_finish( web, task );
+        }
+    }
+
+    if( ( web->close_mode == TR_WEB_CLOSE_WHEN_IDLE ) && !web->taskCount )
+        web_free( web->session );
+}
+
+static void
+event_cb( evutil_socket_t fd, short what, void * vweb )
+{
+    int unused;
+    int action = 0;
+    struct tr_web * web = vweb;
+
+    if( what & EV_READ ) action |= CURL_CSELECT_IN;
+    if( what & EV_WRITE ) action |= CURL_CSELECT_OUT;
+
+    curl_multi_socket_action( web->multi, fd, action, &unused );
+    check_multi_info( web );
+}
+
+static void
+timer_cb( evutil_socket_t fd UNUSED, short what UNUSED, void * vweb )
+{
+    int unused;
+    struct tr_web * web = vweb;
+
+    curl_multi_socket_action( web->multi, CURL_SOCKET_TIMEOUT, 0, &unused );
+    check_multi_info( web );
+}
+
+/* CURLMOPT_SOCKETFUNCTION: watch `fd' for the events curl wants */
+static int
+sock_cb( CURL * e UNUSED, curl_socket_t fd, int what, void * vweb, void * vevent )
+{
+    struct tr_web * web = vweb;
+    struct event * ev = vevent;
+
+    if( what == CURL_POLL_REMOVE )
+    {
+        if( ev != NULL )
+            event_free( ev );
+    }
+    else
+    {
+        const short kind = EV_PERSIST
+                         | ( ( what & CURL_POLL_IN ) ? EV_READ : 0 )
+                         | ( ( what & CURL_POLL_OUT ) ? EV_WRITE : 0 );
+
+        if( ev == NULL ) {
+            ev = event_new( web->session->event_base, fd, kind, event_cb, web );
+            curl_multi_assign( web->multi, fd, ev );
+        } else {
+            event_del( ev );
+            event_assign( ev, web->session->event_base, fd, kind, event_cb, web );
+        }
+
+        event_add( ev, NULL );
+    }
+
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: call timer_cb in `msec' milliseconds */
+static int
+timer_func( CURLM * multi UNUSED, long msec, void * vweb )
+{
+    struct tr_web * web = vweb;
+
+    if( msec < 0 )
+        evtimer_del( web->timer_event );
+    else
+        tr_timerAddMsec( web->timer_event, msec );
+
+    return 0;
+}
+
 /****
 *****
 ****/
 
+static void
+task_add_func( void * vtask )
+{
+    struct tr_web_task * task = vtask;
+    struct tr_web * web = task->session->web;
+
+    if( web != NULL )
+        task_add( web, task );
+    else
+        task_free( task );
+}
+
 void
 tr_webRun( tr_session         * session,
            const char         * url,
@@ -289,53 +550,31 @@ tr_webRunWithBuffer( tr_session         * session,
         task->response = buffer ? buffer : evbuffer_new( );
         task->freebuf = buffer ? NULL : task->response;
 
-        tr_lockLock( web->taskLock );
-        tr_list_append( &web->tasks, task );
-        tr_lockUnlock( web->taskLock );
+        /* clients can call this from their own threads */
+        if( tr_amInEventThread( session ) )
+            task_add( web, task );
+        else
+            tr_runInEventThread( session, task_add_func, task );
     }
 }
 
-/**
- * Portability wrapper for select().
- *
- * http://msdn.microsoft.com/en-us/library/ms740141%28VS.85%29.aspx
- * On win32, any two of the parameters, readfds, writefds, or exceptfds,
- * can be given as null. At least one must be non-null, and any non-null
- * descriptor set must contain at least one handle to a socket.
- */
-static void
-tr_select( int nfds,
-           fd_set * r_fd_set, fd_set * w_fd_set, fd_set * c_fd_set,
-           struct timeval  * t )
+void
+tr_webGetStats( const tr_session * session, tr_web_stats * setme )
 {
-#ifdef WIN32
-    if( !r_fd_set->fd_count && !w_fd_set->fd_count && !c_fd_set->fd_count )
-    {
-        const long int msec = t->tv_sec*1000 + t->tv_usec/1000;
-        tr_wait_msec( msec );
-    }
-    else if( select( 0, r_fd_set->fd_count ? r_fd_set : NULL,
-                        w_fd_set->fd_count ? w_fd_set : NULL,
-                        c_fd_set->fd_count ? c_fd_set : NULL, t ) < 0 )
-    {
-        char errstr[512];
-        const int e = EVUTIL_SOCKET_ERROR( );
-        tr_net_strerror( errstr, sizeof( errstr ), e );
-        dbgmsg( "Error: select (%d) %s", e, errstr );
+    const struct tr_web * web = session->web;
+
+    if( web == NULL )
+        memset( setme, 0, sizeof( tr_web_stats ) );
+    else {
+        *setme = web->stats;
+        setme->queuedRequests = web->queuedCount;
     }
-#else
-    select( nfds, r_fd_set, w_fd_set, c_fd_set, t );
-#endif
 }
 
-static void
-tr_webThreadFunc( void * vsession )
+void
+tr_webInit( tr_session * session )
 {
-    CURLM * multi;
     struct tr_web * web;
-    int taskCount = 0;
-    struct tr_web_task * task;
-    tr_session * session = vsession;
 
     /* try to enable ssl for https support; but if that fails,
      * try a plain vanilla init */
@@ -344,109 +583,54 @@ tr_webThreadFunc( void * vsession )
 
     web = tr_new0( struct tr_web, 1 );
     web->close_mode = ~0;
-    web->taskLock = tr_lockNew( );
-    web->tasks = NULL;
-    multi = curl_multi_init( );
+    web->session = session;
+    web->hosts = TR_PTR_ARRAY_INIT;
+    web->timer_event = evtimer_new( session->event_base, timer_cb, web );
+    web->multi = curl_multi_init( );
+    curl_multi_setopt( web->multi, CURLMOPT_SOCKETFUNCTION, sock_cb );
+    curl_multi_setopt( web->multi, CURLMOPT_SOCKETDATA, web );
+    curl_multi_setopt( web->multi, CURLMOPT_TIMERFUNCTION, timer_func );
+    curl_multi_setopt( web->multi, CURLMOPT_TIMERDATA, web );
     session->web = web;
+}
 
-    for( ;; )
-    {
-        long msec;
-        int unused;
-        CURLMsg * msg;
-        CURLMcode mcode;
-
-        if( web->close_mode == TR_WEB_CLOSE_NOW )
-            break;
-        if( ( web->close_mode == TR_WEB_CLOSE_WHEN_IDLE ) && !taskCount )
-            break;
-
-        /* add tasks from the queue */
-        tr_lockLock( web->taskLock );
-        while(( task = tr_list_pop_front( &web->tasks )))
-        {
-            dbgmsg( "adding task to curl: [%s]", task->url );
-            curl_multi_add_handle( multi, createEasy( session, task ));
-            /*fprintf( stderr, "adding a task.. taskCount is now %d\n", taskCount );*/
-            ++taskCount;
-        }
-        tr_lockUnlock( web->taskLock );
-
-        /* maybe wait a little while before calling curl_multi_perform() */
-        msec = 0;
-        curl_multi_timeout( multi, &msec );
-        if( msec < 0 )
-            msec = THREADFUNC_MAX_SLEEP_MSEC;
-        if( msec > 0 )
-        {
-            int usec;
-            int max_fd;
-            struct timeval t;
-            fd_set r_fd_set, w_fd_set, c_fd_set;
-
-            max_fd = 0;
-            FD_ZERO( &r_fd_set );
-            FD_ZERO( &w_fd_set );
-            FD_ZERO( &c_fd_set );
-            curl_multi_fdset( multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd );
-
-            if( msec > THREADFUNC_MAX_SLEEP_MSEC )
-                msec = THREADFUNC_MAX_SLEEP_MSEC;
-
-            usec = msec * 1000;
-            t.tv_sec =  usec / 1000000;
-            t.tv_usec = usec % 1000000;
-
-            tr_select( max_fd+1, &r_fd_set, &w_fd_set, &c_fd_set, &t );
-        }
-
-        /* call curl_multi_perform() */
-        do {
-            mcode = curl_multi_perform( multi, &unused );
-        } while( mcode == CURLM_CALL_MULTI_PERFORM );
-
-        /* pump completed tasks from the multi */
-        while(( msg = curl_multi_info_read( multi, &unused )))
-        {
-            if(( msg->msg == CURLMSG_DONE ) && ( msg->easy_handle != NULL ))
-            {
-                double total_time;
-                struct tr_web_task * task;
-                long req_bytes_sent;
-                CURL * e = msg->easy_handle;
-                curl_easy_getinfo( e, CURLINFO_PRIVATE, (void*)&task );
-                curl_easy_getinfo( e, CURLINFO_RESPONSE_CODE, &task->code );
-                curl_easy_getinfo( e, CURLINFO_REQUEST_SIZE, &req_bytes_sent );
-                curl_easy_getinfo( e, CURLINFO_TOTAL_TIME, &total_time );
-                task->did_connect = task->code>0 || req_bytes_sent>0;
-                task->did_timeout = !task->code && ( total_time >= task->timeout_secs );
-                curl_multi_remove_handle( multi, e );
-                curl_easy_cleanup( e );
-/*fprintf( stderr, "removing a completed task.. taskCount is now %d (response code: %d, response len: %d)\n", taskCount, (int)task->code, (int)evbuffer_get_length(task->response) );*/
-                tr_runInEventThread( task->session, task_finish_func, task );
-                --taskCount;
-            }
-        }
-    }
+/* Discard any remaining tasks without invoking their callbacks.
+ * This is rare, but can happen on shutdown with unresponsive trackers. */
+static void
+web_free( tr_session * session )
+{
+    int i;
+    struct tr_web_task * task;
+    struct tr_web * web = session->web;
 
-    /* Discard any remaining tasks.
-     * This is rare, but can happen on shutdown with unresponsive trackers. */
-    while(( task = tr_list_pop_front( &web->tasks ))) {
+    while(( task = tr_list_pop_front( &web->running ))) {
         dbgmsg( "Discarding task \"%s\"", task->url );
+        curl_multi_remove_handle( web->multi, task->easy );
+        curl_easy_cleanup( task->easy );
         task_free( task );
     }
+    tr_ptrArrayDestruct( &web->hosts, hostFree );
+
+    for( i=0; i<web->poolCount; ++i )
+        curl_easy_cleanup( web->pool[i] );
 
-    /* cleanup */
-    curl_multi_cleanup( multi );
-    tr_lockFree( web->taskLock );
+    curl_multi_cleanup( web->multi );
+    event_free( web->timer_event );
     tr_free( web );
     session->web = NULL;
 }
 
-void
-tr_webInit( tr_session * session )
+static void
+web_close_func( void * vsession )
 {
-    tr_threadNew( tr_webThreadFunc, session );
+    tr_session * session = vsession;
+    struct tr_web * web = session->web;
+
+    if( web == NULL )
+        return;
+
+    if( ( web->close_mode == TR_WEB_CLOSE_NOW ) || !web->taskCount )
+        web_free( session );
 }
 
 void
@@ -456,6 +640,11 @@ tr_webClose( tr_session * session, tr_web_close_mode close_mode )
     {
         session->web->close_mode = close_mode;
 
+        if( tr_amInEventThread( session ) )
+            web_close_func( session );
+        else
+            tr_runInEventThread( session, web_close_func, session );
+
         if( close_mode == TR_WEB_CLOSE_NOW )
             while( session->web != NULL )
                 tr_wait_msec( 100 );
@@ -42,6 +42,8 @@ void tr_sessionSetWebConfigFunc( tr_session * session, void (*config)(tr_session
 
 void tr_webClose( tr_session * session, tr_web_close_mode close_mode );
 
+void tr_webGetStats( const tr_session * session, tr_web_stats * setme );
+
 typedef void ( tr_web_done_func )( tr_session       * session,
                                    tr_bool            timeout_flag,
                                    tr_bool            did_connect_flag,
@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h> /* atoi() */
 #include <unistd.h> /* getcwd() */
 
 #include <libtransmission/transmission.h>
@@ -27,6 +28,7 @@ static tr_tracker_info trackers[MAX_TRACKERS];
 static int trackerCount = 0;
 static tr_bool isPrivate = FALSE;
 static tr_bool showVersion = FALSE;
+static int hashThreads = 1;
 const char * comment = NULL;
 const char * outfile = NULL;
 const char * infile = NULL;
@@ -37,6 +39,7 @@ static tr_option options[] =
   { 'o', "outfile", "Save the generated .torrent to this filename", "o", 1, "<file>" },
   { 'c', "comment", "Add a comment", "c", 1, "<comment>" },
   { 't', "tracker", "Add a tracker's announce URL", "t", 1, "<url>" },
+  { 'T', "threads", "Number of threads to hash pieces with", "T", 1, "<n>" },
   { 'V', "version", "Show version number and exit", "V", 0, NULL },
   { 0, NULL, NULL, NULL, 0, NULL }
 };
@@ -61,6 +64,7 @@ parseCommandLine( int argc, const char ** argv )
             case 'p': isPrivate = TRUE; break;
             case 'o': outfile = optarg; break;
             case 'c': comment = optarg; break;
+            case 'T': hashThreads = atoi( optarg ); break;
             case 't': if( trackerCount + 1 < MAX_TRACKERS ) {
                           trackers[trackerCount].tier = trackerCount;
                           trackers[trackerCount].announce = (char*) optarg;
@@ -145,6 +149,7 @@ main( int argc, char * argv[] )
     fflush( stdout );
 
     b = tr_metaInfoBuilderCreate( infile );
+    b->hashThreads = hashThreads;
     tr_makeMetaInfo( b, outfile, trackers, trackerCount, comment, isPrivate );
     while( !b->isDone ) {
         tr_wait_msec( 500 );